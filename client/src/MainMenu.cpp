@@ -1,6 +1,7 @@
 #include "MainMenu.h"
 
 #include "Util.h"
+#include "Trace.h"
 #include <stdio.h>
 
 /* Filepaths for external resources */
@@ -241,6 +242,7 @@ MainMenu::~MainMenu()
 
 void MainMenu::update(double secs)
 {
+    TRACE_ZONE("MainMenu::update");
     /* Poll online session */
     session->poll(secs);
 
@@ -333,6 +335,7 @@ void MainMenu::update(double secs)
 
 void MainMenu::render(Renderer *renderer)
 {
+    TRACE_ZONE("MainMenu::render");
     /* Render background and title which are always present */
     renderer->drawTexture(bgTexture, bgSrcXPos, 0, bgSrcWidth,
             bgTexture->GetHeight(), 0, 0, getWidth(), getHeight());
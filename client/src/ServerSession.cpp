@@ -4,6 +4,27 @@
 #define SERVER_ADDR "192.168.0.182"
 #define SERVER_PORT 47411
 
+/*
+ * Longest a dead server may go unnoticed while the session is idle in the menus, in seconds.
+ * While messages are flowing a drop is still noticed within 5 seconds
+ */
+#define SESSION_KEEPALIVE_SECS 15
+
+/*
+ * Longest to keep trying to get a lost connection back, in seconds. Should be no longer than the
+ * server keeps sessions for (its --resume-grace)
+ */
+#define SESSION_RESUME_SECS 30
+
+/* How long a connection may stay suspended before it is given up on and replaced, in seconds */
+#define SESSION_RECONNECT_SECS 5
+
+/* Seconds between attempts to reconnect, or to resume a session the server is letting go of */
+#define RESUME_RETRY_SECS 1
+
+/* Most session messages sent that are kept to replay after a resume */
+#define SESSION_RETAIN_MESSAGES 64
+
 /* For std::bind _1, _2 ... */
 using namespace std::placeholders;
 
@@ -13,6 +34,17 @@ ServerSession::ServerSession()
     callback = nullptr;
     retryNameRequest = false;
     requestingName = false;
+    roomResult = pbuf::RoomReply::OK;
+    roomListNext = 0;
+    messagesSent = 0;
+    messagesReceived = 0;
+    reconnecting = false;
+    reconnectSecsLeft = 0;
+    resuming = false;
+    resumeRetrySecs = -1;
+    suspended = false;
+    suspendedSecs = 0;
+    abandonConnection = false;
 }
 
 ServerSession::~ServerSession()
@@ -31,23 +63,12 @@ void ServerSession::open(std::string name)
 {
     /* Create a connection if not yet done */
     if (connection == nullptr) {
-
-        ConnectionCallbacks cbs = {
-            std::bind(&ServerSession::onConnectSuccess, this, _1),
-            std::bind(&ServerSession::onConnectFail, this, _1),
-            std::bind(&ServerSession::onConnectionLost, this, _1),
-            std::bind(&ServerSession::onConnectionSuspended, this, _1),
-            std::bind(&ServerSession::onConnectionResumed, this, _1),
-            std::bind(&ServerSession::onMsgReceived, this, _1, _2),
-        };
-
-        try {
-            connection = new Connection(SERVER_ADDR, SERVER_PORT, 5, cbs);
-            this->name = name;
-        } catch (ConnectionException &exc) {
-            if (callback != nullptr) {
-                callback(Event::CONNECTION_LOST);
-            }
+        this->name = name;
+        reconnecting = false;
+        resumeRetrySecs = -1;
+        connect();
+        if (connection == nullptr && callback != nullptr) {
+            callback(Event::CONNECTION_LOST);
         }
     } else {
         this->name = name;
@@ -57,19 +78,68 @@ void ServerSession::open(std::string name)
 
 void ServerSession::close()
 {
-    /* Kill the connection, which will delete the session as well */
+    /* Kill the connection, which detaches the session on the server until it is resumed */
     if (connection != nullptr) {
         delete connection;
         connection = nullptr;
     }
+    reconnecting = false;
+    resuming = false;
+    resumeRetrySecs = -1;
+    suspended = false;
+    abandonConnection = false;
+    room.Clear();
+    roomMembers.clear();
 }
 
 void ServerSession::poll(double secs)
 {
+    if (reconnecting) {
+        reconnectSecsLeft -= secs;
+        if (reconnectSecsLeft <= 0) {
+            /* The server won't have kept the session any longer than this either */
+            close();
+            forgetSession();
+            if (callback != nullptr) {
+                callback(Event::CONNECTION_LOST);
+            }
+            return;
+        }
+    } else if (suspended && !resumeToken.empty() && connection != nullptr) {
+        /* Rather than wait out a connection that has gone quiet, resume on a new one */
+        suspendedSecs += secs;
+        if (suspendedSecs >= SESSION_RECONNECT_SECS) {
+            delete connection;
+            connection = nullptr;
+            startReconnecting();
+        }
+    }
+
+    if (resumeRetrySecs >= 0) {
+        resumeRetrySecs -= secs;
+        if (resumeRetrySecs < 0) {
+            if (connection == nullptr) {
+                connect();
+                if (connection == nullptr) {
+                    resumeRetrySecs = RESUME_RETRY_SECS;
+                }
+            } else {
+                sendResumeRequest();
+            }
+        }
+    }
+
     if (connection != nullptr) {
         connection->poll(secs);
 
-        if (retryNameRequest) {
+        if (abandonConnection) {
+            abandonConnection = false;
+            delete connection;
+            connection = nullptr;
+            if (callback != nullptr) {
+                callback(Event::CONNECTION_LOST);
+            }
+        } else if (retryNameRequest) {
             retryNameRequest = false;
             sendNameRequest();
         }
@@ -78,6 +148,9 @@ void ServerSession::poll(double secs)
 
 int ServerSession::getSuspendedTimeLeft()
 {
+    if (reconnecting) {
+        return (int) reconnectSecsLeft;
+    }
     if (connection == nullptr) {
         return 0;
     }
@@ -85,16 +158,175 @@ int ServerSession::getSuspendedTimeLeft()
     return connection->getSuspendedTimeLeft();
 }
 
+LinkStats ServerSession::getLinkStats()
+{
+    if (connection == nullptr) {
+        return LinkStats();
+    }
+
+    return connection->getLinkStats();
+}
+
+void ServerSession::createRoom(uint32_t maxPlayers)
+{
+    pbuf::RoomRequest request;
+    request.set_op(pbuf::RoomRequest::CREATE);
+    request.set_maxplayers(maxPlayers);
+    sendRoomRequest(request);
+}
+
+void ServerSession::joinRoom(const std::string &host)
+{
+    pbuf::RoomRequest request;
+    request.set_op(pbuf::RoomRequest::JOIN);
+    request.set_host(host);
+    sendRoomRequest(request);
+}
+
+void ServerSession::leaveRoom()
+{
+    pbuf::RoomRequest request;
+    request.set_op(pbuf::RoomRequest::LEAVE);
+    sendRoomRequest(request);
+
+    /* Out of the room as far as this side is concerned, whatever the server answers */
+    room.Clear();
+    roomMembers.clear();
+}
+
+void ServerSession::listRooms(uint32_t start)
+{
+    pbuf::RoomRequest request;
+    request.set_op(pbuf::RoomRequest::LIST);
+    request.set_liststart(start);
+    sendRoomRequest(request);
+}
+
+const pbuf::RoomInfo & ServerSession::getRoom()
+{
+    return room;
+}
+
+const std::vector<std::string> & ServerSession::getRoomMembers()
+{
+    return roomMembers;
+}
+
+pbuf::RoomReply::Result ServerSession::getRoomResult()
+{
+    return roomResult;
+}
+
+const std::vector<pbuf::RoomInfo> & ServerSession::getRoomList()
+{
+    return roomList;
+}
+
+uint32_t ServerSession::getRoomListNext()
+{
+    return roomListNext;
+}
+
+void ServerSession::connect()
+{
+    ConnectionCallbacks cbs = {
+        std::bind(&ServerSession::onConnectSuccess, this, _1),
+        std::bind(&ServerSession::onConnectFail, this, _1),
+        std::bind(&ServerSession::onConnectionLost, this, _1),
+        std::bind(&ServerSession::onConnectionSuspended, this, _1),
+        std::bind(&ServerSession::onConnectionResumed, this, _1),
+        std::bind(&ServerSession::onMsgReceived, this, _1, _2),
+        nullptr,
+    };
+
+    try {
+        connection = new Connection(SERVER_ADDR, SERVER_PORT, 5, cbs);
+        /* Varint framing lifts the 64 KiB limit on messages in either direction */
+        connection->setFramingMode(FramingMode::VARINT);
+        connection->setKeepAliveTime(SESSION_KEEPALIVE_SECS);
+    } catch (ConnectionException &exc) {
+        connection = nullptr;
+    }
+}
+
+void ServerSession::startReconnecting()
+{
+    resuming = false;
+    resumeRetrySecs = 0;
+    if (!reconnecting) {
+        reconnecting = true;
+        reconnectSecsLeft = SESSION_RESUME_SECS;
+        if (!suspended && callback != nullptr) {
+            callback(Event::CONNECTION_SUSPENDED);
+        }
+    }
+    suspended = false;
+}
+
+void ServerSession::forgetSession()
+{
+    resumeToken.clear();
+    messagesSent = 0;
+    messagesReceived = 0;
+    unacked.clear();
+    reconnecting = false;
+    resuming = false;
+    resumeRetrySecs = -1;
+    room.Clear();
+    roomMembers.clear();
+}
+
+bool ServerSession::sendSessionMessage(pbuf::NetworkMessage &msg)
+{
+    if (!reconnecting && !resuming) {
+        if (connection == nullptr) {
+            return false;
+        }
+        try {
+            connection->sendNetworkMessage(msg);
+        } catch (ConnectionException &exception) {
+            return false;
+        }
+    }
+
+    /* Counted only once sent (or certain to be replayed), just like the server counts them */
+    messagesSent++;
+    if (unacked.size() >= SESSION_RETAIN_MESSAGES) {
+        unacked.pop_front();
+    }
+    unacked.push_back(msg);
+    return true;
+}
+
+void ServerSession::sendRoomRequest(pbuf::RoomRequest &request)
+{
+    pbuf::NetworkMessage msg;
+    *msg.mutable_roomrequest() = request;
+
+    /* Without a connection there is nothing to ask, and a failed send is reported as lost anyway */
+    sendSessionMessage(msg);
+}
 
 void ServerSession::sendNameRequest()
 {
     requestingName = true;
     pbuf::NetworkMessage msg;
     msg.set_namerequest(name);
+    if (!sendSessionMessage(msg)) {
+        retryNameRequest = true;
+    }
+}
+
+void ServerSession::sendResumeRequest()
+{
+    pbuf::NetworkMessage msg;
+    msg.mutable_resumerequest()->set_token(resumeToken);
+    msg.mutable_resumerequest()->set_received(messagesReceived);
     try {
         connection->sendNetworkMessage(msg);
+        resuming = true;
     } catch (ConnectionException &exception) {
-        retryNameRequest = true;
+        /* The connection is on its way down, which is reported through the callback */
     }
 }
 
@@ -105,7 +337,11 @@ void ServerSession::onConnectSuccess(Connection *conn)
         return;
     }
 
-    if (callback != nullptr) {
+    if (!resumeToken.empty()) {
+        /* Until the server answers, a failure counts as one to open the session */
+        requestingName = !reconnecting;
+        sendResumeRequest();
+    } else if (callback != nullptr) {
         sendNameRequest();
     }
 }
@@ -119,6 +355,10 @@ void ServerSession::onConnectFail(Connection *conn)
 
     delete connection;
     connection = nullptr;
+    if (reconnecting) {
+        resumeRetrySecs = RESUME_RETRY_SECS;
+        return;
+    }
     requestingName = false;
     if (callback != nullptr) {
         callback(Event::CONNECTION_FAILED);
@@ -134,6 +374,20 @@ void ServerSession::onConnectionLost(Connection *conn)
 
     delete connection;
     connection = nullptr;
+    abandonConnection = false;
+    if (reconnecting || (!resumeToken.empty() && !requestingName)) {
+        /* The session is still there on the server, for a while, so go and get it back */
+        bool retrying = reconnecting;
+        startReconnecting();
+        if (retrying) {
+            resumeRetrySecs = RESUME_RETRY_SECS;
+        }
+        return;
+    }
+    resuming = false;
+    suspended = false;
+    room.Clear();
+    roomMembers.clear();
     if (callback != nullptr) {
         if (requestingName) {
             requestingName = false;
@@ -151,9 +405,14 @@ void ServerSession::onConnectionSuspended(Connection *conn)
         return;
     }
 
+    if (reconnecting) {
+        /* Not reported again, and given up on when it takes too long */
+        return;
+    }
     if (requestingName) {
         /* Suspended connection during name request = abort */
         requestingName = false;
+        resuming = false;
         delete connection;
         connection = nullptr;
         if (callback != nullptr) {
@@ -161,6 +420,8 @@ void ServerSession::onConnectionSuspended(Connection *conn)
         }
         return;
     } else {
+        suspended = true;
+        suspendedSecs = 0;
         if (callback != nullptr) {
             callback(Event::CONNECTION_SUSPENDED);
         }
@@ -174,16 +435,28 @@ void ServerSession::onConnectionResumed(Connection *conn)
         return;
     }
 
-    if (callback != nullptr) {
+    /* While reconnecting, resumed is only reported once the session is */
+    suspended = false;
+    if (!reconnecting && callback != nullptr) {
         callback(Event::CONNECTION_RESUMED);
     }
 }
 
-void ServerSession::onMsgReceived(Connection *conn, pbuf::NetworkMessage msg)
+void ServerSession::onMsgReceived(Connection *conn, const pbuf::NetworkMessage &msg)
 {
+    (void) conn;
+    if (msg.type_case() == pbuf::NetworkMessage::kResumeReply) {
+        onResumeReply(msg.resumereply());
+        return;
+    }
+    messagesReceived++;
+
     switch(msg.type_case()) {
     case pbuf::NetworkMessage::kNameReply:
         requestingName = false;
+        if (!msg.resumetoken().empty()) {
+            resumeToken = msg.resumetoken();
+        }
         if (msg.namereply()) {
             if (callback != nullptr) {
                 callback(Event::NAME_ACCEPTED);
@@ -195,7 +468,123 @@ void ServerSession::onMsgReceived(Connection *conn, pbuf::NetworkMessage msg)
         }
         break;
 
+    case pbuf::NetworkMessage::kRoomReply:
+        onRoomReply(msg.roomreply());
+        break;
+
+    case pbuf::NetworkMessage::kRoomUpdate:
+        onRoomUpdate(msg.roomupdate());
+        break;
+
     default:
         break;
     }
+}
+
+void ServerSession::onResumeReply(const pbuf::ResumeReply &reply)
+{
+    if (!resuming) {
+        return;
+    }
+    resuming = false;
+
+    if (reply.result() == pbuf::ResumeReply::BUSY) {
+        /* The server is still letting go of the old connection, so ask again shortly */
+        resumeRetrySecs = RESUME_RETRY_SECS;
+        return;
+    }
+
+    /* Everything the server missed has to still be here to replay, or the session can't go on */
+    uint64_t firstKept = messagesSent - unacked.size();
+    bool resumed = (reply.result() == pbuf::ResumeReply::RESUMED &&
+            reply.received() >= firstKept && reply.received() <= messagesSent);
+    if (!resumed) {
+        bool wasReconnecting = reconnecting;
+        forgetSession();
+        if (wasReconnecting) {
+            /* Can't delete the connection from inside its own callback */
+            abandonConnection = true;
+        } else {
+            sendNameRequest();
+        }
+        return;
+    }
+
+    resumeToken = reply.token();
+    while (messagesSent - unacked.size() < reply.received()) {
+        unacked.pop_front();
+    }
+    try {
+        for (pbuf::NetworkMessage &msg : unacked) {
+            connection->sendNetworkMessage(msg);
+        }
+    } catch (ConnectionException &exception) {
+        /* Lost again, which is reported through the callback and resumed once more */
+    }
+
+    if (reconnecting) {
+        reconnecting = false;
+        if (callback != nullptr) {
+            callback(Event::CONNECTION_RESUMED);
+        }
+        return;
+    }
+
+    /* Opened again: out of any room the server still has it in, and under the name asked for */
+    pbuf::RoomRequest leave;
+    leave.set_op(pbuf::RoomRequest::LEAVE);
+    sendRoomRequest(leave);
+    if (reply.name() != name) {
+        sendNameRequest();
+    } else {
+        requestingName = false;
+        if (callback != nullptr) {
+            callback(Event::NAME_ACCEPTED);
+        }
+    }
+}
+
+void ServerSession::onRoomReply(const pbuf::RoomReply &reply)
+{
+    roomResult = reply.result();
+    Event event = Event::NONE;
+    if (reply.op() == pbuf::RoomRequest::LIST) {
+        roomList.assign(reply.rooms().begin(), reply.rooms().end());
+        roomListNext = reply.listnext();
+        event = Event::ROOMS_LISTED;
+    } else if (reply.op() == pbuf::RoomRequest::CREATE || reply.op() == pbuf::RoomRequest::JOIN) {
+        if (reply.result() == pbuf::RoomReply::OK) {
+            room = reply.room();
+            roomMembers.clear();
+            if (reply.op() == pbuf::RoomRequest::CREATE) {
+                roomMembers.push_back(name);
+            }
+            event = Event::ROOM_ENTERED;
+        } else {
+            event = Event::ROOM_REJECTED;
+        }
+    }
+
+    if (event != Event::NONE && callback != nullptr) {
+        callback(event);
+    }
+}
+
+void ServerSession::onRoomUpdate(const pbuf::RoomUpdate &update)
+{
+    /* An update from a room already left may still be on its way */
+    if (update.room().id() != room.id()) {
+        return;
+    }
+
+    if (update.closed()) {
+        room.Clear();
+        roomMembers.clear();
+    } else {
+        room = update.room();
+        roomMembers.assign(update.members().begin(), update.members().end());
+    }
+    if (callback != nullptr) {
+        callback(update.closed() ? Event::ROOM_CLOSED : Event::ROOM_UPDATED);
+    }
 }
\ No newline at end of file
@@ -1,6 +1,9 @@
 #ifndef FD__SERVERSESSION_H
 #define FD__SERVERSESSION_H
 
+#include <deque>
+#include <vector>
+
 #include "Connection.h"
 
 /*
@@ -10,6 +13,11 @@
  * in messages transmitted to/from the server) and to register a callback to be informed
  * of events arising from the connection/server. It is a stateful "session" that retains
  * info about the connection to the server and established parameters for the interaction.
+ *
+ * Once a name is accepted the server hands out a resume token. If the connection is lost after
+ * that, the session reconnects by itself and resumes where it left off, keeping its name and room
+ * and replaying whatever either side sent that the other missed, so the consumer only sees the
+ * connection suspended and resumed. Only when that fails for long enough is the connection lost.
  */
 class ServerSession {
  public:
@@ -31,23 +39,62 @@ class ServerSession {
         CONNECTION_LOST,      /* AFTER name accepted/rejected, loss of connection */
         NAME_ACCEPTED,
         NAME_REJECTED,
+        ROOM_ENTERED,         /* A room was created or joined, see getRoom() */
+        ROOM_REJECTED,        /* A room request failed, see getRoomResult() */
+        ROOM_UPDATED,         /* Someone joined or left the room, see getRoomMembers() */
+        ROOM_CLOSED,          /* The host left the room, which put everyone else out of it */
+        ROOMS_LISTED,         /* A page of open rooms arrived, see getRoomList() */
     };
 
     /* Register a callback function to be notified of events for this ServerSession */
     void registerCallback(std::function<void(Event)> cb);
 
-    /* Attempt to open a server session using the given name */
+    /*
+     * Attempt to open a server session using the given name, carrying on with the session closed
+     * last if the server still keeps it
+     */
     void open(std::string name);
 
-    /* End any existing session with the server (releasing name) and close any connection */
+    /*
+     * Close any connection to the server. The server keeps the session (and name) for a while,
+     * for the next open() to carry on with, but the room is left on doing so
+     */
     void close();
 
     /* Poll events for this ServerSession. Should be called regularly */
     void poll(double secs);
 
-    /* Get the remaining time until a suspended session is disconnected */
+    /* Get the remaining time until a suspended (or reconnecting) session is disconnected */
     int getSuspendedTimeLeft();
 
+    /* Get the round trip time, jitter and loss measured on the connection (all 0 if none) */
+    LinkStats getLinkStats();
+
+    /*
+     * Host a new room for at most maxPlayers players (0 for as many as the server allows), or
+     * join the room hosted by the given player. Requires an accepted name. Answered with a
+     * ROOM_ENTERED or ROOM_REJECTED event
+     */
+    void createRoom(uint32_t maxPlayers);
+    void joinRoom(const std::string &host);
+
+    /* Leave the room entered, closing it if this session is the host */
+    void leaveRoom();
+
+    /* Ask for the page of open rooms starting at the given position. Answered with ROOMS_LISTED */
+    void listRooms(uint32_t start = 0);
+
+    /* Get the room this session is in (id 0 if none), and its members with the host first */
+    const pbuf::RoomInfo & getRoom();
+    const std::vector<std::string> & getRoomMembers();
+
+    /* Get the reason the last room request was rejected */
+    pbuf::RoomReply::Result getRoomResult();
+
+    /* Get the last page of open rooms listed, and where the next page starts (0 if none) */
+    const std::vector<pbuf::RoomInfo> & getRoomList();
+    uint32_t getRoomListNext();
+
  private:
 
     /* This is the connection instance used to communicate with the server */
@@ -65,6 +112,72 @@ class ServerSession {
     /* Set to true if currently in process of connecting / requesting name */
     bool requestingName;
 
+    /* The room entered (id 0 if none) and its members, as last told by the server */
+    pbuf::RoomInfo room;
+    std::vector<std::string> roomMembers;
+
+    /* The result of the last room request answered */
+    pbuf::RoomReply::Result roomResult;
+
+    /* The last page of open rooms listed, and where the next one starts */
+    std::vector<pbuf::RoomInfo> roomList;
+    uint32_t roomListNext;
+
+    /* The token to resume the session with, empty if none was handed out */
+    std::string resumeToken;
+
+    /* Session messages sent and received so far (all types but probes and resumes) */
+    uint64_t messagesSent;
+    uint64_t messagesReceived;
+
+    /* The last messages sent, which the server may not have received yet, oldest first */
+    std::deque<pbuf::NetworkMessage> unacked;
+
+    /* Set while getting a lost connection back without the consumer noticing, and time left */
+    bool reconnecting;
+    double reconnectSecsLeft;
+
+    /* Set while a resume request is waiting to be answered on the connection */
+    bool resuming;
+
+    /* Seconds until reconnecting or asking to resume again, negative if not waiting to */
+    double resumeRetrySecs;
+
+    /* Set while the connection is suspended, and how long it has been */
+    bool suspended;
+    double suspendedSecs;
+
+    /* Set when the connection is to be let go of on the next poll, being in one of its callbacks */
+    bool abandonConnection;
+
+    /* Creates the connection to the server, which calls back once connected */
+    void connect();
+
+    /* Starts getting the lost connection back, the old one being gone already */
+    void startReconnecting();
+
+    /* Forgets the session's token, counts and room, so the next one starts from scratch */
+    void forgetSession();
+
+    /*
+     * Sends a session message, keeping it to replay after a resume. While reconnecting it is only
+     * kept. Returns false if it could not be sent at all
+     */
+    bool sendSessionMessage(pbuf::NetworkMessage &msg);
+
+    /* Sends a room request over the connection, if there is one */
+    void sendRoomRequest(pbuf::RoomRequest &request);
+
+    /* Asks the server to carry on with the session on the current connection */
+    void sendResumeRequest();
+
+    /* Handle the server's answer to a resume request */
+    void onResumeReply(const pbuf::ResumeReply &reply);
+
+    /* Handle the server's answer to a room request, and updates to the room entered */
+    void onRoomReply(const pbuf::RoomReply &reply);
+    void onRoomUpdate(const pbuf::RoomUpdate &update);
+
     /* Sends a name request protobuf message over the connection containing the name class member */
     void sendNameRequest();
 
@@ -80,7 +193,7 @@ class ServerSession {
     void onConnectionLost(Connection *conn);
     void onConnectionSuspended(Connection *conn);
     void onConnectionResumed(Connection *conn);
-    void onMsgReceived(Connection *conn, pbuf::NetworkMessage msg);
+    void onMsgReceived(Connection *conn, const pbuf::NetworkMessage &msg);
 
 };
 
@@ -3,6 +3,7 @@
 #include <fstream>
 
 #include "Util.h"
+#include "Trace.h"
 #include "pbuf/generated/WindowConfiguration.pb.h"
 
 static const char CFG_PREFS_FILE[] = "window_cfg.dat";
@@ -138,6 +139,7 @@ void Window::flipToScene(Scene *newScene)
 
 void Window::update(double secs)
 {
+    TRACE_ZONE("Window::update");
     if (raylibWindow->IsResized()) {
         recalculateSizeParams();
     }
@@ -184,6 +186,7 @@ void Window::recalculateSizeParams()
 
 void Window::renderFrame()
 {
+    TRACE_ZONE("Window::renderFrame");
     renderer.start();
     if (currentScene != nullptr) {
         currentScene->render(&renderer);
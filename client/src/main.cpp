@@ -1,9 +1,11 @@
 #include <iostream>
+#include <cstring>
 
 #include "Window.h"
 #include "MainMenu.h"
 #include "Util.h"
 #include "Connection.h"
+#include "Trace.h"
 
 using namespace std::placeholders;
 
@@ -58,8 +60,11 @@ GameRunner::~GameRunner()
 
 void GameRunner::run()
 {
+	TRACE_THREAD_NAME("main");
+	TRACE_ZONE("GameRunner::run");
 	double lastTime = GetTime();
 	while (!window->shouldClose()) {
+		TRACE_ZONE("frame");
 
 		/* Update the window and scene */
 		double elapsedTime = GetTime() - lastTime;
@@ -84,7 +89,25 @@ void GameRunner::onWindowRequest(const WindowConfiguration &config)
 int main(int argc, char *argv[])
 {
 	Util::registerRunArgs(argc, argv);
-	GameRunner runner;
-	runner.run();
+
+	/* --trace FILE records where each frame's time goes, written to FILE on exit */
+	const char *tracePath = nullptr;
+	for (int i = 1; i + 1 < argc; i++) {
+		if (strcmp(argv[i], "--trace") == 0) {
+			tracePath = argv[i + 1];
+		}
+	}
+	if (tracePath != nullptr) {
+		Trace::start(tracePath);
+	}
+
+	{
+		GameRunner runner;
+		runner.run();
+	}
+
+	if (tracePath != nullptr && !Trace::write()) {
+		std::cout << "Failed to write trace to " << tracePath << std::endl;
+	}
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,10 @@
+if [ -d bench/bin ]; then rm -rf bench/bin; fi
+if [ -d bench/generated ]; then rm -rf bench/generated; fi
+mkdir bench/bin
+mkdir -p bench/generated/pbuf/generated
+
+protoc -I ../shared-src/pbuf --cpp_out=./bench/generated/pbuf/generated ../shared-src/pbuf/*.proto
+# micro-bench needs google-benchmark (libbenchmark-dev). Pass --benchmark_format=json for JSON output
+g++ -O2 -I ./src -I ../shared-src -I ./bench/generated bench/SessionListBench.cpp bench/FramingBench.cpp src/SessionList.cpp ../shared-src/Connection.cpp ../shared-src/Trace.cpp ./bench/generated/pbuf/generated/*.cc -lbenchmark_main -lbenchmark -lprotobuf -pthread -o bench/bin/micro-bench
+g++ -O2 -I ./src -I ../shared-src -I ./bench/generated bench/BotSwarm.cpp src/TimerWheel.cpp ../shared-src/Connection.cpp ../shared-src/Trace.cpp ./bench/generated/pbuf/generated/*.cc -lprotobuf -pthread -o bench/bin/bot-swarm
+echo "Built benchmarks in 'bench/bin/'"
@@ -0,0 +1,687 @@
+/*
+ * Load generator for the lobby server. Runs a swarm of headless bots against a server on this
+ * machine, each with its own Connection speaking the same protocol as the client's ServerSession
+ * (varint framing, name requests, the client's keep-alive time), and reports the throughput and
+ * the p50/p99/p99.9 latency of connecting, of having a name accepted and of room requests. Every
+ * bot is watched by a single epoll and keeps its keep-alive deadlines on the server's own
+ * TimerWheel, so thousands of bots cost no more to run than the server they load.
+ *
+ * Scenarios (--scenario):
+ *   connect  Every bot connects and stays connected
+ *   name     Every bot connects and has a unique name accepted (the default)
+ *   rename   As name, then every bot asks for a new name every --interval seconds
+ *   idle     As name, then the bots stay quiet so only keep-alive traffic flows
+ *   drop     As name, then every bot drops its connection abruptly (RST) every --interval
+ *            seconds and connects again
+ *   storm    As name, then halfway through every bot drops its connection at once and they
+ *            all connect again together
+ *   rooms    As name, then the bots pair up: every even bot hosts a room and lists a page of
+ *            rooms every --interval seconds, while the next bot joins and leaves its room in
+ *            turn every --interval seconds (so there are half as many rooms as bots)
+ *
+ * Bots that fail to connect or lose their connection connect again, no faster than --rate
+ * connects per second overall (0 for no limit).
+ *
+ * Every bot connects from the same address and renames as often as it is told to, so leave the
+ * server's --connect-rate off (the default) to load it rather than its rate limits. Name requests
+ * refused for going over a session's rate show up as names rejected.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "Connection.h"
+#include "TimerWheel.h"
+
+/* Server to load, unless given on the command line */
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT 44444
+
+/* Keep-alive time of the client's ServerSession, which the bots behave like */
+#define BOT_KEEPALIVE_SECS 15
+
+/* How long a bot waits for its connection to open before counting it as failed */
+static const double CONNECT_TIMEOUT_SECS = 5;
+
+/* How often the bots' scenario actions, connect timeouts and reconnects are checked */
+static const double ACTION_TICK_SECS = 0.01;
+
+/* The most readiness events handled per epoll_wait */
+static const int MAX_EVENTS = 1024;
+
+/* For std::bind _1, _2 ... */
+using namespace std::placeholders;
+
+/* Returns the seconds elapsed since the given time */
+static double secsSince(std::chrono::steady_clock::time_point start)
+{
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / 1000000000.0;
+}
+
+/* The samples of a latency, in seconds */
+class LatencySamples {
+ public:
+
+    void add(double secs) {
+        samples.push_back(secs);
+    }
+
+    size_t count() {
+        return samples.size();
+    }
+
+    /* Returns the given percentile (0 to 100) of the samples in milliseconds, or 0 if there are none */
+    double percentileMs(double percentile) {
+        if (samples.empty()) {
+            return 0;
+        }
+        std::sort(samples.begin(), samples.end());
+        size_t rank = (size_t) (percentile / 100 * samples.size());
+        return samples[std::min(rank, samples.size() - 1)] * 1000;
+    }
+
+ private:
+    std::vector<double> samples;
+};
+
+/* The swarm of bots and everything that drives them */
+class Swarm {
+ public:
+
+    /* The scenarios a swarm can run (see the top of this file) */
+    enum class Scenario {
+        CONNECT,
+        NAME,
+        RENAME,
+        IDLE,
+        DROP,
+        STORM,
+        ROOMS
+    };
+
+    Swarm(std::string host, uint16_t port, int numBots, Scenario scenario, double intervalSecs,
+            double connectRate);
+    ~Swarm();
+
+    /* Run the scenario for the given number of seconds, then print the report */
+    void run(double durationSecs);
+
+ private:
+
+    /* How far along a bot is */
+    enum class BotState {
+        OFFLINE,        /* No connection, waiting to connect (again) */
+        CONNECTING,     /* Waiting for its connection to open */
+        CONNECTED,      /* Connection open, no name requested yet */
+        NAMING,         /* Waiting for the reply to a name request */
+        NAMED           /* Name accepted, acting out the scenario */
+    };
+
+    struct Bot {
+        Connection *conn;
+        BotState state;
+
+        /* When the current connect, name or room request was started, to measure its latency */
+        std::chrono::steady_clock::time_point startedAt;
+
+        /* Seconds into the run when the bot next renames, drops or makes a room request */
+        double nextActionSecs;
+
+        /* Bumped for every name requested, to keep each one unique */
+        int nameGeneration;
+
+        /* Whether a room request is waiting for its reply, and whether the bot is in a room */
+        bool roomRequested;
+        bool inRoom;
+    };
+
+    std::string host;
+    uint16_t port;
+    Scenario scenario;
+    double intervalSecs;
+    double connectRate;
+
+    std::vector<Bot> bots;
+
+    /* Watches the socket of every bot with a connection */
+    int epollfd;
+
+    /* Runs the keep-alive deadlines of every connected bot */
+    TimerWheel *timers;
+
+    /* When the run started, and the seconds since then as of the current tick */
+    std::chrono::steady_clock::time_point runStart;
+    double runSecs;
+
+    /* Connects that may still be started under --rate */
+    double connectAllowance;
+
+    /* Spreads the first scenario action of each bot across the interval */
+    std::mt19937 rng;
+
+    /* What happened during the run */
+    LatencySamples connectLatency;
+    LatencySamples nameLatency;
+    LatencySamples roomLatency[4];
+    uint64_t connectsFailed;
+    uint64_t namesRejected;
+    uint64_t connectionsLost;
+    uint64_t connectionsSuspended;
+    uint64_t drops;
+    uint64_t roomsRejected;
+    uint64_t roomUpdates;
+
+    /* Start connecting any offline bots that --rate allows */
+    void startConnects(double elapsedSecs);
+
+    /* Open a new connection for the bot */
+    void connect(int index);
+
+    /* Close the bot's connection, abruptly (with a RST) if abort is set */
+    void disconnect(int index, bool abort);
+
+    /* Queue a request for a new unique name for the bot */
+    void requestName(int index);
+
+    /* Returns the name last requested by the bot */
+    std::string botName(int index);
+
+    /* Queue the bot's next room request: create, join, leave or list */
+    void requestRoom(int index);
+
+    /*
+     * Write out anything queued on the bot's connection. Not for use in its callbacks, since the
+     * connection may be lost (and deleted)
+     */
+    void flush(int index);
+
+    /* Fail connects that have taken too long, and start any scenario actions that are due */
+    void runActions();
+
+    /* Print what happened during the run */
+    void report(double durationSecs);
+
+    /* Callbacks registered with each bot's connection */
+    void onConnectSuccess(int index, Connection *conn);
+    void onConnectFail(int index, Connection *conn);
+    void onConnectionLost(int index, Connection *conn);
+    void onConnectionSuspended(int index, Connection *conn);
+    void onConnectionResumed(int index, Connection *conn);
+    void onMsgReceived(int index, Connection *conn, const pbuf::NetworkMessage &msg);
+
+};
+
+Swarm::Swarm(std::string host, uint16_t port, int numBots, Scenario scenario, double intervalSecs,
+        double connectRate)
+{
+    this->host = host;
+    this->port = port;
+    this->scenario = scenario;
+    this->intervalSecs = intervalSecs;
+    this->connectRate = connectRate;
+    bots.resize(numBots);
+    for (Bot &bot : bots) {
+        bot.conn = nullptr;
+        bot.state = BotState::OFFLINE;
+        bot.nextActionSecs = 0;
+        bot.nameGeneration = 0;
+        bot.roomRequested = false;
+        bot.inRoom = false;
+    }
+    runSecs = 0;
+    connectAllowance = 0;
+    rng.seed(44444);
+    connectsFailed = 0;
+    namesRejected = 0;
+    connectionsLost = 0;
+    connectionsSuspended = 0;
+    drops = 0;
+    roomsRejected = 0;
+    roomUpdates = 0;
+
+    epollfd = epoll_create1(0);
+    if (epollfd < 0) {
+        throw std::runtime_error("Failed to create epoll instance");
+    }
+    timers = new TimerWheel();
+}
+
+Swarm::~Swarm()
+{
+    for (size_t i = 0; i < bots.size(); i++) {
+        disconnect(i, false);
+    }
+    delete timers;
+    close(epollfd);
+}
+
+void Swarm::run(double durationSecs)
+{
+    struct epoll_event events[MAX_EVENTS];
+    bool stormed = false;
+    double lastActionSecs = -ACTION_TICK_SECS;
+    double lastConnectSecs = 0;
+
+    runStart = std::chrono::steady_clock::now();
+    while ((runSecs = secsSince(runStart)) < durationSecs) {
+
+        if (scenario == Scenario::STORM && !stormed && runSecs >= durationSecs / 2) {
+            /* Everyone drops at once, and is let back in all together */
+            for (size_t i = 0; i < bots.size(); i++) {
+                if (bots[i].conn != nullptr) {
+                    disconnect(i, true);
+                    drops++;
+                }
+            }
+            connectAllowance = bots.size();
+            stormed = true;
+        }
+
+        startConnects(runSecs - lastConnectSecs);
+        lastConnectSecs = runSecs;
+
+        if (runSecs - lastActionSecs >= ACTION_TICK_SECS) {
+            runActions();
+            lastActionSecs = runSecs;
+        }
+        timers->advance();
+
+        double waitSecs = timers->getSecsUntilNext(lastActionSecs + ACTION_TICK_SECS - runSecs);
+        int numEvents = epoll_wait(epollfd, events, MAX_EVENTS, (int) std::ceil(waitSecs * 1000));
+        for (int i = 0; i < numEvents; i++) {
+            Bot &bot = bots[events[i].data.u32];
+            if (bot.conn == nullptr) {
+                /* Lost while handling an earlier event */
+                continue;
+            }
+
+            if (bot.state == BotState::CONNECTING) {
+                /* The name request made once connected is only queued */
+                bot.conn->poll(0);
+                flush(events[i].data.u32);
+            } else {
+                bot.conn->pollReadable();
+            }
+        }
+    }
+
+    report(durationSecs);
+}
+
+void Swarm::startConnects(double elapsedSecs)
+{
+    if (connectRate > 0) {
+        /* Let a burst of up to a second's worth build up, no more */
+        connectAllowance = std::min(connectAllowance + elapsedSecs * connectRate, connectRate);
+    }
+
+    for (size_t i = 0; i < bots.size(); i++) {
+        if (bots[i].state != BotState::OFFLINE) {
+            continue;
+        }
+        if (connectRate > 0 && connectAllowance < 1) {
+            break;
+        }
+        connect(i);
+        if (connectRate > 0) {
+            connectAllowance--;
+        }
+    }
+}
+
+void Swarm::connect(int index)
+{
+    Bot &bot = bots[index];
+
+    ConnectionCallbacks cbs = {
+        std::bind(&Swarm::onConnectSuccess, this, index, _1),
+        std::bind(&Swarm::onConnectFail, this, index, _1),
+        std::bind(&Swarm::onConnectionLost, this, index, _1),
+        std::bind(&Swarm::onConnectionSuspended, this, index, _1),
+        std::bind(&Swarm::onConnectionResumed, this, index, _1),
+        std::bind(&Swarm::onMsgReceived, this, index, _1, _2),
+        nullptr,
+    };
+
+    bot.startedAt = std::chrono::steady_clock::now();
+    try {
+        bot.conn = new Connection(host, port, CONNECT_TIMEOUT_SECS, cbs);
+    } catch (ConnectionException &exp) {
+        connectsFailed++;
+        return;
+    }
+    bot.conn->setFramingMode(FramingMode::VARINT);
+    bot.conn->setKeepAliveTime(BOT_KEEPALIVE_SECS);
+    bot.state = BotState::CONNECTING;
+
+    /* Writable once the connect has completed one way or the other */
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.u32 = index;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, bot.conn->getSocketFd(), &ev);
+}
+
+void Swarm::disconnect(int index, bool abort)
+{
+    Bot &bot = bots[index];
+    if (bot.conn != nullptr) {
+        if (abort && bot.conn->getSocketFd() >= 0) {
+            /* Closing with a zero linger time resets the connection, as a crashed client would */
+            struct linger lingerOpt = { 1, 0 };
+            setsockopt(bot.conn->getSocketFd(), SOL_SOCKET, SO_LINGER, &lingerOpt, sizeof(lingerOpt));
+        }
+        timers->cancel(bot.conn);
+        delete bot.conn;
+        bot.conn = nullptr;
+    }
+    bot.state = BotState::OFFLINE;
+    bot.roomRequested = false;
+    bot.inRoom = false;
+}
+
+void Swarm::requestName(int index)
+{
+    Bot &bot = bots[index];
+    pbuf::NetworkMessage msg;
+    bot.nameGeneration++;
+    msg.set_namerequest(botName(index));
+    bot.conn->sendNetworkMessage(msg);
+    bot.state = BotState::NAMING;
+    bot.startedAt = std::chrono::steady_clock::now();
+}
+
+std::string Swarm::botName(int index)
+{
+    return "bot-" + std::to_string(index) + "-" + std::to_string(bots[index].nameGeneration - 1);
+}
+
+void Swarm::requestRoom(int index)
+{
+    Bot &bot = bots[index];
+    pbuf::NetworkMessage msg;
+    pbuf::RoomRequest *request = msg.mutable_roomrequest();
+    bool host = (index % 2 == 0);
+    if (!bot.inRoom && host) {
+        request->set_op(pbuf::RoomRequest::CREATE);
+        request->set_maxplayers(2);
+    } else if (!bot.inRoom) {
+        /* Wait for the host to be named, or the name asked for would be out of date */
+        if (bots[index - 1].state != BotState::NAMED) {
+            return;
+        }
+        request->set_op(pbuf::RoomRequest::JOIN);
+        request->set_host(botName(index - 1));
+    } else if (host) {
+        std::uniform_int_distribution<uint32_t> start(0, bots.size() / 2);
+        request->set_op(pbuf::RoomRequest::LIST);
+        request->set_liststart(start(rng));
+    } else {
+        request->set_op(pbuf::RoomRequest::LEAVE);
+    }
+    bot.conn->sendNetworkMessage(msg);
+    bot.roomRequested = true;
+    bot.startedAt = std::chrono::steady_clock::now();
+}
+
+void Swarm::flush(int index)
+{
+    Connection *conn = bots[index].conn;
+    if (conn != nullptr && conn->hasPendingSends()) {
+        /* A lost connection has already been cleaned up by onConnectionLost */
+        conn->flushSends();
+    }
+}
+
+void Swarm::runActions()
+{
+    for (size_t i = 0; i < bots.size(); i++) {
+        Bot &bot = bots[i];
+
+        if (bot.state == BotState::CONNECTING) {
+            if (secsSince(bot.startedAt) >= CONNECT_TIMEOUT_SECS) {
+                connectsFailed++;
+                disconnect(i, false);
+            }
+            continue;
+        }
+
+        if (bot.state != BotState::NAMED || runSecs < bot.nextActionSecs) {
+            continue;
+        }
+        if (scenario == Scenario::RENAME) {
+            requestName(i);
+            flush(i);
+            bot.nextActionSecs = runSecs + intervalSecs;
+        } else if (scenario == Scenario::DROP) {
+            disconnect(i, true);
+            drops++;
+        } else if (scenario == Scenario::ROOMS) {
+            if (!bot.roomRequested) {
+                requestRoom(i);
+                flush(i);
+            }
+            bot.nextActionSecs = runSecs + intervalSecs;
+        }
+    }
+}
+
+void Swarm::onConnectSuccess(int index, Connection *conn)
+{
+    Bot &bot = bots[index];
+    connectLatency.add(secsSince(bot.startedAt));
+    bot.state = BotState::CONNECTED;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.u32 = index;
+    epoll_ctl(epollfd, EPOLL_CTL_MOD, conn->getSocketFd(), &ev);
+    conn->setTimers(timers);
+
+    if (scenario != Scenario::CONNECT) {
+        requestName(index);
+    }
+}
+
+void Swarm::onConnectFail(int index, Connection *conn)
+{
+    (void) conn;
+    connectsFailed++;
+    disconnect(index, false);
+}
+
+void Swarm::onConnectionLost(int index, Connection *conn)
+{
+    (void) conn;
+    connectionsLost++;
+    disconnect(index, false);
+}
+
+void Swarm::onConnectionSuspended(int index, Connection *conn)
+{
+    (void) index;
+    (void) conn;
+    connectionsSuspended++;
+}
+
+void Swarm::onConnectionResumed(int index, Connection *conn)
+{
+    (void) index;
+    (void) conn;
+}
+
+void Swarm::onMsgReceived(int index, Connection *conn, const pbuf::NetworkMessage &msg)
+{
+    (void) conn;
+    Bot &bot = bots[index];
+    if (msg.type_case() == pbuf::NetworkMessage::kRoomReply && bot.roomRequested) {
+        const pbuf::RoomReply &reply = msg.roomreply();
+        bot.roomRequested = false;
+        if (reply.result() != pbuf::RoomReply::OK) {
+            /* Mostly joins racing their host's create, or its reconnect */
+            roomsRejected++;
+            return;
+        }
+        roomLatency[reply.op()].add(secsSince(bot.startedAt));
+        if (reply.op() == pbuf::RoomRequest::CREATE || reply.op() == pbuf::RoomRequest::JOIN) {
+            bot.inRoom = true;
+        } else if (reply.op() == pbuf::RoomRequest::LEAVE) {
+            bot.inRoom = false;
+        }
+        return;
+    }
+    if (msg.type_case() == pbuf::NetworkMessage::kRoomUpdate) {
+        roomUpdates++;
+        if (msg.roomupdate().closed()) {
+            bot.inRoom = false;
+        }
+        return;
+    }
+    if (msg.type_case() != pbuf::NetworkMessage::kNameReply || bot.state != BotState::NAMING) {
+        return;
+    }
+
+    if (msg.namereply()) {
+        nameLatency.add(secsSince(bot.startedAt));
+        bot.state = BotState::NAMED;
+        std::uniform_real_distribution<double> firstAction(0, intervalSecs);
+        bot.nextActionSecs = runSecs + firstAction(rng);
+    } else {
+        /* Only another swarm or client holding the same name could cause this */
+        namesRejected++;
+        requestName(index);
+    }
+}
+
+void Swarm::report(double durationSecs)
+{
+    size_t online = 0;
+    LatencySamples rtt;
+    for (Bot &bot : bots) {
+        if (bot.conn != nullptr && bot.state != BotState::CONNECTING) {
+            online++;
+            LinkStats stats = bot.conn->getLinkStats();
+            if (stats.rttSamples > 0) {
+                rtt.add(stats.smoothedRtt);
+            }
+        }
+    }
+
+    std::cout << std::fixed << std::setprecision(3);
+    std::cout << bots.size() << " bots for " << durationSecs << " s, " << online <<
+            " connected at the end" << std::endl;
+    std::cout << std::setw(14) << "" << std::setw(10) << "count" << std::setw(12) << "per sec" <<
+            std::setw(12) << "p50 ms" << std::setw(12) << "p99 ms" << std::setw(12) << "p99.9 ms" <<
+            std::endl;
+
+    LatencySamples *latencies[] = { &connectLatency, &nameLatency, &roomLatency[0],
+            &roomLatency[1], &roomLatency[2], &roomLatency[3], &rtt };
+    const char *labels[] = { "connect", "name accept", "room create", "room join", "room leave",
+            "room list", "smoothed rtt" };
+    for (int i = 0; i < 7; i++) {
+        if (latencies[i]->count() == 0 && i >= 2 && i <= 5) {
+            continue;
+        }
+        std::cout << std::setw(14) << std::left << labels[i] << std::right << std::setw(10) <<
+                latencies[i]->count() << std::setw(12) << latencies[i]->count() / durationSecs <<
+                std::setw(12) << latencies[i]->percentileMs(50) << std::setw(12) <<
+                latencies[i]->percentileMs(99) << std::setw(12) << latencies[i]->percentileMs(99.9) <<
+                std::endl;
+    }
+
+    std::cout << "connects failed " << connectsFailed << ", names rejected " << namesRejected <<
+            ", dropped on purpose " << drops << ", lost " << connectionsLost << ", suspended " <<
+            connectionsSuspended << std::endl;
+    if (scenario == Scenario::ROOMS) {
+        std::cout << "room requests rejected " << roomsRejected << ", room updates received " <<
+                roomUpdates << std::endl;
+    }
+}
+
+/* Print the command line usage of the load generator */
+static void printUsage(const char *prog)
+{
+    std::cout << "Usage: " << prog << " [--bots N] [--scenario NAME] [--duration SECS]" <<
+            " [--interval SECS] [--rate N] [--host HOST] [--port PORT]" << std::endl;
+    std::cout << "  --bots N          Number of bots to run. Default 1000" << std::endl;
+    std::cout << "  --scenario NAME   connect, name, rename, idle, drop, storm or rooms. Default name" <<
+            std::endl;
+    std::cout << "  --duration SECS   How long to run for. Default 10" << std::endl;
+    std::cout << "  --interval SECS   How often each bot renames, drops or makes a room request." <<
+            " Default 1" << std::endl;
+    std::cout << "  --rate N          Most connects started per second, 0 for no limit. Default 0" << std::endl;
+    std::cout << "  --host HOST       Server address. Default " << DEFAULT_HOST << std::endl;
+    std::cout << "  --port PORT       Server port. Default " << DEFAULT_PORT << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    int numBots = 1000;
+    Swarm::Scenario scenario = Swarm::Scenario::NAME;
+    double durationSecs = 10;
+    double intervalSecs = 1;
+    double connectRate = 0;
+    std::string host = DEFAULT_HOST;
+    uint16_t port = DEFAULT_PORT;
+
+    const char *scenarioNames[] = { "connect", "name", "rename", "idle", "drop", "storm", "rooms" };
+    for (int i = 1; i < argc; i++) {
+        bool known = true;
+        if (strcmp(argv[i], "--bots") == 0 && i + 1 < argc) {
+            numBots = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--scenario") == 0 && i + 1 < argc) {
+            known = false;
+            i++;
+            for (int s = 0; s < 7; s++) {
+                if (strcmp(argv[i], scenarioNames[s]) == 0) {
+                    scenario = (Swarm::Scenario) s;
+                    known = true;
+                }
+            }
+        } else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+            durationSecs = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+            intervalSecs = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            connectRate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--host") == 0 && i + 1 < argc) {
+            host = argv[++i];
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else {
+            known = false;
+        }
+        if (!known || numBots <= 0 || intervalSecs <= 0) {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    /* Every bot needs a descriptor, so allow as many as the hard limit does */
+    struct rlimit fileLimit;
+    if (getrlimit(RLIMIT_NOFILE, &fileLimit) == 0 && fileLimit.rlim_cur < fileLimit.rlim_max) {
+        fileLimit.rlim_cur = fileLimit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fileLimit);
+    }
+
+    Connection::init();
+    Swarm *swarm = new Swarm(host, port, numBots, scenario, intervalSecs, connectRate);
+    swarm->run(durationSecs);
+    delete swarm;
+    Connection::quit();
+    return 0;
+}
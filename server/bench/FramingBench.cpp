@@ -0,0 +1,294 @@
+/*
+ * Microbenchmarks for the per-message cost of Connection: encoding a NetworkMessage into the send
+ * queue (serialization plus framing) and decoding a batch of received frames (framing plus
+ * parsing into an arena, as the EventLoop does), for each kind of message in both framing modes.
+ * Bare protobuf serialization and parsing are timed alongside to tell the two layers apart, and
+ * sending one room update to a room's worth of connections either serialized for each of them or
+ * encoded once and shared.
+ */
+
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <benchmark/benchmark.h>
+#include <google/protobuf/arena.h>
+
+#include "Connection.h"
+
+/*
+ * Most frames in each batch encoded between emptying the send queue, or handed to
+ * Connection::receiveData in one go, and most bytes, which keeps batches of large messages under
+ * the send queue's high watermark
+ */
+static const int BATCH_FRAMES = 64;
+static const size_t BATCH_BYTES = 64 * 1024;
+
+/* The kinds of message timed */
+enum class MessageKind {
+    PING,
+    PONG,
+    NAME_REQUEST,
+    NAME_REPLY,
+    LARGE_NAME_REQUEST
+};
+
+/* Fill in a message of the given kind as the server or client would send it */
+static void makeMessage(MessageKind kind, pbuf::NetworkMessage &msg)
+{
+    switch (kind) {
+    case MessageKind::PING:
+    case MessageKind::PONG:
+        msg.set_probetype(kind == MessageKind::PING ? pbuf::NetworkMessage_ProbeType_PING :
+                pbuf::NetworkMessage_ProbeType_PONG);
+        msg.set_probeseq(12345);
+        msg.set_probetime(1234567890123);
+        break;
+    case MessageKind::NAME_REQUEST:
+        msg.set_namerequest("player-12345");
+        break;
+    case MessageKind::NAME_REPLY:
+        msg.set_namereply(true);
+        break;
+    case MessageKind::LARGE_NAME_REQUEST:
+        msg.set_namerequest(std::string(4096, 'n'));
+        break;
+    }
+}
+
+/* A transport that leaves sends queued, so encoding can be timed without touching a socket */
+class QueueOnlyTransport : public ConnectionTransport {
+ public:
+    void sendQueued(Connection *) override {}
+};
+
+/* Set by the listener below to the connection it wrapped */
+static Connection *wrappedConnection = nullptr;
+
+/*
+ * Wrap one end of a socketpair in a Connection as if it had been accepted, which is the only way
+ * to get a server-side Connection. The socket is never read or written. The other end is
+ * returned in peerfd for the caller to close
+ */
+static Connection * openConnection(FramingMode mode, int *peerfd)
+{
+    static Listener listener(0, [](Connection *conn) { wrappedConnection = conn; });
+    static QueueOnlyTransport transport;
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        return nullptr;
+    }
+    listener.handleAccepted(fds[0]);
+    *peerfd = fds[1];
+
+    Connection *conn = wrappedConnection;
+    conn->setFramingMode(mode);
+    conn->setTransport(&transport);
+    return conn;
+}
+
+/* Everything encoded since the queue was last emptied, as the transport would write it */
+static void drainSends(Connection *conn, std::string &out)
+{
+    conn->takePendingSends(out);
+    conn->sendCompleted(out.length());
+}
+
+static void BM_Encode(benchmark::State &state, MessageKind kind, FramingMode mode)
+{
+    int peerfd;
+    Connection *conn = openConnection(mode, &peerfd);
+    pbuf::NetworkMessage msg;
+    makeMessage(kind, msg);
+    std::string out;
+
+    int queued = 0;
+    size_t queuedBytes = 0;
+    for (auto _ : state) {
+        conn->sendNetworkMessage(msg);
+        queuedBytes += msg.GetCachedSize();
+        if (++queued == BATCH_FRAMES || queuedBytes >= BATCH_BYTES) {
+            drainSends(conn, out);
+            queued = 0;
+            queuedBytes = 0;
+        }
+    }
+    drainSends(conn, out);
+
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * msg.ByteSizeLong());
+    delete conn;
+    close(peerfd);
+}
+
+static void BM_Decode(benchmark::State &state, MessageKind kind, FramingMode mode)
+{
+    int peerfd;
+    Connection *conn = openConnection(mode, &peerfd);
+    google::protobuf::Arena arena;
+    conn->setMessageArena(&arena);
+
+    uint64_t handled = 0;
+    conn->setOnMsgReceivedCallback([&handled](Connection *, const pbuf::NetworkMessage &msg) {
+        benchmark::DoNotOptimize(&msg);
+        handled++;
+    });
+
+    /*
+     * Encode the batch with the same connection, so the frames are exactly as sent. Any framing
+     * preamble is taken off first, since it is only ever received once
+     */
+    std::string batch;
+    drainSends(conn, batch);
+    pbuf::NetworkMessage msg;
+    makeMessage(kind, msg);
+    int frames = 0;
+    size_t bytes = 0;
+    while (frames < BATCH_FRAMES && bytes < BATCH_BYTES) {
+        conn->sendNetworkMessage(msg);
+        frames++;
+        bytes += msg.GetCachedSize();
+    }
+    drainSends(conn, batch);
+
+    std::string pongs;
+    for (auto _ : state) {
+        conn->receiveData(batch.data(), batch.length());
+        arena.Reset();
+        if (kind == MessageKind::PING) {
+            drainSends(conn, pongs);
+        }
+    }
+
+    if (kind != MessageKind::PING && kind != MessageKind::PONG &&
+            handled != (uint64_t) (state.iterations() * frames)) {
+        state.SkipWithError("Not every frame was decoded");
+    }
+    state.SetItemsProcessed(state.iterations() * frames);
+    state.SetBytesProcessed(state.iterations() * batch.length());
+    conn->setMessageArena(nullptr);
+    delete conn;
+    close(peerfd);
+}
+
+static void BM_Broadcast(benchmark::State &state, bool encodeOnce)
+{
+    int numRecipients = state.range(0);
+    std::vector<Connection*> conns(numRecipients);
+    std::vector<int> peerfds(numRecipients);
+    for (int i = 0; i < numRecipients; i++) {
+        conns[i] = openConnection(FramingMode::VARINT, &peerfds[i]);
+    }
+
+    pbuf::NetworkMessage msg;
+    pbuf::RoomUpdate *update = msg.mutable_roomupdate();
+    update->mutable_room()->set_id(12345);
+    update->mutable_room()->set_host("player-1");
+    update->mutable_room()->set_numplayers(4);
+    update->mutable_room()->set_maxplayers(4);
+    for (int i = 1; i <= 4; i++) {
+        update->add_members("player-" + std::to_string(i));
+    }
+    std::string out;
+
+    int queued = 0;
+    for (auto _ : state) {
+        if (encodeOnce) {
+            std::shared_ptr<const EncodedMessage> encoded = EncodedMessage::encode(msg);
+            for (Connection *conn : conns) {
+                conn->sendEncodedMessage(*encoded);
+            }
+        } else {
+            for (Connection *conn : conns) {
+                conn->sendNetworkMessage(msg);
+            }
+        }
+        if (++queued == BATCH_FRAMES) {
+            for (Connection *conn : conns) {
+                drainSends(conn, out);
+            }
+            queued = 0;
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * numRecipients);
+    for (int i = 0; i < numRecipients; i++) {
+        drainSends(conns[i], out);
+        delete conns[i];
+        close(peerfds[i]);
+    }
+}
+
+static void BM_ProtobufSerialize(benchmark::State &state, MessageKind kind)
+{
+    pbuf::NetworkMessage msg;
+    makeMessage(kind, msg);
+    std::string out(msg.ByteSizeLong(), '\0');
+
+    for (auto _ : state) {
+        size_t size = msg.ByteSizeLong();
+        msg.SerializeWithCachedSizesToArray((uint8_t*) &out[0]);
+        benchmark::DoNotOptimize(size);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * out.length());
+}
+
+static void BM_ProtobufParse(benchmark::State &state, MessageKind kind)
+{
+    pbuf::NetworkMessage msg;
+    makeMessage(kind, msg);
+    std::string data = msg.SerializeAsString();
+    google::protobuf::Arena arena;
+
+    int parsed = 0;
+    for (auto _ : state) {
+        pbuf::NetworkMessage *in = google::protobuf::Arena::CreateMessage<pbuf::NetworkMessage>(&arena);
+        benchmark::DoNotOptimize(in->ParseFromArray(data.data(), data.length()));
+        if (++parsed == BATCH_FRAMES) {
+            arena.Reset();
+            parsed = 0;
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * data.length());
+}
+
+BENCHMARK_CAPTURE(BM_Encode, ping_fixed16, MessageKind::PING, FramingMode::FIXED16);
+BENCHMARK_CAPTURE(BM_Encode, ping_varint, MessageKind::PING, FramingMode::VARINT);
+BENCHMARK_CAPTURE(BM_Encode, name_request_fixed16, MessageKind::NAME_REQUEST, FramingMode::FIXED16);
+BENCHMARK_CAPTURE(BM_Encode, name_request_varint, MessageKind::NAME_REQUEST, FramingMode::VARINT);
+BENCHMARK_CAPTURE(BM_Encode, name_reply_fixed16, MessageKind::NAME_REPLY, FramingMode::FIXED16);
+BENCHMARK_CAPTURE(BM_Encode, name_reply_varint, MessageKind::NAME_REPLY, FramingMode::VARINT);
+BENCHMARK_CAPTURE(BM_Encode, large_name_request_fixed16, MessageKind::LARGE_NAME_REQUEST,
+        FramingMode::FIXED16);
+BENCHMARK_CAPTURE(BM_Encode, large_name_request_varint, MessageKind::LARGE_NAME_REQUEST,
+        FramingMode::VARINT);
+
+BENCHMARK_CAPTURE(BM_Decode, ping_fixed16, MessageKind::PING, FramingMode::FIXED16);
+BENCHMARK_CAPTURE(BM_Decode, ping_varint, MessageKind::PING, FramingMode::VARINT);
+BENCHMARK_CAPTURE(BM_Decode, pong_fixed16, MessageKind::PONG, FramingMode::FIXED16);
+BENCHMARK_CAPTURE(BM_Decode, pong_varint, MessageKind::PONG, FramingMode::VARINT);
+BENCHMARK_CAPTURE(BM_Decode, name_request_fixed16, MessageKind::NAME_REQUEST, FramingMode::FIXED16);
+BENCHMARK_CAPTURE(BM_Decode, name_request_varint, MessageKind::NAME_REQUEST, FramingMode::VARINT);
+BENCHMARK_CAPTURE(BM_Decode, name_reply_fixed16, MessageKind::NAME_REPLY, FramingMode::FIXED16);
+BENCHMARK_CAPTURE(BM_Decode, name_reply_varint, MessageKind::NAME_REPLY, FramingMode::VARINT);
+BENCHMARK_CAPTURE(BM_Decode, large_name_request_fixed16, MessageKind::LARGE_NAME_REQUEST,
+        FramingMode::FIXED16);
+BENCHMARK_CAPTURE(BM_Decode, large_name_request_varint, MessageKind::LARGE_NAME_REQUEST,
+        FramingMode::VARINT);
+
+BENCHMARK_CAPTURE(BM_ProtobufSerialize, ping, MessageKind::PING);
+BENCHMARK_CAPTURE(BM_ProtobufSerialize, name_request, MessageKind::NAME_REQUEST);
+BENCHMARK_CAPTURE(BM_ProtobufSerialize, large_name_request, MessageKind::LARGE_NAME_REQUEST);
+BENCHMARK_CAPTURE(BM_ProtobufParse, ping, MessageKind::PING);
+BENCHMARK_CAPTURE(BM_ProtobufParse, name_request, MessageKind::NAME_REQUEST);
+BENCHMARK_CAPTURE(BM_ProtobufParse, large_name_request, MessageKind::LARGE_NAME_REQUEST);
+
+BENCHMARK_CAPTURE(BM_Broadcast, serialize_each, false)->Arg(4)->Arg(64)->Arg(1024);
+BENCHMARK_CAPTURE(BM_Broadcast, encode_once, true)->Arg(4)->Arg(64)->Arg(1024);
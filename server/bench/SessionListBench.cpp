@@ -0,0 +1,163 @@
+/*
+ * Microbenchmarks for SessionList and Session. Times findByName and findByConnection for random
+ * existing keys, a generateSession/destroySession pair and Session::setName churn, each at
+ * populations of 100 up to 1M named sessions. Lookups should stay flat as the population grows.
+ */
+
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "SessionList.h"
+
+/* Number of distinct random keys each lookup benchmark cycles through */
+static const int LOOKUP_KEYS = 65536;
+
+/*
+ * Connections are only compared by identity in the list, so the benchmarks use distinct fake
+ * pointer values instead of opening real sockets. They are cleared before the list is destroyed.
+ */
+static Connection * fakeConnection(int i)
+{
+    return (Connection *) (uintptr_t) (0x10000 + (uintptr_t) i * 64);
+}
+
+/* Returns the name session i of a population is given */
+static std::string sessionName(int i)
+{
+    return "player-" + std::to_string(i);
+}
+
+/* A list of named sessions with fake connections, which clears the connections when freed */
+struct Population {
+    SessionList *sessions;
+    int size;
+
+    Population(int size) {
+        this->size = size;
+        sessions = new SessionList();
+        for (int i = 0; i < size; i++) {
+            Session *sess = sessions->generateSession();
+            sess->setConnection(fakeConnection(i));
+            sess->setName(sessionName(i));
+        }
+    }
+
+    ~Population() {
+        for (size_t i = 0; i < sessions->getSlotCount(); i++) {
+            Session *sess = sessions->getSlot(i);
+            if (sess != nullptr) {
+                sess->setConnection(nullptr);
+            }
+        }
+        delete sessions;
+    }
+};
+
+/*
+ * Building a large population takes far longer than the benchmarks using it, so the last one
+ * built is kept for the next benchmark of the same size. Benchmarks must leave it as they found
+ * it
+ */
+static std::unique_ptr<Population> cachedPopulation;
+
+static Population * population(int size)
+{
+    if (cachedPopulation == nullptr || cachedPopulation->size != size) {
+        cachedPopulation.reset();
+        cachedPopulation.reset(new Population(size));
+    }
+    return cachedPopulation.get();
+}
+
+/* Returns the indexes of LOOKUP_KEYS random sessions of a population of the given size */
+static std::vector<int> randomSessions(int size)
+{
+    std::mt19937 rng(44444);
+    std::uniform_int_distribution<int> pick(0, size - 1);
+    std::vector<int> picked;
+    for (int i = 0; i < LOOKUP_KEYS; i++) {
+        picked.push_back(pick(rng));
+    }
+    return picked;
+}
+
+static void BM_FindByName(benchmark::State &state)
+{
+    SessionList *sessions = population(state.range(0))->sessions;
+    std::vector<std::string> names;
+    for (int i : randomSessions(state.range(0))) {
+        names.push_back(sessionName(i));
+    }
+
+    size_t next = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(sessions->findByName(names[next]));
+        next = (next + 1) % names.size();
+    }
+}
+BENCHMARK(BM_FindByName)->RangeMultiplier(10)->Range(10, 1000000);
+
+static void BM_FindByConnection(benchmark::State &state)
+{
+    SessionList *sessions = population(state.range(0))->sessions;
+    std::vector<Connection*> conns;
+    for (int i : randomSessions(state.range(0))) {
+        conns.push_back(fakeConnection(i));
+    }
+
+    size_t next = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(sessions->findByConnection(conns[next]));
+        next = (next + 1) % conns.size();
+    }
+}
+BENCHMARK(BM_FindByConnection)->RangeMultiplier(10)->Range(10, 1000000);
+
+/* A session joining and leaving again, which leaves the population as it was */
+static void BM_GenerateDestroySession(benchmark::State &state)
+{
+    SessionList *sessions = population(state.range(0))->sessions;
+
+    for (auto _ : state) {
+        Session *sess = sessions->generateSession();
+        benchmark::DoNotOptimize(sess);
+        sessions->destroySession(sess);
+    }
+}
+BENCHMARK(BM_GenerateDestroySession)->RangeMultiplier(10)->Range(10, 1000000);
+
+/*
+ * Sessions changing name in turn. Session i flips between two names of its own, so names stay
+ * unique as they would be with the NameRegistry in front
+ */
+static void BM_SetNameChurn(benchmark::State &state)
+{
+    int size = state.range(0);
+    SessionList *sessions = population(size)->sessions;
+    std::vector<Session*> order;
+    std::vector<std::string> names;
+    for (int i = 0; i < size; i++) {
+        order.push_back(sessions->findByName(sessionName(i)));
+        names.push_back("renamed-" + std::to_string(i));
+    }
+    for (int i = 0; i < size; i++) {
+        names.push_back(sessionName(i));
+    }
+
+    size_t next = 0;
+    for (auto _ : state) {
+        order[next % size]->setName(names[next]);
+        next = (next + 1) % names.size();
+    }
+
+    /* Finish the round so every session has its original name back for the next benchmark */
+    while (next != 0) {
+        order[next % size]->setName(names[next]);
+        next = (next + 1) % names.size();
+    }
+}
+BENCHMARK(BM_SetNameChurn)->RangeMultiplier(10)->Range(10, 1000000);
@@ -0,0 +1,126 @@
+#include "AdmissionControl.h"
+
+#include <algorithm>
+#include <chrono>
+
+/* The limit on each kind of message, in the order of MessageKind */
+static const RateLimit MESSAGE_LIMITS[] = {
+    {NAME_REQUESTS_PER_SEC, NAME_REQUESTS_BURST},
+    {ROOM_REQUESTS_PER_SEC, ROOM_REQUESTS_BURST},
+    {RESUME_REQUESTS_PER_SEC, RESUME_REQUESTS_BURST},
+    {OTHER_MESSAGES_PER_SEC, OTHER_MESSAGES_BURST},
+};
+
+/* Spreads addresses over the table, since those of one network differ only in a few bits */
+static uint32_t hashAddr(uint32_t addr)
+{
+    addr ^= addr >> 16;
+    addr *= 0x85ebca6b;
+    addr ^= addr >> 13;
+    addr *= 0xc2b2ae35;
+    addr ^= addr >> 16;
+    return addr;
+}
+
+bool TokenBucket::take(const RateLimit &limit, uint32_t nowMs)
+{
+    /* Unsigned, so the difference is right even across the clock wrapping around */
+    uint32_t elapsedMs = nowMs - stampMs;
+    tokens = std::min(limit.burst, tokens + elapsedMs * (limit.perSec / 1000));
+    stampMs = nowMs;
+    if (tokens < 1) {
+        return false;
+    }
+    tokens -= 1;
+    return true;
+}
+
+AdmissionControl::AdmissionControl(const RateLimit &connectLimit)
+{
+    this->connectLimit = connectLimit;
+    stripes = new Stripe[ADMISSION_STRIPES];
+    for (int i = 0; i < ADMISSION_STRIPES; i++) {
+        for (Entry &entry : stripes[i].entries) {
+            entry.addr = 0;
+        }
+    }
+}
+
+AdmissionControl::~AdmissionControl()
+{
+    delete[] stripes;
+}
+
+uint32_t AdmissionControl::nowMs()
+{
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return (uint32_t) std::chrono::duration_cast<std::chrono::milliseconds>(now).count();
+}
+
+bool AdmissionControl::admitConnect(uint32_t addr, uint32_t nowMs)
+{
+    if (connectLimit.perSec <= 0 || addr == 0) {
+        return true;
+    }
+
+    uint32_t hash = hashAddr(addr);
+    Stripe &stripe = stripes[hash % ADMISSION_STRIPES];
+    std::lock_guard<std::mutex> guard(stripe.lock);
+
+    /*
+     * Entries are never emptied, so an address is either within its first few probes or not in
+     * the table at all. If not, it takes over an empty entry or else the one idle the longest
+     */
+    Entry *found = nullptr;
+    Entry *stalest = nullptr;
+    for (uint32_t probe = 0; probe < ADMISSION_PROBE_LIMIT; probe++) {
+        Entry &entry = stripe.entries[(hash / ADMISSION_STRIPES + probe) &
+                (ADMISSION_STRIPE_BUCKETS - 1)];
+        if (entry.addr == addr) {
+            found = &entry;
+            break;
+        }
+        if (entry.addr == 0) {
+            stalest = &entry;
+            break;
+        }
+        if (stalest == nullptr || nowMs - entry.bucket.stampMs > nowMs - stalest->bucket.stampMs) {
+            stalest = &entry;
+        }
+    }
+    if (found == nullptr) {
+        found = stalest;
+        found->addr = addr;
+        found->bucket = TokenBucket();
+    }
+    return found->bucket.take(connectLimit, nowMs);
+}
+
+bool AdmissionControl::admitMessage(SessionLimits &limits, pbuf::NetworkMessage::TypeCase type,
+        uint32_t nowMs)
+{
+    MessageKind kind;
+    switch (type) {
+    case pbuf::NetworkMessage::kNameRequest:
+        kind = MessageKind::NAME;
+        break;
+    case pbuf::NetworkMessage::kRoomRequest:
+        kind = MessageKind::ROOM;
+        break;
+    case pbuf::NetworkMessage::kResumeRequest:
+        kind = MessageKind::RESUME;
+        break;
+    case pbuf::NetworkMessage::kProbeType:
+        return true;
+    default:
+        kind = MessageKind::OTHER;
+        break;
+    }
+
+    if (limits.buckets[(int) kind].take(MESSAGE_LIMITS[(int) kind], nowMs)) {
+        limits.strikes = 0;
+        return true;
+    }
+    limits.strikes++;
+    return false;
+}
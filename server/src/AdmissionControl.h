@@ -0,0 +1,121 @@
+#ifndef FD__ADMISSIONCONTROL_H
+#define FD__ADMISSIONCONTROL_H
+
+#include <cstdint>
+#include <mutex>
+
+#include "Connection.h"
+
+/* How many independently-locked stripes the per-address buckets are split into */
+#define ADMISSION_STRIPES 16
+
+/* Per-address buckets each stripe holds (a power of two) */
+#define ADMISSION_STRIPE_BUCKETS 1024
+
+/* Buckets looked through for an address before the stalest of them is reused for it */
+#define ADMISSION_PROBE_LIMIT 8
+
+/* Messages a session may send of each limited kind, per second and in a burst */
+#define NAME_REQUESTS_PER_SEC 2
+#define NAME_REQUESTS_BURST 10
+#define ROOM_REQUESTS_PER_SEC 20
+#define ROOM_REQUESTS_BURST 40
+#define RESUME_REQUESTS_PER_SEC 2
+#define RESUME_REQUESTS_BURST 5
+#define OTHER_MESSAGES_PER_SEC 50
+#define OTHER_MESSAGES_BURST 100
+
+/*
+ * Messages a session may have refused in a row before its connection is dropped, as no client
+ * that heeds its refusals gets anywhere near
+ */
+#define MESSAGE_LIMIT_STRIKES 100
+
+/* How fast tokens come back to a bucket, and the most it holds. No limit at all if perSec is 0 */
+struct RateLimit {
+    float perSec;
+    float burst;
+};
+
+/*
+ * A token bucket, refilled lazily: the tokens that came back since it was last touched are only
+ * worked out when it is next asked for one, so an idle bucket costs nothing. A new bucket is full.
+ */
+struct TokenBucket {
+    float tokens = UINT32_MAX;
+    uint32_t stampMs = 0;
+
+    /* Take a token if there is one at the given time (see AdmissionControl::nowMs) */
+    bool take(const RateLimit &limit, uint32_t nowMs);
+};
+
+/* The kinds of message a session is limited in sending, each with a bucket of its own */
+enum class MessageKind : uint8_t {
+    NAME,
+    ROOM,
+    RESUME,
+    OTHER,
+    NUM_KINDS
+};
+
+/* The buckets of one session, and how many of its messages were refused in a row */
+struct SessionLimits {
+    TokenBucket buckets[(int) MessageKind::NUM_KINDS];
+    uint32_t strikes = 0;
+};
+
+/*
+ * Token-bucket rate limits on what clients may ask of the server, checked before any handler
+ * runs so that refusing a client costs next to nothing. Connects are limited per source address,
+ * shared by every worker (the kernel spreads one address's connects across all the listeners):
+ * the buckets live in a fixed-size open-addressing table split into independently-locked
+ * stripes, so memory stays bounded no matter how many addresses connect. An address whose bucket
+ * was reused for another simply starts over with a full one, which is only ever the case for
+ * addresses that have been quiet the longest. Messages are limited per session, with buckets
+ * kept in the session itself.
+ */
+class AdmissionControl {
+ public:
+
+    /* Constructor - allow every address connects at the given rate */
+    AdmissionControl(const RateLimit &connectLimit);
+
+    /* Destructor - free the buckets */
+    ~AdmissionControl();
+
+    /* Returns milliseconds on a steady clock, which wraps around every 49 days */
+    static uint32_t nowMs();
+
+    /*
+     * Take a token for a connect from the given IPv4 address (in network byte order), returning
+     * false if there is none left. Safe to call from any thread
+     */
+    bool admitConnect(uint32_t addr, uint32_t nowMs);
+
+    /*
+     * Take a token for a message of the given type from the session with the given limits,
+     * returning false if there is none left. Probes are never limited
+     */
+    static bool admitMessage(SessionLimits &limits, pbuf::NetworkMessage::TypeCase type,
+            uint32_t nowMs);
+
+ private:
+
+    /* One address and its bucket. Empty when addr is 0, which never connects */
+    struct Entry {
+        uint32_t addr;
+        TokenBucket bucket;
+    };
+
+    /* A single lock-protected partition of the table */
+    struct Stripe {
+        std::mutex lock;
+        Entry entries[ADMISSION_STRIPE_BUCKETS];
+    };
+
+    RateLimit connectLimit;
+    Stripe *stripes;
+
+};
+
+#endif
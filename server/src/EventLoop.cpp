@@ -0,0 +1,639 @@
+#include "EventLoop.h"
+
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+
+/* Size of the io_uring submission queue (the completion queue is twice this) */
+static const unsigned RING_ENTRIES = 4096;
+
+/* The id of the provided buffer group that io_uring receives pick their buffers from */
+static const uint16_t RING_BUFFER_GROUP = 0;
+
+/* Number of provided receive buffers (must be a power of two) and the size of each */
+static const unsigned RING_NUM_BUFFERS = 1024;
+static const unsigned RING_BUFFER_SIZE = 4096;
+
+/* Pack an io_uring request kind and id into the 64 bits of user data carried by the request */
+static uint64_t ringUserData(uint8_t op, uint64_t id)
+{
+    return ((uint64_t) op << 56) | id;
+}
+
+EventLoop::EventLoop(bool preferIoUring)
+{
+    epollfd = -1;
+    listener = nullptr;
+    numEvents = 0;
+    curEvent = 0;
+    ring = nullptr;
+    nextRingId = 1;
+    multishotRecv = true;
+    acceptArmed = false;
+    draining = false;
+    acceptPaused = false;
+    wakeTime = std::chrono::steady_clock::now();
+    busyNanos = 0;
+
+    google::protobuf::ArenaOptions arenaOptions;
+    arenaBlock = new char[EVENT_LOOP_ARENA_BLOCK_SIZE];
+    arenaOptions.initial_block = arenaBlock;
+    arenaOptions.initial_block_size = EVENT_LOOP_ARENA_BLOCK_SIZE;
+    msgArena = new google::protobuf::Arena(arenaOptions);
+
+    wakeCount = 0;
+    /* Blocking, since io_uring fails reads of a nonblocking one right away instead of waiting */
+    wakefd = eventfd(0, EFD_CLOEXEC);
+    if (wakefd < 0) {
+        delete msgArena;
+        delete[] arenaBlock;
+        throw EventLoopException("Failed to create eventfd");
+    }
+
+    if (preferIoUring) {
+        try {
+            ring = new IoUring(RING_ENTRIES, RING_BUFFER_GROUP, RING_NUM_BUFFERS, RING_BUFFER_SIZE);
+            armWake();
+            return;
+        } catch (IoUringException &exp) {
+            /* Fall back to epoll below */
+            ring = nullptr;
+        }
+    }
+
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &wakefd;
+    if (epollfd < 0 || epoll_ctl(epollfd, EPOLL_CTL_ADD, wakefd, &ev) < 0) {
+        if (epollfd >= 0) {
+            close(epollfd);
+        }
+        close(wakefd);
+        delete msgArena;
+        delete[] arenaBlock;
+        throw EventLoopException("Failed to create epoll instance");
+    }
+}
+
+EventLoop::~EventLoop()
+{
+    if (ring != nullptr) {
+        delete ring;
+        for (auto &entry : ringSendsInFlight) {
+            delete entry.second;
+        }
+    } else {
+        close(epollfd);
+    }
+    close(wakefd);
+
+    /* The arena has to go before the block it allocates from */
+    delete msgArena;
+    delete[] arenaBlock;
+}
+
+bool EventLoop::isUsingIoUring()
+{
+    return ring != nullptr;
+}
+
+uint64_t EventLoop::getBusyNanos()
+{
+    return busyNanos;
+}
+
+void EventLoop::addListener(Listener *listener)
+{
+    this->listener = listener;
+
+    if (ring != nullptr) {
+        armAccept();
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = listener;
+
+    int err = epoll_ctl(epollfd, EPOLL_CTL_ADD, listener->getSocketFd(), &ev);
+    if (err < 0) {
+        throw EventLoopException("Failed to register listener with epoll");
+    }
+}
+
+void EventLoop::addConnection(Connection *conn)
+{
+    conn->setMessageArena(msgArena);
+
+    if (ring != nullptr) {
+        uint64_t id = nextRingId++;
+        ringConns[id] = conn;
+        ringIds[conn] = id;
+        conn->setTransport(this);
+        if (!draining) {
+            armRecv(id, conn->getSocketFd());
+        }
+        return;
+    }
+
+    conn->setTransport(this);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = conn;
+
+    int err = epoll_ctl(epollfd, EPOLL_CTL_ADD, conn->getSocketFd(), &ev);
+    if (err < 0) {
+        throw EventLoopException("Failed to register connection with epoll");
+    }
+}
+
+void EventLoop::removeConnection(Connection *conn)
+{
+    conn->setTransport(nullptr);
+    conn->setMessageArena(nullptr);
+    for (Connection *&dirty : dirtyConns) {
+        if (dirty == conn) {
+            dirty = nullptr;
+        }
+    }
+
+    if (ring != nullptr) {
+        auto idIt = ringIds.find(conn);
+        if (idIt == ringIds.end()) {
+            return;
+        }
+        uint64_t id = idIt->second;
+        ringIds.erase(idIt);
+
+        ringConns.erase(id);
+
+        /*
+         * In-flight requests hold the socket open even after its fd is closed, so cancel them.
+         * Their completions still arrive and are dropped since the id is no longer known
+         */
+        struct io_uring_sqe *sqe = ring->getSqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = ringUserData((uint8_t) RingOp::RECV, id);
+        sqe->user_data = ringUserData((uint8_t) RingOp::CANCEL, 0);
+        if (ringSendsInFlight.count(id) != 0) {
+            sqe = ring->getSqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = ringUserData((uint8_t) RingOp::SEND, id);
+            sqe->user_data = ringUserData((uint8_t) RingOp::CANCEL, 0);
+        }
+        return;
+    }
+
+    /* A closed socket has already been dropped from the epoll set by the kernel */
+    int fd = conn->getSocketFd();
+    if (fd >= 0) {
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL);
+    }
+
+    /* Discard events for this connection that have been returned but not yet dispatched */
+    for (int i = curEvent + 1; i < numEvents; i++) {
+        if (events[i].data.ptr == conn) {
+            events[i].data.ptr = nullptr;
+        }
+    }
+}
+
+void EventLoop::wait(double maxSecs)
+{
+    flushDirty();
+
+    /* Every message from the last wait() has been handled, so their memory can be reused */
+    msgArena->Reset();
+    resumeAcceptIfDue(maxSecs);
+
+    auto sleepTime = std::chrono::steady_clock::now();
+    busyNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(sleepTime - wakeTime).count();
+
+    if (ring != nullptr) {
+        waitRing(maxSecs);
+        return;
+    }
+
+    int timeoutMillis = (maxSecs > 0) ? (int) (maxSecs * 1000) : 0;
+
+    numEvents = epoll_wait(epollfd, events, EVENT_LOOP_MAX_EVENTS, timeoutMillis);
+    wakeTime = std::chrono::steady_clock::now();
+    if (numEvents < 0) {
+        numEvents = 0;
+        if (errno != EINTR) {
+            throw EventLoopException("Failed waiting on epoll instance");
+        }
+        return;
+    }
+
+    for (curEvent = 0; curEvent < numEvents; curEvent++) {
+        void *target = events[curEvent].data.ptr;
+        if (target == nullptr) {
+            /* Connection was removed earlier in this same batch */
+            continue;
+        }
+
+        if (target == listener) {
+            /* Level-triggered, so a listener that can't be emptied has to be left alone a while */
+            if (!listener->poll()) {
+                pauseAccept();
+            }
+            continue;
+        }
+
+        if (target == &wakefd) {
+            /* Only there to end the wait. Reset the count so it isn't reported again */
+            read(wakefd, &wakeCount, sizeof(wakeCount));
+            continue;
+        }
+
+        Connection *conn = (Connection*) target;
+        uint32_t ready = events[curEvent].events;
+        if (ready & EPOLLOUT) {
+            /* The socket has room again for data it would not take earlier */
+            if (!conn->flushSends()) {
+                continue;
+            }
+            if (!conn->hasPendingSends()) {
+                watchWritable(conn, false);
+            }
+        }
+        if (ready & ~EPOLLOUT) {
+            /* Hangups and errors are discovered by the recv inside pollReadable */
+            conn->pollReadable();
+        }
+    }
+
+    numEvents = 0;
+    curEvent = 0;
+}
+
+bool EventLoop::drain(double maxSecs)
+{
+    draining = true;
+    if (ring == nullptr) {
+        /* Nothing is in flight with epoll. Write what the sockets take, the rest stays queued */
+        flushDirty();
+        return true;
+    }
+
+    /* Cancelled requests complete without rearming, after handing over anything they received */
+    struct io_uring_sqe *sqe;
+    if (acceptArmed) {
+        sqe = ring->getSqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = ringUserData((uint8_t) RingOp::ACCEPT, 0);
+        sqe->user_data = ringUserData((uint8_t) RingOp::CANCEL, 0);
+    }
+    for (uint64_t id : recvsArmed) {
+        sqe = ring->getSqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = ringUserData((uint8_t) RingOp::RECV, id);
+        sqe->user_data = ringUserData((uint8_t) RingOp::CANCEL, 0);
+    }
+
+    auto deadline = std::chrono::steady_clock::now() +
+            std::chrono::nanoseconds((uint64_t) (maxSecs * 1000000000));
+    while (acceptArmed || !recvsArmed.empty() || !ringSendsInFlight.empty() ||
+            !dirtyConns.empty()) {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline) {
+            return ringSendsInFlight.empty();
+        }
+        wait(std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - now).count() /
+                1000000000.0);
+    }
+    return true;
+}
+
+void EventLoop::wake()
+{
+    uint64_t one = 1;
+    write(wakefd, &one, sizeof(one));
+}
+
+void EventLoop::sendQueued(Connection *conn)
+{
+    dirtyConns.push_back(conn);
+}
+
+void EventLoop::flushDirty()
+{
+    /* Flushing can lose connections, which may queue more sends, so the list can grow meanwhile */
+    for (size_t i = 0; i < dirtyConns.size(); i++) {
+        Connection *conn = dirtyConns[i];
+        if (conn == nullptr || !conn->hasPendingSends()) {
+            continue;
+        }
+
+        if (ring != nullptr) {
+            /*
+             * With a send already in flight, the queued data follows once it completes. An
+             * overflowed connection is lost right away, as its send may never complete
+             */
+            uint64_t id = ringIds[conn];
+            if (ringSendsInFlight.count(id) == 0 || conn->hasSendOverflowed()) {
+                RingSend *send = new RingSend();
+                if (!conn->takePendingSends(send->data)) {
+                    delete send;
+                    continue;
+                }
+                startSend(id, conn, send);
+            }
+            continue;
+        }
+
+        if (!conn->flushSends()) {
+            continue;
+        }
+        if (conn->hasPendingSends()) {
+            /* The socket is full, so finish the job once it is writable */
+            watchWritable(conn, true);
+        }
+    }
+    dirtyConns.clear();
+}
+
+void EventLoop::watchWritable(Connection *conn, bool watch)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    if (watch) {
+        ev.events |= EPOLLOUT;
+    }
+    ev.data.ptr = conn;
+
+    int err = epoll_ctl(epollfd, EPOLL_CTL_MOD, conn->getSocketFd(), &ev);
+    if (err < 0) {
+        throw EventLoopException("Failed to update connection events with epoll");
+    }
+}
+
+void EventLoop::waitRing(double maxSecs)
+{
+    /* One syscall submits everything queued since the last wait and reaps completions */
+    ring->submitAndWait(maxSecs);
+    wakeTime = std::chrono::steady_clock::now();
+
+    struct io_uring_cqe *cqe = ring->peekCqe();
+    while (cqe != nullptr) {
+        uint64_t userData = cqe->user_data;
+        int res = cqe->res;
+        uint32_t flags = cqe->flags;
+        ring->advanceCqe();
+
+        RingOp op = (RingOp) (userData >> 56);
+        uint64_t id = userData & ((1ULL << 56) - 1);
+
+        switch (op) {
+        case RingOp::ACCEPT:
+            if (!(flags & IORING_CQE_F_MORE)) {
+                acceptArmed = false;
+            }
+            if (res >= 0) {
+                listener->handleAccepted(res);
+            } else if (res == -EMFILE || res == -ENFILE || res == -ENOBUFS || res == -ENOMEM) {
+                /* Out of descriptors or memory for now. The rest wait in the backlog */
+                pauseAccept();
+            } else if (res != -EAGAIN && res != -EINTR && res != -ECANCELED &&
+                    res != -ECONNABORTED && res != -EPROTO) {
+                throw ListenerException("Socket accept failed");
+            }
+            /* Only this one connection failed (or none did), so carry on with the rest */
+            if (!acceptArmed && !draining && !acceptPaused) {
+                armAccept();
+            }
+            break;
+
+        case RingOp::RECV:
+            handleRecvCompletion(id, res, flags);
+            break;
+
+        case RingOp::SEND:
+            handleSendCompletion(id, res);
+            break;
+
+        case RingOp::WAKE:
+            /* Only there to end the wait. Read the count again to hear about the next wake() */
+            armWake();
+            break;
+
+        default:
+            break;
+        }
+
+        cqe = ring->peekCqe();
+    }
+}
+
+void EventLoop::pauseAccept()
+{
+    if (acceptPaused) {
+        return;
+    }
+    acceptPaused = true;
+    acceptResumeAt = std::chrono::steady_clock::now() +
+            std::chrono::milliseconds((int) (EVENT_LOOP_ACCEPT_PAUSE_SECS * 1000));
+
+    /* A multishot accept left armed would only fail again on every connection pending */
+    if (ring != nullptr) {
+        if (acceptArmed) {
+            struct io_uring_sqe *sqe = ring->getSqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = ringUserData((uint8_t) RingOp::ACCEPT, 0);
+            sqe->user_data = ringUserData((uint8_t) RingOp::CANCEL, 0);
+        }
+        return;
+    }
+
+    /* Likewise a listener still watched would wake every wait() up straight away */
+    watchListener(false);
+}
+
+void EventLoop::resumeAcceptIfDue(double &maxSecs)
+{
+    if (!acceptPaused) {
+        return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (now < acceptResumeAt) {
+        double pauseSecs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                acceptResumeAt - now).count() / 1000000000.0;
+        if (pauseSecs < maxSecs) {
+            maxSecs = pauseSecs;
+        }
+        return;
+    }
+
+    acceptPaused = false;
+    if (ring == nullptr) {
+        watchListener(true);
+    } else if (!draining && !acceptArmed) {
+        armAccept();
+    }
+}
+
+void EventLoop::watchListener(bool watch)
+{
+    struct epoll_event ev;
+    ev.events = watch ? EPOLLIN : 0;
+    ev.data.ptr = listener;
+
+    int err = epoll_ctl(epollfd, EPOLL_CTL_MOD, listener->getSocketFd(), &ev);
+    if (err < 0) {
+        throw EventLoopException("Failed to update listener events with epoll");
+    }
+}
+
+void EventLoop::armAccept()
+{
+    struct io_uring_sqe *sqe = ring->getSqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listener->getSocketFd();
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = ringUserData((uint8_t) RingOp::ACCEPT, 0);
+    acceptArmed = true;
+}
+
+void EventLoop::armWake()
+{
+    struct io_uring_sqe *sqe = ring->getSqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = wakefd;
+    sqe->addr = (uint64_t) (uintptr_t) &wakeCount;
+    sqe->len = sizeof(wakeCount);
+    sqe->user_data = ringUserData((uint8_t) RingOp::WAKE, 0);
+}
+
+void EventLoop::armRecv(uint64_t id, int fd)
+{
+    struct io_uring_sqe *sqe = ring->getSqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = ring->getBufferGroup();
+    sqe->ioprio = multishotRecv ? IORING_RECV_MULTISHOT : 0;
+    sqe->user_data = ringUserData((uint8_t) RingOp::RECV, id);
+    recvsArmed.insert(id);
+}
+
+void EventLoop::startSend(uint64_t id, Connection *conn, RingSend *send)
+{
+    ringSendsInFlight[id] = send;
+    send->offset = 0;
+
+    struct io_uring_sqe *sqe = ring->getSqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->getSocketFd();
+    sqe->addr = (uint64_t) (uintptr_t) send->data.data();
+    sqe->len = send->data.length();
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    sqe->user_data = ringUserData((uint8_t) RingOp::SEND, id);
+}
+
+void EventLoop::handleRecvCompletion(uint64_t id, int res, uint32_t flags)
+{
+    bool hasBuffer = (flags & IORING_CQE_F_BUFFER) != 0;
+    uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    bool rearm = !(flags & IORING_CQE_F_MORE);
+    if (rearm) {
+        recvsArmed.erase(id);
+    }
+
+    auto it = ringConns.find(id);
+    if (it == ringConns.end()) {
+        /* Connection was removed while this receive was outstanding */
+        if (hasBuffer) {
+            ring->recycleBuffer(bid);
+        }
+        return;
+    }
+    Connection *conn = it->second;
+
+    if (res > 0) {
+        conn->receiveData(ring->getBuffer(bid), res);
+        ring->recycleBuffer(bid);
+
+        /* Handling the data may have lost and removed the connection */
+        if (rearm && !draining && ringConns.count(id) != 0) {
+            armRecv(id, conn->getSocketFd());
+        }
+        return;
+    }
+
+    if (hasBuffer) {
+        ring->recycleBuffer(bid);
+    }
+
+    if (draining && (res == -ECANCELED || res == -ENOBUFS)) {
+        /* Stopped by drain(), with the socket still open for whoever takes it over */
+        return;
+    }
+
+    if (res == -ENOBUFS || (res == -EINVAL && multishotRecv)) {
+        /* Out of buffers for now, or the kernel can't do multishot receives. Either way retry */
+        if (res == -EINVAL) {
+            multishotRecv = false;
+        }
+        if (rearm) {
+            armRecv(id, conn->getSocketFd());
+        }
+        return;
+    }
+
+    /* Graceful shutdown by the peer (0) or a real error */
+    conn->transportLost();
+}
+
+void EventLoop::handleSendCompletion(uint64_t id, int res)
+{
+    auto sendIt = ringSendsInFlight.find(id);
+    if (sendIt == ringSendsInFlight.end()) {
+        return;
+    }
+    RingSend *send = sendIt->second;
+
+    auto connIt = ringConns.find(id);
+    if (connIt == ringConns.end() || res <= 0) {
+        ringSendsInFlight.erase(sendIt);
+        delete send;
+
+        /* A cancelled send belongs to a connection that has already been removed */
+        if (connIt != ringConns.end() && res != -ECANCELED) {
+            connIt->second->transportLost();
+        }
+        return;
+    }
+    Connection *conn = connIt->second;
+
+    send->offset += res;
+    conn->sendCompleted(res);
+    if (send->offset < send->data.length()) {
+        /* Short send (interrupted despite MSG_WAITALL). Carry on with the rest */
+        struct io_uring_sqe *sqe = ring->getSqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = conn->getSocketFd();
+        sqe->addr = (uint64_t) (uintptr_t) (send->data.data() + send->offset);
+        sqe->len = send->data.length() - send->offset;
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        sqe->user_data = ringUserData((uint8_t) RingOp::SEND, id);
+        return;
+    }
+
+    if (conn->hasPendingSends()) {
+        /* Send everything queued while this was in flight, reusing the same storage */
+        ringSendsInFlight.erase(sendIt);
+        if (!conn->takePendingSends(send->data)) {
+            delete send;
+            return;
+        }
+        startSend(id, conn, send);
+        return;
+    }
+
+    ringSendsInFlight.erase(sendIt);
+    delete send;
+}
@@ -0,0 +1,219 @@
+#ifndef FD__EVENTLOOP_H
+#define FD__EVENTLOOP_H
+
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <sys/epoll.h>
+
+#include <google/protobuf/arena.h>
+
+#include "Connection.h"
+#include "IoUring.h"
+
+/* The most readiness events that will be handled in a single call to wait() */
+#define EVENT_LOOP_MAX_EVENTS 256
+
+/* Size of the block that the messages received in each wait() are allocated from first */
+#define EVENT_LOOP_ARENA_BLOCK_SIZE (64 * 1024)
+
+/*
+ * How long accepting stops for once the process runs out of descriptors or memory, in seconds.
+ * The connections pending meanwhile wait in the listen backlog
+ */
+#define EVENT_LOOP_ACCEPT_PAUSE_SECS 0.1
+
+/*
+ * Class representing the reactor for the server. The Listener and every accepted Connection are
+ * registered with it, and wait() blocks until one of them has something to handle or the given
+ * timeout expires, so idle connections cost nothing between keep-alive ticks.
+ *
+ * Sends are not written as they are made. Each connection queues its outgoing messages and the
+ * loop writes everything queued for a connection in one go at the start of the next wait(), so
+ * all the messages a peer is sent during one tick cost a single send. Likewise every message
+ * received during a wait() is parsed into an arena that is reset at the start of the next one,
+ * so handling messages costs no heap allocations.
+ *
+ * There are two backends behind the same interface. By default it is epoll based: wait() sleeps
+ * until sockets are readable and then polls just those, and only watches for writability while a
+ * connection has data the socket would not take. Optionally it can use io_uring, in which case
+ * the loop itself does all socket I/O with a multishot accept on the listener, multishot receives
+ * into a shared ring of provided buffers, and sends straight from the connections' queues, so a
+ * whole batch of messages costs a single syscall. If io_uring is unavailable the epoll backend is
+ * used. ONLY IMPLEMENTED FOR LINUX BUILDS.
+ */
+class EventLoop : public ConnectionTransport {
+ public:
+
+    /*
+     * Constructor - create the underlying epoll instance, or io_uring instance if preferIoUring
+     * is set and the kernel supports everything needed
+     */
+    EventLoop(bool preferIoUring = false);
+
+    /* Destructor - close the epoll / io_uring instance. Registered objects are not freed */
+    ~EventLoop();
+
+    /* Returns true if the io_uring backend is in use, false for epoll */
+    bool isUsingIoUring();
+
+    /* Register the listener so that wait() accepts incoming connections when they are pending */
+    void addListener(Listener *listener);
+
+    /* Register a connection so that wait() receives on it whenever data arrives */
+    void addConnection(Connection *conn);
+
+    /*
+     * Unregister a connection. This must be called before the connection is deleted so that any
+     * events for it still pending in the current wait() call are discarded
+     */
+    void removeConnection(Connection *conn);
+
+    /*
+     * Write out everything queued to be sent since the last call, then block for at most maxSecs
+     * seconds waiting for activity on any registered socket and dispatch everything that is
+     * ready. Returns early if interrupted by a signal
+     */
+    void wait(double maxSecs);
+
+    /*
+     * Returns how long the loop was busy before its last wait() went to sleep, in nanoseconds:
+     * from the previous wake up through dispatching what was ready, whatever the caller did in
+     * between and writing out the queued sends
+     */
+    uint64_t getBusyNanos();
+
+    /*
+     * Stop accepting and receiving, then wait (for at most maxSecs) until everything queued to be
+     * sent has been taken by the sockets, so that every socket can be handed to another process
+     * with nothing left inside the loop. Whatever arrives meanwhile is dispatched as usual.
+     * Returns false if a send was still in flight when time ran out. Nothing is accepted or
+     * received afterwards
+     */
+    bool drain(double maxSecs);
+
+    /*
+     * Make the current (or next) wait() return straight away, so work handed to the loop's
+     * thread is picked up without waiting for a socket or timer. Safe to call from any thread
+     */
+    void wake();
+
+    /* ConnectionTransport implementation: remember the connection to flush in the next wait() */
+    void sendQueued(Connection *conn) override;
+
+ private:
+
+    /* The file descriptor of the epoll instance (epoll backend only) */
+    int epollfd;
+
+    /* The registered listener, used to tell listener events apart from connection events */
+    Listener *listener;
+
+    /*
+     * The eventfd written by wake(), and where its count is read into. Its address marks its
+     * events apart from those of the listener and connections
+     */
+    int wakefd;
+    uint64_t wakeCount;
+
+    /* The readiness events returned by the current (or last) epoll_wait call */
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+
+    /* How many entries of events are valid, and the index of the one being dispatched */
+    int numEvents;
+    int curEvent;
+
+    /* The arena received messages are parsed into, and the block it reuses after every reset */
+    google::protobuf::Arena *msgArena;
+    char *arenaBlock;
+
+    /* When the last wait() woke up, and how long the loop was busy before it went to sleep */
+    std::chrono::steady_clock::time_point wakeTime;
+    uint64_t busyNanos;
+
+    /* Connections that have queued sends since the last flush. Removed ones are set to nullptr */
+    std::vector<Connection*> dirtyConns;
+
+    /* The io_uring instance, or nullptr when using the epoll backend */
+    IoUring *ring;
+
+    /* Kinds of io_uring request, stored in the top byte of each request's user data */
+    enum class RingOp : uint8_t {
+        ACCEPT = 1,
+        RECV,
+        SEND,
+        CANCEL,
+        WAKE
+    };
+
+    /* Outgoing data taken from a connection's queue, kept alive until the kernel is done with it */
+    struct RingSend {
+        std::string data;
+        size_t offset;
+    };
+
+    /*
+     * io_uring connections by id, and ids by connection. Ids are never reused so completions that
+     * arrive after a connection is removed can be recognized and dropped
+     */
+    std::unordered_map<uint64_t, Connection*> ringConns;
+    std::unordered_map<Connection*, uint64_t> ringIds;
+    uint64_t nextRingId;
+
+    /*
+     * The data currently being sent for each connection id, including removed connections. Only
+     * one send is in flight per connection to keep order; anything queued meanwhile follows it
+     */
+    std::unordered_map<uint64_t, RingSend*> ringSendsInFlight;
+
+    /* Cleared if the kernel turns out not to support multishot receives */
+    bool multishotRecv;
+
+    /* Whether the accept is outstanding, and the ids of connections with a receive outstanding */
+    bool acceptArmed;
+    std::unordered_set<uint64_t> recvsArmed;
+
+    /* Set by drain() to stop requests being rearmed as they complete */
+    bool draining;
+
+    /* Set while accepting is stopped for want of descriptors or memory, and until when */
+    bool acceptPaused;
+    std::chrono::steady_clock::time_point acceptResumeAt;
+
+    /* Write out the queued sends of every dirty connection */
+    void flushDirty();
+
+    /* Start or stop watching a connection for writability (epoll backend only) */
+    void watchWritable(Connection *conn, bool watch);
+
+    /* Start or stop watching the listener for pending connections (epoll backend only) */
+    void watchListener(bool watch);
+
+    /* Stop accepting for EVENT_LOOP_ACCEPT_PAUSE_SECS, the process being out of resources */
+    void pauseAccept();
+
+    /* Start accepting again if the pause is over, else cap maxSecs to wake up when it is */
+    void resumeAcceptIfDue(double &maxSecs);
+
+    /* io_uring backend implementation helpers */
+    void waitRing(double maxSecs);
+    void armAccept();
+    void armWake();
+    void armRecv(uint64_t id, int fd);
+    void startSend(uint64_t id, Connection *conn, RingSend *send);
+    void handleRecvCompletion(uint64_t id, int res, uint32_t flags);
+    void handleSendCompletion(uint64_t id, int res);
+
+};
+
+/* Empty exception type to throw when the event loop fails */
+class EventLoopException : public std::runtime_error {
+ public:
+    EventLoopException(const char* message) : std::runtime_error(message) {}
+};
+
+#endif
@@ -0,0 +1,397 @@
+#include "Handoff.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* How long the waiting thread sleeps before checking whether to stop */
+#define HANDOFF_POLL_MILLIS 250
+
+/* Close every descriptor in the list */
+static void closeAll(const std::vector<int> &fds)
+{
+    for (int fd : fds) {
+        close(fd);
+    }
+}
+
+/* Give up on the other server if it stalls for longer than the handover timeout */
+static void setTimeouts(int fd)
+{
+    struct timeval timeout;
+    timeout.tv_sec = HANDOFF_TIMEOUT_SECS;
+    timeout.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+Handoff::Handoff(const std::string &path)
+{
+    this->path = path;
+    listenfd = -1;
+    peerfd = -1;
+    serving = false;
+    requested = false;
+}
+
+Handoff::~Handoff()
+{
+    serving = false;
+    if (serveThread.joinable()) {
+        serveThread.join();
+    }
+    if (listenfd >= 0) {
+        close(listenfd);
+    }
+    if (peerfd >= 0) {
+        close(peerfd);
+    }
+}
+
+void Handoff::socketAddress(struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (path.length() >= sizeof(addr->sun_path)) {
+        throw HandoffException("Handoff socket path is too long");
+    }
+    memcpy(addr->sun_path, path.c_str(), path.length());
+}
+
+bool Handoff::receive(std::vector<int> &listenerFds, std::vector<HandoffSession> &sessions,
+        std::vector<HandoffRoom> &rooms, uint64_t &nameInstance)
+{
+    struct sockaddr_un addr;
+    socketAddress(&addr);
+
+    peerfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (peerfd < 0) {
+        throw HandoffException("Failed to create handoff socket");
+    }
+    if (connect(peerfd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        /* No socket file, or one left behind by a server that is gone: nothing to take over */
+        close(peerfd);
+        peerfd = -1;
+        return false;
+    }
+    setTimeouts(peerfd);
+
+    std::vector<int> fds;
+    try {
+        pbuf::HandoffBatch batch;
+        do {
+            fds.clear();
+            receiveBatch(batch, fds);
+
+            for (uint32_t i = 0; i < batch.numlisteners(); i++) {
+                listenerFds.push_back(fds[i]);
+            }
+            if (batch.nameinstance() != 0) {
+                nameInstance = batch.nameinstance();
+            }
+            for (int i = 0; i < batch.rooms_size(); i++) {
+                const pbuf::HandoffBatch::Room &msg = batch.rooms(i);
+                HandoffRoom room;
+                room.id = msg.id();
+                room.maxPlayers = msg.maxplayers();
+                room.members.assign(msg.members().begin(), msg.members().end());
+                rooms.push_back(std::move(room));
+            }
+            for (int i = 0; i < batch.sessions_size(); i++) {
+                const pbuf::HandoffBatch::Session &msg = batch.sessions(i);
+                HandoffSession session;
+                session.conn.sockfd = fds[batch.numlisteners() + i];
+                session.conn.framingMode = (FramingMode) msg.framingmode();
+                session.conn.framingDetected = msg.framingdetected();
+                session.conn.pendingRecv = msg.pendingrecv();
+                session.conn.pendingSend = msg.pendingsend();
+                session.name = msg.name();
+                session.named = msg.named();
+                session.room = msg.room();
+                session.resumeToken = msg.resumetoken();
+                session.messagesSent = msg.messagessent();
+                session.messagesReceived = msg.messagesreceived();
+                sessions.push_back(std::move(session));
+            }
+        } while (!batch.last());
+
+        /* Rooms come before their members, so only now can the members be checked */
+        for (const HandoffRoom &room : rooms) {
+            for (uint32_t member : room.members) {
+                if (member >= sessions.size()) {
+                    throw HandoffException("Malformed handoff room from the previous server");
+                }
+            }
+        }
+    } catch (HandoffException &exp) {
+        /* Leave nothing half taken over */
+        closeAll(listenerFds);
+        listenerFds.clear();
+        for (HandoffSession &session : sessions) {
+            close(session.conn.sockfd);
+        }
+        sessions.clear();
+        rooms.clear();
+        throw;
+    }
+
+    close(peerfd);
+    peerfd = -1;
+    return true;
+}
+
+void Handoff::receiveBatch(pbuf::HandoffBatch &batch, std::vector<int> &fds)
+{
+    /* The sockets arrive together with the first byte of the batch, so with its size */
+    uint32_t size;
+    struct iovec iov;
+    iov.iov_base = &size;
+    iov.iov_len = sizeof(size);
+
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH_FDS)];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t res;
+    do {
+        res = recvmsg(peerfd, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    } while (res < 0 && errno == EINTR);
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+            cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            int *received = (int*) CMSG_DATA(cmsg);
+            fds.insert(fds.end(), received, received + count);
+        }
+    }
+
+    if (res != sizeof(size) || (msg.msg_flags & MSG_CTRUNC) || size > HANDOFF_MAX_BATCH_BYTES) {
+        closeAll(fds);
+        throw HandoffException("Failed to receive handoff batch from the previous server");
+    }
+
+    std::string data(size, '\0');
+    size_t got = 0;
+    while (got < size) {
+        res = recv(peerfd, &data[got], size - got, MSG_WAITALL);
+        if (res <= 0 && !(res < 0 && errno == EINTR)) {
+            closeAll(fds);
+            throw HandoffException("Previous server stopped partway through the handoff");
+        }
+        if (res > 0) {
+            got += res;
+        }
+    }
+
+    if (!batch.ParseFromString(data) ||
+            fds.size() != batch.numlisteners() + (size_t) batch.sessions_size()) {
+        closeAll(fds);
+        throw HandoffException("Malformed handoff batch from the previous server");
+    }
+}
+
+void Handoff::serve(std::function<void()> onRequest)
+{
+    struct sockaddr_un addr;
+    socketAddress(&addr);
+
+    listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenfd < 0) {
+        throw HandoffException("Failed to create handoff socket");
+    }
+
+    /*
+     * Replace the file of the server taken over from, or one left behind by a crash. Whoever
+     * connects gets every connected socket, so only the same user may, from the moment the file
+     * exists. Called before the workers start, so no other thread creates files meanwhile
+     */
+    unlink(path.c_str());
+    mode_t oldMask = umask(S_IRWXG | S_IRWXO);
+    int err = bind(listenfd, (struct sockaddr*) &addr, sizeof(addr));
+    umask(oldMask);
+    if (err < 0 || listen(listenfd, 1) < 0) {
+        close(listenfd);
+        listenfd = -1;
+        throw HandoffException("Failed to listen on handoff socket");
+    }
+    chmod(path.c_str(), S_IRUSR | S_IWUSR);
+
+    this->onRequest = onRequest;
+    serving = true;
+    serveThread = std::thread(&Handoff::runServer, this);
+}
+
+bool Handoff::isRequested()
+{
+    return requested;
+}
+
+void Handoff::runServer()
+{
+    while (serving) {
+        struct pollfd pfd;
+        pfd.fd = listenfd;
+        pfd.events = POLLIN;
+        if (::poll(&pfd, 1, HANDOFF_POLL_MILLIS) <= 0) {
+            continue;
+        }
+
+        int fd = accept4(listenfd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+
+        /* The file's permissions aside, only a process of the same user is handed anything */
+        struct ucred cred;
+        socklen_t credLen = sizeof(cred);
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credLen) < 0 ||
+                cred.uid != geteuid()) {
+            close(fd);
+            continue;
+        }
+
+        setTimeouts(fd);
+        peerfd = fd;
+        requested = true;
+        serving = false;
+        onRequest();
+        return;
+    }
+}
+
+void Handoff::send(const std::vector<int> &listenerFds,
+        const std::vector<HandoffSession> &sessions, const std::vector<HandoffRoom> &rooms,
+        uint64_t nameInstance)
+{
+    /* The waiting thread set peerfd before reporting the request, so wait for it to finish */
+    if (serveThread.joinable()) {
+        serveThread.join();
+    }
+
+    /* Once a socket is in a sent batch it stays open for the other side, so close it here */
+    size_t listenersSent = 0;
+    size_t sessionsSent = 0;
+    try {
+        pbuf::HandoffBatch batch;
+        batch.set_numlisteners(listenerFds.size());
+        batch.set_last(sessions.empty());
+        batch.set_nameinstance(nameInstance);
+        for (const HandoffRoom &room : rooms) {
+            pbuf::HandoffBatch::Room *msg = batch.add_rooms();
+            msg->set_id(room.id);
+            msg->set_maxplayers(room.maxPlayers);
+            for (uint32_t member : room.members) {
+                msg->add_members(member);
+            }
+        }
+        sendBatch(batch, listenerFds);
+        listenersSent = listenerFds.size();
+        closeAll(listenerFds);
+
+        while (sessionsSent < sessions.size()) {
+            batch.Clear();
+            std::vector<int> fds;
+            size_t bytes = 0;
+            size_t end = sessionsSent;
+            while (end < sessions.size() && fds.size() < HANDOFF_BATCH_FDS &&
+                    (fds.empty() || bytes < HANDOFF_BATCH_BYTES)) {
+                const HandoffSession &session = sessions[end++];
+                pbuf::HandoffBatch::Session *msg = batch.add_sessions();
+                msg->set_name(session.name);
+                msg->set_named(session.named);
+                msg->set_room(session.room);
+                msg->set_resumetoken(session.resumeToken);
+                msg->set_messagessent(session.messagesSent);
+                msg->set_messagesreceived(session.messagesReceived);
+                msg->set_framingmode((uint32_t) session.conn.framingMode);
+                msg->set_framingdetected(session.conn.framingDetected);
+                msg->set_pendingrecv(session.conn.pendingRecv);
+                msg->set_pendingsend(session.conn.pendingSend);
+                fds.push_back(session.conn.sockfd);
+                bytes += session.conn.pendingRecv.length() + session.conn.pendingSend.length();
+            }
+            batch.set_last(end == sessions.size());
+            sendBatch(batch, fds);
+            sessionsSent = end;
+            closeAll(fds);
+        }
+    } catch (HandoffException &exp) {
+        for (size_t i = listenersSent; i < listenerFds.size(); i++) {
+            close(listenerFds[i]);
+        }
+        for (size_t i = sessionsSent; i < sessions.size(); i++) {
+            close(sessions[i].conn.sockfd);
+        }
+        throw;
+    }
+
+    close(peerfd);
+    peerfd = -1;
+}
+
+void Handoff::sendBatch(const pbuf::HandoffBatch &batch, const std::vector<int> &fds)
+{
+    std::string data;
+    batch.SerializeToString(&data);
+    uint32_t size = data.length();
+
+    struct iovec iov[2];
+    iov[0].iov_base = &size;
+    iov[0].iov_len = sizeof(size);
+    iov[1].iov_base = &data[0];
+    iov[1].iov_len = data.length();
+
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH_FDS)];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    if (!fds.empty()) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+        memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+    }
+
+    ssize_t res;
+    do {
+        res = sendmsg(peerfd, &msg, MSG_NOSIGNAL);
+    } while (res < 0 && errno == EINTR);
+    if (res < 0) {
+        throw HandoffException("Failed to send handoff batch to the new server");
+    }
+
+    /* The sockets went with the first byte, so anything left over is plain data */
+    size_t sent = res;
+    size_t total = sizeof(size) + data.length();
+    while (sent < total) {
+        const char *rest = (sent < sizeof(size)) ? (const char*) &size + sent :
+                data.data() + (sent - sizeof(size));
+        size_t restLen = (sent < sizeof(size)) ? sizeof(size) - sent : total - sent;
+        res = ::send(peerfd, rest, restLen, MSG_NOSIGNAL);
+        if (res < 0 && errno != EINTR) {
+            throw HandoffException("Failed to send handoff batch to the new server");
+        }
+        if (res > 0) {
+            sent += res;
+        }
+    }
+}
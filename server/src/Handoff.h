@@ -0,0 +1,134 @@
+#ifndef FD__HANDOFF_H
+#define FD__HANDOFF_H
+
+#include <atomic>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/un.h>
+
+#include "Connection.h"
+#include "pbuf/generated/Handoff.pb.h"
+
+/* Most sockets passed in one message. The kernel allows no more than 253 */
+#define HANDOFF_BATCH_FDS 200
+
+/* Batches are cut once the session data in them reaches this many bytes */
+#define HANDOFF_BATCH_BYTES (1024 * 1024)
+
+/* Largest batch accepted from the previous server */
+#define HANDOFF_MAX_BATCH_BYTES (64 * 1024 * 1024)
+
+/* Longest either server waits on the other before giving up on the handover, in seconds */
+#define HANDOFF_TIMEOUT_SECS 10
+
+/* A session on its way from one server to the next, along with its connection */
+struct HandoffSession {
+    ConnectionHandoff conn;
+    std::string name;
+    bool named;
+
+    /* The room the session was last known to be in, or 0 */
+    uint32_t room = 0;
+
+    /* The token to resume the session with (empty if none), and how far it had got */
+    std::string resumeToken;
+    uint64_t messagesSent = 0;
+    uint64_t messagesReceived = 0;
+};
+
+/* A game room on its way to the next server, its members given as positions in the sessions */
+struct HandoffRoom {
+    uint32_t id;
+    uint32_t maxPlayers;
+    std::vector<uint32_t> members;
+};
+
+/*
+ * Hands a running server over to its replacement (usually a new build) without dropping anyone.
+ * The running server waits on a Unix socket at a known path. A new server started with the same
+ * path connects to it, at which the running server stops its workers and sends across its
+ * listening sockets and every connected socket (as SCM_RIGHTS descriptors), along with each
+ * session's registered name, partly received frame and unsent data, and the game rooms. The new
+ * server carries on from there and the old one exits, so clients see nothing more than a brief
+ * pause and connects waiting in the listen backlog are not lost. ONLY IMPLEMENTED FOR LINUX BUILDS.
+ */
+class Handoff {
+ public:
+
+    /* Constructor - nothing is connected to or waited on until receive() or serve() */
+    Handoff(const std::string &path);
+
+    /*
+     * Destructor - stop waiting for a replacement. The socket file is left behind, since it may
+     * belong to the replacement by now, and is cleared away by the next serve()
+     */
+    ~Handoff();
+
+    /*
+     * Take over from the server waiting at the path, if there is one. Returns false straight away
+     * if there isn't, otherwise fills in the listening sockets, sessions and rooms handed over,
+     * and the id its names are held under (see NameRegistry::handOff), and returns true. Throws
+     * HandoffException if the handover breaks off partway
+     */
+    bool receive(std::vector<int> &listenerFds, std::vector<HandoffSession> &sessions,
+            std::vector<HandoffRoom> &rooms, uint64_t &nameInstance);
+
+    /*
+     * Start waiting at the path for a replacement server on a thread of its own, which calls
+     * onRequest once one connects. Throws HandoffException if the path can't be listened on
+     */
+    void serve(std::function<void()> onRequest);
+
+    /* Returns true once a replacement server has connected */
+    bool isRequested();
+
+    /*
+     * Send the listening sockets, sessions, rooms and name instance to the replacement server that
+     * connected, closing the sockets here either way. Throws HandoffException if they can't all
+     * be sent
+     */
+    void send(const std::vector<int> &listenerFds, const std::vector<HandoffSession> &sessions,
+            const std::vector<HandoffRoom> &rooms, uint64_t nameInstance);
+
+ private:
+
+    /* Where the Unix socket lives in the filesystem */
+    std::string path;
+
+    /* The socket waited on for a replacement server, or -1 when not serving */
+    int listenfd;
+
+    /* The socket connected to the other server, or -1 */
+    int peerfd;
+
+    /* Cleared to stop the waiting thread, and set once a replacement has connected */
+    std::atomic<bool> serving;
+    std::atomic<bool> requested;
+
+    std::thread serveThread;
+    std::function<void()> onRequest;
+
+    /* Body of the waiting thread */
+    void runServer();
+
+    /* Send one batch along with the sockets it describes */
+    void sendBatch(const pbuf::HandoffBatch &batch, const std::vector<int> &fds);
+
+    /* Receive one batch, adding the sockets that came with it to fds */
+    void receiveBatch(pbuf::HandoffBatch &batch, std::vector<int> &fds);
+
+    /* Fill in the address of the socket file. Throws HandoffException if the path is too long */
+    void socketAddress(struct sockaddr_un *addr);
+};
+
+/* Empty exception type to throw when handing over between servers fails */
+class HandoffException : public std::runtime_error {
+ public:
+    HandoffException(const char* message) : std::runtime_error(message) {}
+};
+
+#endif
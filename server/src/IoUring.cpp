@@ -0,0 +1,239 @@
+#include "IoUring.h"
+
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+#include <cstdlib>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* Operations the server relies on. The ring is refused if the kernel lacks any of them */
+static const int REQUIRED_OPS[] = {
+    IORING_OP_ACCEPT,
+    IORING_OP_RECV,
+    IORING_OP_SEND,
+    IORING_OP_ASYNC_CANCEL
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags,
+        void *arg, size_t argSize)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argSize);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned numArgs)
+{
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, numArgs);
+}
+
+IoUring::IoUring(unsigned entries, uint16_t bufferGroup, unsigned numBuffers, unsigned bufferSize)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ringfd = sys_io_uring_setup(entries, &params);
+    if (ringfd < 0) {
+        throw IoUringException("io_uring is not available on this kernel");
+    }
+
+    /* A single mmap for both rings and bounded waits are needed (both well older than pbuf rings) */
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+        close(ringfd);
+        throw IoUringException("io_uring lacks required features");
+    }
+
+    /* Make sure every operation used is supported */
+    size_t probeSize = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe *) calloc(1, probeSize);
+    int err = sys_io_uring_register(ringfd, IORING_REGISTER_PROBE, probe, 256);
+    bool opsSupported = (err >= 0);
+    for (int op : REQUIRED_OPS) {
+        if (!opsSupported || op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            opsSupported = false;
+        }
+    }
+    free(probe);
+    if (!opsSupported) {
+        close(ringfd);
+        throw IoUringException("io_uring lacks required operations");
+    }
+
+    /* Map the submission and completion rings, which share one mapping */
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ringMemSize = (sqSize > cqSize) ? sqSize : cqSize;
+    ringMem = mmap(NULL, ringMemSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd,
+            IORING_OFF_SQ_RING);
+    if (ringMem == MAP_FAILED) {
+        close(ringfd);
+        throw IoUringException("Failed to map io_uring rings");
+    }
+
+    sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (struct io_uring_sqe *) mmap(NULL, sqesSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        munmap(ringMem, ringMemSize);
+        close(ringfd);
+        throw IoUringException("Failed to map io_uring submission entries");
+    }
+
+    char *base = (char *) ringMem;
+    sqHead = (unsigned *) (base + params.sq_off.head);
+    sqTail = (unsigned *) (base + params.sq_off.tail);
+    sqArray = (unsigned *) (base + params.sq_off.array);
+    sqMask = *(unsigned *) (base + params.sq_off.ring_mask);
+    sqEntries = params.sq_entries;
+    sqLocalTail = *sqTail;
+
+    cqHead = (unsigned *) (base + params.cq_off.head);
+    cqTail = (unsigned *) (base + params.cq_off.tail);
+    cqes = (struct io_uring_cqe *) (base + params.cq_off.cqes);
+    cqMask = *(unsigned *) (base + params.cq_off.ring_mask);
+
+    /* Set up and register the provided buffer ring that receives pick their buffers from */
+    this->bufferGroup = bufferGroup;
+    this->numBuffers = numBuffers;
+    this->bufferSize = bufferSize;
+    bufRingSize = numBuffers * sizeof(struct io_uring_buf);
+    bufRing = (struct io_uring_buf_ring *) mmap(NULL, bufRingSize, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    buffers = (char *) malloc((size_t) numBuffers * bufferSize);
+    if (bufRing == MAP_FAILED || buffers == nullptr) {
+        if (bufRing != MAP_FAILED) {
+            munmap(bufRing, bufRingSize);
+        }
+        free(buffers);
+        munmap(sqes, sqesSize);
+        munmap(ringMem, ringMemSize);
+        close(ringfd);
+        throw IoUringException("Failed to allocate io_uring receive buffers");
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) bufRing;
+    reg.ring_entries = numBuffers;
+    reg.bgid = bufferGroup;
+    err = sys_io_uring_register(ringfd, IORING_REGISTER_PBUF_RING, &reg, 1);
+    if (err < 0) {
+        munmap(bufRing, bufRingSize);
+        free(buffers);
+        munmap(sqes, sqesSize);
+        munmap(ringMem, ringMemSize);
+        close(ringfd);
+        throw IoUringException("io_uring lacks provided buffer rings");
+    }
+
+    bufLocalTail = 0;
+    for (unsigned bid = 0; bid < numBuffers; bid++) {
+        recycleBuffer(bid);
+    }
+}
+
+IoUring::~IoUring()
+{
+    close(ringfd);
+    munmap(bufRing, bufRingSize);
+    free(buffers);
+    munmap(sqes, sqesSize);
+    munmap(ringMem, ringMemSize);
+}
+
+struct io_uring_sqe * IoUring::getSqe()
+{
+    unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    if (sqLocalTail - head >= sqEntries) {
+        /* Full - push what we have to the kernel to make room */
+        enter(false, 0);
+        head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        if (sqLocalTail - head >= sqEntries) {
+            throw IoUringException("io_uring submission queue overflow");
+        }
+    }
+
+    unsigned idx = sqLocalTail & sqMask;
+    struct io_uring_sqe *sqe = &sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqArray[idx] = idx;
+    sqLocalTail++;
+    return sqe;
+}
+
+void IoUring::submitAndWait(double maxSecs)
+{
+    bool completionsWaiting = (__atomic_load_n(cqTail, __ATOMIC_ACQUIRE) != *cqHead);
+    enter(!completionsWaiting && maxSecs > 0, maxSecs);
+}
+
+void IoUring::enter(bool wait, double maxSecs)
+{
+    /* Publish the entries handed out so far */
+    unsigned toSubmit = sqLocalTail - *sqTail;
+    __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+
+    if (toSubmit == 0 && !wait) {
+        return;
+    }
+
+    struct io_uring_timespec ts;
+    ts.tv_sec = (long long) maxSecs;
+    ts.tv_nsec = (long long) ((maxSecs - ts.tv_sec) * 1000000000);
+
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t) (uintptr_t) &ts;
+
+    unsigned flags = IORING_ENTER_EXT_ARG;
+    if (wait) {
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+
+    int res = sys_io_uring_enter(ringfd, toSubmit, wait ? 1 : 0, flags, &arg, sizeof(arg));
+    if (res < 0 && errno != ETIME && errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+        throw IoUringException("Failed to enter io_uring");
+    }
+}
+
+struct io_uring_cqe * IoUring::peekCqe()
+{
+    unsigned head = *cqHead;
+    if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+        return nullptr;
+    }
+    return &cqes[head & cqMask];
+}
+
+void IoUring::advanceCqe()
+{
+    __atomic_store_n(cqHead, *cqHead + 1, __ATOMIC_RELEASE);
+}
+
+uint16_t IoUring::getBufferGroup()
+{
+    return bufferGroup;
+}
+
+char * IoUring::getBuffer(uint16_t bid)
+{
+    return &buffers[(size_t) bid * bufferSize];
+}
+
+void IoUring::recycleBuffer(uint16_t bid)
+{
+    /*
+     * Index the ring memory directly: the ring's head (with its tail) overlays the first entry,
+     * whose addr, len and bid fields it leaves alone
+     */
+    struct io_uring_buf *buf = &((struct io_uring_buf *) bufRing)[bufLocalTail & (numBuffers - 1)];
+    buf->addr = (uint64_t) (uintptr_t) getBuffer(bid);
+    buf->len = bufferSize;
+    buf->bid = bid;
+    bufLocalTail++;
+    __atomic_store_n(&bufRing->tail, (uint16_t) bufLocalTail, __ATOMIC_RELEASE);
+}
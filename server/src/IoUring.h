@@ -0,0 +1,105 @@
+#ifndef FD__IOURING_H
+#define FD__IOURING_H
+
+#include <stdexcept>
+
+#include "IoUringAbi.h"
+
+/*
+ * Thin wrapper around a raw io_uring instance (set up through the syscalls directly, so there is
+ * no dependency on liburing). Provides access to submission queue entries, submission with a
+ * bounded wait for completions, completion queue iteration, and a single ring of provided receive
+ * buffers that the kernel picks from when a receive is ready.
+ * The constructor throws IoUringException when the kernel lacks io_uring or a required feature,
+ * so callers can fall back to plain sockets.
+ */
+class IoUring {
+ public:
+
+    /*
+     * Constructor - set up a ring with (at least) the given number of submission entries and a
+     * provided buffer ring of numBuffers buffers (a power of two) of bufferSize bytes each,
+     * registered under the group id bufferGroup
+     */
+    IoUring(unsigned entries, uint16_t bufferGroup, unsigned numBuffers, unsigned bufferSize);
+
+    /* Destructor - unmap and close the ring. The kernel cancels anything still in flight */
+    ~IoUring();
+
+    /*
+     * Get a zeroed submission queue entry to fill in. If the submission queue is full, pending
+     * entries are submitted first to make room
+     */
+    struct io_uring_sqe * getSqe();
+
+    /*
+     * Submit all pending entries and wait up to maxSecs seconds for at least one completion,
+     * unless completions are already waiting
+     */
+    void submitAndWait(double maxSecs);
+
+    /* Returns the next unconsumed completion entry, or nullptr if there are none */
+    struct io_uring_cqe * peekCqe();
+
+    /* Mark the completion entry returned by peekCqe as consumed */
+    void advanceCqe();
+
+    /* Returns the group id that receives should select buffers from */
+    uint16_t getBufferGroup();
+
+    /* Returns the memory of the provided buffer with the given id */
+    char * getBuffer(uint16_t bid);
+
+    /* Hand the provided buffer with the given id back to the kernel once its data is consumed */
+    void recycleBuffer(uint16_t bid);
+
+ private:
+
+    /* Submit pending entries, optionally waiting for a completion for up to maxSecs seconds */
+    void enter(bool wait, double maxSecs);
+
+    /* The io_uring file descriptor */
+    int ringfd;
+
+    /* The shared ring memory mapping and its size */
+    void *ringMem;
+    size_t ringMemSize;
+
+    /* The submission queue entry array mapping */
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+
+    /* Pointers into the submission queue ring */
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqArray;
+    unsigned sqMask;
+    unsigned sqEntries;
+
+    /* The tail including entries handed out by getSqe but not yet submitted */
+    unsigned sqLocalTail;
+
+    /* Pointers into the completion queue ring */
+    unsigned *cqHead;
+    unsigned *cqTail;
+    struct io_uring_cqe *cqes;
+    unsigned cqMask;
+
+    /* The provided buffer ring shared with the kernel, and the memory of the buffers themselves */
+    struct io_uring_buf_ring *bufRing;
+    size_t bufRingSize;
+    char *buffers;
+    unsigned numBuffers;
+    unsigned bufferSize;
+    uint16_t bufferGroup;
+    unsigned bufLocalTail;
+
+};
+
+/* Empty exception type to throw when io_uring is unavailable or fails */
+class IoUringException : public std::runtime_error {
+ public:
+    IoUringException(const char* message) : std::runtime_error(message) {}
+};
+
+#endif
@@ -0,0 +1,221 @@
+#ifndef FD__IOURINGABI_H
+#define FD__IOURINGABI_H
+
+#include <cstdint>
+
+/*
+ * The parts of the io_uring kernel ABI (as in linux/io_uring.h) that IoUring and the event loop
+ * use, kept here so the server builds without kernel headers, or with headers older than the
+ * features it asks for. The layouts and values are fixed by the kernel, and whether the running
+ * kernel supports each feature is checked when the ring is set up, falling back to epoll if not.
+ * Only the fields used are named; the rest are padding that keeps the layout the kernel's.
+ */
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register 427
+#endif
+
+/* Operations */
+#ifndef IORING_OP_ACCEPT
+#define IORING_OP_ACCEPT 13
+#endif
+#ifndef IORING_OP_ASYNC_CANCEL
+#define IORING_OP_ASYNC_CANCEL 14
+#endif
+#ifndef IORING_OP_READ
+#define IORING_OP_READ 22
+#endif
+#ifndef IORING_OP_SEND
+#define IORING_OP_SEND 26
+#endif
+#ifndef IORING_OP_RECV
+#define IORING_OP_RECV 27
+#endif
+
+/* Submission entry flags, and the flags of accepts and receives kept in ioprio */
+#ifndef IOSQE_BUFFER_SELECT
+#define IOSQE_BUFFER_SELECT (1U << 5)
+#endif
+#ifndef IORING_RECV_MULTISHOT
+#define IORING_RECV_MULTISHOT (1U << 1)
+#endif
+#ifndef IORING_ACCEPT_MULTISHOT
+#define IORING_ACCEPT_MULTISHOT (1U << 0)
+#endif
+
+/* Completion entry flags, the upper 16 bits holding the id of the provided buffer picked */
+#ifndef IORING_CQE_F_BUFFER
+#define IORING_CQE_F_BUFFER (1U << 0)
+#endif
+#ifndef IORING_CQE_F_MORE
+#define IORING_CQE_F_MORE (1U << 1)
+#endif
+#ifndef IORING_CQE_BUFFER_SHIFT
+#define IORING_CQE_BUFFER_SHIFT 16
+#endif
+
+/* Offsets to mmap the rings at */
+#ifndef IORING_OFF_SQ_RING
+#define IORING_OFF_SQ_RING 0ULL
+#endif
+#ifndef IORING_OFF_SQES
+#define IORING_OFF_SQES 0x10000000ULL
+#endif
+
+/* io_uring_enter flags */
+#ifndef IORING_ENTER_GETEVENTS
+#define IORING_ENTER_GETEVENTS (1U << 0)
+#endif
+#ifndef IORING_ENTER_EXT_ARG
+#define IORING_ENTER_EXT_ARG (1U << 3)
+#endif
+
+/* Features the kernel reports in io_uring_params */
+#ifndef IORING_FEAT_SINGLE_MMAP
+#define IORING_FEAT_SINGLE_MMAP (1U << 0)
+#endif
+#ifndef IORING_FEAT_EXT_ARG
+#define IORING_FEAT_EXT_ARG (1U << 8)
+#endif
+
+/* io_uring_register opcodes, and the flag of each supported operation in a probe */
+#ifndef IORING_REGISTER_PROBE
+#define IORING_REGISTER_PROBE 8
+#endif
+#ifndef IORING_REGISTER_PBUF_RING
+#define IORING_REGISTER_PBUF_RING 22
+#endif
+#ifndef IO_URING_OP_SUPPORTED
+#define IO_URING_OP_SUPPORTED (1U << 0)
+#endif
+
+struct io_uring_sqe {
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t ioprio;
+    int32_t fd;
+    uint64_t off;
+    uint64_t addr;
+    uint32_t len;
+    union {
+        uint32_t rw_flags;
+        uint32_t msg_flags;
+        uint32_t accept_flags;
+        uint32_t cancel_flags;
+    };
+    uint64_t user_data;
+    union {
+        uint16_t buf_index;
+        uint16_t buf_group;
+    };
+    uint16_t personality;
+    int32_t splice_fd_in;
+    uint64_t pad[2];
+};
+
+struct io_uring_cqe {
+    uint64_t user_data;
+    int32_t res;
+    uint32_t flags;
+};
+
+struct io_sqring_offsets {
+    uint32_t head;
+    uint32_t tail;
+    uint32_t ring_mask;
+    uint32_t ring_entries;
+    uint32_t flags;
+    uint32_t dropped;
+    uint32_t array;
+    uint32_t resv1;
+    uint64_t resv2;
+};
+
+struct io_cqring_offsets {
+    uint32_t head;
+    uint32_t tail;
+    uint32_t ring_mask;
+    uint32_t ring_entries;
+    uint32_t overflow;
+    uint32_t cqes;
+    uint32_t flags;
+    uint32_t resv1;
+    uint64_t resv2;
+};
+
+struct io_uring_params {
+    uint32_t sq_entries;
+    uint32_t cq_entries;
+    uint32_t flags;
+    uint32_t sq_thread_cpu;
+    uint32_t sq_thread_idle;
+    uint32_t features;
+    uint32_t wq_fd;
+    uint32_t resv[3];
+    struct io_sqring_offsets sq_off;
+    struct io_cqring_offsets cq_off;
+};
+
+struct io_uring_probe_op {
+    uint8_t op;
+    uint8_t resv;
+    uint16_t flags;
+    uint32_t resv2;
+};
+
+struct io_uring_probe {
+    uint8_t last_op;
+    uint8_t ops_len;
+    uint16_t resv;
+    uint32_t resv2[3];
+    struct io_uring_probe_op ops[0];
+};
+
+/* One entry of a provided buffer ring */
+struct io_uring_buf {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t bid;
+    uint16_t resv;
+};
+
+/* The head of a provided buffer ring, which overlays its first entry */
+struct io_uring_buf_ring {
+    uint64_t resv1;
+    uint32_t resv2;
+    uint16_t resv3;
+    uint16_t tail;
+};
+
+struct io_uring_buf_reg {
+    uint64_t ring_addr;
+    uint32_t ring_entries;
+    uint16_t bgid;
+    uint16_t flags;
+    uint64_t resv[3];
+};
+
+/* The kernel's own timespec (__kernel_timespec), 64-bit on every architecture */
+struct io_uring_timespec {
+    int64_t tv_sec;
+    long long tv_nsec;
+};
+
+struct io_uring_getevents_arg {
+    uint64_t sigmask;
+    uint32_t sigmask_sz;
+    uint32_t pad;
+    uint64_t ts;
+};
+
+static_assert(sizeof(struct io_uring_sqe) == 64, "io_uring_sqe must match the kernel's");
+static_assert(sizeof(struct io_uring_params) == 120, "io_uring_params must match the kernel's");
+static_assert(sizeof(struct io_uring_buf_reg) == 40, "io_uring_buf_reg must match the kernel's");
+
+#endif
@@ -0,0 +1,39 @@
+#include "LocalNameRegistry.h"
+
+bool LocalNameRegistry::reserve(const std::string &name, uint64_t owner)
+{
+    Stripe &stripe = stripeFor(name);
+    std::lock_guard<std::mutex> guard(stripe.lock);
+
+    auto result = stripe.owners.emplace(name, owner);
+    return result.second || result.first->second == owner;
+}
+
+void LocalNameRegistry::release(const std::string &name, uint64_t owner)
+{
+    Stripe &stripe = stripeFor(name);
+    std::lock_guard<std::mutex> guard(stripe.lock);
+
+    auto it = stripe.owners.find(name);
+    if (it != stripe.owners.end() && it->second == owner) {
+        stripe.owners.erase(it);
+    }
+}
+
+bool LocalNameRegistry::transfer(const std::string &name, uint64_t from, uint64_t to)
+{
+    Stripe &stripe = stripeFor(name);
+    std::lock_guard<std::mutex> guard(stripe.lock);
+
+    auto it = stripe.owners.find(name);
+    if (it == stripe.owners.end() || it->second != from) {
+        return false;
+    }
+    it->second = to;
+    return true;
+}
+
+LocalNameRegistry::Stripe & LocalNameRegistry::stripeFor(const std::string &name)
+{
+    return stripes[std::hash<std::string>()(name) % NAME_REGISTRY_STRIPES];
+}
@@ -0,0 +1,41 @@
+#ifndef FD__LOCALNAMEREGISTRY_H
+#define FD__LOCALNAMEREGISTRY_H
+
+#include <string>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+#include "NameRegistry.h"
+
+/* How many independently-locked stripes the registry is split into */
+#define NAME_REGISTRY_STRIPES 64
+
+/*
+ * Name registry kept in this process, for a server that doesn't share names with any other.
+ * Names are hashed onto a fixed set of stripes, each with its own lock, so workers only contend
+ * when they touch names on the same stripe.
+ */
+class LocalNameRegistry : public NameRegistry {
+ public:
+
+    bool reserve(const std::string &name, uint64_t owner) override;
+    void release(const std::string &name, uint64_t owner) override;
+    bool transfer(const std::string &name, uint64_t from, uint64_t to) override;
+
+ private:
+
+    /* A single lock-protected partition of the registry */
+    struct Stripe {
+        std::mutex lock;
+        std::unordered_map<std::string, uint64_t> owners;
+    };
+
+    /* Returns the stripe that is responsible for the given name */
+    Stripe & stripeFor(const std::string &name);
+
+    Stripe stripes[NAME_REGISTRY_STRIPES];
+
+};
+
+#endif
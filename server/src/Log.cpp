@@ -0,0 +1,366 @@
+#include "Log.h"
+
+#include <cerrno>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <unistd.h>
+
+/* Longest line formatted, which is always left free at the end of the write buffer */
+#define LOG_LINE_MAX 512
+
+/* Name of each level in the output */
+static const char *LEVEL_NAMES[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+/*
+ * Short name of each event, used when reporting how many were sampled out. Sized by the event
+ * count, so an extra entry fails to compile and a missing one is caught below by its null name
+ */
+static constexpr const char *EVENT_NAMES[(int) LogEvent::NUM_EVENTS] = {
+    "connection received",
+    "connection taken over",
+    "connection terminated",
+    "connection suspended",
+    "connection resumed",
+    "name accepted",
+    "name updated",
+    "name rejected",
+    "room created",
+    "room joined",
+    "room left",
+    "session detached",
+    "session resumed",
+    "session expired",
+    "connection refused",
+    "message refused",
+    "send failed",
+    "ping keep-alive fallback",
+    "send backpressure"
+};
+static_assert(sizeof(EVENT_NAMES) / sizeof(EVENT_NAMES[0]) == (int) LogEvent::NUM_EVENTS,
+        "EVENT_NAMES must have an entry for every LogEvent");
+static_assert(EVENT_NAMES[(int) LogEvent::NUM_EVENTS - 1] != nullptr,
+        "EVENT_NAMES must name every LogEvent");
+
+/* Whether each event is limited to LOG_SAMPLE_LIMIT_PER_SEC records per second per ring */
+static const bool EVENT_SAMPLED[(int) LogEvent::NUM_EVENTS] = {true, true, true, true, true, true,
+        true, true, true, true, true, true, true, true, true, true, true, true, false};
+static_assert(sizeof(EVENT_SAMPLED) / sizeof(EVENT_SAMPLED[0]) == (int) LogEvent::NUM_EVENTS,
+        "EVENT_SAMPLED must have an entry for every LogEvent");
+
+static const uint64_t NANOS_PER_SEC = 1000000000;
+
+void LogRecord::setPeer(Connection *conn)
+{
+    peerAddr = conn->getPeerAddr();
+    peerPort = conn->getPeerPort();
+}
+
+void LogRecord::setText(const std::string &str)
+{
+    textLen = (str.length() < LOG_TEXT_SIZE) ? str.length() : LOG_TEXT_SIZE;
+    memcpy(text, str.data(), textLen);
+}
+
+LogRing::LogRing(int id, Logger *logger)
+{
+    this->id = id;
+    this->logger = logger;
+    for (int i = 0; i < (int) LogEvent::NUM_EVENTS; i++) {
+        sampleSecond[i] = 0;
+        sampleCount[i] = 0;
+        sampledOut[i] = 0;
+    }
+    dropped = 0;
+    head = 0;
+    tail = 0;
+}
+
+LogRecord * LogRing::claim(LogLevel level, LogEvent event)
+{
+    if (level < logger->minLevel) {
+        return nullptr;
+    }
+    uint64_t nanos = logger->nanosNow();
+
+    int index = (int) event;
+    if (EVENT_SAMPLED[index]) {
+        uint64_t second = nanos / NANOS_PER_SEC;
+        if (second != sampleSecond[index]) {
+            sampleSecond[index] = second;
+            sampleCount[index] = 0;
+        }
+        if (sampleCount[index] >= LOG_SAMPLE_LIMIT_PER_SEC) {
+            sampledOut[index].fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        sampleCount[index]++;
+    }
+
+    /* The writer only ever frees up slots, so a stale tail just means less room */
+    uint64_t next = head.load(std::memory_order_relaxed);
+    if (next - tail.load(std::memory_order_acquire) >= LOG_RING_RECORDS) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    LogRecord *rec = &records[next & (LOG_RING_RECORDS - 1)];
+    rec->nanos = nanos;
+    rec->level = level;
+    rec->event = event;
+    rec->peerAddr = 0;
+    rec->peerPort = 0;
+    rec->textLen = 0;
+    return rec;
+}
+
+void LogRing::publish()
+{
+    head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+Logger::Logger(int fd, LogLevel minLevel)
+{
+    this->fd = fd;
+    this->minLevel = minLevel;
+    startTime = std::chrono::steady_clock::now();
+    writeBuffer = new char[LOG_WRITE_BUFFER_SIZE];
+    writeBufferUsed = 0;
+    lastReportNanos = 0;
+    stopping = false;
+    writerThread = std::thread(&Logger::runWriter, this);
+}
+
+Logger::~Logger()
+{
+    {
+        std::lock_guard<std::mutex> guard(stopMutex);
+        stopping = true;
+    }
+    stopCondition.notify_one();
+    writerThread.join();
+
+    for (LogRing *ring : rings) {
+        delete ring;
+    }
+    delete[] writeBuffer;
+}
+
+LogRing * Logger::createRing(int id)
+{
+    LogRing *ring = new LogRing(id, this);
+    std::lock_guard<std::mutex> guard(ringsMutex);
+    rings.push_back(ring);
+    return ring;
+}
+
+bool Logger::parseLevel(const char *name, LogLevel *level)
+{
+    for (int i = 0; i <= (int) LogLevel::ERROR; i++) {
+        if (strcasecmp(name, LEVEL_NAMES[i]) == 0) {
+            *level = (LogLevel) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+uint64_t Logger::nanosNow()
+{
+    auto elapsed = std::chrono::steady_clock::now() - startTime;
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+}
+
+void Logger::runWriter()
+{
+    std::unique_lock<std::mutex> lock(stopMutex);
+    while (!stopping) {
+        stopCondition.wait_for(lock, std::chrono::milliseconds(LOG_FLUSH_INTERVAL_MS));
+        lock.unlock();
+        drainRings(nanosNow() - lastReportNanos >= NANOS_PER_SEC);
+        lock.lock();
+    }
+    lock.unlock();
+
+    /* Anything logged before the destructor was called still goes out */
+    drainRings(true);
+}
+
+void Logger::drainRings(bool reportNow)
+{
+    std::lock_guard<std::mutex> guard(ringsMutex);
+    for (LogRing *ring : rings) {
+        uint64_t next = ring->tail.load(std::memory_order_relaxed);
+        uint64_t end = ring->head.load(std::memory_order_acquire);
+        for (; next != end; next++) {
+            formatRecord(ring, ring->records[next & (LOG_RING_RECORDS - 1)]);
+        }
+        ring->tail.store(end, std::memory_order_release);
+    }
+
+    if (reportNow) {
+        uint64_t nanos = nanosNow();
+        for (LogRing *ring : rings) {
+            uint64_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+            if (dropped > 0) {
+                appendLine(nanos, ring->id, LogLevel::WARN,
+                        "Dropped %llu log records while the log writer fell behind",
+                        (unsigned long long) dropped);
+            }
+            for (int i = 0; i < (int) LogEvent::NUM_EVENTS; i++) {
+                uint64_t sampledOut = ring->sampledOut[i].exchange(0, std::memory_order_relaxed);
+                if (sampledOut > 0) {
+                    appendLine(nanos, ring->id, LogLevel::INFO, "Sampled out %llu '%s' records",
+                            (unsigned long long) sampledOut, EVENT_NAMES[i]);
+                }
+            }
+        }
+        lastReportNanos = nanos;
+    }
+
+    writeOut();
+}
+
+void Logger::formatRecord(LogRing *ring, const LogRecord &rec)
+{
+    char ip[INET_ADDRSTRLEN];
+    struct in_addr addr;
+    addr.s_addr = rec.peerAddr;
+    inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+    int textLen = rec.textLen;
+
+    switch (rec.event) {
+    case LogEvent::CONNECTION_RECEIVED:
+        appendLine(rec.nanos, ring->id, rec.level, "Connection received from %s:%u", ip,
+                rec.peerPort);
+        break;
+    case LogEvent::CONNECTION_TAKEN_OVER:
+        if (textLen > 0) {
+            appendLine(rec.nanos, ring->id, rec.level,
+                    "Took over session '%.*s' with %s:%u from the previous server", textLen,
+                    rec.text, ip, rec.peerPort);
+        } else {
+            appendLine(rec.nanos, ring->id, rec.level,
+                    "Took over connection with %s:%u from the previous server", ip, rec.peerPort);
+        }
+        break;
+    case LogEvent::CONNECTION_TERMINATED:
+        appendLine(rec.nanos, ring->id, rec.level, "Connection with %s:%u terminated", ip,
+                rec.peerPort);
+        break;
+    case LogEvent::CONNECTION_SUSPENDED:
+        appendLine(rec.nanos, ring->id, rec.level, "SUSPENDED connection with %s:%u", ip,
+                rec.peerPort);
+        break;
+    case LogEvent::CONNECTION_RESUMED:
+        appendLine(rec.nanos, ring->id, rec.level, "RESUMED connection with %s:%u", ip,
+                rec.peerPort);
+        break;
+    case LogEvent::NAME_ACCEPTED:
+        appendLine(rec.nanos, ring->id, rec.level, "Accepted name '%.*s' for session with %s:%u",
+                textLen, rec.text, ip, rec.peerPort);
+        break;
+    case LogEvent::NAME_UPDATED:
+        appendLine(rec.nanos, ring->id, rec.level, "Updated name to '%.*s' for session with %s:%u",
+                textLen, rec.text, ip, rec.peerPort);
+        break;
+    case LogEvent::NAME_REJECTED:
+        appendLine(rec.nanos, ring->id, rec.level,
+                "Already-taken name '%.*s' rejected for session with %s:%u", textLen, rec.text,
+                ip, rec.peerPort);
+        break;
+    case LogEvent::ROOM_CREATED:
+        appendLine(rec.nanos, ring->id, rec.level, "'%.*s' with %s:%u created room %llu", textLen,
+                rec.text, ip, rec.peerPort, (unsigned long long) rec.args[0]);
+        break;
+    case LogEvent::ROOM_JOINED:
+        appendLine(rec.nanos, ring->id, rec.level, "'%.*s' with %s:%u joined room %llu", textLen,
+                rec.text, ip, rec.peerPort, (unsigned long long) rec.args[0]);
+        break;
+    case LogEvent::ROOM_LEFT:
+        appendLine(rec.nanos, ring->id, rec.level, "'%.*s' with %s:%u left room %llu", textLen,
+                rec.text, ip, rec.peerPort, (unsigned long long) rec.args[0]);
+        break;
+    case LogEvent::SESSION_DETACHED:
+        appendLine(rec.nanos, ring->id, rec.level,
+                "Keeping session '%.*s' of %s:%u for %llu s to be resumed", textLen, rec.text, ip,
+                rec.peerPort, (unsigned long long) rec.args[0]);
+        break;
+    case LogEvent::SESSION_RESUMED:
+        appendLine(rec.nanos, ring->id, rec.level,
+                "Resumed session '%.*s' with %s:%u, replaying %llu message(s)", textLen, rec.text,
+                ip, rec.peerPort, (unsigned long long) rec.args[0]);
+        break;
+    case LogEvent::SESSION_EXPIRED:
+        appendLine(rec.nanos, ring->id, rec.level, "Session '%.*s' expired without being resumed",
+                textLen, rec.text);
+        break;
+    case LogEvent::CONNECTION_REFUSED:
+        appendLine(rec.nanos, ring->id, rec.level,
+                "Refused connection from %s:%u, over the rate of connects from its address", ip,
+                rec.peerPort);
+        break;
+    case LogEvent::MESSAGE_REFUSED:
+        appendLine(rec.nanos, ring->id, rec.level,
+                "Refused %.*s from %s:%u, over its rate (%llu refused in a row)", textLen, rec.text,
+                ip, rec.peerPort, (unsigned long long) rec.args[0]);
+        break;
+    case LogEvent::SEND_FAILED:
+        appendLine(rec.nanos, ring->id, rec.level, "Failed to send to %s:%u: %.*s", ip,
+                rec.peerPort, textLen, rec.text);
+        break;
+    case LogEvent::PING_KEEPALIVE_FALLBACK:
+        appendLine(rec.nanos, ring->id, rec.level, "Keeping alive %s:%u with pings: %.*s", ip,
+                rec.peerPort, textLen, rec.text);
+        break;
+    case LogEvent::SEND_BACKPRESSURE:
+        appendLine(rec.nanos, ring->id, rec.level,
+                "Send backpressure: %llu messages dropped, %llu producers paused, %llu slow peers"
+                " disconnected, %llu/%llu bytes queued", (unsigned long long) rec.args[0],
+                (unsigned long long) rec.args[1], (unsigned long long) rec.args[2],
+                (unsigned long long) rec.args[3], (unsigned long long) rec.args[4]);
+        break;
+    default:
+        break;
+    }
+}
+
+void Logger::appendLine(uint64_t nanos, int id, LogLevel level, const char *format, ...)
+{
+    if (LOG_WRITE_BUFFER_SIZE - writeBufferUsed < LOG_LINE_MAX) {
+        writeOut();
+    }
+
+    /* Lines are cut short to LOG_LINE_MAX, keeping room for the newline */
+    char *line = &writeBuffer[writeBufferUsed];
+    int len = snprintf(line, LOG_LINE_MAX, "%.3f [%d] %s: ", (double) nanos / NANOS_PER_SEC, id,
+            LEVEL_NAMES[(int) level]);
+    va_list args;
+    va_start(args, format);
+    len += vsnprintf(&line[len], LOG_LINE_MAX - len, format, args);
+    va_end(args);
+    if (len > LOG_LINE_MAX - 1) {
+        len = LOG_LINE_MAX - 1;
+    }
+    line[len] = '\n';
+    writeBufferUsed += len + 1;
+}
+
+void Logger::writeOut()
+{
+    size_t written = 0;
+    while (written < writeBufferUsed) {
+        ssize_t res = write(fd, &writeBuffer[written], writeBufferUsed - written);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /* Nowhere left to report it, so the output is lost */
+            break;
+        }
+        written += res;
+    }
+    writeBufferUsed = 0;
+}
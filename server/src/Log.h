@@ -0,0 +1,228 @@
+#ifndef FD__LOG_H
+#define FD__LOG_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Connection.h"
+
+/* Number of records each ring holds before further records are dropped (a power of two) */
+#define LOG_RING_RECORDS 4096
+
+/* Most bytes of text (such as a name) kept in one record, longer text is cut short */
+#define LOG_TEXT_SIZE 96
+
+/* Most integer arguments kept in one record */
+#define LOG_MAX_ARGS 5
+
+/* How long the writer sleeps between draining the rings */
+#define LOG_FLUSH_INTERVAL_MS 20
+
+/* Size of the buffer the writer formats records into, which is written out in one go when full */
+#define LOG_WRITE_BUFFER_SIZE (64 * 1024)
+
+/*
+ * Most records of one sampled event each ring keeps per second. Any more are counted and
+ * reported once a second instead, so a connect storm can't flood the log
+ */
+#define LOG_SAMPLE_LIMIT_PER_SEC 200
+
+/* Levels of importance of log records, least important first */
+enum class LogLevel : uint8_t {
+    DEBUG,
+    INFO,
+    WARN,
+    ERROR
+};
+
+/* Every kind of record the server logs. Each has its own format in Log.cpp */
+enum class LogEvent : uint8_t {
+    CONNECTION_RECEIVED,
+    CONNECTION_TAKEN_OVER,
+    CONNECTION_TERMINATED,
+    CONNECTION_SUSPENDED,
+    CONNECTION_RESUMED,
+    NAME_ACCEPTED,
+    NAME_UPDATED,
+    NAME_REJECTED,
+    ROOM_CREATED,
+    ROOM_JOINED,
+    ROOM_LEFT,
+    SESSION_DETACHED,
+    SESSION_RESUMED,
+    SESSION_EXPIRED,
+    CONNECTION_REFUSED,
+    MESSAGE_REFUSED,
+    SEND_FAILED,
+    PING_KEEPALIVE_FALLBACK,
+    SEND_BACKPRESSURE,
+    NUM_EVENTS
+};
+
+/*
+ * One log record, kept in binary form until the writer formats it. Filling one in never
+ * allocates: the peer is kept as its raw address and text is copied into a fixed buffer.
+ */
+struct LogRecord {
+
+    /* Nanoseconds since the logger started */
+    uint64_t nanos;
+
+    /* Integer arguments of the event, such as counters */
+    uint64_t args[LOG_MAX_ARGS];
+
+    /* Peer address in network byte order and port, if the event is about a connection */
+    uint32_t peerAddr;
+    uint16_t peerPort;
+
+    LogLevel level;
+    LogEvent event;
+
+    /* Length of text, which is not null terminated */
+    uint8_t textLen;
+    char text[LOG_TEXT_SIZE];
+
+    /* Note the peer of the given connection */
+    void setPeer(Connection *conn);
+
+    /* Copy in the given text, cut short to LOG_TEXT_SIZE bytes */
+    void setText(const std::string &str);
+};
+
+class Logger;
+
+/*
+ * Lock-free ring of log records with a single producer, one per worker, drained by the logger's
+ * writer thread. Logging only ever claims a slot in the ring and fills it in: when the ring is
+ * full the record is dropped and counted rather than waiting for the writer, so the event loop
+ * never blocks on log I/O.
+ */
+class LogRing {
+ public:
+
+    /*
+     * Claim the next record for an event of the given level, with its time, level and event
+     * filled in. Returns nullptr if the record should not be logged: its level is filtered out,
+     * its event is over the sample limit this second, or the ring is full. Otherwise the record
+     * must be filled in and handed over with publish() before the next call. Producer only
+     */
+    LogRecord * claim(LogLevel level, LogEvent event);
+
+    /* Hand the claimed record over to the writer. Producer only */
+    void publish();
+
+ private:
+
+    friend class Logger;
+
+    /* Constructor - only the logger creates rings */
+    LogRing(int id, Logger *logger);
+
+    /* Identifies the ring's producer in log output */
+    int id;
+
+    /* The logger draining this ring, for its level and clock */
+    Logger *logger;
+
+    /* Start of the current sample second of each event and records claimed in it (producer only) */
+    uint64_t sampleSecond[(int) LogEvent::NUM_EVENTS];
+    uint32_t sampleCount[(int) LogEvent::NUM_EVENTS];
+
+    /* Records left out by sampling since the writer last reported them */
+    std::atomic<uint64_t> sampledOut[(int) LogEvent::NUM_EVENTS];
+
+    /* Records dropped because the ring was full since the writer last reported them */
+    std::atomic<uint64_t> dropped;
+
+    /*
+     * Records are written at head by the producer and read from tail by the writer. Each index
+     * only ever grows and is kept on its own cache line, with the records behind them
+     */
+    char padBefore[64];
+    std::atomic<uint64_t> head;
+    char padBetween[64];
+    std::atomic<uint64_t> tail;
+    char padAfter[64];
+    LogRecord records[LOG_RING_RECORDS];
+};
+
+/*
+ * Asynchronous logger. Each producer thread logs into its own LogRing, and a background writer
+ * thread drains every ring every LOG_FLUSH_INTERVAL_MS, formats the records into text and writes
+ * them out in batches. Records dropped or sampled out are reported in their place.
+ */
+class Logger {
+ public:
+
+    /* Constructor - start the writer thread, writing to fd and keeping records of minLevel up */
+    Logger(int fd, LogLevel minLevel);
+
+    /* Destructor - stop the writer thread once it has written out everything already logged */
+    ~Logger();
+
+    /*
+     * Returns a new ring for a producer thread, owned by the logger. The id tells producers apart
+     * in the output
+     */
+    LogRing * createRing(int id);
+
+    /* Returns the level given its name (debug, info, warn or error). Returns false if unknown */
+    static bool parseLevel(const char *name, LogLevel *level);
+
+ private:
+
+    friend class LogRing;
+
+    /* The file descriptor written to */
+    int fd;
+
+    /* Records below this level are not logged */
+    LogLevel minLevel;
+
+    /* The time the logger started, which records are timed from */
+    std::chrono::steady_clock::time_point startTime;
+
+    /* Every ring created, guarded by ringsMutex, which producers never take */
+    std::vector<LogRing*> rings;
+    std::mutex ringsMutex;
+
+    /* Text formatted but not yet written out (writer thread only) */
+    char *writeBuffer;
+    size_t writeBufferUsed;
+
+    /* Time the dropped and sampled out counts were last reported (writer thread only) */
+    uint64_t lastReportNanos;
+
+    /* Wakes the writer early when the logger is being destroyed */
+    std::mutex stopMutex;
+    std::condition_variable stopCondition;
+    bool stopping;
+
+    std::thread writerThread;
+
+    /* Nanoseconds since the logger started */
+    uint64_t nanosNow();
+
+    /* Body of the writer thread */
+    void runWriter();
+
+    /* Format every record published so far in every ring, and report counts due */
+    void drainRings(bool reportNow);
+
+    /* Format one record of the given ring into the write buffer */
+    void formatRecord(LogRing *ring, const LogRecord &rec);
+
+    /* Format one line into the write buffer, making room by writing out first if needed */
+    void appendLine(uint64_t nanos, int id, LogLevel level, const char *format, ...);
+
+    /* Write out everything in the write buffer */
+    void writeOut();
+};
+
+#endif
@@ -0,0 +1,402 @@
+#include "Metrics.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* How long the endpoint's thread waits for a scraper before checking whether to stop */
+#define METRICS_POLL_MILLIS 250
+
+/* Largest request read from a scraper. Only the request line is looked at */
+#define METRICS_REQUEST_MAX 4096
+
+/* The quantiles exported for every histogram */
+static const double QUANTILES[] = {0.5, 0.9, 0.99, 0.999};
+
+/*
+ * The message types counted, indexed by pbuf::NetworkMessage::TypeCase. 0 is unset, and 4, 5
+ * and 9 are fields outside the type oneof
+ */
+static const char *MESSAGE_TYPE_NAMES[TrafficCounters::NUM_TYPES] = {
+    nullptr,
+    "probe",
+    "name_request",
+    "name_reply",
+    nullptr,
+    nullptr,
+    "room_request",
+    "room_reply",
+    "room_update",
+    nullptr,
+    "resume_request",
+    "resume_reply"
+};
+
+/* Implementation for Histogram class */
+
+Histogram::Histogram()
+{
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        buckets[i] = 0;
+    }
+    sum = 0;
+}
+
+int Histogram::bucketFor(uint64_t value)
+{
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    if (msb >= HISTOGRAM_MAX_BITS) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+
+    /* The bits below the most significant one pick the bucket within its power of two */
+    int shift = msb - HISTOGRAM_SUB_BUCKET_BITS;
+    int subBucket = (value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1);
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS + subBucket;
+}
+
+uint64_t Histogram::bucketValue(int bucket)
+{
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+    int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t low = (uint64_t) (HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS) << shift;
+    return low + ((1ULL << shift) >> 1);
+}
+
+void Histogram::record(uint64_t nanos)
+{
+    std::atomic<uint64_t> &bucket = buckets[bucketFor(nanos)];
+    bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    sum.store(sum.load(std::memory_order_relaxed) + nanos, std::memory_order_relaxed);
+}
+
+void Histogram::addTo(std::vector<uint64_t> &snapshot, uint64_t *snapshotCount,
+        uint64_t *snapshotSum)
+{
+    /* Counted from the buckets as read, so quantiles agree with it while recording goes on */
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        uint64_t bucketCount = buckets[i].load(std::memory_order_relaxed);
+        snapshot[i] += bucketCount;
+        *snapshotCount += bucketCount;
+    }
+    *snapshotSum += sum.load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::quantile(const std::vector<uint64_t> &snapshot, uint64_t count, double q)
+{
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t) std::ceil(q * count);
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += snapshot[i];
+        if (seen >= rank) {
+            return bucketValue(i);
+        }
+    }
+    return bucketValue(HISTOGRAM_BUCKETS - 1);
+}
+
+/* Implementation for WorkerMetrics struct */
+
+WorkerMetrics::WorkerMetrics(int id)
+{
+    this->id = id;
+    sessions = 0;
+    namedSessions = 0;
+    suspendedSessions = 0;
+    accepts = 0;
+    detaches = 0;
+    resumes = 0;
+    refusedConnects = 0;
+    refusedMessages = 0;
+}
+
+void WorkerMetrics::add(std::atomic<int64_t> &gauge, int64_t amount)
+{
+    gauge.store(gauge.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+void WorkerMetrics::add(std::atomic<uint64_t> &counter, uint64_t amount)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+/* Implementation for Metrics class */
+
+/* Append one line to the export. Lines are short, so a fixed buffer is plenty */
+static void appendf(std::string &out, const char *format, ...)
+        __attribute__((format(printf, 2, 3)));
+
+static void appendf(std::string &out, const char *format, ...)
+{
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (len > 0) {
+        out.append(line, std::min((size_t) len, sizeof(line) - 1));
+    }
+}
+
+/* Append the HELP and TYPE header of a metric */
+static void appendHeader(std::string &out, const char *name, const char *help, const char *type)
+{
+    appendf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+Metrics::Metrics(SendBudget *sendBudget)
+{
+    this->sendBudget = sendBudget;
+    listenfd = -1;
+    serving = false;
+}
+
+Metrics::~Metrics()
+{
+    stopServing();
+    for (WorkerMetrics *worker : workers) {
+        delete worker;
+    }
+}
+
+WorkerMetrics * Metrics::createWorker(int id)
+{
+    WorkerMetrics *worker = new WorkerMetrics(id);
+    std::lock_guard<std::mutex> guard(workersMutex);
+    workers.push_back(worker);
+    return worker;
+}
+
+std::string Metrics::render()
+{
+    std::lock_guard<std::mutex> guard(workersMutex);
+    std::string out;
+
+    appendHeader(out, "fd_sessions", "Sessions open", "gauge");
+    for (WorkerMetrics *worker : workers) {
+        appendf(out, "fd_sessions{worker=\"%d\"} %lld\n", worker->id,
+                (long long) worker->sessions.load(std::memory_order_relaxed));
+    }
+    appendHeader(out, "fd_named_sessions", "Sessions open with a name", "gauge");
+    for (WorkerMetrics *worker : workers) {
+        appendf(out, "fd_named_sessions{worker=\"%d\"} %lld\n", worker->id,
+                (long long) worker->namedSessions.load(std::memory_order_relaxed));
+    }
+    appendHeader(out, "fd_suspended_sessions", "Sessions whose connection is suspended", "gauge");
+    for (WorkerMetrics *worker : workers) {
+        appendf(out, "fd_suspended_sessions{worker=\"%d\"} %lld\n", worker->id,
+                (long long) worker->suspendedSessions.load(std::memory_order_relaxed));
+    }
+    appendHeader(out, "fd_accepts_total", "Connections accepted", "counter");
+    for (WorkerMetrics *worker : workers) {
+        appendf(out, "fd_accepts_total{worker=\"%d\"} %llu\n", worker->id,
+                (unsigned long long) worker->accepts.load(std::memory_order_relaxed));
+    }
+    appendHeader(out, "fd_session_detaches_total", "Sessions kept to be resumed after losing their"
+            " connection", "counter");
+    for (WorkerMetrics *worker : workers) {
+        appendf(out, "fd_session_detaches_total{worker=\"%d\"} %llu\n", worker->id,
+                (unsigned long long) worker->detaches.load(std::memory_order_relaxed));
+    }
+    appendHeader(out, "fd_session_resumes_total", "Sessions resumed on a new connection",
+            "counter");
+    for (WorkerMetrics *worker : workers) {
+        appendf(out, "fd_session_resumes_total{worker=\"%d\"} %llu\n", worker->id,
+                (unsigned long long) worker->resumes.load(std::memory_order_relaxed));
+    }
+    appendHeader(out, "fd_refused_connects_total", "Connects refused for going over the rate"
+            " allowed from their address", "counter");
+    for (WorkerMetrics *worker : workers) {
+        appendf(out, "fd_refused_connects_total{worker=\"%d\"} %llu\n", worker->id,
+                (unsigned long long) worker->refusedConnects.load(std::memory_order_relaxed));
+    }
+    appendHeader(out, "fd_refused_messages_total", "Messages refused for going over their"
+            " session's rate", "counter");
+    for (WorkerMetrics *worker : workers) {
+        appendf(out, "fd_refused_messages_total{worker=\"%d\"} %llu\n", worker->id,
+                (unsigned long long) worker->refusedMessages.load(std::memory_order_relaxed));
+    }
+
+    appendHeader(out, "fd_messages_received_total", "Messages received by type", "counter");
+    for (WorkerMetrics *worker : workers) {
+        for (int type = 1; type < TrafficCounters::NUM_TYPES; type++) {
+            if (MESSAGE_TYPE_NAMES[type] == nullptr) {
+                continue;
+            }
+            appendf(out, "fd_messages_received_total{worker=\"%d\",type=\"%s\"} %llu\n",
+                    worker->id, MESSAGE_TYPE_NAMES[type], (unsigned long long)
+                    worker->traffic.messagesReceived[type].load(std::memory_order_relaxed));
+        }
+    }
+    appendHeader(out, "fd_messages_sent_total", "Messages queued to send by type", "counter");
+    for (WorkerMetrics *worker : workers) {
+        for (int type = 1; type < TrafficCounters::NUM_TYPES; type++) {
+            if (MESSAGE_TYPE_NAMES[type] == nullptr) {
+                continue;
+            }
+            appendf(out, "fd_messages_sent_total{worker=\"%d\",type=\"%s\"} %llu\n",
+                    worker->id, MESSAGE_TYPE_NAMES[type], (unsigned long long)
+                    worker->traffic.messagesSent[type].load(std::memory_order_relaxed));
+        }
+    }
+    appendHeader(out, "fd_received_bytes_total", "Bytes received", "counter");
+    for (WorkerMetrics *worker : workers) {
+        appendf(out, "fd_received_bytes_total{worker=\"%d\"} %llu\n", worker->id,
+                (unsigned long long) worker->traffic.bytesReceived.load(std::memory_order_relaxed));
+    }
+    appendHeader(out, "fd_sent_bytes_total", "Bytes written to sockets", "counter");
+    for (WorkerMetrics *worker : workers) {
+        appendf(out, "fd_sent_bytes_total{worker=\"%d\"} %llu\n", worker->id,
+                (unsigned long long) worker->traffic.bytesSent.load(std::memory_order_relaxed));
+    }
+
+    appendHeader(out, "fd_send_queue_bytes", "Bytes queued to send on every connection", "gauge");
+    appendf(out, "fd_send_queue_bytes %llu\n", (unsigned long long) sendBudget->getUsed());
+    appendHeader(out, "fd_send_queue_limit_bytes", "Most bytes that may be queued to send", "gauge");
+    appendf(out, "fd_send_queue_limit_bytes %llu\n", (unsigned long long) sendBudget->getLimit());
+
+    renderHistogram(out, "fd_event_loop_busy_seconds",
+            "Time each event loop iteration spent between waking up and sleeping again",
+            &WorkerMetrics::loopBusy);
+    renderHistogram(out, "fd_name_request_seconds", "Time taken to handle each name request",
+            &WorkerMetrics::nameRequests);
+    renderHistogram(out, "fd_room_request_seconds", "Time taken to handle each room request",
+            &WorkerMetrics::roomRequests);
+    return out;
+}
+
+void Metrics::renderHistogram(std::string &out, const char *name, const char *help,
+        Histogram WorkerMetrics::*histogram)
+{
+    std::vector<uint64_t> snapshot(HISTOGRAM_BUCKETS, 0);
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    for (WorkerMetrics *worker : workers) {
+        (worker->*histogram).addTo(snapshot, &count, &sum);
+    }
+
+    appendHeader(out, name, help, "summary");
+    for (double q : QUANTILES) {
+        appendf(out, "%s{quantile=\"%g\"} %.9f\n", name, q,
+                Histogram::quantile(snapshot, count, q) / 1e9);
+    }
+    appendf(out, "%s_sum %.9f\n", name, sum / 1e9);
+    appendf(out, "%s_count %llu\n", name, (unsigned long long) count);
+}
+
+void Metrics::stopServing()
+{
+    if (serving) {
+        serving = false;
+        serveThread.join();
+    }
+    if (listenfd >= 0) {
+        close(listenfd);
+        listenfd = -1;
+    }
+}
+
+void Metrics::serve(uint16_t port)
+{
+    listenfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenfd < 0) {
+        throw MetricsException("Failed to create metrics socket");
+    }
+    int enable = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+    /* Only local scrapers, since nothing is authenticated */
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(listenfd, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(listenfd, 16) < 0) {
+        close(listenfd);
+        listenfd = -1;
+        throw MetricsException("Failed to listen on metrics port");
+    }
+
+    serving = true;
+    serveThread = std::thread(&Metrics::runServer, this);
+}
+
+void Metrics::runServer()
+{
+    while (serving) {
+        struct pollfd pfd;
+        pfd.fd = listenfd;
+        pfd.events = POLLIN;
+        if (::poll(&pfd, 1, METRICS_POLL_MILLIS) <= 0) {
+            continue;
+        }
+
+        int fd = accept4(listenfd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd >= 0) {
+            answer(fd);
+        }
+    }
+}
+
+void Metrics::answer(int fd)
+{
+    struct timeval timeout;
+    timeout.tv_sec = METRICS_REQUEST_TIMEOUT_SECS;
+    timeout.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    /* Read up to the end of the headers. The body of a GET is empty */
+    std::string request;
+    char buffer[1024];
+    while (request.find("\r\n\r\n") == std::string::npos && request.length() < METRICS_REQUEST_MAX) {
+        ssize_t res = recv(fd, buffer, sizeof(buffer), 0);
+        if (res <= 0) {
+            break;
+        }
+        request.append(buffer, res);
+    }
+
+    std::string response;
+    if (request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 6, "GET / ") == 0) {
+        std::string body = render();
+        response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                std::to_string(body.length()) + "\r\n\r\n" + body;
+    } else {
+        response = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+    }
+
+    size_t written = 0;
+    while (written < response.length()) {
+        ssize_t res = send(fd, &response[written], response.length() - written, MSG_NOSIGNAL);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        if (res <= 0) {
+            break;
+        }
+        written += res;
+    }
+    close(fd);
+}
@@ -0,0 +1,178 @@
+#ifndef FD__METRICS_H
+#define FD__METRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Connection.h"
+
+/*
+ * Histogram buckets per doubling of the value (a power of two). Values are kept to within
+ * 1 / HISTOGRAM_SUB_BUCKETS of their size
+ */
+#define HISTOGRAM_SUB_BUCKET_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+
+/* Highest power of two a histogram tells apart. Anything larger lands in the top bucket */
+#define HISTOGRAM_MAX_BITS 40
+
+/* Number of buckets in a histogram */
+#define HISTOGRAM_BUCKETS \
+    ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+/* How long the metrics endpoint waits on a scraper that is slow to send its request */
+#define METRICS_REQUEST_TIMEOUT_SECS 1
+
+/*
+ * Log-linear histogram of nanosecond durations, in the style of HdrHistogram: every power of
+ * two is split into HISTOGRAM_SUB_BUCKETS equal buckets, so any quantile read back is within
+ * 12.5% of the true value from nanoseconds up to minutes, in under 2.5 KiB. Only one thread
+ * may record into it, which keeps recording free of locked instructions, but it may be read from
+ * any thread.
+ */
+class Histogram {
+ public:
+
+    /* Constructor - start empty */
+    Histogram();
+
+    /* Record one value. Single writer only */
+    void record(uint64_t nanos);
+
+    /* Add this histogram's bucket counts, total count and sum (as of now) onto a snapshot */
+    void addTo(std::vector<uint64_t> &buckets, uint64_t *count, uint64_t *sum);
+
+    /* Returns the value of the given quantile (0 to 1) of a snapshot of bucket counts */
+    static uint64_t quantile(const std::vector<uint64_t> &buckets, uint64_t count, double q);
+
+ private:
+
+    /* Values recorded in each bucket, and the total of every value recorded */
+    std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+    std::atomic<uint64_t> sum;
+
+    /* Returns the bucket the value falls in */
+    static int bucketFor(uint64_t value);
+
+    /* Returns the middle of the range of values in the bucket */
+    static uint64_t bucketValue(int bucket);
+};
+
+/*
+ * Everything measured about one worker. Only the worker's own thread writes to it, so none of
+ * it is locked or contended; a scrape reads it concurrently with relaxed loads.
+ */
+struct WorkerMetrics {
+
+    /* Constructor - start every count at 0 */
+    WorkerMetrics(int id);
+
+    /* Identifies the worker in the exported labels */
+    int id;
+
+    /* Sessions open, those with a name, and those whose connection is SUSPENDED */
+    std::atomic<int64_t> sessions;
+    std::atomic<int64_t> namedSessions;
+    std::atomic<int64_t> suspendedSessions;
+
+    /* Connections accepted since the server started */
+    std::atomic<uint64_t> accepts;
+
+    /* Sessions kept after losing their connection, and sessions resumed on a new one */
+    std::atomic<uint64_t> detaches;
+    std::atomic<uint64_t> resumes;
+
+    /* Connects and messages refused for going over their rate limits */
+    std::atomic<uint64_t> refusedConnects;
+    std::atomic<uint64_t> refusedMessages;
+
+    /* Data and messages sent and received by every connection of the worker */
+    TrafficCounters traffic;
+
+    /* How long each event loop iteration was busy for */
+    Histogram loopBusy;
+
+    /* How long each name request took to handle, including the shared NameRegistry */
+    Histogram nameRequests;
+
+    /* How long each room request took to handle, including the shared RoomRegistry */
+    Histogram roomRequests;
+
+    /* Add to one of the gauges or counters above. Single writer only */
+    static void add(std::atomic<int64_t> &gauge, int64_t amount);
+    static void add(std::atomic<uint64_t> &counter, uint64_t amount);
+};
+
+/*
+ * Registry of every worker's metrics, exported in the Prometheus text format. Workers each get
+ * their own WorkerMetrics to write to, and a scrape reads them all without taking any lock they
+ * take, so scraping never stalls the event loops. Counters and gauges are exported per worker,
+ * and histograms as summaries (quantiles) of every worker's measurements together.
+ *
+ * Optionally serves the export over HTTP on a loopback port from a thread of its own, so it can
+ * be scraped by Prometheus or read with curl.
+ */
+class Metrics {
+ public:
+
+    /* Constructor - the send budget is exported as the total send queue depth */
+    Metrics(SendBudget *sendBudget);
+
+    /* Destructor - stop serving. Any WorkerMetrics handed out are freed */
+    ~Metrics();
+
+    /* Returns new metrics for a worker to write to, owned by the registry */
+    WorkerMetrics * createWorker(int id);
+
+    /* Returns every metric in the Prometheus text exposition format */
+    std::string render();
+
+    /*
+     * Serve the metrics over HTTP at 127.0.0.1 on the given port from a thread of its own.
+     * Throws MetricsException if the port can't be listened on
+     */
+    void serve(uint16_t port);
+
+    /* Stop serving the metrics, freeing the port. Does nothing if not serving */
+    void stopServing();
+
+ private:
+
+    /* The budget of every connection's send queue (not owned by the registry) */
+    SendBudget *sendBudget;
+
+    /* Every worker's metrics, guarded by workersMutex, which workers never take */
+    std::vector<WorkerMetrics*> workers;
+    std::mutex workersMutex;
+
+    /* The endpoint's listening socket, or -1 when not serving */
+    int listenfd;
+
+    /* Cleared to stop the endpoint's thread */
+    std::atomic<bool> serving;
+
+    std::thread serveThread;
+
+    /* Body of the endpoint's thread */
+    void runServer();
+
+    /* Answer one request on an accepted socket, then close it */
+    void answer(int fd);
+
+    /* Append a summary of the given histogram of every worker to out */
+    void renderHistogram(std::string &out, const char *name, const char *help,
+            Histogram WorkerMetrics::*histogram);
+};
+
+/* Empty exception type to throw when the metrics endpoint fails */
+class MetricsException : public std::runtime_error {
+ public:
+    MetricsException(const char* message) : std::runtime_error(message) {}
+};
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef FD__NAMEREGISTRY_H
+#define FD__NAMEREGISTRY_H
+
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <string>
+
+/* Longest name a session may take, in bytes, so every message naming players stays small */
+#define NAME_MAX_LENGTH 64
+
+/* What NameRegistry::reserveAsync found out straight away */
+enum class NameResult : uint8_t {
+    RESERVED,
+    TAKEN,
+    PENDING
+};
+
+/*
+ * Record of which names are currently registered, shared by all server workers (and, depending
+ * on the implementation, by other servers too) so that name uniqueness holds across session
+ * shards. Each name is held by an opaque owner id, which must be unique among the live sessions
+ * of every worker. Safe to call from any thread.
+ *
+ * LocalNameRegistry keeps the names in this process, for a server running on its own.
+ * RemoteNameRegistry keeps them in a registry service shared by several servers.
+ */
+class NameRegistry {
+ public:
+
+    virtual ~NameRegistry() {}
+
+    /*
+     * Attempt to register the name to the given owner. Returns true if the name was free or is
+     * already held by this owner, false if another owner holds it
+     */
+    virtual bool reserve(const std::string &name, uint64_t owner) = 0;
+
+    /*
+     * Attempt to register the name as reserve() does, without waiting on anything slow. Returns
+     * RESERVED or TAKEN if that is known straight away, otherwise PENDING, and done is called
+     * with the answer later from another thread, which mustn't call the registry from it
+     */
+    virtual NameResult reserveAsync(const std::string &name, uint64_t owner,
+            const std::function<void(bool)> &done) {
+        (void) done;
+        return reserve(name, owner) ? NameResult::RESERVED : NameResult::TAKEN;
+    }
+
+    /* Release the name if (and only if) it is held by the given owner */
+    virtual void release(const std::string &name, uint64_t owner) = 0;
+
+    /*
+     * Hand the name from one owner to another without it ever being free in between. Returns
+     * false (changing nothing) if the name is not held by the first owner
+     */
+    virtual bool transfer(const std::string &name, uint64_t from, uint64_t to) = 0;
+
+    /*
+     * Stop sharing names, the server handing its sessions over to a replacement. The names stay
+     * held rather than being released, so no other server can take one in between, and releases
+     * from here on change nothing outside this process. Returns the id the replacement carries on
+     * holding them under, or 0 if there is nothing to carry on from
+     */
+    virtual uint64_t handOff() { return 0; }
+
+};
+
+/* Empty exception type to throw when a name registry can't be reached */
+class NameRegistryException : public std::runtime_error {
+ public:
+    NameRegistryException(const char* message) : std::runtime_error(message) {}
+};
+
+#endif
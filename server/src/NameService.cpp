@@ -0,0 +1,285 @@
+#include "NameService.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* How long the service sleeps between checking for leases running out and whether to stop */
+#define NAME_SERVICE_POLL_MILLIS 250
+
+/* Prefix of an address that names a Unix socket rather than a TCP host and port */
+static const char UNIX_PREFIX[] = "unix:";
+
+/*
+ * Work out the socket address for unix:PATH or HOST:PORT (an empty HOST being any address when
+ * listening). Sets path to the Unix socket's path, if it is one. Throws NameRegistryException if
+ * the address is malformed or the host unknown
+ */
+static socklen_t resolveAddress(const std::string &address, bool listening,
+        struct sockaddr_storage *out, std::string *path)
+{
+    memset(out, 0, sizeof(*out));
+    if (address.compare(0, strlen(UNIX_PREFIX), UNIX_PREFIX) == 0) {
+        struct sockaddr_un *addr = (struct sockaddr_un*) out;
+        *path = address.substr(strlen(UNIX_PREFIX));
+        if (path->empty() || path->length() >= sizeof(addr->sun_path)) {
+            throw NameRegistryException("Name registry socket path is empty or too long");
+        }
+        addr->sun_family = AF_UNIX;
+        memcpy(addr->sun_path, path->c_str(), path->length());
+        return sizeof(*addr);
+    }
+
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos) {
+        throw NameRegistryException("Name registry address is neither unix:PATH nor HOST:PORT");
+    }
+    std::string host = address.substr(0, colon);
+    std::string port = address.substr(colon + 1);
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+    struct addrinfo *found;
+    if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &found) != 0) {
+        throw NameRegistryException("Name registry host or port is unknown");
+    }
+    socklen_t len = found->ai_addrlen;
+    memcpy(out, found->ai_addr, len);
+    freeaddrinfo(found);
+    path->clear();
+    return len;
+}
+
+/* Read exactly len bytes, returning false if the socket fails, closes or times out first */
+static bool readFully(int fd, char *buf, size_t len)
+{
+    size_t got = 0;
+    while (got < len) {
+        ssize_t res = recv(fd, buf + got, len - got, 0);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        if (res <= 0) {
+            return false;
+        }
+        got += res;
+    }
+    return true;
+}
+
+/* Give up on the other side if it stalls partway through a batch */
+static void setTimeouts(int fd)
+{
+    struct timeval timeout;
+    timeout.tv_sec = NAME_SERVICE_TIMEOUT_SECS;
+    timeout.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    /* Every batch waits on its answer, so never hold one back to coalesce it */
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+NameService::NameService(const std::string &address, uint32_t leaseSecs)
+{
+    this->leaseSecs = leaseSecs;
+    running = false;
+
+    struct sockaddr_storage addr;
+    socklen_t addrLen = resolveAddress(address, true, &addr, &unixPath);
+    listenfd = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenfd < 0) {
+        throw NameRegistryException("Failed to create name registry socket");
+    }
+    if (unixPath.empty()) {
+        int one = 1;
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    } else {
+        /* Replace a socket file left behind by a crash */
+        unlink(unixPath.c_str());
+    }
+    if (bind(listenfd, (struct sockaddr*) &addr, addrLen) < 0 || listen(listenfd, SOMAXCONN) < 0) {
+        close(listenfd);
+        throw NameRegistryException("Failed to listen on name registry socket");
+    }
+}
+
+NameService::~NameService()
+{
+    for (int fd : clients) {
+        close(fd);
+    }
+    close(listenfd);
+    if (!unixPath.empty()) {
+        unlink(unixPath.c_str());
+    }
+}
+
+void NameService::run()
+{
+    running = true;
+    std::vector<struct pollfd> pfds;
+    while (running) {
+        pfds.clear();
+        pfds.push_back({listenfd, POLLIN, 0});
+        for (int fd : clients) {
+            pfds.push_back({fd, POLLIN, 0});
+        }
+        int ready = ::poll(pfds.data(), pfds.size(), NAME_SERVICE_POLL_MILLIS);
+        expireLeases();
+        if (ready <= 0) {
+            continue;
+        }
+
+        /* A server sends a whole batch at once and then waits, so a batch is read in one go */
+        std::vector<int> remaining;
+        for (size_t i = 1; i < pfds.size(); i++) {
+            int fd = pfds[i].fd;
+            if (pfds[i].revents == 0) {
+                remaining.push_back(fd);
+                continue;
+            }
+            pbuf::NameRequestBatch batch;
+            pbuf::NameReplyBatch reply;
+            if (!receiveBatch(fd, batch)) {
+                /* Its names stay leased, so a server that reconnects in time keeps them */
+                close(fd);
+                continue;
+            }
+            apply(batch, reply);
+            if (!sendBatch(fd, reply)) {
+                close(fd);
+                continue;
+            }
+            remaining.push_back(fd);
+        }
+        clients.swap(remaining);
+
+        if (pfds[0].revents != 0) {
+            int fd = accept4(listenfd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd >= 0) {
+                setTimeouts(fd);
+                clients.push_back(fd);
+            }
+        }
+    }
+}
+
+void NameService::stop()
+{
+    running = false;
+}
+
+int NameService::connectTo(const std::string &address)
+{
+    struct sockaddr_storage addr;
+    std::string path;
+    socklen_t addrLen = resolveAddress(address, false, &addr, &path);
+    int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        throw NameRegistryException("Failed to create name registry socket");
+    }
+    if (connect(fd, (struct sockaddr*) &addr, addrLen) < 0) {
+        close(fd);
+        throw NameRegistryException("Failed to connect to the name registry");
+    }
+    setTimeouts(fd);
+    return fd;
+}
+
+bool NameService::sendBatch(int fd, const google::protobuf::MessageLite &batch)
+{
+    std::string data(sizeof(uint32_t), '\0');
+    uint32_t size = htonl(batch.ByteSizeLong());
+    memcpy(&data[0], &size, sizeof(size));
+    if (!batch.AppendToString(&data)) {
+        return false;
+    }
+
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t res = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        if (res <= 0) {
+            return false;
+        }
+        sent += res;
+    }
+    return true;
+}
+
+bool NameService::receiveBatch(int fd, google::protobuf::MessageLite &batch)
+{
+    uint32_t size;
+    if (!readFully(fd, (char*) &size, sizeof(size))) {
+        return false;
+    }
+    size = ntohl(size);
+    if (size > NAME_SERVICE_MAX_FRAME) {
+        return false;
+    }
+    std::string data(size, '\0');
+    return readFully(fd, &data[0], size) && batch.ParseFromString(data);
+}
+
+void NameService::apply(const pbuf::NameRequestBatch &batch, pbuf::NameReplyBatch &reply)
+{
+    Instance &instance = instances[batch.instance()];
+    instance.expiresAt = std::chrono::steady_clock::now() + std::chrono::seconds(leaseSecs);
+    if (batch.sync()) {
+        releaseAll(instance);
+    }
+
+    for (const pbuf::NameRequestBatch::Op &op : batch.ops()) {
+        bool result = true;
+        if (op.kind() == pbuf::NameRequestBatch::Op::RESERVE) {
+            auto it = owners.emplace(op.name(), batch.instance()).first;
+            result = it->second == batch.instance();
+            if (result) {
+                instance.names.insert(op.name());
+            }
+        } else {
+            auto it = owners.find(op.name());
+            if (it != owners.end() && it->second == batch.instance()) {
+                owners.erase(it);
+                instance.names.erase(op.name());
+            }
+        }
+        reply.add_results(result);
+    }
+    reply.set_leasesecs(leaseSecs);
+}
+
+void NameService::expireLeases()
+{
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = instances.begin(); it != instances.end(); ) {
+        if (now >= it->second.expiresAt) {
+            releaseAll(it->second);
+            it = instances.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void NameService::releaseAll(Instance &instance)
+{
+    for (const std::string &name : instance.names) {
+        owners.erase(name);
+    }
+    instance.names.clear();
+}
@@ -0,0 +1,98 @@
+#ifndef FD__NAMESERVICE_H
+#define FD__NAMESERVICE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <google/protobuf/message_lite.h>
+
+#include "NameRegistry.h"
+#include "pbuf/generated/NameService.pb.h"
+
+/* Default time a server's names are kept without hearing from it, in seconds */
+#define NAME_SERVICE_LEASE_SECS 15
+
+/* Largest batch either side accepts, in bytes (a sync batch lists every name a server holds) */
+#define NAME_SERVICE_MAX_FRAME (16 * 1024 * 1024)
+
+/* Longest either side waits on the other partway through a batch, in seconds */
+#define NAME_SERVICE_TIMEOUT_SECS 2
+
+/*
+ * The registry service that several servers share their names through (see RemoteNameRegistry),
+ * so any number of them can run behind a load balancer with names unique across all of them.
+ * Run with fd-server --serve-names, which is also the stand-in to test against locally.
+ *
+ * Listens at an address of the form unix:PATH for a Unix socket, or HOST:PORT for TCP. Each
+ * server sends batches of reserves and releases under an instance id of its own, every batch
+ * being answered in order. A server's names are leased: every batch renews them, and if a server
+ * isn't heard from for the lease time (it crashed, or lost its way to the service) its names are
+ * freed for others. Everything runs on one thread, which is plenty for the handful of servers
+ * that connect, each sending a batch at a time.
+ */
+class NameService {
+ public:
+
+    /*
+     * Constructor - start listening at the given address, keeping names for leaseSecs without
+     * hearing from their server. Throws NameRegistryException if it can't be listened on
+     */
+    NameService(const std::string &address, uint32_t leaseSecs = NAME_SERVICE_LEASE_SECS);
+
+    /* Destructor - close the listener and every connection */
+    ~NameService();
+
+    /* Answer batches until stop() is called. Blocks the calling thread */
+    void run();
+
+    /* Make run() return. Safe to call from any thread */
+    void stop();
+
+    /*
+     * Connect to a service at the given address, returning the socket. Throws
+     * NameRegistryException if it can't be connected to
+     */
+    static int connectTo(const std::string &address);
+
+    /* Send or receive one batch over a socket. Return false if the socket failed or timed out */
+    static bool sendBatch(int fd, const google::protobuf::MessageLite &batch);
+    static bool receiveBatch(int fd, google::protobuf::MessageLite &batch);
+
+ private:
+
+    /* The names a server holds, and when they are freed unless it is heard from */
+    struct Instance {
+        std::unordered_set<std::string> names;
+        std::chrono::steady_clock::time_point expiresAt;
+    };
+
+    int listenfd;
+    uint32_t leaseSecs;
+    std::atomic<bool> running;
+
+    /* The path of the Unix socket listened on, to remove once done, or empty for TCP */
+    std::string unixPath;
+
+    /* Sockets of the connected servers */
+    std::vector<int> clients;
+
+    /* The instance holding each name, and every instance holding any */
+    std::unordered_map<std::string, uint64_t> owners;
+    std::unordered_map<uint64_t, Instance> instances;
+
+    /* Apply one batch from a server, filling in the reply */
+    void apply(const pbuf::NameRequestBatch &batch, pbuf::NameReplyBatch &reply);
+
+    /* Free the names of every server whose lease ran out */
+    void expireLeases();
+
+    /* Release every name the instance holds */
+    void releaseAll(Instance &instance);
+};
+
+#endif
@@ -0,0 +1,291 @@
+#include "RemoteNameRegistry.h"
+
+#include <random>
+
+#include <unistd.h>
+
+RemoteNameRegistry::RemoteNameRegistry(const std::string &address, uint64_t instance,
+        const std::vector<std::string> &handedOver)
+{
+    this->address = address;
+    if (instance == 0) {
+        std::random_device random;
+        instance = ((uint64_t) random() << 32) | random();
+    }
+    this->instance = instance;
+
+    /* Confirmed already, so the first batch keeps them and frees the rest the instance held */
+    for (const std::string &name : handedOver) {
+        held[name] = {UNCLAIMED, true};
+    }
+    handedOff = false;
+    inFlight = false;
+    leaseSecs = NAME_SERVICE_LEASE_SECS;
+
+    /* Connected here so a wrong address is reported straight away */
+    fd = NameService::connectTo(address);
+    running = true;
+    ioThread = std::thread(&RemoteNameRegistry::run, this);
+}
+
+RemoteNameRegistry::~RemoteNameRegistry()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        running = false;
+    }
+    opsQueued.notify_all();
+    if (ioThread.joinable()) {
+        ioThread.join();
+    }
+
+    /* Holding no names at all frees them now, rather than once the lease runs out */
+    if (fd >= 0) {
+        if (!handedOff) {
+            pbuf::NameRequestBatch batch;
+            pbuf::NameReplyBatch reply;
+            batch.set_instance(instance);
+            batch.set_sync(true);
+            if (NameService::sendBatch(fd, batch)) {
+                NameService::receiveBatch(fd, reply);
+            }
+        }
+        close(fd);
+    }
+}
+
+bool RemoteNameRegistry::reserve(const std::string &name, uint64_t owner)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    bool answered = false;
+    bool reserved = false;
+    NameResult result = reserveLocked(name, owner, [&answered, &reserved](bool answer) {
+        reserved = answer;
+        answered = true;
+    });
+    if (result != NameResult::PENDING) {
+        return result == NameResult::RESERVED;
+    }
+    opsDone.wait(guard, [&answered]() { return answered; });
+    return reserved;
+}
+
+NameResult RemoteNameRegistry::reserveAsync(const std::string &name, uint64_t owner,
+        const std::function<void(bool)> &done)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return reserveLocked(name, owner, done);
+}
+
+NameResult RemoteNameRegistry::reserveLocked(const std::string &name, uint64_t owner,
+        const std::function<void(bool)> &done)
+{
+    auto heldIt = held.find(name);
+    if (heldIt != held.end()) {
+        if (heldIt->second.owner == UNCLAIMED) {
+            heldIt->second.owner = owner;
+        }
+
+        /*
+         * One still being reserved is refused even to its owner: owners are session slots, and
+         * the session in this one may not be the one that asked
+         */
+        bool reserved = heldIt->second.confirmed && heldIt->second.owner == owner;
+        return reserved ? NameResult::RESERVED : NameResult::TAKEN;
+    }
+    auto takenIt = taken.find(name);
+    if (takenIt != taken.end()) {
+        if (std::chrono::steady_clock::now() < takenIt->second) {
+            return NameResult::TAKEN;
+        }
+        taken.erase(takenIt);
+    }
+    if (fd < 0 || !running) {
+        return NameResult::TAKEN;
+    }
+
+    /* Held as far as this server's other sessions are concerned, until the service says */
+    held[name] = {owner, false};
+    queued.push_back({pbuf::NameRequestBatch::Op::RESERVE, name, done});
+    opsQueued.notify_one();
+    return NameResult::PENDING;
+}
+
+void RemoteNameRegistry::release(const std::string &name, uint64_t owner)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = held.find(name);
+    if (it == held.end() || it->second.owner != owner || !it->second.confirmed) {
+        return;
+    }
+    held.erase(it);
+    if (running) {
+        queued.push_back({pbuf::NameRequestBatch::Op::RELEASE, name, nullptr});
+        opsQueued.notify_one();
+    }
+}
+
+bool RemoteNameRegistry::transfer(const std::string &name, uint64_t from, uint64_t to)
+{
+    /* The service only knows which server holds a name, so this never leaves the process */
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = held.find(name);
+    if (it == held.end() || it->second.owner != from) {
+        return false;
+    }
+    it->second.owner = to;
+    return true;
+}
+
+uint64_t RemoteNameRegistry::handOff()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        running = false;
+        handedOff = true;
+    }
+    opsQueued.notify_all();
+    ioThread.join();
+
+    /* A batch on its way was answered first. What's left, the replacement's first batch settles */
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<Op> ops;
+    ops.swap(queued);
+    failOps(ops);
+    return instance;
+}
+
+void RemoteNameRegistry::run()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    bool synced = false;
+    auto renewAt = std::chrono::steady_clock::now();
+    while (running) {
+        if (!synced) {
+            synced = sync(guard);
+            if (!synced) {
+                /* Refuse whatever is waiting rather than hold up the workers until it's back */
+                std::vector<Op> ops;
+                ops.swap(queued);
+                failOps(ops);
+                opsQueued.wait_for(guard, std::chrono::seconds(NAME_RECONNECT_SECS),
+                        [this]() { return !running; });
+                continue;
+            }
+            renewAt = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(leaseSecs * 1000 / 3);
+        }
+
+        /* Whatever piles up while a batch is on its way goes out together in the next */
+        opsQueued.wait_until(guard, renewAt, [this]() { return !running || !queued.empty(); });
+        if (!running) {
+            break;
+        }
+        std::vector<Op> ops;
+        ops.swap(queued);
+        pbuf::NameRequestBatch batch;
+        batch.set_instance(instance);
+        for (const Op &op : ops) {
+            pbuf::NameRequestBatch::Op *msg = batch.add_ops();
+            msg->set_kind(op.kind);
+            msg->set_name(op.name);
+        }
+
+        inFlight = true;
+        pbuf::NameReplyBatch reply;
+        bool answered = exchange(guard, batch, reply);
+        inFlight = false;
+        if (!answered) {
+            failOps(ops);
+            synced = false;
+            continue;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < ops.size(); i++) {
+            Op &op = ops[i];
+            if (op.kind != pbuf::NameRequestBatch::Op::RESERVE) {
+                continue;
+            }
+            bool reserved = reply.results(i);
+            op.done(reserved);
+            if (reserved) {
+                held[op.name].confirmed = true;
+            } else {
+                held.erase(op.name);
+                if (taken.size() >= NAME_NEGATIVE_CACHE_MAX) {
+                    taken.clear();
+                }
+                taken[op.name] = now + std::chrono::seconds(NAME_NEGATIVE_CACHE_SECS);
+            }
+        }
+        leaseSecs = reply.leasesecs();
+        renewAt = now + std::chrono::milliseconds(leaseSecs * 1000 / 3);
+        opsDone.notify_all();
+    }
+}
+
+bool RemoteNameRegistry::exchange(std::unique_lock<std::mutex> &guard,
+        const pbuf::NameRequestBatch &batch, pbuf::NameReplyBatch &reply)
+{
+    guard.unlock();
+    bool answered = NameService::sendBatch(fd, batch) && NameService::receiveBatch(fd, reply) &&
+            reply.results_size() == batch.ops_size();
+    guard.lock();
+    if (!answered) {
+        close(fd);
+        fd = -1;
+    }
+    return answered;
+}
+
+bool RemoteNameRegistry::sync(std::unique_lock<std::mutex> &guard)
+{
+    if (fd < 0) {
+        guard.unlock();
+        int newFd = -1;
+        try {
+            newFd = NameService::connectTo(address);
+        } catch (NameRegistryException &exp) {
+            /* Tried again shortly */
+        }
+        guard.lock();
+        if (newFd < 0) {
+            return false;
+        }
+        fd = newFd;
+    }
+
+    /*
+     * Only the names confirmed so far: those still being reserved are in the queue. A name
+     * another server took while this one was away stays with the session here too, the one
+     * conflict an outage longer than the lease can cause
+     */
+    pbuf::NameRequestBatch batch;
+    batch.set_instance(instance);
+    batch.set_sync(true);
+    for (const auto &entry : held) {
+        if (entry.second.confirmed) {
+            pbuf::NameRequestBatch::Op *msg = batch.add_ops();
+            msg->set_kind(pbuf::NameRequestBatch::Op::RESERVE);
+            msg->set_name(entry.first);
+        }
+    }
+    pbuf::NameReplyBatch reply;
+    if (!exchange(guard, batch, reply)) {
+        return false;
+    }
+    leaseSecs = reply.leasesecs();
+    return true;
+}
+
+void RemoteNameRegistry::failOps(std::vector<Op> &ops)
+{
+    for (Op &op : ops) {
+        if (op.kind == pbuf::NameRequestBatch::Op::RESERVE) {
+            held.erase(op.name);
+            op.done(false);
+        }
+    }
+    opsDone.notify_all();
+}
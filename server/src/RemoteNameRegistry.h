@@ -0,0 +1,145 @@
+#ifndef FD__REMOTENAMEREGISTRY_H
+#define FD__REMOTENAMEREGISTRY_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "NameRegistry.h"
+#include "NameService.h"
+
+/* How long a name found to be taken is refused here without asking the service again, in seconds */
+#define NAME_NEGATIVE_CACHE_SECS 2
+
+/* Most names remembered as taken. The whole cache is forgotten once it holds this many */
+#define NAME_NEGATIVE_CACHE_MAX 65536
+
+/* How long to wait between attempts to reach the service again after losing it, in seconds */
+#define NAME_RECONNECT_SECS 1
+
+/*
+ * Name registry kept by a NameService shared with other servers, so names are unique across all
+ * of them. Every change goes through one connection to the service, on a thread of its own: what
+ * the workers ask for while a batch is on its way is gathered into the next one, so however many
+ * workers reserve names at once it costs one round trip. A worker is told whether it got a name
+ * once its batch is answered rather than waiting for it (see reserveAsync), and releases are sent
+ * on without waiting at all. Whenever the service is heard from the lease on this server's names
+ * is renewed, and when there is nothing else to send an empty batch is sent often enough to keep
+ * it.
+ *
+ * Most name requests never reach the service. The names this server holds are known here
+ * (ownership between its own sessions, and transfers, never leave the process), and a name found
+ * to be taken is refused here for NAME_NEGATIVE_CACHE_SECS, so a client asking for the same taken
+ * name over and over costs nothing. The price is that a name freed elsewhere may be refused for
+ * that long.
+ *
+ * While the service can't be reached, every name not already held here is refused so names stay
+ * unique. Once it is reached again, this server's names are reserved all over, in one batch.
+ *
+ * A server handing over to a replacement stops without releasing anything, and the replacement
+ * carries on under the same instance id: its first batch reserves the names of the sessions
+ * handed over, which the service already has under that id, and frees the rest in one go.
+ */
+class RemoteNameRegistry : public NameRegistry {
+ public:
+
+    /*
+     * Constructor - connect to the service at the given address (see NameService). Throws
+     * NameRegistryException if it can't be reached. Given the instance id of the server handed
+     * over from (see handOff) and the names of the sessions handed over, carries on holding
+     * those names, each going to the first owner to reserve it
+     */
+    RemoteNameRegistry(const std::string &address, uint64_t instance = 0,
+            const std::vector<std::string> &handedOver = {});
+
+    /* Destructor - release every name held, unless handed off, and disconnect */
+    ~RemoteNameRegistry();
+
+    bool reserve(const std::string &name, uint64_t owner) override;
+    NameResult reserveAsync(const std::string &name, uint64_t owner,
+            const std::function<void(bool)> &done) override;
+    void release(const std::string &name, uint64_t owner) override;
+    bool transfer(const std::string &name, uint64_t from, uint64_t to) override;
+    uint64_t handOff() override;
+
+ private:
+
+    /* Owner of a name handed over that no session here has reserved yet */
+    static const uint64_t UNCLAIMED = UINT64_MAX;
+
+    /* A name held here, or being reserved for the owner until the service answers */
+    struct Held {
+        uint64_t owner;
+        bool confirmed;
+    };
+
+    /* A reserve or release on its way to the service, and what to call with a reserve's answer */
+    struct Op {
+        pbuf::NameRequestBatch::Op::Kind kind;
+        std::string name;
+        std::function<void(bool)> done;
+    };
+
+    std::string address;
+
+    /* The random id this server holds its names under at the service */
+    uint64_t instance;
+
+    /*
+     * The connection to the service, or -1 while it can't be reached. Only the thread uses it or
+     * changes it, the latter only under the lock
+     */
+    int fd;
+
+    /* Guards everything below, and with it every call from the workers */
+    std::mutex lock;
+
+    /* Signalled when there is something to send, and when a batch was answered */
+    std::condition_variable opsQueued;
+    std::condition_variable opsDone;
+
+    /* Ops waiting for the next batch, and whether a batch is on its way */
+    std::vector<Op> queued;
+    bool inFlight;
+
+    std::unordered_map<std::string, Held> held;
+    std::unordered_map<std::string, std::chrono::steady_clock::time_point> taken;
+
+    /* How long the service keeps names without hearing from this server */
+    uint32_t leaseSecs;
+
+    /* Cleared to stop the thread, and set once the names were handed off */
+    bool running;
+    bool handedOff;
+    std::thread ioThread;
+
+    /* Body of the connection's thread */
+    void run();
+
+    /*
+     * With the lock held, answer a reserve from what is known here, or else hold the name for
+     * the owner and queue the reserve, with done to be called once the service answers
+     */
+    NameResult reserveLocked(const std::string &name, uint64_t owner,
+            const std::function<void(bool)> &done);
+
+    /*
+     * Send one batch and wait for its answer, with lock unlocked meanwhile. Returns false (and
+     * drops the connection) if the service couldn't be reached
+     */
+    bool exchange(std::unique_lock<std::mutex> &guard, const pbuf::NameRequestBatch &batch,
+            pbuf::NameReplyBatch &reply);
+
+    /* (Re)connect and reserve every name held here all over. Returns false if it failed */
+    bool sync(std::unique_lock<std::mutex> &guard);
+
+    /* Answer the reserves among the given ops, the batch having failed */
+    void failOps(std::vector<Op> &ops);
+};
+
+#endif
@@ -0,0 +1,161 @@
+#include "ResumeRegistry.h"
+
+#include <random>
+
+#include <sys/random.h>
+
+ResumeRegistry::ResumeRegistry(double graceSecs)
+{
+    this->graceSecs = (graceSecs > 0) ? graceSecs : 0;
+    grace = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(this->graceSecs));
+    nextIndex = 0;
+}
+
+double ResumeRegistry::getGraceSecs()
+{
+    return graceSecs;
+}
+
+std::string ResumeRegistry::generateToken()
+{
+    std::string token(RESUME_TOKEN_SIZE, '\0');
+    if (getrandom(&token[0], token.length(), 0) != (ssize_t) token.length()) {
+        /* Only without a kernel entropy source to ask, which random_device falls back on anyway */
+        std::random_device random;
+        for (char &byte : token) {
+            byte = (char) random();
+        }
+    }
+    return token;
+}
+
+void ResumeRegistry::attach(const std::string &token, const SessionRef &ref)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    refsByToken[token] = ref;
+}
+
+SessionRef ResumeRegistry::detach(DetachedSession &&session)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    /* Indexes only wrap around after billions of detaches, long after the old ones expired */
+    while (detached.count(nextIndex) != 0) {
+        nextIndex++;
+    }
+    SessionRef ref;
+    ref.worker = DETACHED_WORKER;
+    ref.handle.index = nextIndex++;
+
+    refsByToken[session.state.token] = ref;
+    indexesByFormer[session.former.key()] = ref.handle.index;
+    expiryOrder.push_back(ref.handle.index);
+    Detached &entry = detached[ref.handle.index];
+    entry.session = std::move(session);
+    entry.detachedAt = std::chrono::steady_clock::now();
+    return ref;
+}
+
+ResumeRegistry::Result ResumeRegistry::resume(const std::string &token,
+        const std::string &newToken, uint64_t received, const SessionRef &to,
+        DetachedSession *out, SessionRef *ref)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto tokenIt = refsByToken.find(token);
+    if (tokenIt == refsByToken.end()) {
+        return Result::UNKNOWN;
+    }
+    *ref = tokenIt->second;
+    if (ref->worker != DETACHED_WORKER) {
+        return Result::ATTACHED;
+    }
+
+    refsByToken.erase(tokenIt);
+    takeDetached(ref->handle.index, out);
+
+    /* Everything after what the client received has to still be kept to replay */
+    const ResumeState &state = out->state;
+    if (received > state.messagesSent || received < state.messagesSent - state.unacked.size()) {
+        return Result::MISSED;
+    }
+    refsByToken[newToken] = to;
+    return Result::RESUMED;
+}
+
+bool ResumeRegistry::retain(const SessionRef &ref, const std::shared_ptr<const EncodedMessage> &msg)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    Detached *entry = findDetached(ref);
+    if (entry == nullptr) {
+        return false;
+    }
+    entry->session.state.countSent(msg);
+    return true;
+}
+
+void ResumeRegistry::expire(std::vector<std::pair<SessionRef, DetachedSession>> &out)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto now = std::chrono::steady_clock::now();
+    while (!expiryOrder.empty()) {
+        auto it = detached.find(expiryOrder.front());
+        if (it != detached.end()) {
+            if (now - it->second.detachedAt < grace) {
+                break;
+            }
+            SessionRef ref;
+            ref.worker = DETACHED_WORKER;
+            ref.handle.index = it->first;
+            out.emplace_back(ref, DetachedSession());
+            refsByToken.erase(it->second.session.state.token);
+            takeDetached(it->first, &out.back().second);
+        }
+
+        /* Resumed sessions are left in the order until they come up, and skipped then */
+        expiryOrder.pop_front();
+    }
+}
+
+size_t ResumeRegistry::getDetachedCount()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return detached.size();
+}
+
+ResumeRegistry::Detached * ResumeRegistry::findDetached(const SessionRef &ref)
+{
+    uint32_t index = ref.handle.index;
+    if (ref.worker != DETACHED_WORKER) {
+        auto formerIt = indexesByFormer.find(ref.key());
+        if (formerIt == indexesByFormer.end()) {
+            return nullptr;
+        }
+        index = formerIt->second;
+    }
+
+    auto it = detached.find(index);
+    if (it == detached.end()) {
+        return nullptr;
+    }
+
+    /* A former ref only counts for the session that was in the slot, not one there since */
+    if (ref.worker != DETACHED_WORKER &&
+            !(it->second.session.former.handle == ref.handle)) {
+        return nullptr;
+    }
+    return &it->second;
+}
+
+void ResumeRegistry::takeDetached(uint32_t index, DetachedSession *out)
+{
+    auto it = detached.find(index);
+
+    /* The slot may have been detached from again since, under the same former key */
+    auto formerIt = indexesByFormer.find(it->second.session.former.key());
+    if (formerIt != indexesByFormer.end() && formerIt->second == index) {
+        indexesByFormer.erase(formerIt);
+    }
+    *out = std::move(it->second.session);
+    detached.erase(it);
+}
@@ -0,0 +1,132 @@
+#ifndef FD__RESUMEREGISTRY_H
+#define FD__RESUMEREGISTRY_H
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "RoomRegistry.h"
+#include "SessionList.h"
+
+/* Bytes of randomness in a resume token */
+#define RESUME_TOKEN_SIZE 16
+
+/* A named session whose connection was lost, kept for a while in case its client comes back */
+struct DetachedSession {
+    std::string name;
+
+    /* The room the session was last known to be in, or 0 */
+    uint32_t room = 0;
+
+    /* The token, message counts and the messages kept for replay, including those sent since */
+    ResumeState state;
+
+    /* What the session was known as before it was detached */
+    SessionRef former;
+};
+
+/*
+ * Process-wide record of which session every resume token belongs to, shared by all server
+ * workers since a client that reconnects may land on any of them. A token either belongs to a
+ * live session of some worker, or to a detached session kept here until it is resumed or the
+ * grace period runs out.
+ *
+ * While detached, a session keeps its name and room membership under a SessionRef of its own
+ * (with worker DETACHED_WORKER), and messages sent to it under that ref are kept to replay once
+ * it is resumed. Detached sessions expire in the order they were detached, so expiry only ever
+ * looks at those that are due. Guarded by a single lock, which is only ever held for a few hash
+ * lookups.
+ */
+class ResumeRegistry {
+ public:
+
+    /* The worker in the SessionRef of every detached session, which no real worker uses */
+    static const uint32_t DETACHED_WORKER = UINT32_MAX;
+
+    /* The outcome of trying to resume a session */
+    enum class Result {
+        RESUMED,    /* The detached session was taken out to carry on with */
+        UNKNOWN,    /* There is no session with the token (any more) */
+        ATTACHED,   /* The session is still live on some worker, whose old connection must go */
+        MISSED      /* The client missed messages no longer kept, so the session was taken out */
+    };
+
+    /* Constructor - keep detached sessions for graceSecs. 0 turns resuming off altogether */
+    ResumeRegistry(double graceSecs);
+
+    /* Returns how long detached sessions are kept, 0 if resuming is off */
+    double getGraceSecs();
+
+    /* Returns a new random token, which is as good as unguessable */
+    static std::string generateToken();
+
+    /* Note that the given live session holds the token */
+    void attach(const std::string &token, const SessionRef &ref);
+
+    /*
+     * Keep a session whose connection was lost (holding state.token, which must be attached),
+     * returning what it is known as while detached
+     */
+    SessionRef detach(DetachedSession &&session);
+
+    /*
+     * Take out the detached session with the given token to carry on as the session given, which
+     * holds newToken from now on, for a client that has received the given number of session
+     * messages. Fills in the session and what it was known as while detached. If the session is
+     * still attached, sets ref to the live session and leaves it be
+     */
+    Result resume(const std::string &token, const std::string &newToken, uint64_t received,
+            const SessionRef &to, DetachedSession *out, SessionRef *ref);
+
+    /*
+     * Keep a message sent to a detached session to replay later. The ref may also be what the
+     * session was known as before it was detached, for messages that were on their way. Returns
+     * false if there is no such session
+     */
+    bool retain(const SessionRef &ref, const std::shared_ptr<const EncodedMessage> &msg);
+
+    /* Take out every detached session that has run out its grace period, with its ref */
+    void expire(std::vector<std::pair<SessionRef, DetachedSession>> &out);
+
+    /* Returns the number of sessions detached and waiting to be resumed */
+    size_t getDetachedCount();
+
+ private:
+
+    /* A detached session and when it was detached */
+    struct Detached {
+        DetachedSession session;
+        std::chrono::steady_clock::time_point detachedAt;
+    };
+
+    std::mutex lock;
+
+    std::chrono::steady_clock::duration grace;
+    double graceSecs;
+
+    /* The session holding each token: live, or detached if its worker is DETACHED_WORKER */
+    std::unordered_map<std::string, SessionRef> refsByToken;
+
+    /* Every detached session by the index of its detached ref, and by the key of its former ref */
+    std::unordered_map<uint32_t, Detached> detached;
+    std::unordered_map<uint64_t, uint32_t> indexesByFormer;
+
+    /* Indexes of the detached sessions in the order they were detached (some since resumed) */
+    std::deque<uint32_t> expiryOrder;
+
+    /* The index the next detached session gets */
+    uint32_t nextIndex;
+
+    /* Returns the detached session the ref refers to (either way), or nullptr if none */
+    Detached * findDetached(const SessionRef &ref);
+
+    /* Forget the detached session at the given index, moving it into out */
+    void takeDetached(uint32_t index, DetachedSession *out);
+};
+
+#endif
@@ -0,0 +1,264 @@
+#include "RoomRegistry.h"
+
+RoomRegistry::RoomRegistry()
+{
+    nextId = 1;
+}
+
+pbuf::RoomReply::Result RoomRegistry::create(const SessionRef &host, const std::string &hostName,
+        uint32_t maxPlayers, pbuf::RoomInfo *info)
+{
+    if (maxPlayers == 0 || maxPlayers > ROOM_MAX_PLAYERS) {
+        maxPlayers = ROOM_MAX_PLAYERS;
+    } else if (maxPlayers < ROOM_MIN_PLAYERS) {
+        maxPlayers = ROOM_MIN_PLAYERS;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (idsByMember.count(host.key()) != 0 || idsByHost.count(hostName) != 0) {
+        return pbuf::RoomReply::ALREADY_IN_ROOM;
+    }
+
+    /* Skip 0, which means no room, and (after wrapping around) any id still in use */
+    while (nextId == 0 || positionsById.count(nextId) != 0) {
+        nextId++;
+    }
+    uint32_t id = nextId++;
+
+    rooms.emplace_back();
+    Room &room = rooms.back();
+    room.id = id;
+    room.maxPlayers = maxPlayers;
+    room.numMembers = 1;
+    room.members[0].ref = host;
+    room.members[0].name = hostName;
+    positionsById[id] = rooms.size() - 1;
+    idsByHost[hostName] = id;
+    idsByMember[host.key()] = id;
+
+    describe(room, info);
+    return pbuf::RoomReply::OK;
+}
+
+pbuf::RoomReply::Result RoomRegistry::join(uint32_t roomId, const std::string &hostName,
+        const SessionRef &member, const std::string &name, pbuf::RoomInfo *info,
+        RoomChange *change)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (idsByMember.count(member.key()) != 0) {
+        return pbuf::RoomReply::ALREADY_IN_ROOM;
+    }
+
+    if (roomId == 0) {
+        auto hostIt = idsByHost.find(hostName);
+        if (hostIt == idsByHost.end()) {
+            return pbuf::RoomReply::NO_SUCH_ROOM;
+        }
+        roomId = hostIt->second;
+    }
+    int64_t position = findRoom(roomId);
+    if (position < 0) {
+        return pbuf::RoomReply::NO_SUCH_ROOM;
+    }
+
+    Room &room = rooms[position];
+    if (room.numMembers >= room.maxPlayers) {
+        return pbuf::RoomReply::ROOM_FULL;
+    }
+    room.members[room.numMembers].ref = member;
+    room.members[room.numMembers].name = name;
+    room.numMembers++;
+    idsByMember[member.key()] = roomId;
+
+    describe(room, info);
+    describeChange(room, change);
+    return pbuf::RoomReply::OK;
+}
+
+pbuf::RoomReply::Result RoomRegistry::leave(const SessionRef &member, RoomChange *change)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto memberIt = idsByMember.find(member.key());
+    if (memberIt == idsByMember.end()) {
+        return pbuf::RoomReply::NOT_IN_ROOM;
+    }
+    int64_t position = findRoom(memberIt->second);
+    idsByMember.erase(memberIt);
+    if (position < 0) {
+        return pbuf::RoomReply::NOT_IN_ROOM;
+    }
+    Room &room = rooms[position];
+
+    uint32_t index = 0;
+    while (room.members[index].ref.key() != member.key()) {
+        index++;
+    }
+
+    /* Closing up the gap moves the next member into the host's place */
+    std::string hostName = room.members[0].name;
+
+    /* Close up the gap, keeping the host first and everyone else in the order they joined */
+    for (uint32_t i = index + 1; i < room.numMembers; i++) {
+        room.members[i - 1] = std::move(room.members[i]);
+    }
+    room.numMembers--;
+
+    describeChange(room, change);
+    if (index == 0) {
+        /* The host left, which closes the room on everyone else */
+        change->update.set_closed(true);
+        change->update.mutable_room()->set_host(hostName);
+        idsByHost.erase(hostName);
+        for (uint32_t i = 0; i < room.numMembers; i++) {
+            idsByMember.erase(room.members[i].ref.key());
+        }
+        removeRoom(position);
+    }
+    return pbuf::RoomReply::OK;
+}
+
+void RoomRegistry::list(uint32_t start, size_t maxBytes, pbuf::RoomReply *reply)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    uint32_t end = start + ROOM_LIST_PAGE;
+    if (end > rooms.size()) {
+        end = rooms.size();
+    }
+    for (uint32_t i = start; i < end; i++) {
+        describe(rooms[i], reply->add_rooms());
+        if (reply->ByteSizeLong() + ROOM_LIST_RESERVED_BYTES > maxBytes) {
+            /* The page is full. A room too big for a page of its own is skipped, not retried */
+            reply->mutable_rooms()->RemoveLast();
+            end = (i == start) ? i + 1 : i;
+            break;
+        }
+    }
+    reply->set_listnext(end < rooms.size() ? end : 0);
+}
+
+uint32_t RoomRegistry::roomOf(const SessionRef &member)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto memberIt = idsByMember.find(member.key());
+    return (memberIt == idsByMember.end()) ? 0 : memberIt->second;
+}
+
+uint32_t RoomRegistry::replaceMember(const SessionRef &from, const SessionRef &to,
+        pbuf::RoomUpdate *update)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto memberIt = idsByMember.find(from.key());
+    if (memberIt == idsByMember.end()) {
+        return 0;
+    }
+    uint32_t id = memberIt->second;
+    int64_t position = findRoom(id);
+    idsByMember.erase(memberIt);
+    if (position < 0) {
+        return 0;
+    }
+    idsByMember[to.key()] = id;
+
+    Room &room = rooms[position];
+    for (uint32_t i = 0; i < room.numMembers; i++) {
+        if (room.members[i].ref.key() == from.key()) {
+            room.members[i].ref = to;
+        }
+    }
+
+    RoomChange change;
+    describeChange(room, &change);
+    *update = std::move(change.update);
+    return id;
+}
+
+size_t RoomRegistry::getRoomCount()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return rooms.size();
+}
+
+std::vector<RoomSnapshot> RoomRegistry::snapshot()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<RoomSnapshot> out(rooms.size());
+    for (size_t i = 0; i < rooms.size(); i++) {
+        out[i].id = rooms[i].id;
+        out[i].maxPlayers = rooms[i].maxPlayers;
+        for (uint32_t m = 0; m < rooms[i].numMembers; m++) {
+            out[i].members.push_back(rooms[i].members[m].ref);
+        }
+    }
+    return out;
+}
+
+bool RoomRegistry::restore(uint32_t id, uint32_t maxPlayers,
+        const std::vector<SessionRef> &members, const std::vector<std::string> &names)
+{
+    if (id == 0 || members.empty() || members.size() > ROOM_MAX_PLAYERS ||
+            names.size() != members.size()) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (positionsById.count(id) != 0 || idsByHost.count(names[0]) != 0) {
+        return false;
+    }
+    for (const SessionRef &member : members) {
+        if (idsByMember.count(member.key()) != 0) {
+            return false;
+        }
+    }
+
+    rooms.emplace_back();
+    Room &room = rooms.back();
+    room.id = id;
+    room.maxPlayers = maxPlayers;
+    room.numMembers = members.size();
+    for (size_t i = 0; i < members.size(); i++) {
+        room.members[i].ref = members[i];
+        room.members[i].name = names[i];
+        idsByMember[members[i].key()] = id;
+    }
+    positionsById[id] = rooms.size() - 1;
+    idsByHost[names[0]] = id;
+    if (id >= nextId) {
+        nextId = id + 1;
+    }
+    return true;
+}
+
+int64_t RoomRegistry::findRoom(uint32_t id)
+{
+    auto it = positionsById.find(id);
+    return (it == positionsById.end()) ? (int64_t) -1 : (int64_t) it->second;
+}
+
+void RoomRegistry::removeRoom(uint32_t position)
+{
+    positionsById.erase(rooms[position].id);
+    if (position != rooms.size() - 1) {
+        rooms[position] = std::move(rooms.back());
+        positionsById[rooms[position].id] = position;
+    }
+    rooms.pop_back();
+}
+
+void RoomRegistry::describe(const Room &room, pbuf::RoomInfo *info)
+{
+    info->set_id(room.id);
+    info->set_host(room.members[0].name);
+    info->set_numplayers(room.numMembers);
+    info->set_maxplayers(room.maxPlayers);
+}
+
+void RoomRegistry::describeChange(const Room &room, RoomChange *change)
+{
+    change->recipients.clear();
+    change->update.Clear();
+    describe(room, change->update.mutable_room());
+    for (uint32_t i = 0; i < room.numMembers; i++) {
+        change->recipients.push_back(room.members[i].ref);
+        change->update.add_members(room.members[i].name);
+    }
+}
@@ -0,0 +1,156 @@
+#ifndef FD__ROOMREGISTRY_H
+#define FD__ROOMREGISTRY_H
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "SessionList.h"
+#include "pbuf/generated/NetworkMessage.pb.h"
+
+/* Most players a room can hold, host included, and the fewest a room can be created for */
+#define ROOM_MAX_PLAYERS 8
+#define ROOM_MIN_PLAYERS 2
+
+/* Most rooms returned for one list request */
+#define ROOM_LIST_PAGE 32
+
+/* Bytes of a list page's size limit left for the rest of the message around the room list */
+#define ROOM_LIST_RESERVED_BYTES 32
+
+/* Identifies a session server-wide: the worker it belongs to and its handle within that worker */
+struct SessionRef {
+    uint32_t worker = 0;
+    SessionHandle handle;
+
+    /* Packs the worker and slot, which only one live session holds at a time, into one key */
+    uint64_t key() const {
+        return ((uint64_t) worker << 32) | handle.index;
+    }
+};
+
+/* Who to tell about a change to a room, and what to tell them */
+struct RoomChange {
+    std::vector<SessionRef> recipients;
+    pbuf::RoomUpdate update;
+};
+
+/* The members of a room, host first, as needed to hand the room over to another server */
+struct RoomSnapshot {
+    uint32_t id;
+    uint32_t maxPlayers;
+    std::vector<SessionRef> members;
+};
+
+/*
+ * Process-wide record of the game rooms, shared by all server workers since the players of a room
+ * may have connected to different workers. Rooms are kept back to back in one array in listing
+ * order (a closed room's place is taken by the last room), indexed by id and by host name, and
+ * every member is indexed by the room it is in, so every operation costs the same however many
+ * rooms there are and none of them looks at the sessions. Members are kept inline in their room.
+ *
+ * Only the member index knows for sure who is in which room. Each Session only keeps a hint of
+ * the room it joined, since a room closed by its host has members on other workers whose
+ * sessions can't be touched from here. Guarded by a single lock, which is only ever held for
+ * a few hash lookups.
+ */
+class RoomRegistry {
+ public:
+
+    /* Constructor - start with no rooms */
+    RoomRegistry();
+
+    /*
+     * Create a room hosted by the given session under its (registered) name, for at most
+     * maxPlayers players (the most allowed if 0). Fills in info on success
+     */
+    pbuf::RoomReply::Result create(const SessionRef &host, const std::string &hostName,
+            uint32_t maxPlayers, pbuf::RoomInfo *info);
+
+    /*
+     * Join the room with the given id, or if the id is 0 the room hosted by hostName. Fills in
+     * info, and who to tell about the new member (everyone in the room, the member included)
+     */
+    pbuf::RoomReply::Result join(uint32_t roomId, const std::string &hostName,
+            const SessionRef &member, const std::string &name, pbuf::RoomInfo *info,
+            RoomChange *change);
+
+    /*
+     * Leave the room the session is in, filling in who to tell. A host leaving closes the room,
+     * taking everyone else out of it too
+     */
+    pbuf::RoomReply::Result leave(const SessionRef &member, RoomChange *change);
+
+    /*
+     * Fill in one page of rooms from the given position, and where the next page starts. The
+     * page is cut short so the reply sent in one message stays within maxBytes
+     */
+    void list(uint32_t start, size_t maxBytes, pbuf::RoomReply *reply);
+
+    /* Returns the id of the room the session is in, or 0 if it is in none */
+    uint32_t roomOf(const SessionRef &member);
+
+    /*
+     * Have another session stand in for a member of a room, as when a session is detached from
+     * its connection or resumed on a new one. Nobody is told, since the member stays the same
+     * player. Returns the id of the room (0 if the session is in none), filling in the update
+     * that describes it
+     */
+    uint32_t replaceMember(const SessionRef &from, const SessionRef &to, pbuf::RoomUpdate *update);
+
+    /* Returns the number of open rooms */
+    size_t getRoomCount();
+
+    /* Returns every room, for handing them over to the server taking over */
+    std::vector<RoomSnapshot> snapshot();
+
+    /*
+     * Recreate a room handed over by the previous server with the same id, and its members with
+     * their names, host first. Returns false (recreating nothing) if the id or any member is
+     * already in use
+     */
+    bool restore(uint32_t id, uint32_t maxPlayers, const std::vector<SessionRef> &members,
+            const std::vector<std::string> &names);
+
+ private:
+
+    /* A player in a room */
+    struct Member {
+        SessionRef ref;
+        std::string name;
+    };
+
+    struct Room {
+        uint32_t id;
+        uint32_t maxPlayers;
+        uint32_t numMembers;
+        Member members[ROOM_MAX_PLAYERS];
+    };
+
+    std::mutex lock;
+
+    /* Every open room, in listing order */
+    std::vector<Room> rooms;
+
+    /* Position in rooms by room id, room id by host name, and room id by member key */
+    std::unordered_map<uint32_t, uint32_t> positionsById;
+    std::unordered_map<std::string, uint32_t> idsByHost;
+    std::unordered_map<uint64_t, uint32_t> idsByMember;
+
+    /* The id the next room created gets. Ids are not reused until they wrap around */
+    uint32_t nextId;
+
+    /* Returns the position of the room with the given id, or -1 if there is none */
+    int64_t findRoom(uint32_t id);
+
+    /* Remove the room at the given position, moving the last room into its place */
+    void removeRoom(uint32_t position);
+
+    /* Describe the room in info, and its members in the change's update */
+    static void describe(const Room &room, pbuf::RoomInfo *info);
+    static void describeChange(const Room &room, RoomChange *change);
+};
+
+#endif
@@ -0,0 +1,909 @@
+#include "ServerWorker.h"
+
+#include <chrono>
+
+#include <fcntl.h>
+
+#include "Trace.h"
+
+/*
+ * Longest the event loop sleeps when no timer is due sooner, which bounds how long stop() takes
+ * to be noticed
+ */
+#define MAX_WAIT_SECS 0.25
+
+/* How many seconds between checks of the send budget counters for logging */
+#define REPORT_INTERVAL_SECS 1.0
+
+/* For std::bind _1, _2 ... */
+using namespace std::placeholders;
+
+ServerWorker::ServerWorker(int id, uint16_t port, int listenerFd, NameRegistry *names,
+        RoomRegistry *rooms, ResumeRegistry *resumes, AdmissionControl *admission,
+        SendBudget *sendBudget, Logger *logger, Metrics *metrics,
+        const ServerWorkerOptions &options)
+{
+    this->id = id;
+    this->names = names;
+    this->rooms = rooms;
+    this->resumes = resumes;
+    this->admission = admission;
+    this->sendBudget = sendBudget;
+    this->options = options;
+    log = logger->createRing(id);
+    this->metrics = metrics->createWorker(id);
+    loggedFramesDropped = 0;
+    loggedPauses = 0;
+    loggedDisconnects = 0;
+    running = true;
+
+    if (listenerFd >= 0) {
+        listener = Listener::adopt(listenerFd, std::bind(&ServerWorker::onConnAccept, this, _1));
+    } else {
+        listener = new Listener(port, std::bind(&ServerWorker::onConnAccept, this, _1),
+                options.acceptBacklog, options.deferAcceptSecs);
+    }
+    listener->setAdmitCallback(std::bind(&ServerWorker::admitConnect, this, _1));
+    try {
+        eventLoop = new EventLoop(options.preferIoUring);
+        eventLoop->addListener(listener);
+    } catch (EventLoopException &exp) {
+        delete listener;
+        throw;
+    }
+    sessions = new SessionList();
+    timers = new TimerWheel();
+}
+
+ServerWorker::~ServerWorker()
+{
+    delete sessions;
+    delete timers;
+    delete eventLoop;
+    delete listener;
+}
+
+bool ServerWorker::isUsingIoUring()
+{
+    return eventLoop->isUsingIoUring();
+}
+
+void ServerWorker::run()
+{
+    TRACE_THREAD_NAME("worker " + std::to_string(id));
+    double reportSecs = 0;
+    auto lastTime = std::chrono::high_resolution_clock::now();
+    while (running) {
+
+        /* Update the elapsed time for this loop for polling */
+        auto elapsedTime = std::chrono::high_resolution_clock::now() - lastTime;
+        double elapsedSecs = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsedTime).count() / 1000000000.0d;
+        lastTime += std::chrono::nanoseconds((uint64_t) (1000000000 * elapsedSecs));
+
+        /* Run the keep-alive deadlines that are due, which only touches those connections */
+        {
+            TRACE_ZONE("TimerWheel::advance");
+            timers->advance();
+        }
+
+        /*
+         * The budget is shared, so one worker reporting on it is enough. The same worker writes
+         * out the trace when asked to, stalling only itself while it does, and ends the detached
+         * sessions that are due
+         */
+        reportSecs += elapsedSecs;
+        if (reportSecs >= REPORT_INTERVAL_SECS) {
+            if (id == 0) {
+                logSendBackpressure();
+                Trace::writeIfRequested();
+                expireDetachedSessions();
+            }
+            reportSecs = 0;
+        }
+
+        /* Sleep until a socket is readable, the next timer is due or another worker posts */
+        eventLoop->wait(timers->getSecsUntilNext(MAX_WAIT_SECS));
+        deliverInbox();
+        metrics->loopBusy.record(eventLoop->getBusyNanos());
+    }
+}
+
+void ServerWorker::stop()
+{
+    running = false;
+    eventLoop->wake();
+}
+
+void ServerWorker::setPeers(const std::vector<ServerWorker*> &peers)
+{
+    this->peers = peers;
+}
+
+void ServerWorker::post(const std::vector<SessionHandle> &recipients,
+        const std::shared_ptr<const EncodedMessage> &msg)
+{
+    bool wasEmpty;
+    {
+        std::lock_guard<std::mutex> guard(inboxMutex);
+        wasEmpty = inbox.empty() && inboxDrops.empty() && inboxNames.empty();
+        inbox.emplace_back();
+        inbox.back().recipients = recipients;
+        inbox.back().msg = msg;
+    }
+
+    /* If the inbox wasn't empty, the worker has already been woken up to empty it */
+    if (wasEmpty) {
+        eventLoop->wake();
+    }
+}
+
+void ServerWorker::dropConnection(SessionHandle handle)
+{
+    bool wasEmpty;
+    {
+        std::lock_guard<std::mutex> guard(inboxMutex);
+        wasEmpty = inbox.empty() && inboxDrops.empty() && inboxNames.empty();
+        inboxDrops.push_back(handle);
+    }
+    if (wasEmpty) {
+        eventLoop->wake();
+    }
+}
+
+void ServerWorker::postNameAnswer(NameAnswer answer)
+{
+    bool wasEmpty;
+    {
+        std::lock_guard<std::mutex> guard(inboxMutex);
+        wasEmpty = inbox.empty() && inboxDrops.empty() && inboxNames.empty();
+        inboxNames.push_back(std::move(answer));
+    }
+    if (wasEmpty) {
+        eventLoop->wake();
+    }
+}
+
+void ServerWorker::deliverInbox()
+{
+    {
+        std::lock_guard<std::mutex> guard(inboxMutex);
+        if (inbox.empty() && inboxDrops.empty() && inboxNames.empty()) {
+            return;
+        }
+        delivering.swap(inbox);
+        dropping.swap(inboxDrops);
+        answering.swap(inboxNames);
+    }
+
+    TRACE_ZONE("ServerWorker::deliverInbox");
+    for (Delivery &delivery : delivering) {
+        sendToSessions(delivery.recipients, delivery.msg);
+    }
+    delivering.clear();
+
+    for (const NameAnswer &answer : answering) {
+        onNameAnswered(answer);
+    }
+    answering.clear();
+
+    for (const SessionHandle &handle : dropping) {
+        Session *sess = sessions->get(handle);
+        if (sess != nullptr) {
+            /* Lost as if the socket had failed, which detaches the session */
+            sess->getConnection()->transportLost();
+        }
+    }
+    dropping.clear();
+}
+
+void ServerWorker::sendToSessions(const std::vector<SessionHandle> &recipients,
+        const std::shared_ptr<const EncodedMessage> &msg)
+{
+    for (const SessionHandle &handle : recipients) {
+        Session *sess = sessions->get(handle);
+        if (sess != nullptr) {
+            sess->getResumeState().countSent(msg);
+            try {
+                sess->getConnection()->sendEncodedMessage(*msg);
+            } catch (ConnectionException &exp) {
+                /* Only this peer misses out, the rest still get it */
+                std::string reason = exp.what();
+                logConnection(LogLevel::WARN, LogEvent::SEND_FAILED, sess->getConnection(),
+                        &reason);
+            }
+        } else {
+            /* Sent before the session was detached, so it is replayed if the session resumes */
+            SessionRef ref;
+            ref.worker = id;
+            ref.handle = handle;
+            resumes->retain(ref, msg);
+        }
+    }
+}
+
+void ServerWorker::sendToSession(Session *sess, pbuf::NetworkMessage &msg)
+{
+    ResumeState &resume = sess->getResumeState();
+    try {
+        if (resume.token.empty()) {
+            /* Nothing to keep for a session that can't be resumed, so skip the shared encoding */
+            resume.messagesSent++;
+            sess->getConnection()->sendNetworkMessage(msg);
+        } else {
+            std::shared_ptr<const EncodedMessage> encoded = EncodedMessage::encode(msg);
+            resume.countSent(encoded);
+            sess->getConnection()->sendEncodedMessage(*encoded);
+        }
+    } catch (ConnectionException &exp) {
+        /* A message the peer can't take (too big for its framing) is its loss, not the server's */
+        std::string reason = exp.what();
+        logConnection(LogLevel::WARN, LogEvent::SEND_FAILED, sess->getConnection(), &reason);
+    }
+}
+
+void ServerWorker::logSendBackpressure()
+{
+    uint64_t framesDropped = sendBudget->framesDropped;
+    uint64_t pauses = sendBudget->pauses;
+    uint64_t disconnects = sendBudget->disconnects;
+    if (framesDropped == loggedFramesDropped && pauses == loggedPauses &&
+            disconnects == loggedDisconnects) {
+        return;
+    }
+
+    LogRecord *rec = log->claim(LogLevel::WARN, LogEvent::SEND_BACKPRESSURE);
+    if (rec != nullptr) {
+        rec->args[0] = framesDropped;
+        rec->args[1] = pauses;
+        rec->args[2] = disconnects;
+        rec->args[3] = sendBudget->getUsed();
+        rec->args[4] = sendBudget->getLimit();
+        log->publish();
+    }
+    loggedFramesDropped = framesDropped;
+    loggedPauses = pauses;
+    loggedDisconnects = disconnects;
+}
+
+void ServerWorker::logConnection(LogLevel level, LogEvent event, Connection *conn,
+        const std::string *text)
+{
+    LogRecord *rec = log->claim(level, event);
+    if (rec != nullptr) {
+        rec->setPeer(conn);
+        if (text != nullptr) {
+            rec->setText(*text);
+        }
+        log->publish();
+    }
+}
+
+void ServerWorker::logRoom(LogEvent event, Connection *conn, Session *sess, uint32_t room)
+{
+    LogRecord *rec = log->claim(LogLevel::INFO, event);
+    if (rec != nullptr) {
+        rec->setPeer(conn);
+        rec->setText(*sess->getName());
+        rec->args[0] = room;
+        log->publish();
+    }
+}
+
+SessionRef ServerWorker::sessionRef(Session *sess)
+{
+    SessionRef ref;
+    ref.worker = id;
+    ref.handle = sess->getHandle();
+    return ref;
+}
+
+uint64_t ServerWorker::nameOwner(Session *sess)
+{
+    /*
+     * A slot holds at most one live session and names are released before it is emptied, or
+     * once answered if a reserve was still on its way (see onNameAnswered)
+     */
+    return sessionRef(sess).key();
+}
+
+void ServerWorker::onMsgRecv(Connection *conn, const pbuf::NetworkMessage &msg)
+{
+    TRACE_ZONE("ServerWorker::onMsgRecv");
+    try {
+        handleMessage(conn, msg);
+    } catch (ConnectionException &exp) {
+        /* Whatever the handler couldn't send, the rest of the server carries on */
+        std::string reason = exp.what();
+        logConnection(LogLevel::WARN, LogEvent::SEND_FAILED, conn, &reason);
+    }
+}
+
+void ServerWorker::handleMessage(Connection *conn, const pbuf::NetworkMessage &msg)
+{
+    Session *sess = sessions->findByConnection(conn);
+
+    /* Whatever follows a name request waits for its answer, so replies go out in order */
+    if (sess->isNameWaiting()) {
+        if (sess->getHeldBack().size() >= NAME_WAIT_MAX_MESSAGES) {
+            dropConnection(sess->getHandle());
+            return;
+        }
+        sess->getHeldBack().push_back(msg);
+        return;
+    }
+
+    /* Over its rate, a message is turned away before any handler (or shared registry) sees it */
+    if (!AdmissionControl::admitMessage(sess->getLimits(), msg.type_case(),
+            AdmissionControl::nowMs())) {
+        refuseMessage(conn, sess, msg);
+        return;
+    }
+    if (msg.type_case() == pbuf::NetworkMessage::kResumeRequest) {
+        onResumeRequest(conn, sess, msg.resumerequest());
+        return;
+    }
+    sess->getResumeState().messagesReceived++;
+
+    if (msg.type_case() == pbuf::NetworkMessage::kNameRequest) {
+        onNameRequest(sess, msg.namerequest());
+    } else if (msg.type_case() == pbuf::NetworkMessage::kRoomRequest) {
+        onRoomRequest(conn, msg.roomrequest());
+    }
+}
+
+void ServerWorker::onNameRequest(Session *sess, const std::string &name)
+{
+    auto startTime = std::chrono::steady_clock::now();
+
+    /* Rooms know their members by name, so a session's name can't change while in one */
+    if (sess->getRoom() != 0 && rooms->roomOf(sessionRef(sess)) == 0) {
+        sess->setRoom(0);
+    }
+    if (name.length() > NAME_MAX_LENGTH) {
+        /* Names are sent on to everyone in the same room, and in every page of rooms */
+        finishNameRequest(sess, name, false, startTime);
+        return;
+    }
+    if (sess->getRoom() != 0 && *sess->getName() != name) {
+        finishNameRequest(sess, name, false, startTime);
+        return;
+    }
+
+    /*
+     * The registry is shared by every worker, so this is the server-wide uniqueness check. When
+     * it has to ask elsewhere, the loop carries on with other sessions until the answer is posted
+     */
+    NameAnswer answer;
+    answer.handle = sess->getHandle();
+    answer.owner = nameOwner(sess);
+    answer.name = name;
+    answer.reserved = false;
+    answer.startTime = startTime;
+    NameResult result = names->reserveAsync(name, answer.owner, [this, answer](bool reserved) {
+        NameAnswer answered = answer;
+        answered.reserved = reserved;
+        postNameAnswer(std::move(answered));
+    });
+    if (result == NameResult::PENDING) {
+        sess->setNameWaiting(true);
+        return;
+    }
+    finishNameRequest(sess, name, result == NameResult::RESERVED, startTime);
+}
+
+void ServerWorker::finishNameRequest(Session *sess, const std::string &name, bool reserved,
+        std::chrono::steady_clock::time_point startTime)
+{
+    Connection *conn = sess->getConnection();
+    pbuf::NetworkMessage reply;
+    if (reserved) {
+        std::string *oldName = sess->getName();
+        if (oldName == nullptr) {
+            logConnection(LogLevel::INFO, LogEvent::NAME_ACCEPTED, conn, &name);
+            WorkerMetrics::add(metrics->namedSessions, 1);
+
+            /* From now on the session outlives its connection, for the grace period */
+            if (resumes->getGraceSecs() > 0) {
+                std::string token = ResumeRegistry::generateToken();
+                resumes->attach(token, sessionRef(sess));
+                reply.set_resumetoken(token);
+                sess->getResumeState().token = std::move(token);
+            }
+        } else {
+            logConnection(LogLevel::INFO, LogEvent::NAME_UPDATED, conn, &name);
+            if (*oldName != name) {
+                names->release(*oldName, nameOwner(sess));
+            }
+        }
+        sess->setName(name);
+    } else {
+        logConnection(LogLevel::INFO, LogEvent::NAME_REJECTED, conn, &name);
+    }
+    reply.set_namereply(reserved);
+    sendToSession(sess, reply);
+
+    auto elapsed = std::chrono::steady_clock::now() - startTime;
+    metrics->nameRequests.record(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+}
+
+void ServerWorker::onNameAnswered(const NameAnswer &answer)
+{
+    Session *sess = sessions->get(answer.handle);
+    if (sess == nullptr) {
+        /* Gone while waiting, unless the session in its slot since (the same owner) took it */
+        Session *occupant = sessions->getSlot(answer.handle.index);
+        if (answer.reserved && (occupant == nullptr || occupant->getName() == nullptr ||
+                *occupant->getName() != answer.name)) {
+            names->release(answer.name, answer.owner);
+        }
+        return;
+    }
+    sess->setNameWaiting(false);
+    finishNameRequest(sess, answer.name, answer.reserved, answer.startTime);
+
+    /* Until another name request has to wait, or the session is let go of by one of them */
+    while (sess != nullptr && !sess->isNameWaiting() && !sess->getHeldBack().empty()) {
+        pbuf::NetworkMessage msg = std::move(sess->getHeldBack().front());
+        sess->getHeldBack().pop_front();
+        onMsgRecv(sess->getConnection(), msg);
+        sess = sessions->get(answer.handle);
+    }
+}
+
+void ServerWorker::onRoomRequest(Connection *conn, const pbuf::RoomRequest &request)
+{
+    auto startTime = std::chrono::steady_clock::now();
+    Session *sess = sessions->findByConnection(conn);
+    pbuf::NetworkMessage reply;
+    pbuf::RoomReply *roomReply = reply.mutable_roomreply();
+    roomReply->set_op(request.op());
+    RoomChange change;
+    pbuf::RoomReply::Result result = pbuf::RoomReply::OK;
+
+    switch (request.op()) {
+    case pbuf::RoomRequest::CREATE:
+        if (sess->getName() == nullptr) {
+            result = pbuf::RoomReply::NOT_NAMED;
+            break;
+        }
+        result = rooms->create(sessionRef(sess), *sess->getName(), request.maxplayers(),
+                roomReply->mutable_room());
+        if (result == pbuf::RoomReply::OK) {
+            sess->setRoom(roomReply->room().id());
+            logRoom(LogEvent::ROOM_CREATED, conn, sess, sess->getRoom());
+        }
+        break;
+    case pbuf::RoomRequest::JOIN:
+        if (sess->getName() == nullptr) {
+            result = pbuf::RoomReply::NOT_NAMED;
+            break;
+        }
+        result = rooms->join(request.roomid(), request.host(), sessionRef(sess),
+                *sess->getName(), roomReply->mutable_room(), &change);
+        if (result == pbuf::RoomReply::OK) {
+            sess->setRoom(roomReply->room().id());
+            logRoom(LogEvent::ROOM_JOINED, conn, sess, sess->getRoom());
+        }
+        break;
+    case pbuf::RoomRequest::LEAVE:
+        result = rooms->leave(sessionRef(sess), &change);
+        if (result == pbuf::RoomReply::OK) {
+            logRoom(LogEvent::ROOM_LEFT, conn, sess, change.update.room().id());
+        }
+        sess->setRoom(0);
+        break;
+    case pbuf::RoomRequest::LIST:
+        rooms->list(request.liststart(), conn->getMaxSendSize(), roomReply);
+        break;
+    default:
+        /* An operation added after this server was built, which it can't answer */
+        return;
+    }
+
+    roomReply->set_result(result);
+    sendToSession(sess, reply);
+    sendRoomChange(change);
+
+    auto elapsed = std::chrono::steady_clock::now() - startTime;
+    metrics->roomRequests.record(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+}
+
+void ServerWorker::leaveRoom(Session *sess)
+{
+    if (sess->getRoom() == 0) {
+        return;
+    }
+    RoomChange change;
+    if (rooms->leave(sessionRef(sess), &change) == pbuf::RoomReply::OK) {
+        logRoom(LogEvent::ROOM_LEFT, sess->getConnection(), sess, change.update.room().id());
+        sendRoomChange(change);
+    }
+    sess->setRoom(0);
+}
+
+void ServerWorker::sendRoomChange(const RoomChange &change)
+{
+    if (change.recipients.empty()) {
+        return;
+    }
+
+    /* Encoded once for the whole room, whichever workers its members are on */
+    pbuf::NetworkMessage msg;
+    *msg.mutable_roomupdate() = change.update;
+    std::shared_ptr<const EncodedMessage> encoded = EncodedMessage::encode(msg);
+
+    /*
+     * Group the recipients by worker, so each other worker is posted to (and woken) once. Members
+     * whose connection was lost keep the update to be replayed when they resume
+     */
+    std::vector<std::vector<SessionHandle>> byWorker(peers.size());
+    for (const SessionRef &ref : change.recipients) {
+        if (ref.worker == ResumeRegistry::DETACHED_WORKER) {
+            resumes->retain(ref, encoded);
+        } else {
+            byWorker[ref.worker].push_back(ref.handle);
+        }
+    }
+
+    for (size_t worker = 0; worker < byWorker.size(); worker++) {
+        if (byWorker[worker].empty()) {
+            continue;
+        }
+        if ((int) worker == id) {
+            sendToSessions(byWorker[worker], encoded);
+        } else {
+            peers[worker]->post(byWorker[worker], encoded);
+        }
+    }
+}
+
+void ServerWorker::onResumeRequest(Connection *conn, Session *sess,
+        const pbuf::ResumeRequest &request)
+{
+    TRACE_ZONE("ServerWorker::onResumeRequest");
+    pbuf::NetworkMessage reply;
+    pbuf::ResumeReply *resumeReply = reply.mutable_resumereply();
+    resumeReply->set_result(pbuf::ResumeReply::UNKNOWN);
+
+    /* Only a new connection can carry on with a session, before it does anything else */
+    ResumeState &resume = sess->getResumeState();
+    if (sess->getName() != nullptr || resume.messagesReceived != 0 ||
+            resumes->getGraceSecs() <= 0) {
+        conn->sendNetworkMessage(reply);
+        return;
+    }
+
+    std::string token = ResumeRegistry::generateToken();
+    DetachedSession detached;
+    SessionRef detachedRef;
+    ResumeRegistry::Result result = resumes->resume(request.token(), token, request.received(),
+            sessionRef(sess), &detached, &detachedRef);
+    if (result == ResumeRegistry::Result::ATTACHED && (int) detachedRef.worker == id) {
+        /* The old connection, not yet noticed to be dead, is this worker's: let it go right now */
+        Session *old = sessions->get(detachedRef.handle);
+        if (old != nullptr) {
+            old->getConnection()->transportLost();
+        }
+        result = resumes->resume(request.token(), token, request.received(), sessionRef(sess),
+                &detached, &detachedRef);
+    }
+    if (result == ResumeRegistry::Result::ATTACHED) {
+        /* Another worker has to let go of it first, by which time the client will ask again */
+        peers[detachedRef.worker]->dropConnection(detachedRef.handle);
+        resumeReply->set_result(pbuf::ResumeReply::BUSY);
+        conn->sendNetworkMessage(reply);
+        return;
+    }
+    if (result != ResumeRegistry::Result::RESUMED) {
+        /* Replaying would leave a gap where messages are no longer kept, so start afresh */
+        if (result == ResumeRegistry::Result::MISSED) {
+            endDetachedSession(detachedRef, detached);
+        }
+        conn->sendNetworkMessage(reply);
+        return;
+    }
+
+    /* Take the name and place in the room over from the detached session, as they were */
+    names->transfer(detached.name, detachedRef.key(), nameOwner(sess));
+    sess->setName(detached.name);
+    WorkerMetrics::add(metrics->namedSessions, 1);
+    pbuf::NetworkMessage roomMsg;
+    uint32_t room = rooms->replaceMember(detachedRef, sessionRef(sess),
+            roomMsg.mutable_roomupdate());
+    sess->setRoom(room);
+
+    resume = std::move(detached.state);
+    resume.token = token;
+    resume.acknowledge(request.received());
+    resumeReply->set_result(pbuf::ResumeReply::RESUMED);
+    resumeReply->set_name(detached.name);
+    resumeReply->set_received(resume.messagesReceived);
+    resumeReply->set_token(token);
+    conn->sendNetworkMessage(reply);
+
+    /* What the client missed, in order, and then where its room stands now */
+    for (const std::shared_ptr<const EncodedMessage> &msg : resume.unacked) {
+        conn->sendEncodedMessage(*msg);
+    }
+    if (room != 0) {
+        sendToSession(sess, roomMsg);
+    } else if (detached.room != 0) {
+        /* Put out of the room while away, and the update saying so may have gone astray */
+        roomMsg.mutable_roomupdate()->mutable_room()->set_id(detached.room);
+        roomMsg.mutable_roomupdate()->set_closed(true);
+        sendToSession(sess, roomMsg);
+    }
+
+    WorkerMetrics::add(metrics->resumes, 1);
+    LogRecord *rec = log->claim(LogLevel::INFO, LogEvent::SESSION_RESUMED);
+    if (rec != nullptr) {
+        rec->setPeer(conn);
+        rec->setText(detached.name);
+        rec->args[0] = resume.unacked.size();
+        log->publish();
+    }
+}
+
+void ServerWorker::detachSession(Session *sess)
+{
+    DetachedSession detached;
+    detached.name = *sess->getName();
+    detached.room = sess->getRoom();
+    detached.state = std::move(sess->getResumeState());
+    detached.former = sessionRef(sess);
+
+    /*
+     * Registered before the name and room move over, so that room updates sent to either ref
+     * from now on are kept for replay
+     */
+    SessionRef ref = resumes->detach(std::move(detached));
+    names->transfer(*sess->getName(), nameOwner(sess), ref.key());
+    pbuf::RoomUpdate update;
+    rooms->replaceMember(sessionRef(sess), ref, &update);
+
+    WorkerMetrics::add(metrics->detaches, 1);
+    LogRecord *rec = log->claim(LogLevel::INFO, LogEvent::SESSION_DETACHED);
+    if (rec != nullptr) {
+        rec->setPeer(sess->getConnection());
+        rec->setText(*sess->getName());
+        rec->args[0] = (uint64_t) resumes->getGraceSecs();
+        log->publish();
+    }
+}
+
+void ServerWorker::endDetachedSession(const SessionRef &ref, DetachedSession &session)
+{
+    RoomChange change;
+    if (rooms->leave(ref, &change) == pbuf::RoomReply::OK) {
+        sendRoomChange(change);
+    }
+    names->release(session.name, ref.key());
+}
+
+void ServerWorker::expireDetachedSessions()
+{
+    std::vector<std::pair<SessionRef, DetachedSession>> expired;
+    resumes->expire(expired);
+    for (std::pair<SessionRef, DetachedSession> &entry : expired) {
+        endDetachedSession(entry.first, entry.second);
+        LogRecord *rec = log->claim(LogLevel::INFO, LogEvent::SESSION_EXPIRED);
+        if (rec != nullptr) {
+            rec->setText(entry.second.name);
+            log->publish();
+        }
+    }
+}
+
+void ServerWorker::onConnectionLost(Connection *conn)
+{
+    TRACE_ZONE("ServerWorker::onConnectionLost");
+    Session *sess = sessions->findByConnection(conn);
+    if (sess != nullptr) {
+        logConnection(LogLevel::INFO, LogEvent::CONNECTION_TERMINATED, conn);
+        if (!sess->getResumeState().token.empty()) {
+            detachSession(sess);
+        } else {
+            leaveRoom(sess);
+            if (sess->getName() != nullptr) {
+                names->release(*sess->getName(), nameOwner(sess));
+            }
+        }
+        if (sess->getName() != nullptr) {
+            WorkerMetrics::add(metrics->namedSessions, -1);
+        }
+        if (sess->isSuspended()) {
+            WorkerMetrics::add(metrics->suspendedSessions, -1);
+        }
+        WorkerMetrics::add(metrics->sessions, -1);
+        eventLoop->removeConnection(conn);
+        timers->cancel(conn);
+        sessions->destroySession(sess);
+    }
+}
+
+void ServerWorker::onConnectionSuspended(Connection *conn)
+{
+    TRACE_ZONE("ServerWorker::onConnectionSuspended");
+    logConnection(LogLevel::INFO, LogEvent::CONNECTION_SUSPENDED, conn);
+    Session *sess = sessions->findByConnection(conn);
+    if (sess != nullptr && !sess->isSuspended()) {
+        sess->setSuspended(true);
+        WorkerMetrics::add(metrics->suspendedSessions, 1);
+    }
+}
+
+void ServerWorker::onConnectionResumed(Connection *conn)
+{
+    TRACE_ZONE("ServerWorker::onConnectionResumed");
+    logConnection(LogLevel::INFO, LogEvent::CONNECTION_RESUMED, conn);
+    Session *sess = sessions->findByConnection(conn);
+    if (sess != nullptr && sess->isSuspended()) {
+        sess->setSuspended(false);
+        WorkerMetrics::add(metrics->suspendedSessions, -1);
+    }
+}
+
+SessionRef ServerWorker::adoptSession(const HandoffSession &session)
+{
+    Connection *conn = Connection::adopt(session.conn);
+    Session *sess = addConnection(conn);
+    if (session.named && names->reserve(session.name, nameOwner(sess))) {
+        sess->setName(session.name);
+        WorkerMetrics::add(metrics->namedSessions, 1);
+
+        /* Whatever was kept for replay stayed behind, so only a client missing nothing resumes */
+        ResumeState &resume = sess->getResumeState();
+        resume.messagesSent = session.messagesSent;
+        resume.messagesReceived = session.messagesReceived;
+        if (!session.resumeToken.empty() && resumes->getGraceSecs() > 0) {
+            resume.token = session.resumeToken;
+            resumes->attach(resume.token, sessionRef(sess));
+        }
+    }
+    sess->setRoom(session.room);
+    logConnection(LogLevel::INFO, LogEvent::CONNECTION_TAKEN_OVER, conn, sess->getName());
+    return sessionRef(sess);
+}
+
+int ServerWorker::handOff(double maxSecs, std::vector<HandoffSession> &out,
+        std::vector<SessionRef> &refs)
+{
+    /* Every worker has stopped, so nothing more is posted: queue the last room updates */
+    deliverInbox();
+    eventLoop->drain(maxSecs);
+
+    for (size_t i = 0; i < sessions->getSlotCount(); i++) {
+        Session *sess = sessions->getSlot(i);
+        if (sess == nullptr) {
+            continue;
+        }
+        Connection *conn = sess->getConnection();
+        eventLoop->removeConnection(conn);
+        timers->cancel(conn);
+
+        /* A session still sending when time ran out is closed instead, as its peer will notice */
+        HandoffSession session;
+        if (conn->detach(session.conn)) {
+            session.named = sess->getName() != nullptr;
+            if (session.named) {
+                session.name = *sess->getName();
+            }
+            session.room = sess->getRoom();
+            session.resumeToken = sess->getResumeState().token;
+            session.messagesSent = sess->getResumeState().messagesSent;
+            session.messagesReceived = sess->getResumeState().messagesReceived;
+            out.push_back(std::move(session));
+            refs.push_back(sessionRef(sess));
+        }
+        if (sess->getName() != nullptr) {
+            names->release(*sess->getName(), nameOwner(sess));
+            WorkerMetrics::add(metrics->namedSessions, -1);
+        }
+        if (sess->isSuspended()) {
+            WorkerMetrics::add(metrics->suspendedSessions, -1);
+        }
+        WorkerMetrics::add(metrics->sessions, -1);
+        sessions->destroySession(sess);
+    }
+
+    return fcntl(listener->getSocketFd(), F_DUPFD_CLOEXEC, 0);
+}
+
+void ServerWorker::refuseMessage(Connection *conn, Session *sess,
+        const pbuf::NetworkMessage &msg)
+{
+    WorkerMetrics::add(metrics->refusedMessages, 1);
+    uint32_t strikes = sess->getLimits().strikes;
+    LogRecord *rec = log->claim(LogLevel::WARN, LogEvent::MESSAGE_REFUSED);
+    if (rec != nullptr) {
+        rec->setPeer(conn);
+        const google::protobuf::FieldDescriptor *field =
+                msg.GetDescriptor()->FindFieldByNumber(msg.type_case());
+        rec->setText((field != nullptr) ? field->name() : std::string("empty message"));
+        rec->args[0] = strikes;
+        log->publish();
+    }
+    if (strikes >= MESSAGE_LIMIT_STRIKES) {
+        /* Can't lose the connection from inside its own callback, so let the inbox do it */
+        if (strikes == MESSAGE_LIMIT_STRIKES) {
+            dropConnection(sess->getHandle());
+        }
+        return;
+    }
+
+    /* Refused messages still count towards resuming, as the client counts them sent */
+    pbuf::NetworkMessage reply;
+    switch (msg.type_case()) {
+    case pbuf::NetworkMessage::kResumeRequest:
+        reply.mutable_resumereply()->set_result(pbuf::ResumeReply::BUSY);
+        conn->sendNetworkMessage(reply);
+        break;
+    case pbuf::NetworkMessage::kNameRequest:
+        sess->getResumeState().messagesReceived++;
+        reply.set_namereply(false);
+        sendToSession(sess, reply);
+        break;
+    case pbuf::NetworkMessage::kRoomRequest:
+        sess->getResumeState().messagesReceived++;
+        reply.mutable_roomreply()->set_op(msg.roomrequest().op());
+        reply.mutable_roomreply()->set_result(pbuf::RoomReply::RATE_LIMITED);
+        sendToSession(sess, reply);
+        break;
+    default:
+        sess->getResumeState().messagesReceived++;
+        break;
+    }
+}
+
+bool ServerWorker::admitConnect(const struct sockaddr_in &peer)
+{
+    if (admission->admitConnect(peer.sin_addr.s_addr, AdmissionControl::nowMs())) {
+        return true;
+    }
+
+    WorkerMetrics::add(metrics->refusedConnects, 1);
+    LogRecord *rec = log->claim(LogLevel::WARN, LogEvent::CONNECTION_REFUSED);
+    if (rec != nullptr) {
+        rec->peerAddr = peer.sin_addr.s_addr;
+        rec->peerPort = ntohs(peer.sin_port);
+        log->publish();
+    }
+    return false;
+}
+
+void ServerWorker::onConnAccept(Connection *conn)
+{
+    TRACE_ZONE("ServerWorker::onConnAccept");
+    addConnection(conn);
+    WorkerMetrics::add(metrics->accepts, 1);
+    logConnection(LogLevel::INFO, LogEvent::CONNECTION_RECEIVED, conn);
+}
+
+Session * ServerWorker::addConnection(Connection *conn)
+{
+    conn->setOnMsgReceivedCallback(std::bind(&ServerWorker::onMsgRecv, this, _1, _2));
+    conn->setOnConnectionLostCallback(std::bind(&ServerWorker::onConnectionLost, this, _1));
+    conn->setOnConnectionSuspendedCallback(std::bind(&ServerWorker::onConnectionSuspended, this, _1));
+    conn->setOnConnectionResumedCallback(std::bind(&ServerWorker::onConnectionResumed, this, _1));
+    conn->setSendBudget(sendBudget);
+    conn->setTrafficCounters(&metrics->traffic);
+    conn->setSendLimits(SEND_LOW_WATERMARK, SEND_HIGH_WATERMARK, SendPolicy::DROP_OLDEST);
+    conn->setKeepAliveTime(options.keepAliveSecs);
+    if (options.tcpKeepAlive) {
+        try {
+            conn->enableTcpKeepAlive();
+        } catch (ConnectionException &exp) {
+            /* Pinging the peer works just as well, only less cheaply */
+            std::string reason = exp.what();
+            logConnection(LogLevel::WARN, LogEvent::PING_KEEPALIVE_FALLBACK, conn, &reason);
+        }
+    }
+    Session *sess = sessions->generateSession();
+    sess->setConnection(conn);
+    eventLoop->addConnection(conn);
+    conn->setTimers(timers);
+    WorkerMetrics::add(metrics->sessions, 1);
+    return sess;
+}
@@ -0,0 +1,301 @@
+#ifndef FD__SERVERWORKER_H
+#define FD__SERVERWORKER_H
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "AdmissionControl.h"
+#include "Connection.h"
+#include "EventLoop.h"
+#include "Handoff.h"
+#include "Log.h"
+#include "Metrics.h"
+#include "NameRegistry.h"
+#include "ResumeRegistry.h"
+#include "RoomRegistry.h"
+#include "SessionList.h"
+#include "TimerWheel.h"
+
+/*
+ * Most messages held back from a session while its name request is answered. A client sending
+ * more than that meanwhile has its connection let go of, as only a misbehaving one would
+ */
+#define NAME_WAIT_MAX_MESSAGES 64
+
+/* Settings shared by every worker, taken from the command line */
+struct ServerWorkerOptions {
+
+    /* Do socket I/O through io_uring when the kernel supports it */
+    bool preferIoUring;
+
+    /* Longest a dead peer may go unnoticed before its connection is SUSPENDED, in seconds */
+    double keepAliveSecs;
+
+    /* Leave probing idle peers to the kernel's TCP keep-alive instead of sending pings */
+    bool tcpKeepAlive;
+
+    /* Connections the kernel may complete ahead of them being accepted */
+    int acceptBacklog;
+
+    /* Hold back connections until they send their first data, for up to this many seconds */
+    int deferAcceptSecs;
+};
+
+/*
+ * Class representing one shard of the server. Each worker owns its own listener socket on the
+ * shared server port (the kernel spreads incoming connections across all SO_REUSEPORT listeners),
+ * its own event loop and timer wheel, and the SessionList for every connection it accepted.
+ * Nothing in a worker is touched by other threads except the NameRegistry, RoomRegistry and
+ * ResumeRegistry, which are shared by all workers so that names stay unique, rooms can be joined
+ * and sessions resumed server-wide, and the inbox through which other workers pass on room updates
+ * for this worker's sessions (or ask it to let go of a session's old connection) and the
+ * NameRegistry passes on the answers to name requests it couldn't answer straight away.
+ *
+ * A named session whose connection is lost is detached into the ResumeRegistry rather than ended,
+ * keeping its name and room, until its client resumes it (on any worker) with the token it was
+ * given or the grace period runs out.
+ */
+class ServerWorker {
+ public:
+
+    /*
+     * Constructor - start listening on the given port, or carry on with the given listening
+     * socket (handed over by the previous server) unless it is -1. The id tells workers apart in
+     * the log and in the rooms, so must be the worker's position in the list given to setPeers.
+     * Every connection's queued sends are charged to the given budget, which is shared by all
+     * workers, as are the rate limits on connects from each address. Events are logged to a ring
+     * of the given logger, and measured in metrics of the given registry. Throws
+     * ListenerException or EventLoopException if the sockets can't be set up
+     */
+    ServerWorker(int id, uint16_t port, int listenerFd, NameRegistry *names,
+            RoomRegistry *rooms, ResumeRegistry *resumes, AdmissionControl *admission,
+            SendBudget *sendBudget, Logger *logger, Metrics *metrics,
+            const ServerWorkerOptions &options);
+
+    /* Destructor - closes the listener and every session owned by this worker */
+    ~ServerWorker();
+
+    /* Returns true if this worker ended up using the io_uring backend */
+    bool isUsingIoUring();
+
+    /* Run the event loop for this worker until stop() is called. Blocks the calling thread */
+    void run();
+
+    /* Ask the worker to return from run(). Safe to call from any thread */
+    void stop();
+
+    /*
+     * Tell the worker about every worker of the server (itself included) by id, so it can pass on
+     * room updates to the sessions of the others. Call before run()
+     */
+    void setPeers(const std::vector<ServerWorker*> &peers);
+
+    /*
+     * Send an encoded message to the given sessions of this worker from its own thread, which is
+     * woken up to do so. Safe to call from any thread; sessions gone by then are skipped
+     */
+    void post(const std::vector<SessionHandle> &recipients,
+            const std::shared_ptr<const EncodedMessage> &msg);
+
+    /*
+     * Let go of the connection of the given session of this worker from its own thread, as if it
+     * had been lost, so the session is detached to be resumed elsewhere. Safe to call from any
+     * thread; a session gone by then is skipped
+     */
+    void dropConnection(SessionHandle handle);
+
+    /*
+     * Carry on with a session handed over by the previous server, re-registering its name and
+     * resume token. Returns what the session is known as in the rooms, to restore them with. Call
+     * before run()
+     */
+    SessionRef adoptSession(const HandoffSession &session);
+
+    /*
+     * Hand over every session to the server taking over, once run() has returned: stop
+     * accepting and receiving, wait up to maxSecs for sends in flight to finish, then detach the
+     * sessions into the given list, along with what each was known as in the rooms. Sessions
+     * that can't be detached in time are closed. Returns a duplicate of the listening socket,
+     * also for handing over
+     */
+    int handOff(double maxSecs, std::vector<HandoffSession> &out, std::vector<SessionRef> &refs);
+
+ private:
+
+    /* Identifies this worker in log output */
+    int id;
+
+    /* The registry of names shared by all workers (not owned by this worker) */
+    NameRegistry *names;
+
+    /* The registry of game rooms shared by all workers (not owned by this worker) */
+    RoomRegistry *rooms;
+
+    /* The registry of resume tokens and detached sessions shared by all workers (not owned) */
+    ResumeRegistry *resumes;
+
+    /* The rate limits on connects from each address, shared by all workers (not owned) */
+    AdmissionControl *admission;
+
+    /* Every worker of the server by id, this one included (not owned by this worker) */
+    std::vector<ServerWorker*> peers;
+
+    /* A message posted by another worker, to send to some sessions of this one */
+    struct Delivery {
+        std::vector<SessionHandle> recipients;
+        std::shared_ptr<const EncodedMessage> msg;
+    };
+
+    /* The NameRegistry's answer to a name request of one of this worker's sessions */
+    struct NameAnswer {
+        SessionHandle handle;
+        uint64_t owner;
+        std::string name;
+        bool reserved;
+        std::chrono::steady_clock::time_point startTime;
+    };
+
+    /*
+     * Deliveries posted and not yet sent, and those being sent (kept to reuse its memory), and
+     * likewise the sessions whose connections other workers asked to be let go of and the
+     * answers to name requests
+     */
+    std::mutex inboxMutex;
+    std::vector<Delivery> inbox;
+    std::vector<Delivery> delivering;
+    std::vector<SessionHandle> inboxDrops;
+    std::vector<SessionHandle> dropping;
+    std::vector<NameAnswer> inboxNames;
+    std::vector<NameAnswer> answering;
+
+    /* The memory budget for send queues shared by all workers (not owned by this worker) */
+    SendBudget *sendBudget;
+
+    /* The settings applied to every accepted connection */
+    ServerWorkerOptions options;
+
+    /* This worker's ring of the shared logger (owned by the logger) */
+    LogRing *log;
+
+    /* This worker's metrics in the shared registry (owned by the registry) */
+    WorkerMetrics *metrics;
+
+    /* The send budget counters as of the last time they were logged (worker 0 only) */
+    uint64_t loggedFramesDropped;
+    uint64_t loggedPauses;
+    uint64_t loggedDisconnects;
+
+    /* The listener socket accepting connections for this worker */
+    Listener *listener;
+
+    /* The reactor waiting on the listener and every connection of this worker */
+    EventLoop *eventLoop;
+
+    /* The shard of sessions whose connections were accepted by this worker */
+    SessionList *sessions;
+
+    /* Runs the keep-alive deadlines of every connection of this worker */
+    TimerWheel *timers;
+
+    /* Cleared by stop() to make run() return */
+    std::atomic<bool> running;
+
+    /* Log the send budget counters if any have changed since last time */
+    void logSendBackpressure();
+
+    /* Log an event about the given connection, with optional text such as a name */
+    void logConnection(LogLevel level, LogEvent event, Connection *conn,
+            const std::string *text = nullptr);
+
+    /* Returns what the given session is known as in the shared RoomRegistry */
+    SessionRef sessionRef(Session *sess);
+
+    /* Returns the id the given session holds names under in the shared NameRegistry */
+    uint64_t nameOwner(Session *sess);
+
+    /* Handle a message received from the given connection, replying to it */
+    void handleMessage(Connection *conn, const pbuf::NetworkMessage &msg);
+
+    /*
+     * Handle a name request from the given session, replying to it straight away if the
+     * NameRegistry can, otherwise once it has answered (see onNameAnswered)
+     */
+    void onNameRequest(Session *sess, const std::string &name);
+
+    /* Take on the name asked for if it was reserved, and reply to the session's name request */
+    void finishNameRequest(Session *sess, const std::string &name, bool reserved,
+            std::chrono::steady_clock::time_point startTime);
+
+    /* Pass the NameRegistry's answer on to the worker's own thread. Safe from any thread */
+    void postNameAnswer(NameAnswer answer);
+
+    /*
+     * Reply to the name request answered, then handle the messages held back from its session
+     * meanwhile. The name is released again if the session is gone
+     */
+    void onNameAnswered(const NameAnswer &answer);
+
+    /* Handle a room request from the given connection and reply to it */
+    void onRoomRequest(Connection *conn, const pbuf::RoomRequest &request);
+
+    /* Take the session out of its room, if it is still in one, and tell the rest of the room */
+    void leaveRoom(Session *sess);
+
+    /* Send the update of a room change to its recipients, on whichever worker each one is */
+    void sendRoomChange(const RoomChange &change);
+
+    /*
+     * Send the given message to those of the given sessions of this worker still connected, and
+     * keep it for replay for any that have been detached since it was sent
+     */
+    void sendToSessions(const std::vector<SessionHandle> &recipients,
+            const std::shared_ptr<const EncodedMessage> &msg);
+
+    /* Send a session message to the given session, counting it and keeping it for replay */
+    void sendToSession(Session *sess, pbuf::NetworkMessage &msg);
+
+    /*
+     * Send everything posted to the inbox by other workers, drop the connections asked to and
+     * reply to the name requests answered
+     */
+    void deliverInbox();
+
+    /* Resume the session with the token asked for as the given (new) session, and reply */
+    void onResumeRequest(Connection *conn, Session *sess, const pbuf::ResumeRequest &request);
+
+    /* Keep a named session whose connection was lost in the ResumeRegistry */
+    void detachSession(Session *sess);
+
+    /* End a detached session that can't be resumed, freeing its name and place in its room */
+    void endDetachedSession(const SessionRef &ref, DetachedSession &session);
+
+    /* End the detached sessions that have run out their grace period (worker 0 only) */
+    void expireDetachedSessions();
+
+    /* Log an event about a room and the named session that acted on it */
+    void logRoom(LogEvent event, Connection *conn, Session *sess, uint32_t room);
+
+    /*
+     * Refuse a message that went over its session's rate, answering it the way its handler
+     * refuses anything, and drop the connection of a session that just keeps on going
+     */
+    void refuseMessage(Connection *conn, Session *sess, const pbuf::NetworkMessage &msg);
+
+    /* Set up a new connection of this worker with a session of its own, which is returned */
+    Session * addConnection(Connection *conn);
+
+    /* Callback functions registered with the listener and every accepted connection */
+    bool admitConnect(const struct sockaddr_in &peer);
+    void onConnAccept(Connection *conn);
+    void onMsgRecv(Connection *conn, const pbuf::NetworkMessage &msg);
+    void onConnectionLost(Connection *conn);
+    void onConnectionSuspended(Connection *conn);
+    void onConnectionResumed(Connection *conn);
+
+};
+
+#endif
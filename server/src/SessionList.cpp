@@ -1,9 +1,44 @@
 #include "SessionList.h"
 
+#include <cassert>
+#include <functional>
+
+/* Number of entries a SessionIndex starts out with. Must be a power of two */
+static const size_t INDEX_INITIAL_SIZE = 16;
+
+/* Number of session slots a SessionList starts out with */
+static const uint32_t LIST_INITIAL_SLOTS = 16;
+
+void ResumeState::countSent(const std::shared_ptr<const EncodedMessage> &msg)
+{
+    messagesSent++;
+    if (!token.empty()) {
+        if (unacked.size() == RESUME_RETAIN_MESSAGES) {
+            unacked.pop_front();
+        }
+        unacked.push_back(msg);
+    }
+}
+
+void ResumeState::acknowledge(uint64_t received)
+{
+    /* The first message kept is number messagesSent - unacked.size() + 1 */
+    while (!unacked.empty() && messagesSent - unacked.size() < received) {
+        unacked.pop_front();
+    }
+}
+
 Session::Session()
 {
+    list = nullptr;
+    index = 0;
+    generation = 1;
+    alive = false;
     conn = nullptr;
-    name = nullptr;
+    named = false;
+    suspended = false;
+    room = 0;
+    nameWaiting = false;
 }
 
 Session::~Session()
@@ -11,14 +46,34 @@ Session::~Session()
     if (conn != nullptr) {
         delete conn;
     }
-    if (name != nullptr) {
-        delete name;
+}
+
+void Session::reset()
+{
+    if (conn != nullptr) {
+        delete conn;
+        conn = nullptr;
+    }
+    name.clear();
+    named = false;
+    suspended = false;
+    room = 0;
+    resume = ResumeState();
+    limits = SessionLimits();
+    nameWaiting = false;
+    heldBack.clear();
+    alive = false;
+
+    /* Invalidate every outstanding handle to this slot. Generation 0 is reserved as invalid */
+    generation++;
+    if (generation == 0) {
+        generation = 1;
     }
 }
 
 std::string * Session::getName()
 {
-    return name;
+    return named ? &name : nullptr;
 }
 
 Connection * Session::getConnection()
@@ -26,94 +81,267 @@ Connection * Session::getConnection()
     return conn;
 }
 
-void Session::setName(std::string name)
+void Session::setName(const std::string &name)
 {
-    this->name = new std::string(name);
+    if (named) {
+        list->nameIndex.erase(SessionList::hashName(this->name), index);
+    }
+    this->name = name;
+    named = true;
+    list->nameIndex.insert(SessionList::hashName(this->name), index);
 }
 
 void Session::setConnection(Connection *conn)
 {
+    if (this->conn != nullptr) {
+        list->connIndex.erase(SessionList::hashConnection(this->conn), index);
+    }
     this->conn = conn;
+    if (conn != nullptr) {
+        list->connIndex.insert(SessionList::hashConnection(conn), index, conn);
+    }
 }
 
-Session * Session::getNext()
+SessionHandle Session::getHandle()
 {
-    return next;
+    SessionHandle handle;
+    handle.index = index;
+    handle.generation = generation;
+    return handle;
 }
 
-SessionList::SessionList()
+bool Session::isSuspended()
 {
-    listHead = nullptr;
+    return suspended;
 }
 
-SessionList::~SessionList()
+void Session::setSuspended(bool suspended)
+{
+    this->suspended = suspended;
+}
+
+uint32_t Session::getRoom()
+{
+    return room;
+}
+
+void Session::setRoom(uint32_t room)
+{
+    this->room = room;
+}
+
+ResumeState & Session::getResumeState()
+{
+    return resume;
+}
+
+SessionLimits & Session::getLimits()
+{
+    return limits;
+}
+
+bool Session::isNameWaiting()
+{
+    return nameWaiting;
+}
+
+void Session::setNameWaiting(bool waiting)
+{
+    nameWaiting = waiting;
+}
+
+std::deque<pbuf::NetworkMessage> & Session::getHeldBack()
+{
+    return heldBack;
+}
+
+SessionIndex::SessionIndex()
+{
+    entries = allocate(INDEX_INITIAL_SIZE);
+    mask = INDEX_INITIAL_SIZE - 1;
+    count = 0;
+}
+
+SessionIndex::~SessionIndex()
+{
+    delete[] entries;
+}
+
+void SessionIndex::insert(size_t hash, uint32_t slot, const void *key)
 {
-    /* Free any remaining sessions in the list */
-    Session *temp;
-    while(listHead != nullptr) {
-        temp = listHead->next;
-        delete listHead;
-        listHead = temp;
+    /* Keep the load factor at or below 1/2 so probe sequences stay short */
+    if ((count + 1) * 2 > mask + 1) {
+        grow();
+    }
+
+    size_t idx = hash & mask;
+    while (entries[idx].slot != NO_SLOT) {
+        idx = (idx + 1) & mask;
     }
+    entries[idx].hash = (uint32_t) hash;
+    entries[idx].key = key;
+    entries[idx].slot = slot;
+    count++;
 }
 
-Session * SessionList::generateSession()
+void SessionIndex::erase(size_t hash, uint32_t slot)
 {
-    Session *sess = new Session();
+    size_t idx = hash & mask;
+    while (entries[idx].slot != slot) {
+        assert(entries[idx].slot != NO_SLOT);
+        idx = (idx + 1) & mask;
+    }
 
-    sess->next = listHead;
-    sess->prev = nullptr;
+    /* Shift later entries of the probe run back so no lookup ever stops short at the hole */
+    size_t hole = idx;
+    idx = (idx + 1) & mask;
+    while (entries[idx].slot != NO_SLOT) {
+        size_t home = entries[idx].hash & mask;
+        if (((idx - home) & mask) >= ((idx - hole) & mask)) {
+            entries[hole] = entries[idx];
+            hole = idx;
+        }
+        idx = (idx + 1) & mask;
+    }
+    entries[hole].slot = NO_SLOT;
+    count--;
+}
 
-    if (listHead != nullptr) {
-        listHead->prev = sess;
+SessionIndex::Entry * SessionIndex::allocate(size_t size)
+{
+    Entry *table = new Entry[size];
+    for (size_t i = 0; i < size; i++) {
+        table[i].slot = NO_SLOT;
     }
+    return table;
+}
 
-    listHead = sess;
+void SessionIndex::grow()
+{
+    Entry *oldEntries = entries;
+    size_t oldSize = mask + 1;
+
+    entries = allocate(oldSize * 2);
+    mask = oldSize * 2 - 1;
 
+    for (size_t i = 0; i < oldSize; i++) {
+        if (oldEntries[i].slot != NO_SLOT) {
+            size_t idx = oldEntries[i].hash & mask;
+            while (entries[idx].slot != NO_SLOT) {
+                idx = (idx + 1) & mask;
+            }
+            entries[idx] = oldEntries[i];
+        }
+    }
+
+    delete[] oldEntries;
+}
+
+SessionList::SessionList()
+{
+    slots = new Session[LIST_INITIAL_SLOTS];
+    numSlots = 0;
+    capacity = LIST_INITIAL_SLOTS;
+}
+
+SessionList::~SessionList()
+{
+    /* Destroying the slots frees any remaining connections */
+    delete[] slots;
+}
+
+Session * SessionList::generateSession()
+{
+    uint32_t index;
+    if (!freeSlots.empty()) {
+        index = freeSlots.back();
+        freeSlots.pop_back();
+    } else {
+        if (numSlots == capacity) {
+            /* Move every session into a larger array. Connections move with them, not freed */
+            Session *oldSlots = slots;
+            slots = new Session[capacity * 2];
+            for (uint32_t i = 0; i < numSlots; i++) {
+                slots[i] = std::move(oldSlots[i]);
+                oldSlots[i].conn = nullptr;
+            }
+            capacity *= 2;
+            delete[] oldSlots;
+        }
+        index = numSlots++;
+    }
+
+    Session *sess = &slots[index];
+    sess->list = this;
+    sess->index = index;
+    sess->alive = true;
     return sess;
 }
 
 void SessionList::destroySession(Session *sess)
 {
-    if (sess->next != nullptr) {
-        sess->next->prev = sess->prev;
+    assert(sess->alive);
+
+    if (sess->named) {
+        nameIndex.erase(hashName(sess->name), sess->index);
+    }
+    if (sess->conn != nullptr) {
+        connIndex.erase(hashConnection(sess->conn), sess->index);
     }
 
-    if (sess->prev != nullptr) {
-        sess->prev->next = sess->next;
-    } else {
-        assert(listHead == sess);
-        listHead = sess->next;
+    /* The slot stays in place as a tombstone, so a sweep over the slots can carry on past it */
+    sess->reset();
+    freeSlots.push_back(sess->index);
+}
+
+Session * SessionList::get(SessionHandle handle)
+{
+    if (handle.index >= numSlots) {
+        return nullptr;
     }
 
-    delete sess;
+    Session *sess = &slots[handle.index];
+    if (!sess->alive || sess->generation != handle.generation) {
+        return nullptr;
+    }
+    return sess;
 }
 
 Session * SessionList::findByConnection(Connection * conn)
 {
-    Session *temp = listHead;
-    while(temp != nullptr) {
-        if (temp->conn == conn) {
-            return temp;
-        }
-        temp = temp->next;
-    }
-    return nullptr;
+    uint32_t slot = connIndex.findKey(hashConnection(conn), conn);
+    return (slot == SessionIndex::NO_SLOT) ? nullptr : &slots[slot];
 }
 
-Session * SessionList::findByName(std::string name)
+Session * SessionList::findByName(const std::string &name)
 {
-    Session *temp = listHead;
-    while (temp != nullptr) {
-        if (temp->name != nullptr && *(temp->name) == name) {
-            return temp;
-        }
-        temp = temp->next;
-    }
-    return nullptr;
+    uint32_t slot = nameIndex.find(hashName(name), [this, &name](uint32_t slot) {
+        return slots[slot].name == name;
+    });
+    return (slot == SessionIndex::NO_SLOT) ? nullptr : &slots[slot];
+}
+
+size_t SessionList::getSlotCount()
+{
+    return numSlots;
+}
+
+Session * SessionList::getSlot(size_t index)
+{
+    return slots[index].alive ? &slots[index] : nullptr;
+}
+
+size_t SessionList::hashName(const std::string &name)
+{
+    return std::hash<std::string>()(name);
 }
 
-Session * SessionList::getFirst()
+size_t SessionList::hashConnection(Connection *conn)
 {
-    return listHead;
+    /* Pointer hashes are the identity, so mix the bits (murmur3 finalizer) before masking */
+    uint64_t x = (uint64_t) (uintptr_t) conn;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return (size_t) x;
 }
@@ -2,94 +2,302 @@
 #define FD__SESSIONLIST_H
 
 #include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
 
+#include "AdmissionControl.h"
 #include "Connection.h"
 
 /* Forward declaration for Session member pointer */
 class SessionList;
 
+/*
+ * A reference to a Session that stays safe to hold after the Session is destroyed. It names the
+ * slot the Session lives in plus the generation of that slot, which changes every time the slot's
+ * Session is destroyed, so a stale handle simply fails to resolve. Generation 0 is never used by
+ * a live Session, making a default-constructed handle invalid.
+ */
+struct SessionHandle {
+    uint32_t index = 0;
+    uint32_t generation = 0;
+
+    bool operator==(const SessionHandle &other) const {
+        return index == other.index && generation == other.generation;
+    }
+};
+
+/* Most of the last messages sent to a session that are kept for replaying after a resume */
+#define RESUME_RETAIN_MESSAGES 64
+
+/*
+ * What it takes to carry on with a session on a new connection: the token its client resumes
+ * with, and how many session messages (anything but probes and resumes) have gone each way, with
+ * the last of those sent kept to replay whatever the client missed. Nothing is kept until the
+ * session has a token.
+ */
+struct ResumeState {
+    std::string token;
+    uint64_t messagesSent = 0;
+    uint64_t messagesReceived = 0;
+
+    /* The last messages sent, oldest first, ending with message number messagesSent */
+    std::deque<std::shared_ptr<const EncodedMessage>> unacked;
+
+    /* Count a message sent, keeping it for replay if the session has a token */
+    void countSent(const std::shared_ptr<const EncodedMessage> &msg);
+
+    /* Forget the messages the client has received, given how many that is */
+    void acknowledge(uint64_t received);
+};
+
 /*
  * Represents a session in the session list, including the connection, the name registered,
- * and any other session-specific data
+ * and any other session-specific data. Sessions live inline in the SessionList's slot array, so
+ * a Session pointer is only valid until the next call to SessionList::generateSession.
+ * Anything that needs to refer to a Session for longer should keep its SessionHandle.
  */
 class Session {
  public:
-    
+
     /* Retrieve the name registered to the given session. Returns nullptr if no name registered */
     std::string * getName();
 
     /* Retrieve the connection associated with this session */
     Connection * getConnection();
 
-    /* Sets the name registered to this session */
-    void setName(std::string name);
+    /* Sets the name registered to this session, keeping the list's name index up to date */
+    void setName(const std::string &name);
 
-    /* Sets the connection associated with this session */
+    /* Sets the connection associated with this session, keeping the list's connection index up to date */
     void setConnection(Connection *conn);
 
-    /* Returns the next Session in the SessionList. nullptr if last Session */
-    Session * getNext();
+    /* Returns the handle that refers to this Session */
+    SessionHandle getHandle();
+
+    /* Whether the connection was last reported SUSPENDED (and not RESUMED since) */
+    bool isSuspended();
+    void setSuspended(bool suspended);
+
+    /*
+     * The id of the room this session last created or joined, or 0 if none. Only a hint: the
+     * RoomRegistry has the final say, since the room may have been closed by its host since
+     */
+    uint32_t getRoom();
+    void setRoom(uint32_t room);
+
+    /* What the session's client needs to carry on with it after a reconnect */
+    ResumeState & getResumeState();
+
+    /* How much more the session's client may send, kind by kind, before it is refused */
+    SessionLimits & getLimits();
+
+    /*
+     * Set while a name request waits on the NameRegistry. The messages received meanwhile are
+     * held back, oldest first, to be handled in order once it is answered
+     */
+    bool isNameWaiting();
+    void setNameWaiting(bool waiting);
+    std::deque<pbuf::NetworkMessage> & getHeldBack();
 
  private:
-    
-    /* Private constructor only for use by SessionList class */
+
+    /* Private constructor only for use by SessionList class. Creates an empty (dead) slot */
     Session();
 
-    /* 
-     * Private destructor only used by SessionList class. Teardown connection and free name and other
-     * allocated memory
-     */
+    /* Private destructor only used by SessionList class. Tears down the connection if any */
     ~Session();
 
+    /*
+     * Move assignment for the SessionList growing its array. The destructor would otherwise
+     * suppress it in favour of copying every name, held back message and replay buffer
+     */
+    Session & operator=(Session &&) = default;
+
+    /* Free the connection and name and mark the slot dead, invalidating handles to it */
+    void reset();
+
+    /* The list this session belongs to, whose indexes must follow changes to name and conn */
+    SessionList *list;
+
+    /* Position of this session in the list's slot array, and the slot's current generation */
+    uint32_t index;
+    uint32_t generation;
+
+    /* True while the slot holds a session, false for an empty slot (tombstone) */
+    bool alive;
+
     /* The connection currently registered for this Session */
     Connection *conn;
 
-    /* The string representing the currently-registered name. nullptr if no name yet */
-    std::string *name;
+    /* The currently-registered name, only meaningful when named is true */
+    std::string name;
+    bool named;
+
+    /* Set between the connection being reported SUSPENDED and RESUMED */
+    bool suspended;
+
+    /* The room last created or joined, or 0 */
+    uint32_t room;
 
-    /* Pointers for doubly-linked list of sessions */
-    Session *next;
-    Session *prev;
+    /* The resume token and the session messages sent and received */
+    ResumeState resume;
 
-    /* Friend class declaration so SessionList can handle these as doubly-linked list entries */
+    /* The session's rate limit buckets */
+    SessionLimits limits;
+
+    /* Set while a name request is answered, and what was received since */
+    bool nameWaiting;
+    std::deque<pbuf::NetworkMessage> heldBack;
+
+    /* Friend class declaration so SessionList can manage these as slots */
     friend class SessionList;
 };
 
-/* 
- * This class represents a doubly-linked list of Sessions that are currently
- * being managed by the server. When a connection is first opened it is attached to a session
- * and placed into this list, even before obtaining a name to identify the session. The session
- * lives on in this list until it is completely lost or closed
+/*
+ * Open-addressing (linear probing) hash index from some key of a Session to the slot index of
+ * that Session. Entries store the key's hash alongside the slot so probing and resizing never
+ * touch the Sessions themselves except to confirm a match. A key that is itself an identity (a
+ * pointer) can be stored in the entry too, so even the match is confirmed without touching the
+ * Session. Removal uses backward-shift deletion, so there are no tombstones and lookups stay
+ * short no matter how much churn there is.
+ */
+class SessionIndex {
+ public:
+
+    /* Constructor - start with a small empty table */
+    SessionIndex();
+
+    /* Destructor - free the table. The indexed Sessions are not touched */
+    ~SessionIndex();
+
+    /* Add the session slot under the given key hash, and the key's identity if it has one */
+    void insert(size_t hash, uint32_t slot, const void *key = nullptr);
+
+    /* Remove the given session slot, which must have been inserted under the given key hash */
+    void erase(size_t hash, uint32_t slot);
+
+    /* Returns the first slot with the given key hash for which matches(slot) is true, or NO_SLOT */
+    template<typename Matcher>
+    uint32_t find(size_t hash, Matcher matches)
+    {
+        size_t idx = hash & mask;
+        while (entries[idx].slot != NO_SLOT) {
+            if (entries[idx].hash == (uint32_t) hash && matches(entries[idx].slot)) {
+                return entries[idx].slot;
+            }
+            idx = (idx + 1) & mask;
+        }
+        return NO_SLOT;
+    }
+
+    /* Returns the slot inserted with the given key hash and identity, or NO_SLOT */
+    uint32_t findKey(size_t hash, const void *key)
+    {
+        size_t idx = hash & mask;
+        while (entries[idx].slot != NO_SLOT) {
+            if (entries[idx].key == key) {
+                return entries[idx].slot;
+            }
+            idx = (idx + 1) & mask;
+        }
+        return NO_SLOT;
+    }
+
+    /* Marks an empty entry, and is returned by find when nothing matches */
+    static const uint32_t NO_SLOT = UINT32_MAX;
+
+ private:
+
+    /*
+     * An entry in the table. Empty when slot is NO_SLOT. The key is null if not stored. Slots are
+     * 32 bits, so the table never needs more of the hash than that, and an entry fits in 16 bytes
+     */
+    struct Entry {
+        uint32_t hash;
+        uint32_t slot;
+        const void *key;
+    };
+
+    /* Allocate a table of the given size (a power of two) with every entry empty */
+    static Entry * allocate(size_t size);
+
+    /* Double the table size and reinsert every entry */
+    void grow();
+
+    Entry *entries;
+    size_t mask;
+    size_t count;
+};
+
+/*
+ * This class represents the Sessions that are currently being managed by the server. When a
+ * connection is first opened it is attached to a session and placed into this list, even before
+ * obtaining a name to identify the session. The session lives on in this list until it is
+ * completely lost or closed.
+ *
+ * Sessions are stored contiguously in an array of slots and referred to by SessionHandles.
+ * Destroying a session just empties its slot (which is reused by a later session), so the slots
+ * can be swept in order with getSlot() while sessions are destroyed along the way. Sessions are
+ * also hash indexed by registered name and by connection so that lookups by either are O(1).
  */
 class SessionList {
  public:
-    
+
     /* Constructor to initialize data */
     SessionList();
 
     /* Destructor to free any memory associated with the list */
     ~SessionList();
 
-    /* Allocates a new session instance and adds it to the list of sessions, returning a reference */
+    /*
+     * Creates a new session in a free slot, returning a reference to it. The reference is only valid
+     * until the next call to generateSession; use its handle to refer to it for longer
+     */
     Session * generateSession();
 
-    /* Removes a session from the session list and frees the associated memory */
+    /* Removes a session from the session list, freeing its connection and emptying its slot */
     void destroySession(Session *sess);
 
+    /* Resolve a handle to its Session. Returns nullptr if that session has since been destroyed */
+    Session * get(SessionHandle handle);
+
     /* Find a session based on its Connection. If none found, returns nullptr */
     Session * findByConnection(Connection * conn);
 
     /* Find a session based on its registered name. If none found, returns nullptr */
-    Session * findByName(std::string name);
+    Session * findByName(const std::string &name);
+
+    /* Returns the number of slots, live or empty, to iterate over with getSlot */
+    size_t getSlotCount();
 
-    /* Returns the first Session in the list of sessions (the list head). nullptr if no sessions in list */
-    Session * getFirst();
+    /* Returns the session in the given slot, or nullptr if that slot is currently empty */
+    Session * getSlot(size_t index);
 
  private:
-    
-    /* Points to the head of the doubly-linked list of sessions */
-    Session *listHead;
 
+    /* Contiguous storage of every session slot, grown by doubling */
+    Session *slots;
+    uint32_t numSlots;
+    uint32_t capacity;
+
+    /* Indexes of empty slots available for reuse, most recently emptied last */
+    std::vector<uint32_t> freeSlots;
+
+    /* Index of sessions with a registered name, keyed on that name */
+    SessionIndex nameIndex;
+
+    /* Index of sessions with a connection, keyed on (and storing) the connection's identity */
+    SessionIndex connIndex;
+
+    /* Hash functions for the keys of the two indexes */
+    static size_t hashName(const std::string &name);
+    static size_t hashConnection(Connection *conn);
+
+    /* Session updates the indexes when its name or connection changes */
+    friend class Session;
 };
 
-#endif
\ No newline at end of file
+#endif
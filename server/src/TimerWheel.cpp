@@ -0,0 +1,163 @@
+#include "TimerWheel.h"
+
+#include <cmath>
+
+TimerWheel::TimerWheel()
+{
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            Timer *head = &slots[level][slot];
+            head->prev = head;
+            head->next = head;
+            head->conn = nullptr;
+            head->expires = 0;
+        }
+    }
+    currentTick = 0;
+    startTime = std::chrono::steady_clock::now();
+}
+
+TimerWheel::~TimerWheel()
+{
+    for (auto &entry : timers) {
+        delete entry.second;
+    }
+}
+
+double TimerWheel::now()
+{
+    auto elapsed = std::chrono::steady_clock::now() - startTime;
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / 1000000000.0;
+}
+
+void TimerWheel::schedule(Connection *conn, double when)
+{
+    Timer *&timer = timers[conn];
+    if (timer == nullptr) {
+        timer = new Timer();
+        timer->prev = timer;
+        timer->next = timer;
+        timer->conn = conn;
+    } else {
+        unlink(timer);
+    }
+
+    /* Round up so a deadline never runs before it is due */
+    double ticks = std::ceil(when / TIMER_WHEEL_TICK_SECS);
+    timer->expires = (ticks > 0) ? (uint64_t) ticks : 0;
+    insert(timer);
+}
+
+void TimerWheel::cancel(Connection *conn)
+{
+    auto it = timers.find(conn);
+    if (it == timers.end()) {
+        return;
+    }
+    unlink(it->second);
+    delete it->second;
+    timers.erase(it);
+}
+
+void TimerWheel::advance()
+{
+    uint64_t targetTick = (uint64_t) (now() / TIMER_WHEEL_TICK_SECS);
+
+    while (currentTick < targetTick) {
+        currentTick++;
+
+        /* Whenever a level comes round to its start, refill it from the level above */
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            if ((currentTick & ((1ULL << (TIMER_WHEEL_SLOT_BITS * level)) - 1)) != 0) {
+                break;
+            }
+            cascade(level, (currentTick >> (TIMER_WHEEL_SLOT_BITS * level)) & (TIMER_WHEEL_SLOTS - 1));
+        }
+
+        /*
+         * Run everything in this tick's slot. Each timer is unlinked before it runs, since running
+         * it may reschedule it, or lose the connection and cancel it
+         */
+        Timer *head = &slots[0][currentTick & (TIMER_WHEEL_SLOTS - 1)];
+        while (head->next != head) {
+            Timer *timer = head->next;
+            unlink(timer);
+            timer->conn->runTimers();
+        }
+    }
+}
+
+double TimerWheel::getSecsUntilNext(double maxSecs)
+{
+    /* Search the first level up to the end of its turn, when the level above cascades into it */
+    uint64_t tick = currentTick + 1;
+    while ((tick & (TIMER_WHEEL_SLOTS - 1)) != 0) {
+        Timer *head = &slots[0][tick & (TIMER_WHEEL_SLOTS - 1)];
+        if (head->next != head) {
+            break;
+        }
+        tick++;
+    }
+
+    double secs = tick * TIMER_WHEEL_TICK_SECS - now();
+    if (secs > maxSecs) {
+        return maxSecs;
+    }
+    return (secs > 0) ? secs : 0;
+}
+
+void TimerWheel::insert(Timer *timer)
+{
+    /* Anything already due runs on the next tick */
+    uint64_t expires = timer->expires;
+    if (expires <= currentTick) {
+        expires = currentTick + 1;
+    }
+
+    /* Find the lowest level whose span reaches the expiry, clamping to the top level */
+    uint64_t delta = expires - currentTick;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ULL << (TIMER_WHEEL_SLOT_BITS * (level + 1)))) {
+        level++;
+    }
+    if (delta >= (1ULL << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS))) {
+        /* Beyond the top level: park it as far out as the wheel reaches */
+        expires = currentTick + (1ULL << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS)) - 1;
+    }
+
+    Timer *head = &slots[level][(expires >> (TIMER_WHEEL_SLOT_BITS * level)) & (TIMER_WHEEL_SLOTS - 1)];
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+void TimerWheel::unlink(Timer *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = timer;
+    timer->next = timer;
+}
+
+void TimerWheel::cascade(int level, int slot)
+{
+    /* Detach the whole list first so nothing is reinserted into the list being walked */
+    Timer *head = &slots[level][slot];
+    if (head->next == head) {
+        return;
+    }
+    Timer pending;
+    pending.next = head->next;
+    pending.prev = head->prev;
+    pending.next->prev = &pending;
+    pending.prev->next = &pending;
+    head->next = head;
+    head->prev = head;
+
+    while (pending.next != &pending) {
+        Timer *timer = pending.next;
+        unlink(timer);
+        insert(timer);
+    }
+}
@@ -0,0 +1,84 @@
+#ifndef FD__TIMERWHEEL_H
+#define FD__TIMERWHEEL_H
+
+#include <cstdint>
+#include <chrono>
+#include <unordered_map>
+
+#include "Connection.h"
+
+/* Length of one tick of the wheel in seconds, which is the precision deadlines are run with */
+#define TIMER_WHEEL_TICK_SECS 0.01
+
+/* Number of levels in the wheel, and the number of slots in each (a power of two) */
+#define TIMER_WHEEL_LEVELS 3
+#define TIMER_WHEEL_SLOT_BITS 8
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+
+/*
+ * Hierarchical hashed timer wheel that runs the keep-alive deadlines of every connection of a
+ * worker. Each level is a ring of slots holding lists of timers: the first level has one slot
+ * per tick, and each slot of a higher level covers a whole turn of the level below, whose timers
+ * are cascaded down when the level below comes round to them. Scheduling and cancelling are
+ * O(1) and advancing only touches the timers that are due (plus the occasional cascade), so
+ * timeout processing costs O(expired) rather than O(connections). Deadlines beyond the top
+ * level are run early, which connections handle by scheduling themselves again.
+ */
+class TimerWheel : public ConnectionTimers {
+ public:
+
+    /* Constructor - start the wheel's clock at 0 */
+    TimerWheel();
+
+    /* Destructor - free every timer. The connections are not touched */
+    ~TimerWheel();
+
+    /* ConnectionTimers implementation: seconds since the wheel was created */
+    double now() override;
+
+    /* ConnectionTimers implementation: (re)schedule runTimers on the connection */
+    void schedule(Connection *conn, double when) override;
+
+    /* Forget any timer for the connection. Must be called before the connection is deleted */
+    void cancel(Connection *conn);
+
+    /* Run every timer that is due by now */
+    void advance();
+
+    /* Returns the seconds until the next timer is due, capped at maxSecs */
+    double getSecsUntilNext(double maxSecs);
+
+ private:
+
+    /* A scheduled call to a connection's runTimers, linked into the list of one slot */
+    struct Timer {
+        Timer *prev;
+        Timer *next;
+        Connection *conn;
+        uint64_t expires;
+    };
+
+    /* Put the timer into the slot for its expiry tick (which must be unlinked) */
+    void insert(Timer *timer);
+
+    /* Take the timer out of whichever list it is in */
+    static void unlink(Timer *timer);
+
+    /* Move every timer in the given slot of a higher level down to where it now belongs */
+    void cascade(int level, int slot);
+
+    /* List heads of every slot of every level. A list head's conn is nullptr */
+    Timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+
+    /* The timer of each connection that has one */
+    std::unordered_map<Connection*, Timer*> timers;
+
+    /* The tick every timer due up to has been run */
+    uint64_t currentTick;
+
+    /* The time the wheel's clock counts from */
+    std::chrono::steady_clock::time_point startTime;
+
+};
+
+#endif
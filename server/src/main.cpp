@@ -1,110 +1,428 @@
-#include <unistd.h>
 #include <iostream>
-#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <signal.h>
+#include <unistd.h>
 
-#include "SessionList.h"
+#include "ServerWorker.h"
+#include "LocalNameRegistry.h"
+#include "RemoteNameRegistry.h"
+#include "NameService.h"
+#include "RoomRegistry.h"
+#include "ResumeRegistry.h"
+#include "AdmissionControl.h"
+#include "Log.h"
+#include "Metrics.h"
+#include "Handoff.h"
+#include "Trace.h"
 
 #define PORT 44444
 
-SessionList *sessions;
-double g_exec_secs = 0;
-
-static void onMsgRecv(Connection *conn, pbuf::NetworkMessage msg) {
-    if (msg.type_case() == pbuf::NetworkMessage::kNameRequest) {
-        pbuf::NetworkMessage reply;
-        Session *sess = sessions->findByName(msg.namerequest());
-        bool nameSuccess = ((sess == nullptr) || (sess->getConnection() == conn));
-        if (nameSuccess) {
-            if (sess == nullptr) {
-                sess = sessions->findByConnection(conn);
-            }
-            if (sess->getName() == nullptr) {
-                std::cout << g_exec_secs << ": Accepted name '" << msg.namerequest() << "' for session with " <<
-                        conn->getPeerIp() << ":" << conn->getPeerPort() << std::endl;
-            } else {
-                std::cout << g_exec_secs << ": Updated name to '" << msg.namerequest() << "' for session with " <<
-                        conn->getPeerIp() << ":" << conn->getPeerPort() << std::endl;
+/* Default limit on the memory used by the send queues of every connection together, in MiB */
+#define DEFAULT_SEND_BUDGET_MB 256
+
+/* Default longest a dead client may go unnoticed before its connection is SUSPENDED, in seconds */
+#define DEFAULT_KEEPALIVE_SECS 30
+
+/* Default time a session whose connection was lost is kept to be resumed, in seconds */
+#define DEFAULT_RESUME_GRACE_SECS 30
+
+/*
+ * Default connects allowed from one address per second (none, so no limit, since clients behind
+ * NAT or a load balancer share an address), and in a burst once a rate is set
+ */
+#define DEFAULT_CONNECT_RATE 0
+#define DEFAULT_CONNECT_BURST 50
+
+/* Longest the workers wait for sends in flight to finish when handing over, in seconds */
+#define HANDOFF_DRAIN_SECS 1.0
+
+/* SIGUSR1 handler, asking for the trace recorded so far to be written out */
+static void onTraceSignal(int signum)
+{
+    (void) signum;
+    Trace::requestWrite();
+}
+
+/*
+ * Recreate the rooms handed over by the previous server, given what each session handed over is
+ * now known as. Returns the number of rooms recreated
+ */
+static size_t restoreRooms(RoomRegistry *rooms, const std::vector<HandoffRoom> &handedOver,
+        const std::vector<HandoffSession> &sessions, const std::vector<SessionRef> &refs)
+{
+    size_t restored = 0;
+    for (const HandoffRoom &room : handedOver) {
+        std::vector<SessionRef> members;
+        std::vector<std::string> memberNames;
+        for (uint32_t position : room.members) {
+            if (sessions[position].named) {
+                members.push_back(refs[position]);
+                memberNames.push_back(sessions[position].name);
             }
-            sess->setName(msg.namerequest());
-        } else {
-            std::cout << g_exec_secs << ": Already-taken name '" << msg.namerequest() << "' rejected for session with " <<
-                    conn->getPeerIp() << ":" << conn->getPeerPort() << std::endl;
         }
-        reply.set_namereply(nameSuccess);
-        conn->sendNetworkMessage(reply);
+        if (memberNames.size() == room.members.size() &&
+                rooms->restore(room.id, room.maxPlayers, members, memberNames)) {
+            restored++;
+        }
     }
+    return restored;
 }
 
-static void onConnectionLost(Connection *conn) {
-    Session *sess = sessions->findByConnection(conn);
-    if (sess != nullptr) {
-        std::cout << g_exec_secs << ": Connection with " << conn->getPeerIp() << ":" << conn->getPeerPort() << " terminated" << std::endl;
-        sessions->destroySession(sess);
+/*
+ * Describe the rooms for the replacement server in terms of the sessions handed over, given what
+ * each was known as here. A room whose host couldn't be handed over is left out, and so is any
+ * other member that couldn't
+ */
+static std::vector<HandoffRoom> exportRooms(RoomRegistry *rooms,
+        const std::vector<SessionRef> &refs)
+{
+    std::unordered_map<uint64_t, uint32_t> positions;
+    for (size_t i = 0; i < refs.size(); i++) {
+        positions[refs[i].key()] = i;
     }
-}
 
-static void onConnectionSuspended(Connection *conn) {
-    std::cout << g_exec_secs << ": SUSPENDED connection with " << conn->getPeerIp() << ":" << conn->getPeerPort() << std::endl;
-}
-
-static void onConnectionResumed(Connection *conn) {
-    std::cout << g_exec_secs << ": RESUMED connection with " << conn->getPeerIp() << ":" << conn->getPeerPort() << std::endl;
+    std::vector<HandoffRoom> out;
+    for (const RoomSnapshot &snapshot : rooms->snapshot()) {
+        HandoffRoom room;
+        room.id = snapshot.id;
+        room.maxPlayers = snapshot.maxPlayers;
+        for (const SessionRef &member : snapshot.members) {
+            auto it = positions.find(member.key());
+            if (it != positions.end()) {
+                room.members.push_back(it->second);
+            } else if (room.members.empty()) {
+                break;
+            }
+        }
+        if (!room.members.empty()) {
+            out.push_back(std::move(room));
+        }
+    }
+    return out;
 }
 
-static void onConnAccept(Connection *conn)
+/* Print the command line usage of the server */
+static void printUsage(const char *prog)
 {
-    conn->setOnMsgReceivedCallback(onMsgRecv);
-    conn->setOnConnectionLostCallback(onConnectionLost);
-    conn->setOnConnectionSuspendedCallback(onConnectionSuspended);
-    conn->setOnConnectionResumedCallback(onConnectionResumed);
-    Session *sess = sessions->generateSession();
-    sess->setConnection(conn);
-
-    std::cout << g_exec_secs << ": Connection received from " << conn->getPeerIp() << ":" << conn->getPeerPort() << std::endl;
+    std::cout << "Usage: " << prog << " [--workers N] [--io-uring] [--send-budget MB]" <<
+            " [--keepalive SECS] [--tcp-keepalive] [--log-level LEVEL] [--metrics-port PORT]" <<
+            " [--trace FILE] [--backlog N] [--defer-accept SECS] [--handoff PATH]" <<
+            " [--resume-grace SECS] [--connect-rate N] [--connect-burst N]" <<
+            " [--name-registry ADDR] [--serve-names ADDR]" << std::endl;
+    std::cout << "  --workers N       Number of worker threads, each with its own listener and" << std::endl;
+    std::cout << "                    session shard. 0 means one per CPU core. Default 1" << std::endl;
+    std::cout << "  --io-uring        Do socket I/O through io_uring when the kernel supports it," << std::endl;
+    std::cout << "                    falling back to epoll otherwise" << std::endl;
+    std::cout << "  --send-budget MB  Most memory the queued outgoing data of all connections may" << std::endl;
+    std::cout << "                    use. Peers that would exceed it are disconnected. Default " <<
+            DEFAULT_SEND_BUDGET_MB << std::endl;
+    std::cout << "  --keepalive SECS  Longest a dead client may go unnoticed. Idle clients are" << std::endl;
+    std::cout << "                    pinged less often the longer this is. Default " <<
+            DEFAULT_KEEPALIVE_SECS << std::endl;
+    std::cout << "  --tcp-keepalive   Probe idle clients with the kernel's TCP keep-alive instead" << std::endl;
+    std::cout << "                    of pings" << std::endl;
+    std::cout << "  --log-level LEVEL Least important events logged: debug, info, warn or error." <<
+            std::endl;
+    std::cout << "                    Default info" << std::endl;
+    std::cout << "  --metrics-port PORT" << std::endl;
+    std::cout << "                    Serve metrics in the Prometheus text format over HTTP on" <<
+            std::endl;
+    std::cout << "                    127.0.0.1 at this port. Off by default" << std::endl;
+    std::cout << "  --trace FILE      Record where the workers' time goes, written to FILE in the" <<
+            std::endl;
+    std::cout << "                    Chrome trace format on SIGUSR1 and on exit" << std::endl;
+    std::cout << "  --backlog N       Connections the kernel may queue ahead of them being accepted," <<
+            std::endl;
+    std::cout << "                    capped by net.core.somaxconn. Default " <<
+            DEFAULT_ACCEPT_BACKLOG << std::endl;
+    std::cout << "  --defer-accept SECS" << std::endl;
+    std::cout << "                    Only accept a connection once it sends data, waiting up to" <<
+            std::endl;
+    std::cout << "                    SECS for it. Off by default" << std::endl;
+    std::cout << "  --handoff PATH    Take over the sessions of the server running with the same" <<
+            std::endl;
+    std::cout << "                    PATH, if any, then wait at PATH (a Unix socket) to hand them" <<
+            std::endl;
+    std::cout << "                    over to the next one. Start the replacement with the same" <<
+            std::endl;
+    std::cout << "                    --workers so no listen backlog is lost" << std::endl;
+    std::cout << "  --resume-grace SECS" << std::endl;
+    std::cout << "                    How long a named session whose client went away is kept for" <<
+            std::endl;
+    std::cout << "                    the client to resume, 0 for never. Default " <<
+            DEFAULT_RESUME_GRACE_SECS << std::endl;
+    std::cout << "  --connect-rate N  Connects allowed from one address per second, any more are" <<
+            std::endl;
+    std::cout << "                    reset straight away. Off by default, as clients behind NAT" <<
+            std::endl;
+    std::cout << "                    or a load balancer share one address" << std::endl;
+    std::cout << "  --connect-burst N Connects allowed from one address at once after being quiet." <<
+            std::endl;
+    std::cout << "                    Default " << DEFAULT_CONNECT_BURST << std::endl;
+    std::cout << "  --name-registry ADDR" << std::endl;
+    std::cout << "                    Keep names unique across every server sharing the name" <<
+            std::endl;
+    std::cout << "                    registry at ADDR, unix:PATH or HOST:PORT. By default names" <<
+            std::endl;
+    std::cout << "                    are only unique within this server" << std::endl;
+    std::cout << "  --serve-names ADDR" << std::endl;
+    std::cout << "                    Run the name registry for other servers at ADDR instead of" <<
+            std::endl;
+    std::cout << "                    a game server" << std::endl;
 }
 
-int main()
+int main(int argc, char *argv[])
 {
-    Listener *listener;
-    bool running = true;
-
-    /* Start listenening for incoming connections to the server */
-    try {
-        listener = new Listener(PORT, onConnAccept);
-    } catch (ListenerException &exp) {
-        std::cout << "Failed to create listener on port " << PORT << std::endl;
-        return 1;
-    }
-    std::cout << "Listening on port " << PORT << std::endl;
-    
-    sessions = new SessionList();
-
-    auto lastTime = std::chrono::high_resolution_clock::now();
-    while (running) {
-
-        /* Update the elapsed time for this loop for polling */
-        auto elapsedTime = std::chrono::high_resolution_clock::now() - lastTime;
-        double elapsedSecs = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsedTime).count() / 1000000000.0d;
-        lastTime += std::chrono::nanoseconds((uint64_t) (1000000000 * elapsedSecs));
-        g_exec_secs += elapsedSecs;
-
-        listener->poll();
-        Session *sess = sessions->getFirst();
-        if (sess == nullptr) {
-            usleep(50000); /* If no sessions currently active, sleep for .05 seconds to conserve CPU */
-        }
-        while (sess != nullptr) {
-            Connection *conn = sess->getConnection();
-            /* Once we poll the conn, we can't use sess anymore (could have been destroyed), so last use of it is here */
-            sess = sess->getNext();
-            if (conn != nullptr) {
-                conn->poll(elapsedSecs);
+    int numWorkers = 1;
+    size_t sendBudgetMb = DEFAULT_SEND_BUDGET_MB;
+    ServerWorkerOptions options;
+    options.preferIoUring = false;
+    options.keepAliveSecs = DEFAULT_KEEPALIVE_SECS;
+    options.tcpKeepAlive = false;
+    options.acceptBacklog = DEFAULT_ACCEPT_BACKLOG;
+    options.deferAcceptSecs = 0;
+    LogLevel logLevel = LogLevel::INFO;
+    int metricsPort = 0;
+    const char *tracePath = nullptr;
+    const char *handoffPath = nullptr;
+    double resumeGraceSecs = DEFAULT_RESUME_GRACE_SECS;
+    RateLimit connectLimit = {DEFAULT_CONNECT_RATE, DEFAULT_CONNECT_BURST};
+    const char *nameRegistryAddress = nullptr;
+    const char *serveNamesAddress = nullptr;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            numWorkers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--io-uring") == 0) {
+            options.preferIoUring = true;
+        } else if (strcmp(argv[i], "--send-budget") == 0 && i + 1 < argc) {
+            sendBudgetMb = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--keepalive") == 0 && i + 1 < argc) {
+            options.keepAliveSecs = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--tcp-keepalive") == 0) {
+            options.tcpKeepAlive = true;
+        } else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc &&
+                Logger::parseLevel(argv[i + 1], &logLevel)) {
+            i++;
+        } else if (strcmp(argv[i], "--metrics-port") == 0 && i + 1 < argc) {
+            metricsPort = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--backlog") == 0 && i + 1 < argc) {
+            options.acceptBacklog = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--defer-accept") == 0 && i + 1 < argc) {
+            options.deferAcceptSecs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if (strcmp(argv[i], "--handoff") == 0 && i + 1 < argc) {
+            handoffPath = argv[++i];
+        } else if (strcmp(argv[i], "--resume-grace") == 0 && i + 1 < argc) {
+            resumeGraceSecs = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--connect-rate") == 0 && i + 1 < argc) {
+            connectLimit.perSec = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--connect-burst") == 0 && i + 1 < argc) {
+            connectLimit.burst = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--name-registry") == 0 && i + 1 < argc) {
+            nameRegistryAddress = argv[++i];
+        } else if (strcmp(argv[i], "--serve-names") == 0 && i + 1 < argc) {
+            serveNamesAddress = argv[++i];
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (serveNamesAddress != nullptr) {
+        try {
+            NameService service(serveNamesAddress);
+            std::cout << "Serving names at " << serveNamesAddress << std::endl;
+            service.run();
+        } catch (NameRegistryException &exp) {
+            std::cout << "Failed to serve names at " << serveNamesAddress << ": " << exp.what() <<
+                    std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (numWorkers <= 0) {
+        numWorkers = std::thread::hardware_concurrency();
+        if (numWorkers <= 0) {
+            numWorkers = 1;
+        }
+    }
+
+    if (tracePath != nullptr) {
+        Trace::start(tracePath);
+        signal(SIGUSR1, onTraceSignal);
+    }
+
+    /* Take over from the server being replaced, if there is one, before claiming any ports */
+    Handoff *handoff = nullptr;
+    std::vector<int> listenerFds;
+    std::vector<HandoffSession> handedOver;
+    std::vector<HandoffRoom> roomsHandedOver;
+    uint64_t nameInstance = 0;
+    if (handoffPath != nullptr) {
+        handoff = new Handoff(handoffPath);
+        try {
+            if (handoff->receive(listenerFds, handedOver, roomsHandedOver, nameInstance)) {
+                std::cout << "Took over " << handedOver.size() << " session(s) and " <<
+                        listenerFds.size() << " listener(s) from the previous server" << std::endl;
+            }
+        } catch (HandoffException &exp) {
+            std::cout << "Failed to take over from the previous server: " << exp.what() <<
+                    std::endl;
+            return 1;
+        }
+    }
+
+    NameRegistry *names;
+    if (nameRegistryAddress != nullptr) {
+        /* The sessions taken over keep their names under the previous server's instance */
+        std::vector<std::string> namesHandedOver;
+        for (const HandoffSession &session : handedOver) {
+            if (session.named) {
+                namesHandedOver.push_back(session.name);
+            }
+        }
+        try {
+            names = new RemoteNameRegistry(nameRegistryAddress, nameInstance, namesHandedOver);
+        } catch (NameRegistryException &exp) {
+            std::cout << "Failed to reach the name registry at " << nameRegistryAddress << ": " <<
+                    exp.what() << std::endl;
+            return 1;
+        }
+    } else {
+        names = new LocalNameRegistry();
+    }
+    RoomRegistry *rooms = new RoomRegistry();
+    ResumeRegistry *resumes = new ResumeRegistry(resumeGraceSecs);
+    AdmissionControl *admission = new AdmissionControl(connectLimit);
+    SendBudget *sendBudget = new SendBudget(sendBudgetMb * 1024 * 1024);
+    Logger *logger = new Logger(STDOUT_FILENO, logLevel);
+    Metrics *metrics = new Metrics(sendBudget);
+    if (metricsPort > 0) {
+        try {
+            metrics->serve(metricsPort);
+        } catch (MetricsException &exp) {
+            std::cout << "Failed to serve metrics on port " << metricsPort << ": " << exp.what() <<
+                    std::endl;
+            return 1;
+        }
+    }
+    std::vector<ServerWorker*> workers;
+
+    /* Start listenening for incoming connections to the server on every worker */
+    for (int i = 0; i < numWorkers; i++) {
+        int listenerFd = (i < (int) listenerFds.size()) ? listenerFds[i] : -1;
+        try {
+            workers.push_back(new ServerWorker(i, PORT, listenerFd, names, rooms, resumes,
+                    admission, sendBudget, logger, metrics, options));
+        } catch (std::runtime_error &exp) {
+            std::cout << "Failed to create listener on port " << PORT << ": " << exp.what() << std::endl;
+            return 1;
+        }
+    }
+    std::cout << "Listening on port " << PORT << " with " << numWorkers << " worker(s) using " <<
+            (workers[0]->isUsingIoUring() ? "io_uring" : "epoll") << std::endl;
+    if ((int) listenerFds.size() > numWorkers) {
+        std::cout << "Closing " << (listenerFds.size() - numWorkers) << " listener(s) taken over" <<
+                " beyond --workers, resetting the connects waiting on them" << std::endl;
+        for (size_t i = numWorkers; i < listenerFds.size(); i++) {
+            close(listenerFds[i]);
+        }
+    }
+    for (ServerWorker *worker : workers) {
+        worker->setPeers(workers);
+    }
+
+    std::vector<SessionRef> adoptedRefs;
+    for (size_t i = 0; i < handedOver.size(); i++) {
+        adoptedRefs.push_back(workers[i % numWorkers]->adoptSession(handedOver[i]));
+    }
+    if (!roomsHandedOver.empty()) {
+        size_t restored = restoreRooms(rooms, roomsHandedOver, handedOver, adoptedRefs);
+        std::cout << "Took over " << restored << " of " << roomsHandedOver.size() <<
+                " room(s) from the previous server" << std::endl;
+    }
+    handedOver.clear();
+    roomsHandedOver.clear();
+
+    /* A replacement connecting to the handoff socket stops every worker to take over from them */
+    if (handoff != nullptr) {
+        try {
+            handoff->serve([&workers]() {
+                for (ServerWorker *worker : workers) {
+                    worker->stop();
+                }
+            });
+        } catch (HandoffException &exp) {
+            std::cout << "Failed to wait for a replacement at " << handoffPath << ": " <<
+                    exp.what() << std::endl;
+            return 1;
+        }
+    }
+
+    /* The main thread runs the first worker itself */
+    std::vector<std::thread> threads;
+    for (int i = 1; i < numWorkers; i++) {
+        threads.emplace_back(&ServerWorker::run, workers[i]);
+    }
+    workers[0]->run();
+
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    /* The workers were stopped for a replacement, which gets everything they had */
+    if (handoff != nullptr && handoff->isRequested()) {
+        metrics->stopServing();
+        std::vector<int> fds;
+        std::vector<HandoffSession> sessions;
+        std::vector<SessionRef> refs;
+
+        /* Before the workers let go of the names, so they stay held for the new server */
+        uint64_t instanceHandedOff = names->handOff();
+        for (ServerWorker *worker : workers) {
+            int fd = worker->handOff(HANDOFF_DRAIN_SECS, sessions, refs);
+            if (fd >= 0) {
+                fds.push_back(fd);
             }
         }
+        std::vector<HandoffRoom> roomsHandedOff = exportRooms(rooms, refs);
+        size_t numSessions = sessions.size();
+        try {
+            handoff->send(fds, sessions, roomsHandedOff, instanceHandedOff);
+            std::cout << "Handed over " << numSessions << " session(s), " <<
+                    roomsHandedOff.size() << " room(s) and " << fds.size() <<
+                    " listener(s) to the new server" << std::endl;
+        } catch (HandoffException &exp) {
+            std::cout << "Failed to hand over to the new server: " << exp.what() << std::endl;
+        }
     }
 
+    /* Write out everything the workers logged before saying anything more */
+    delete logger;
+    if (tracePath != nullptr && !Trace::write()) {
+        std::cout << "Failed to write trace to " << tracePath << std::endl;
+    }
+
+    /* First, as it may still be posting answers to the workers until its thread has stopped */
+    delete names;
+
     std::cout << "Stopping listener and destroying server" << std::endl;
-    delete sessions;
-    delete listener;
-    return 0; 
+    for (ServerWorker *worker : workers) {
+        delete worker;
+    }
+    delete handoff;
+    delete metrics;
+    delete admission;
+    delete resumes;
+    delete rooms;
+    delete sendBudget;
+    return 0;
 }
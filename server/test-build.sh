@@ -0,0 +1,9 @@
+if [ -d test/bin ]; then rm -rf test/bin; fi
+if [ -d test/generated ]; then rm -rf test/generated; fi
+mkdir test/bin
+mkdir -p test/generated/pbuf/generated
+
+protoc -I ../shared-src/pbuf --cpp_out=./test/generated/pbuf/generated ../shared-src/pbuf/*.proto
+g++ -O2 -I ./src -I ../shared-src -I ./test/generated test/RoomRegistryTest.cpp src/RoomRegistry.cpp ./test/generated/pbuf/generated/*.cc -lprotobuf -pthread -o test/bin/room-registry-test
+g++ -O2 -I ./src -I ../shared-src -I ./test/generated test/FramingTest.cpp ../shared-src/Connection.cpp ../shared-src/Trace.cpp ./test/generated/pbuf/generated/*.cc -lprotobuf -pthread -o test/bin/framing-test
+echo "Built tests in 'test/bin/', run each to check it passes"
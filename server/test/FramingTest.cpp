@@ -0,0 +1,165 @@
+/*
+ * Regression tests for how an accepted Connection detects the framing its peer uses. Each test
+ * feeds a connection the bytes a peer would send first, and the program exits non-zero if any
+ * check fails.
+ */
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+#include "Connection.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        std::cout << __FILE__ << ":" << __LINE__ << ": check failed: " #cond << std::endl; \
+        failures++; \
+    } \
+} while (0)
+
+/* An accepted connection along with everything it has reported */
+struct Accepted {
+    Connection *conn;
+    int peerfd;
+    int received;
+    std::string lastName;
+    bool lost;
+};
+
+/* Set by the listener below to the connection it wrapped */
+static Connection *wrappedConnection = nullptr;
+
+/*
+ * Wrap one end of a socketpair in a Connection as if it had been accepted, so it detects the
+ * framing from whatever it is given. The socket itself is never read or written
+ */
+static void acceptConnection(Accepted &acc)
+{
+    static Listener listener(0, [](Connection *conn) { wrappedConnection = conn; });
+
+    int fds[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    listener.handleAccepted(fds[0]);
+    acc.conn = wrappedConnection;
+    acc.peerfd = fds[1];
+    acc.received = 0;
+    acc.lost = false;
+
+    acc.conn->setOnMsgReceivedCallback([&acc](Connection *, const pbuf::NetworkMessage &msg) {
+        acc.received++;
+        acc.lastName = msg.namerequest();
+    });
+    acc.conn->setOnConnectionLostCallback([&acc](Connection *) { acc.lost = true; });
+}
+
+static void closeConnection(Accepted &acc)
+{
+    delete acc.conn;
+    close(acc.peerfd);
+}
+
+/* Returns a name request for a name of the given length, serialized */
+static std::string nameRequest(size_t length)
+{
+    pbuf::NetworkMessage msg;
+    msg.set_namerequest(std::string(length, 'n'));
+    return msg.SerializeAsString();
+}
+
+/* Returns the message framed with a 2-byte big-endian length, as a legacy peer sends it */
+static std::string fixed16Frame(const std::string &body)
+{
+    uint16_t prefix = htons(body.length());
+    return std::string((const char*) &prefix, 2) + body;
+}
+
+/* Returns the message framed with a varint length, which is under 128 bytes here */
+static std::string varintFrame(const std::string &body)
+{
+    return std::string(1, (char) body.length()) + body;
+}
+
+/* A FIXED16 frame under 256 bytes starts with a zero, like the preamble, but has a length after */
+static void testFixed16Short()
+{
+    Accepted acc;
+    acceptConnection(acc);
+    std::string frame = fixed16Frame(nameRequest(20));
+    CHECK(frame[0] == 0 && frame[1] != 0);
+
+    /* One zero byte alone could still be either */
+    acc.conn->receiveData(frame.data(), 1);
+    CHECK(acc.received == 0);
+    acc.conn->receiveData(frame.data() + 1, frame.length() - 1);
+    CHECK(acc.received == 1);
+    CHECK(acc.lastName == std::string(20, 'n'));
+    CHECK(!acc.lost);
+    CHECK(acc.conn->getMaxSendSize() == UINT16_MAX);
+    closeConnection(acc);
+}
+
+/* A FIXED16 frame of 256 bytes or more starts with the high byte of its length */
+static void testFixed16Long()
+{
+    Accepted acc;
+    acceptConnection(acc);
+    std::string frame = fixed16Frame(nameRequest(300));
+    CHECK(frame[0] != 0);
+
+    acc.conn->receiveData(frame.data(), frame.length());
+    CHECK(acc.received == 1);
+    CHECK(acc.lastName == std::string(300, 'n'));
+    CHECK(!acc.lost);
+    CHECK(acc.conn->getMaxSendSize() == UINT16_MAX);
+    closeConnection(acc);
+}
+
+/* The preamble switches to varint framing, even when it arrives split up */
+static void testPreamble()
+{
+    Accepted acc;
+    acceptConnection(acc);
+    std::string stream = std::string("\0\0\2", 3) + varintFrame(nameRequest(20));
+
+    acc.conn->receiveData(stream.data(), 2);
+    CHECK(acc.received == 0);
+    acc.conn->receiveData(stream.data() + 2, stream.length() - 2);
+    CHECK(acc.received == 1);
+    CHECK(acc.lastName == std::string(20, 'n'));
+    CHECK(!acc.lost);
+    CHECK(acc.conn->getMaxSendSize() == MAX_MESSAGE_SIZE);
+    closeConnection(acc);
+}
+
+/* A preamble announcing a framing version that isn't known loses the connection */
+static void testBadVersion()
+{
+    Accepted acc;
+    acceptConnection(acc);
+    std::string stream = std::string("\0\0\3", 3) + varintFrame(nameRequest(20));
+
+    acc.conn->receiveData(stream.data(), stream.length());
+    CHECK(acc.received == 0);
+    CHECK(acc.lost);
+    closeConnection(acc);
+}
+
+int main()
+{
+    testFixed16Short();
+    testFixed16Long();
+    testPreamble();
+    testBadVersion();
+    if (failures != 0) {
+        std::cout << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    std::cout << "All framing tests passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * Regression tests for RoomRegistry. Each test drives the registry directly with made-up
+ * sessions, as the workers would, and the program exits non-zero if any check fails.
+ */
+
+#include <iostream>
+#include <string>
+
+#include "NameRegistry.h"
+#include "RoomRegistry.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        std::cout << __FILE__ << ":" << __LINE__ << ": check failed: " #cond << std::endl; \
+        failures++; \
+    } \
+} while (0)
+
+/* Returns a made-up session of worker 0 in the given slot */
+static SessionRef member(uint32_t slot)
+{
+    SessionRef ref;
+    ref.handle.index = slot;
+    ref.handle.generation = 1;
+    return ref;
+}
+
+/* Joining a room that doesn't exist, by id or by host, is refused rather than read past the end */
+static void testJoinMissingRoom()
+{
+    RoomRegistry rooms;
+    pbuf::RoomInfo info;
+    RoomChange change;
+    CHECK(rooms.join(12345, "", member(1), "alice", &info, &change) ==
+            pbuf::RoomReply::NO_SUCH_ROOM);
+    CHECK(rooms.join(0, "nobody", member(1), "alice", &info, &change) ==
+            pbuf::RoomReply::NO_SUCH_ROOM);
+
+    CHECK(rooms.create(member(2), "host", 4, &info) == pbuf::RoomReply::OK);
+    CHECK(rooms.join(info.id() + 1, "", member(1), "alice", &info, &change) ==
+            pbuf::RoomReply::NO_SUCH_ROOM);
+    CHECK(rooms.roomOf(member(1)) == 0);
+}
+
+/* The host leaving closes the room under the host's name, and frees that name to host again */
+static void testHostLeavesWithMembers()
+{
+    RoomRegistry rooms;
+    pbuf::RoomInfo info;
+    RoomChange change;
+    CHECK(rooms.create(member(1), "host", 4, &info) == pbuf::RoomReply::OK);
+    uint32_t id = info.id();
+    CHECK(rooms.join(id, "", member(2), "bob", &info, &change) == pbuf::RoomReply::OK);
+    CHECK(rooms.join(0, "host", member(3), "carol", &info, &change) == pbuf::RoomReply::OK);
+
+    CHECK(rooms.leave(member(1), &change) == pbuf::RoomReply::OK);
+    CHECK(change.update.closed());
+    CHECK(change.update.room().host() == "host");
+    CHECK(change.recipients.size() == 2);
+    CHECK(rooms.getRoomCount() == 0);
+    CHECK(rooms.roomOf(member(2)) == 0);
+    CHECK(rooms.roomOf(member(3)) == 0);
+
+    /* Neither the host's name nor the first member's is left behind pointing at the room */
+    CHECK(rooms.join(0, "host", member(4), "dave", &info, &change) ==
+            pbuf::RoomReply::NO_SUCH_ROOM);
+    CHECK(rooms.join(0, "bob", member(4), "dave", &info, &change) ==
+            pbuf::RoomReply::NO_SUCH_ROOM);
+    CHECK(rooms.create(member(1), "host", 4, &info) == pbuf::RoomReply::OK);
+    CHECK(rooms.create(member(2), "bob", 4, &info) == pbuf::RoomReply::OK);
+}
+
+/* A member other than the host leaving keeps the room open under the same host */
+static void testMemberLeaves()
+{
+    RoomRegistry rooms;
+    pbuf::RoomInfo info;
+    RoomChange change;
+    CHECK(rooms.create(member(1), "host", 4, &info) == pbuf::RoomReply::OK);
+    CHECK(rooms.join(info.id(), "", member(2), "bob", &info, &change) == pbuf::RoomReply::OK);
+    CHECK(rooms.leave(member(2), &change) == pbuf::RoomReply::OK);
+    CHECK(!change.update.closed());
+    CHECK(change.update.room().host() == "host");
+    CHECK(change.update.members_size() == 1);
+    CHECK(rooms.leave(member(2), &change) == pbuf::RoomReply::NOT_IN_ROOM);
+}
+
+/* A page of rooms stops short of the size limit, and the next page carries on where it stopped */
+static void testListPageSize()
+{
+    RoomRegistry rooms;
+    pbuf::RoomInfo info;
+    for (uint32_t i = 0; i < ROOM_LIST_PAGE; i++) {
+        std::string host = std::string(NAME_MAX_LENGTH, 'a') + std::to_string(i);
+        CHECK(rooms.create(member(i + 1), host, 4, &info) == pbuf::RoomReply::OK);
+    }
+
+    size_t maxBytes = 1000;
+    uint32_t start = 0;
+    uint32_t seen = 0;
+    int pages = 0;
+    do {
+        pbuf::RoomReply reply;
+        rooms.list(start, maxBytes, &reply);
+        CHECK(reply.ByteSizeLong() + ROOM_LIST_RESERVED_BYTES <= maxBytes);
+        CHECK(reply.rooms_size() > 0);
+        seen += reply.rooms_size();
+        start = reply.listnext();
+        pages++;
+    } while (start != 0 && pages < ROOM_LIST_PAGE);
+    CHECK(seen == ROOM_LIST_PAGE);
+    CHECK(pages > 1);
+}
+
+int main()
+{
+    testJoinMissingRoom();
+    testHostLeavesWithMembers();
+    testMemberLeaves();
+    testListPageSize();
+    if (failures != 0) {
+        std::cout << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    std::cout << "All room registry tests passed" << std::endl;
+    return 0;
+}
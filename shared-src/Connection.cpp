@@ -1,4 +1,5 @@
 #include "Connection.h"
+#include "Trace.h"
 
 #if COMPILING_ON_WINDOWS
 
@@ -7,7 +8,7 @@
 #else /* Compiling on linux/mac */
 
 #include <arpa/inet.h>
-#include <sys/select.h>
+#include <poll.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -16,22 +17,222 @@
 #endif
 
 #include <iostream>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 
-/* How many connections can be accepted at TCP level before handling with accept() */
-static const int SOCKET_ACCEPT_BACKLOG = 10;
 
 /*
  * How many seconds between PING requests being sent and how long to reply to one.
- * Note the MAX time to detect a suspended connection is 2*PING_PONG_TIME.
+ * Note the MAX time to detect a suspended connection is 2*PING_PONG_TIME, unless a longer
+ * keep-alive time lets an idle connection wait longer between pings.
  */
 static const float PING_PONG_TIME = 2.5;
 
+/*
+ * Seconds between the kernel's TCP keep-alive probes to a peer that has stopped answering, and
+ * how many it gets to answer before the connection counts as SUSPENDED
+ */
+static const int TCP_KEEPALIVE_INTERVAL = 2;
+static const int TCP_KEEPALIVE_PROBES = 3;
+
+/*
+ * How much each new round trip moves the smoothed round trip time and its mean deviation (the
+ * gains TCP uses), and how much each ping moves the smoothed loss rate
+ */
+static const double RTT_GAIN = 0.125;
+static const double RTT_VARIANCE_GAIN = 0.25;
+static const double LOSS_GAIN = 0.125;
+
 /*
  * How many seconds without receiving any messages from the remote before hard shutdown
  * of this connection. This should be a larger value than 2*PING_PONG_TIME.
  */
 static const float CLOSE_SUSPENDED_TIME = 120;
 
+/* Flags for every send. A peer that has gone away should be reported as an error, not SIGPIPE */
+#if COMPILING_ON_LINUX
+static const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+static const int SEND_FLAGS = 0;
+#endif
+
+/*
+ * The bytes a connection opens with to announce varint framing. To a FIXED16 reader they are an
+ * empty frame, which legacy peers never send since every NetworkMessage sets its type
+ */
+static const char FRAMING_PREAMBLE[3] = { 0, 0, 2 };
+
+/* Longest varint length prefix accepted (enough for any 32-bit length) */
+static const size_t FRAME_VARINT_MAX_BYTES = 5;
+
+/* Returns the time pings are stamped with, in microseconds. Only ever compared to itself */
+static uint64_t probeClockMicros()
+{
+    auto sinceEpoch = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::microseconds>(sinceEpoch).count();
+}
+
+/* Receive buffers are pooled in size classes RECV_BUFFER_SIZE << 0 .. RECV_POOL_CLASSES-1 */
+static const int RECV_POOL_CLASSES = 13;
+
+/* Bytes of free buffers the pool keeps per size class (always at least one buffer) */
+static const size_t RECV_POOL_BYTES_PER_CLASS = 1024 * 1024;
+
+/*
+ * Free receive buffers by size class. Each thread has its own pool, so taking and returning
+ * buffers needs no locking (a connection is only ever polled by one thread at a time)
+ */
+struct RecvBufferPool {
+    std::vector<char*> freeBuffers[RECV_POOL_CLASSES];
+
+    ~RecvBufferPool() {
+        for (std::vector<char*> &buffers : freeBuffers) {
+            for (char *buffer : buffers) {
+                delete[] buffer;
+            }
+        }
+    }
+};
+static thread_local RecvBufferPool recvBufferPool;
+
+/* Take a receive buffer of at least minSize bytes from the pool, setting size to its real size */
+static char * acquireRecvBuffer(size_t minSize, size_t *size)
+{
+    int sizeClass = 0;
+    *size = RECV_BUFFER_SIZE;
+    while (*size < minSize) {
+        *size *= 2;
+        sizeClass++;
+    }
+
+    if (sizeClass < RECV_POOL_CLASSES && !recvBufferPool.freeBuffers[sizeClass].empty()) {
+        char *buffer = recvBufferPool.freeBuffers[sizeClass].back();
+        recvBufferPool.freeBuffers[sizeClass].pop_back();
+        return buffer;
+    }
+    return new char[*size];
+}
+
+/* Give a buffer from acquireRecvBuffer back to the pool, or free it if the pool is full */
+static void releaseRecvBuffer(char *buffer, size_t size)
+{
+    int sizeClass = 0;
+    while (((size_t) RECV_BUFFER_SIZE << sizeClass) < size) {
+        sizeClass++;
+    }
+
+    if (sizeClass < RECV_POOL_CLASSES) {
+        std::vector<char*> &buffers = recvBufferPool.freeBuffers[sizeClass];
+        if (buffers.empty() || (buffers.size() + 1) * size <= RECV_POOL_BYTES_PER_CLASS) {
+            buffers.push_back(buffer);
+            return;
+        }
+    }
+    delete[] buffer;
+}
+
+/* Implementation for SendBudget class */
+
+SendBudget::SendBudget(size_t limit)
+{
+    this->limit = limit;
+    used = 0;
+    framesDropped = 0;
+    pauses = 0;
+    disconnects = 0;
+}
+
+bool SendBudget::charge(size_t bytes)
+{
+    size_t current = used.load(std::memory_order_relaxed);
+    do {
+        if (current + bytes > limit) {
+            return false;
+        }
+    } while (!used.compare_exchange_weak(current, current + bytes, std::memory_order_relaxed));
+    return true;
+}
+
+void SendBudget::release(size_t bytes)
+{
+    used.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+size_t SendBudget::getUsed()
+{
+    return used.load(std::memory_order_relaxed);
+}
+
+size_t SendBudget::getLimit()
+{
+    return limit;
+}
+
+/* Implementation for TrafficCounters class */
+
+TrafficCounters::TrafficCounters()
+{
+    bytesReceived = 0;
+    bytesSent = 0;
+    for (int i = 0; i < NUM_TYPES; i++) {
+        messagesReceived[i] = 0;
+        messagesSent[i] = 0;
+    }
+}
+
+void TrafficCounters::add(std::atomic<uint64_t> &count, uint64_t amount)
+{
+    /* With a single writer a plain load and store can't lose counts, unlike a non-atomic += */
+    count.store(count.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+void TrafficCounters::countBytesReceived(size_t bytes)
+{
+    add(bytesReceived, bytes);
+}
+
+void TrafficCounters::countBytesSent(size_t bytes)
+{
+    add(bytesSent, bytes);
+}
+
+void TrafficCounters::countMessageReceived(pbuf::NetworkMessage::TypeCase type)
+{
+    if (type < NUM_TYPES) {
+        add(messagesReceived[type], 1);
+    }
+}
+
+void TrafficCounters::countMessageSent(pbuf::NetworkMessage::TypeCase type)
+{
+    if (type < NUM_TYPES) {
+        add(messagesSent[type], 1);
+    }
+}
+
+/* Implementation for EncodedMessage class */
+
+std::shared_ptr<const EncodedMessage> EncodedMessage::encode(const pbuf::NetworkMessage &msg)
+{
+    std::shared_ptr<EncodedMessage> encoded(new EncodedMessage());
+    msg.SerializeToString(&encoded->bytes);
+    encoded->type = msg.type_case();
+    return encoded;
+}
+
+const std::string & EncodedMessage::getBytes() const
+{
+    return bytes;
+}
+
+pbuf::NetworkMessage::TypeCase EncodedMessage::getType() const
+{
+    return type;
+}
+
 /* Implementation for Connection class */
 
 void Connection::init()
@@ -51,7 +252,6 @@ WSACleanup();
 
 Connection::Connection(std::string ip, uint16_t port, double timeout, ConnectionCallbacks &callbacks)
 {
-    int flags;
     int err;
 
     struct sockaddr_in address;
@@ -80,7 +280,7 @@ Connection::Connection(std::string ip, uint16_t port, double timeout, Connection
     err = ioctlsocket(sockfd, FIONBIO, &nbmode);
     if (err == SOCKET_ERROR) {
 #else
-    flags = fcntl(sockfd, F_GETFL, 0);
+    int flags = fcntl(sockfd, F_GETFL, 0);
     err = fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
     if (err == -1) {
 #endif
@@ -129,12 +329,55 @@ Connection::Connection(std::string ip, uint16_t port, double timeout, Connection
     openTimeout = timeout;
     cbs = callbacks;
     timer = 0;
-    recvBufferPos = 0;
+#if !COMPILING_ON_WINDOWS
+    timers = nullptr;
+    scheduledDeadline = 0;
+#endif
+    clock = 0;
+    lastHeard = 0;
+    pingInterval = PING_PONG_TIME;
+    keepAliveTime = PING_PONG_TIME * 2;
+    tcpKeepAlive = false;
+    pingSeq = 0;
+    lastPingTime = 0;
+    pingPending = false;
+    probeInterval = 0;
+    linkStats = LinkStats();
+    recvBuffer = nullptr;
+    recvBufferSize = 0;
+    recvBufferStart = 0;
+    recvBufferEnd = 0;
+    recvFrameSize = 0;
+    framingMode = FramingMode::FIXED16;
+    framingDetected = true;
+    maxMessageSize = MAX_MESSAGE_SIZE;
+    msgArena = nullptr;
+    sendBufferStart = 0;
+    sendBytesInFlight = 0;
+    sendLowWatermark = SEND_LOW_WATERMARK;
+    sendHighWatermark = SEND_HIGH_WATERMARK;
+    sendPolicy = SendPolicy::DISCONNECT;
+    sendPaused = false;
+    sendOverflowed = false;
+    sendBudget = nullptr;
+    trafficCounters = nullptr;
     shouldPong = false;
+    pongSeq = 0;
+    pongTime = 0;
+#if !COMPILING_ON_WINDOWS
+    transport = nullptr;
+#endif
 }
 
 Connection::~Connection()
 {
+    if (recvBuffer != nullptr) {
+        releaseRecvBuffer(recvBuffer, recvBufferSize);
+    }
+    if (sendBudget != nullptr) {
+        sendBudget->release(sendBuffer.length() - sendBufferStart + sendBytesInFlight);
+    }
+
 #if COMPILING_ON_WINDOWS
     if (sockfd != INVALID_SOCKET) {
         closesocket(sockfd);
@@ -147,21 +390,61 @@ Connection::~Connection()
 }
 
 #if !COMPILING_ON_WINDOWS
-Connection::Connection(int sockfd)
+Connection::Connection(int sockfd, const struct sockaddr_in *peer)
 {
     currentState = State::ACTIVE;
     this->sockfd = sockfd;
-    recvBufferPos = 0;
+    recvBuffer = nullptr;
+    recvBufferSize = 0;
+    recvBufferStart = 0;
+    recvBufferEnd = 0;
+    recvFrameSize = 0;
+
+    /* The peer decides the framing, announcing anything other than FIXED16 */
+    framingMode = FramingMode::FIXED16;
+    framingDetected = false;
+    maxMessageSize = MAX_MESSAGE_SIZE;
+    msgArena = nullptr;
+    sendBufferStart = 0;
+    sendBytesInFlight = 0;
+    sendLowWatermark = SEND_LOW_WATERMARK;
+    sendHighWatermark = SEND_HIGH_WATERMARK;
+    sendPolicy = SendPolicy::DISCONNECT;
+    sendPaused = false;
+    sendOverflowed = false;
+    sendBudget = nullptr;
+    trafficCounters = nullptr;
     timer = 0;
+    clock = 0;
+    lastHeard = 0;
+    timers = nullptr;
+    scheduledDeadline = 0;
     pingSent = false;
+    pingInterval = PING_PONG_TIME;
+    keepAliveTime = PING_PONG_TIME * 2;
+    tcpKeepAlive = false;
+    pingSeq = 0;
+    lastPingTime = 0;
+    pingPending = false;
+    probeInterval = 0;
+    linkStats = LinkStats();
+    shouldPong = false;
+    pongSeq = 0;
+    pongTime = 0;
+    transport = nullptr;
     cbs.onConnectFail = nullptr;
     cbs.onConnectionLost = nullptr;
     cbs.onConnectSuccess = nullptr;
     cbs.onMsgReceived = nullptr;
-
-    /* Make a record of the remote endpoint details */
-    socklen_t addr_len = sizeof(peerAddr);
-    getpeername(sockfd, (struct sockaddr*) &peerAddr, &addr_len);
+    cbs.onSendBackpressure = nullptr;
+
+    /* Make a record of the remote endpoint details, unless accept already gave them */
+    if (peer != nullptr) {
+        peerAddr = *peer;
+    } else {
+        socklen_t addr_len = sizeof(peerAddr);
+        getpeername(sockfd, (struct sockaddr*) &peerAddr, &addr_len);
+    }
 }
 
 std::string Connection::getPeerIp()
@@ -173,295 +456,704 @@ uint16_t Connection::getPeerPort()
 {
     return ntohs(peerAddr.sin_port);
 }
-#endif
 
-void Connection::sendNetworkMessage(pbuf::NetworkMessage &msg)
+uint32_t Connection::getPeerAddr()
 {
-#if COMPILING_ON_WINDOWS
-    int res;
-#else
-    ssize_t res;
-#endif
+    return peerAddr.sin_addr.s_addr;
+}
 
-    if (currentState == State::DISCONNECTED) {
-        throw ConnectionException("Cannot send data over closed connection");
+bool Connection::detach(ConnectionHandoff &state)
+{
+    if (sockfd < 0 || sendBytesInFlight > 0) {
+        return false;
     }
 
-    std::string serialized = msg.SerializeAsString();
-    if (serialized.empty()) {
-        throw ConnectionException("Error forming name request message");
+    state.sockfd = sockfd;
+    state.framingMode = framingMode;
+    state.framingDetected = framingDetected;
+    if (recvBuffer != nullptr) {
+        state.pendingRecv.assign(&recvBuffer[recvBufferStart], recvBufferEnd - recvBufferStart);
+    } else {
+        state.pendingRecv.clear();
     }
+    state.pendingSend.assign(sendBuffer, sendBufferStart, std::string::npos);
 
-    uint16_t serializedLen = htons(serialized.length());
-#if COMPILING_ON_WINDOWS
-    res = send(sockfd, (char*) &serializedLen, 2, 0);
-#else
-    res = send(sockfd, &serializedLen, 2, 0);
-#endif
-    if (res != 2) {
-        /* 
-         * Lost conn or full buffer. In either case, fail outright for now.
-         * In the future, consider handling full buffer case if it ever actually happens
-         */
-#if COMPILING_ON_WINDOWS
-        closesocket(sockfd);
-        sockfd = INVALID_SOCKET;
-#else
-        close(sockfd);
-        sockfd = -1;
-#endif
-        currentState = State::DISCONNECTED;
-        if (cbs.onConnectionLost != nullptr) {
-            cbs.onConnectionLost(this);
-        }
-        return;
+    /* Keep the socket open and report nothing, since the connection carries on elsewhere */
+    if (sendBudget != nullptr) {
+        sendBudget->release(sendBuffer.length() - sendBufferStart);
     }
+    sendBuffer.clear();
+    sendBufferStart = 0;
+    droppableFrames.clear();
+    recvBufferStart = recvBufferEnd;
+    releaseEmptyRecvBuffer();
+    sockfd = -1;
+    currentState = State::DISCONNECTED;
+    return true;
+}
 
-    res = send(sockfd, serialized.c_str(), serialized.length(), 0);
-    if (res != serialized.length()) {
-        /* 
-         * Lost conn or full buffer. In either case, fail outright for now.
-         * In the future, consider handling full buffer case if it ever actually happens
-         */
-#if COMPILING_ON_WINDOWS
-        closesocket(sockfd);
-        sockfd = INVALID_SOCKET;
-#else
-        close(sockfd);
-        sockfd = -1;
+Connection * Connection::adopt(const ConnectionHandoff &state)
+{
+    Connection *conn = new Connection(state.sockfd);
+    conn->framingMode = state.framingMode;
+    conn->framingDetected = state.framingDetected;
+    conn->sendBuffer = state.pendingSend;
+
+    /* The partial frame is buffered again, and its size noted, as if it had just been received */
+    conn->receiveData(state.pendingRecv.data(), state.pendingRecv.length());
+    return conn;
+}
 #endif
-        currentState = State::DISCONNECTED;
-        if (cbs.onConnectionLost != nullptr) {
-            cbs.onConnectionLost(this);
-        }
-        return;
+
+void Connection::sendNetworkMessage(pbuf::NetworkMessage &msg, bool droppable)
+{
+    size_t msgSize = msg.ByteSizeLong();
+    bool wasEmpty;
+    char *body = reserveFrame(msgSize, msg.type_case(), &wasEmpty);
+    if (body != nullptr) {
+        /* Serialize straight into the send queue behind the length prefix */
+        msg.SerializeWithCachedSizesToArray((uint8_t*) body);
+        commitFrame(msgSize, msg.type_case(), droppable, wasEmpty);
     }
 }
 
-void Connection::poll(double secs)
+void Connection::sendEncodedMessage(const EncodedMessage &msg, bool droppable)
 {
-#if COMPILING_ON_WINDOWS
-    if (currentState == State::DISCONNECTED && sockfd != INVALID_SOCKET) {
-#else
-    if (currentState == State::DISCONNECTED && sockfd >= 0) {
-#endif
-        /* Waiting for socket connect nonblocking result */
+    const std::string &bytes = msg.getBytes();
+    bool wasEmpty;
+    char *body = reserveFrame(bytes.length(), msg.getType(), &wasEmpty);
+    if (body != nullptr) {
+        memcpy(body, bytes.data(), bytes.length());
+        commitFrame(bytes.length(), msg.getType(), droppable, wasEmpty);
+    }
+}
 
-        fd_set fdset;
-        FD_ZERO(&fdset);
-        FD_SET(sockfd, &fdset);
+char * Connection::reserveFrame(size_t msgSize, pbuf::NetworkMessage::TypeCase type,
+        bool *wasEmpty)
+{
+    if (currentState == State::DISCONNECTED) {
+        throw ConnectionException("Cannot send data over closed connection");
+    }
 
-        /* Immediate return (poll) of 'select' function */
-        struct timeval tv;
-        tv.tv_sec = 0;
-        tv.tv_usec = 0;
+    if (msgSize == 0 || msgSize > maxMessageSize ||
+            (framingMode == FramingMode::FIXED16 && msgSize > UINT16_MAX)) {
+        throw ConnectionException("Error forming network message");
+    }
+    size_t frameSize = frameHeaderSize(msgSize) + msgSize;
 
-        int err = select(sockfd+1, NULL, &fdset, NULL, &tv);
+    if (sendOverflowed) {
+        /* Already given up on this peer, it just hasn't been flushed out yet */
+        return nullptr;
+    }
 
-#if COMPILING_ON_WINDOWS
-        if (err == SOCKET_ERROR) {
-            closesocket(sockfd);
-            sockfd = INVALID_SOCKET;
-            throw ConnectionException("Error polling for connection status");
-        }
-        /* err = 0 means timeout for windows and falls through as we want */
-#else
-        if (err < 0) {
-            if (errno != EINTR) { /* Fall through for 'timeout' */
-                /* Error polling socket for connection status */
-                close(sockfd);
-                sockfd = -1;
-                throw ConnectionException("Error polling for connection status");
-            }
-        }
-#endif
-        else if (err > 0) {
+    *wasEmpty = !hasPendingSends();
+    if (sendBudget != nullptr && !sendBudget->charge(frameSize)) {
+        /* Out of memory for send queues overall, so this peer goes regardless of policy */
+        overflowSends();
+        onFrameQueued(type, *wasEmpty);
+        return nullptr;
+    }
 
-            int optval;
-            socklen_t optlen = sizeof(int);
-#if COMPILING_ON_WINDOWS
-            err = getsockopt(sockfd, SOL_SOCKET, SO_ERROR, (char *) &optval, &optlen);
-            if (err != 0 || optval != 0) {
-                /* Error on socket connection */
-                closesocket(sockfd);
-                sockfd = INVALID_SOCKET;
-#else
-            err = getsockopt(sockfd, SOL_SOCKET, SO_ERROR, (void *) &optval, &optlen);
-            if (err < 0 || optval != 0) {
-                /* Error on socket connection */
-                close(sockfd);
-                sockfd = -1;
-#endif
-                if (cbs.onConnectFail != nullptr) {
-                    cbs.onConnectFail(this);
-                }
-                return;
-            }
+    size_t pos = sendBuffer.length();
+    sendBuffer.resize(pos + frameSize);
+    size_t headerSize = writeFrameHeader(&sendBuffer[pos], msgSize);
+    return &sendBuffer[pos + headerSize];
+}
 
-            /* Success */
-            currentState = State::ACTIVE;
-            timer = 0;
-            pingSent = 0;
-            if (cbs.onConnectSuccess != nullptr) {
-                cbs.onConnectSuccess(this);
-            }
-            return;
-        }
+void Connection::commitFrame(size_t msgSize, pbuf::NetworkMessage::TypeCase type,
+        bool droppable, bool wasEmpty)
+{
+    if (trafficCounters != nullptr) {
+        trafficCounters->countMessageSent(type);
+    }
+    if (droppable) {
+        droppableFrames.push_back(sendBuffer.length() - frameHeaderSize(msgSize) - msgSize);
+    }
 
-        /* No interesting result. Make sure we didn't time out and keep waiting */
-        timer += secs;
-        if (timer > openTimeout) {
-            /* Timed out waiting for connection */
-#if COMPILING_ON_WINDOWS
-            closesocket(sockfd);
-            sockfd = INVALID_SOCKET;
-#else
-            close(sockfd);
-            sockfd = -1;
-#endif
-            if (cbs.onConnectFail != nullptr) {
-                cbs.onConnectFail(this);
-            }
-            return;
-        }
+    if (getQueuedSendBytes() > sendHighWatermark) {
+        applySendPolicy();
+    }
+    onFrameQueued(type, wasEmpty);
+}
 
-#if COMPILING_ON_WINDOWS
-    } else if (sockfd != INVALID_SOCKET) {
-#else
-    } else if (sockfd >= 0) {
-#endif
-        /* We have an active / suspended connection. Try receiving */
-        
-        bool recv_again = true;
+void Connection::onFrameQueued(pbuf::NetworkMessage::TypeCase type, bool wasEmpty)
+{
+    /* Anything but a probe is likely to be answered, so stop waiting out a backed-off interval */
+    if (pingInterval > PING_PONG_TIME && type != pbuf::NetworkMessage::kProbeType) {
+        expectAnswer();
+    }
 
-#if COMPILING_ON_WINDOWS
-        int res;
+#if !COMPILING_ON_WINDOWS
+    /* An overflow is reported too, since a stalled peer would otherwise never be flushed out */
+    if (transport != nullptr && (wasEmpty || sendOverflowed)) {
+        transport->sendQueued(this);
+    }
 #else
-        ssize_t res;
+    (void) wasEmpty;
 #endif
+}
 
-        while (recv_again) {
-            recv_again = false;
+void Connection::setSendLimits(size_t lowWatermark, size_t highWatermark, SendPolicy policy)
+{
+    sendLowWatermark = lowWatermark;
+    sendHighWatermark = highWatermark;
+    sendPolicy = policy;
+}
 
-            /* Look for the 2-byte length prefix if we haven't received it yet */
-            if (recvBufferPos < 2) {
-                res = recv(sockfd, &recvBuffer[recvBufferPos], 2 - recvBufferPos, 0);
-#if COMPILING_ON_WINDOWS
-                if (res == 0 || (res == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK)) {
-                    /* Uh oh - a real error and not just nonblocking flagging (or graceful shutdown) */
-                    closesocket(sockfd);
-                    sockfd = INVALID_SOCKET;
-#else
-                if (res == 0 || (res == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
-                    /* Uh oh - a real error and not just nonblocking flagging (or graceful shutdown) */
-                    close(sockfd);
-                    sockfd = -1;
-#endif
-                    currentState = State::DISCONNECTED;
-                    if (cbs.onConnectionLost != nullptr) {
-                        cbs.onConnectionLost(this);
-                    }
-                    return;
-                } else if (res > 0) {
-                    /* We got data! */
-                    recvBufferPos += res;
-                    if (recvBufferPos == 2) {
-                        recvMsgSize = ntohs(*((uint16_t*) &recvBuffer[0]));
-                    }
-                }
-            }
+void Connection::setMessageArena(google::protobuf::Arena *arena)
+{
+    msgArena = arena;
+}
 
-            /* Read recvMsgSize bytes of data to actually be parsed as a NetworkMessage protobuf */
-            if (recvBufferPos >= 2) {
-                res = recv(sockfd, &recvBuffer[recvBufferPos], (recvMsgSize + 2) - recvBufferPos, 0);
-#if COMPILING_ON_WINDOWS
-                if (res == 0 || (res == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK)) {
-                    /* Uh oh - a real error and not just nonblocking flagging (or graceful shutdown) */
-                    closesocket(sockfd);
-                    sockfd = INVALID_SOCKET;
-#else
-                if (res == 0 || (res == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
-                    /* Uh oh - a real error and not just nonblocking flagging (or graceful shutdown) */
-                    close(sockfd);
-                    sockfd = -1;
-#endif
-                    currentState = State::DISCONNECTED;
-                    if (cbs.onConnectionLost != nullptr) {
-                        cbs.onConnectionLost(this);
-                    }
-                    return;
-                } else if (res > 0) {
-                    /* We got data! */
-                    recvBufferPos += res;
-                    if (recvBufferPos == 2 + recvMsgSize) {
-                        /* Got the whole message! Let's parse it */
-                        bool successfulParse = recvMsg.ParseFromArray(&recvBuffer[2], recvMsgSize);
-                        if (!successfulParse) {
-                            /* Parsing failed. No saving this connection now. */
-#if COMPILING_ON_WINDOWS
-                            closesocket(sockfd);
-                            sockfd = INVALID_SOCKET;
+void Connection::setKeepAliveTime(double detectionSecs)
+{
+    /* A ping takes PING_PONG_TIME to answer, so there is no detecting a dead peer any sooner */
+    keepAliveTime = std::max(detectionSecs, (double) PING_PONG_TIME * 2);
+    pingInterval = std::min(pingInterval, keepAliveTime - PING_PONG_TIME);
+    rescheduleTimersIfSooner();
+}
+
+void Connection::setProbeInterval(double probeSecs)
+{
+    probeInterval = probeSecs;
+    rescheduleTimersIfSooner();
+}
+
+LinkStats Connection::getLinkStats()
+{
+    return linkStats;
+}
+
+void Connection::setFramingMode(FramingMode mode)
+{
+    framingMode = mode;
+    framingDetected = true;
+
+    if (mode == FramingMode::VARINT) {
+        /* Announce the framing to the peer ahead of the first message */
+        if (sendBudget != nullptr && !sendBudget->charge(sizeof(FRAMING_PREAMBLE))) {
+            overflowSends();
+            return;
+        }
+        sendBuffer.append(FRAMING_PREAMBLE, sizeof(FRAMING_PREAMBLE));
+    }
+}
+
+void Connection::setMaxMessageSize(size_t size)
+{
+    maxMessageSize = size;
+}
+
+size_t Connection::getMaxSendSize()
+{
+    if (framingMode == FramingMode::FIXED16 && maxMessageSize > UINT16_MAX) {
+        return UINT16_MAX;
+    }
+    return maxMessageSize;
+}
+
+void Connection::setSendBudget(SendBudget *budget)
+{
+    /* Anything already queued (as an adopted connection starts out with) moves to the new budget */
+    size_t queued = sendBuffer.length() - sendBufferStart;
+    if (sendBudget != nullptr) {
+        sendBudget->release(queued);
+    }
+    sendBudget = nullptr;
+    if (budget != nullptr && queued > 0 && !budget->charge(queued)) {
+        overflowSends();
+        budget->disconnects++;
+    }
+    sendBudget = budget;
+}
+
+size_t Connection::getQueuedSendBytes()
+{
+    return sendBuffer.length() - sendBufferStart + sendBytesInFlight;
+}
+
+void Connection::setTrafficCounters(TrafficCounters *counters)
+{
+    trafficCounters = counters;
+}
+
+void Connection::applySendPolicy()
+{
+    switch (sendPolicy) {
+    case SendPolicy::DROP_OLDEST:
+        dropQueuedFrames(getQueuedSendBytes() - sendLowWatermark);
+        if (getQueuedSendBytes() > sendHighWatermark) {
+            /* Not enough droppable messages to make a difference */
+            overflowSends();
+        }
+        break;
+
+    case SendPolicy::PAUSE:
+        if (!sendPaused) {
+            sendPaused = true;
+            if (sendBudget != nullptr) {
+                sendBudget->pauses++;
+            }
+            if (cbs.onSendBackpressure != nullptr) {
+                cbs.onSendBackpressure(this, true);
+            }
+        }
+        break;
+
+    case SendPolicy::DISCONNECT:
+        overflowSends();
+        break;
+    }
+}
+
+void Connection::dropQueuedFrames(size_t bytes)
+{
+    /* Count how many of the oldest droppable frames have to go */
+    size_t numDropped = 0;
+    size_t freed = 0;
+    while (numDropped < droppableFrames.size() && freed < bytes) {
+        freed += queuedFrameLength(droppableFrames[numDropped]);
+        numDropped++;
+    }
+    if (numDropped == 0) {
+        return;
+    }
+
+    /* Close the gaps they leave in a single pass over the queue */
+    size_t write = droppableFrames[0];
+    size_t read = write;
+    for (size_t i = 0; i < numDropped; i++) {
+        size_t frame = droppableFrames[i];
+        memmove(&sendBuffer[write], &sendBuffer[read], frame - read);
+        write += frame - read;
+        read = frame + queuedFrameLength(frame);
+    }
+    memmove(&sendBuffer[write], &sendBuffer[read], sendBuffer.length() - read);
+    sendBuffer.resize(sendBuffer.length() - freed);
+
+    droppableFrames.erase(droppableFrames.begin(), droppableFrames.begin() + numDropped);
+    for (size_t &frame : droppableFrames) {
+        frame -= freed;
+    }
+
+    if (sendBudget != nullptr) {
+        sendBudget->release(freed);
+        sendBudget->framesDropped += numDropped;
+    }
+}
+
+size_t Connection::queuedFrameLength(size_t pos)
+{
+    size_t msgSize;
+    int headerSize = readFrameHeader(&sendBuffer[pos], sendBuffer.length() - pos, &msgSize);
+    return headerSize + msgSize;
+}
+
+void Connection::overflowSends()
+{
+    if (sendBudget != nullptr) {
+        sendBudget->release(sendBuffer.length() - sendBufferStart);
+        sendBudget->disconnects++;
+    }
+    sendBuffer.clear();
+    sendBufferStart = 0;
+    droppableFrames.clear();
+    sendOverflowed = true;
+}
+
+void Connection::checkSendResume()
+{
+    if (sendPaused && getQueuedSendBytes() <= sendLowWatermark) {
+        sendPaused = false;
+        if (cbs.onSendBackpressure != nullptr) {
+            cbs.onSendBackpressure(this, false);
+        }
+    }
+}
+
+bool Connection::flushSends()
+{
+#if COMPILING_ON_WINDOWS
+    int res;
+    if (sockfd == INVALID_SOCKET) {
+#else
+    ssize_t res;
+    if (sockfd < 0) {
+#endif
+        return true;
+    }
+
+    if (sendOverflowed) {
+        loseConnection();
+        return false;
+    }
+
+    size_t pending = sendBuffer.length() - sendBufferStart;
+    if (pending == 0) {
+        return true;
+    }
+
+    res = send(sockfd, &sendBuffer[sendBufferStart], pending, SEND_FLAGS);
+    if (res < 0) {
+#if COMPILING_ON_WINDOWS
+        if (WSAGetLastError() == WSAEWOULDBLOCK) {
 #else
-                            close(sockfd);
-                            sockfd = -1;
-#endif
-                            currentState = State::DISCONNECTED;
-                            if (cbs.onConnectionLost != nullptr) {
-                                cbs.onConnectionLost(this);
-                            }
-                            return;
-                        }
-                        if (currentState != State::ACTIVE) {
-                            currentState = State::ACTIVE;
-                            if (cbs.onConnectionResumed != nullptr) {
-                                cbs.onConnectionResumed(this);
-                            }                        
-                        }
-
-                        if (recvMsg.type_case() == pbuf::NetworkMessage::kProbeType) {
-
-                            if (recvMsg.probetype() == pbuf::NetworkMessage_ProbeType_PING) { 
-                                /* Handle ping: flag to send pong once safe to do so */
-                                shouldPong = true;
-                            }
-                            
-                            /* Do nothing for pong (except resetting connection timer below) */
-
-                        } else if (cbs.onMsgReceived != nullptr) {
-                            cbs.onMsgReceived(this, recvMsg);
-                        }
-                        timer = 0;
-                        pingSent = false;
-                        recvBufferPos = 0; /* Prepare to read next message */
-                        recv_again = true;
-                    }
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+#endif
+            /* Socket buffer is full. Keep everything queued for the next flush */
+            return true;
+        }
+        loseConnection();
+        return false;
+    }
+
+    /* Anything not written (a full socket buffer) stays queued for the next flush */
+    sendBufferStart += res;
+    if (trafficCounters != nullptr) {
+        trafficCounters->countBytesSent(res);
+    }
+    if (sendBudget != nullptr) {
+        sendBudget->release(res);
+    }
+    while (!droppableFrames.empty() && droppableFrames.front() < sendBufferStart) {
+        /* Partly written frames can no longer be dropped */
+        droppableFrames.pop_front();
+    }
+
+    if (sendBufferStart == sendBuffer.length()) {
+        sendBuffer.clear();
+        sendBufferStart = 0;
+    } else if (sendBufferStart * 2 >= sendBuffer.length()) {
+        sendBuffer.erase(0, sendBufferStart);
+        for (size_t &frame : droppableFrames) {
+            frame -= sendBufferStart;
+        }
+        sendBufferStart = 0;
+    }
+
+    checkSendResume();
+    return true;
+}
+
+bool Connection::hasPendingSends()
+{
+    /* An overflowed queue is reported as pending so the flush that loses the connection happens */
+    return sendOverflowed || sendBufferStart < sendBuffer.length();
+}
+
+bool Connection::hasSendOverflowed()
+{
+    return sendOverflowed;
+}
+
+bool Connection::takePendingSends(std::string &out)
+{
+    if (sendOverflowed) {
+        loseConnection();
+        return false;
+    }
+
+    if (sendBufferStart == 0) {
+        out.swap(sendBuffer);
+    } else {
+        out.assign(sendBuffer, sendBufferStart, std::string::npos);
+    }
+    sendBytesInFlight += out.length();
+    sendBuffer.clear();
+    sendBufferStart = 0;
+    droppableFrames.clear();
+    return true;
+}
+
+void Connection::sendCompleted(size_t bytes)
+{
+    sendBytesInFlight -= bytes;
+    if (trafficCounters != nullptr) {
+        trafficCounters->countBytesSent(bytes);
+    }
+    if (sendBudget != nullptr) {
+        sendBudget->release(bytes);
+    }
+    checkSendResume();
+}
+
+void Connection::poll(double secs)
+{
+    TRACE_ZONE("Connection::poll");
+#if COMPILING_ON_WINDOWS
+    if (currentState == State::DISCONNECTED && sockfd != INVALID_SOCKET) {
+#else
+    if (currentState == State::DISCONNECTED && sockfd >= 0) {
+#endif
+        /* Waiting for socket connect nonblocking result */
+
+#if COMPILING_ON_WINDOWS
+        fd_set fdset;
+        FD_ZERO(&fdset);
+        FD_SET(sockfd, &fdset);
+
+        /* Immediate return (poll) of 'select' function */
+        struct timeval tv;
+        tv.tv_sec = 0;
+        tv.tv_usec = 0;
+
+        int err = select(sockfd+1, NULL, &fdset, NULL, &tv);
+#else
+        /* Immediate return of 'poll', which unlike select copes with descriptors past FD_SETSIZE */
+        struct pollfd pfd;
+        pfd.fd = sockfd;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+
+        int err = ::poll(&pfd, 1, 0);
+#endif
+
+#if COMPILING_ON_WINDOWS
+        if (err == SOCKET_ERROR) {
+            closesocket(sockfd);
+            sockfd = INVALID_SOCKET;
+            throw ConnectionException("Error polling for connection status");
+        }
+        /* err = 0 means timeout for windows and falls through as we want */
+#else
+        if (err < 0) {
+            if (errno != EINTR) { /* Fall through for 'timeout' */
+                /* Error polling socket for connection status */
+                close(sockfd);
+                sockfd = -1;
+                throw ConnectionException("Error polling for connection status");
+            }
+        }
+#endif
+        else if (err > 0) {
+
+            int optval;
+            socklen_t optlen = sizeof(int);
+#if COMPILING_ON_WINDOWS
+            err = getsockopt(sockfd, SOL_SOCKET, SO_ERROR, (char *) &optval, &optlen);
+            if (err != 0 || optval != 0) {
+                /* Error on socket connection */
+                closesocket(sockfd);
+                sockfd = INVALID_SOCKET;
+#else
+            err = getsockopt(sockfd, SOL_SOCKET, SO_ERROR, (void *) &optval, &optlen);
+            if (err < 0 || optval != 0) {
+                /* Error on socket connection */
+                close(sockfd);
+                sockfd = -1;
+#endif
+                if (cbs.onConnectFail != nullptr) {
+                    cbs.onConnectFail(this);
                 }
+                return;
             }
+
+            /* Success */
+            currentState = State::ACTIVE;
+            lastHeard = currentTime();
+            pingSent = 0;
+            if (cbs.onConnectSuccess != nullptr) {
+                cbs.onConnectSuccess(this);
+            }
+            return;
         }
 
+        /* No interesting result. Make sure we didn't time out and keep waiting */
         timer += secs;
+        if (timer > openTimeout) {
+            /* Timed out waiting for connection */
+#if COMPILING_ON_WINDOWS
+            closesocket(sockfd);
+            sockfd = INVALID_SOCKET;
+#else
+            close(sockfd);
+            sockfd = -1;
+#endif
+            if (cbs.onConnectFail != nullptr) {
+                cbs.onConnectFail(this);
+            }
+            return;
+        }
 
-        if (timer >= PING_PONG_TIME && !pingSent) {
-            /* Send ping */
-            pingSent = true;
-            pbuf::NetworkMessage pingMsg;
-            pingMsg.set_probetype(pbuf::NetworkMessage_ProbeType_PING);
-            sendNetworkMessage(pingMsg);
+#if COMPILING_ON_WINDOWS
+    } else if (sockfd != INVALID_SOCKET) {
+#else
+    } else if (sockfd >= 0) {
+#endif
+        /* We have an active / suspended connection. Try receiving */
+        clock += secs;
+        if (!receiveMessages()) {
+            return;
         }
 
-        if (timer >= PING_PONG_TIME*2 && currentState == State::ACTIVE) {
-            currentState = State::SUSPENDED;
-            if (cbs.onConnectionSuspended != nullptr) {
-                cbs.onConnectionSuspended(this);
-            }
+        if (!updateTimers()) {
+            return;
         }
 
-        /* Close out long-term inactive socket */
-        if (timer >= CLOSE_SUSPENDED_TIME) {
+        sendPendingPong();
+        flushOwnSends();
+    }
+}
+
+#if !COMPILING_ON_WINDOWS
+int Connection::getSocketFd()
+{
+    return sockfd;
+}
+
+void Connection::pollReadable()
+{
+    if (currentState == State::DISCONNECTED || sockfd < 0) {
+        return;
+    }
+
+    if (!receiveMessages()) {
+        return;
+    }
+
+    sendPendingPong();
+    flushOwnSends();
+}
+
+void Connection::pollTimers(double secs)
+{
+    if (currentState == State::DISCONNECTED || sockfd < 0) {
+        return;
+    }
+
+    clock += secs;
+    if (!updateTimers()) {
+        return;
+    }
+
+    sendPendingPong();
+    flushOwnSends();
+}
+
+void Connection::setTimers(ConnectionTimers *timers)
+{
+    this->timers = timers;
+    if (timers != nullptr) {
+        /* Deadlines are now on the service's clock, so start them afresh */
+        lastHeard = timers->now();
+        scheduleTimers();
+    }
+}
+
+void Connection::runTimers()
+{
+    if (currentState == State::DISCONNECTED || sockfd < 0) {
+        return;
+    }
+
+    if (!updateTimers()) {
+        return;
+    }
+
+    sendPendingPong();
+    flushOwnSends();
+}
+
+#if COMPILING_ON_LINUX
+void Connection::enableTcpKeepAlive()
+{
+    /* Start probing early enough for every probe to have gone out by the keep-alive time */
+    int idle = std::max((int) keepAliveTime - TCP_KEEPALIVE_INTERVAL * TCP_KEEPALIVE_PROBES, 1);
+    const int optVal = 1;
+    int err = setsockopt(sockfd, SOL_SOCKET, SO_KEEPALIVE, &optVal, sizeof(optVal));
+    if (err == 0) {
+        err = setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    }
+    if (err == 0) {
+        err = setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPINTVL, &TCP_KEEPALIVE_INTERVAL,
+                sizeof(TCP_KEEPALIVE_INTERVAL));
+    }
+    if (err == 0) {
+        err = setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPCNT, &TCP_KEEPALIVE_PROBES,
+                sizeof(TCP_KEEPALIVE_PROBES));
+    }
+    if (err < 0) {
+        throw ConnectionException("Failed to enable TCP keep-alive on socket");
+    }
+    tcpKeepAlive = true;
+}
+#endif
+
+void Connection::setTransport(ConnectionTransport *transport)
+{
+    this->transport = transport;
+    if (transport != nullptr && hasPendingSends()) {
+        transport->sendQueued(this);
+    }
+}
+
+void Connection::receiveData(const char *data, size_t len)
+{
+    if (currentState == State::DISCONNECTED || sockfd < 0) {
+        return;
+    }
+    if (trafficCounters != nullptr) {
+        trafficCounters->countBytesReceived(len);
+    }
+
+    /* With nothing buffered, complete frames are handled straight out of the transport's buffer */
+    if (recvBufferStart == recvBufferEnd) {
+        size_t used;
+        if (!handleReceivedFrames(data, len, &used)) {
+            return;
+        }
+        data += used;
+        len -= used;
+    }
+
+    /* Buffer whatever is left, handling frames as they are completed */
+    while (len > 0) {
+        prepareRecvBuffer();
+        size_t space = recvBufferSize - recvBufferEnd;
+        size_t taken = (len < space) ? len : space;
+        memcpy(&recvBuffer[recvBufferEnd], data, taken);
+        recvBufferEnd += taken;
+        data += taken;
+        len -= taken;
+
+        if (!handleBufferedFrames()) {
+            return;
+        }
+    }
+
+    sendPendingPong();
+}
+
+void Connection::transportLost()
+{
+    if (sockfd < 0) {
+        return;
+    }
+    loseConnection();
+}
+#endif
+
+bool Connection::receiveMessages()
+{
 #if COMPILING_ON_WINDOWS
+    int res;
+#else
+    ssize_t res;
+#endif
+
+    while (true) {
+        /* Read as much as fits in one go, then handle every complete frame that arrived */
+        prepareRecvBuffer();
+        size_t space = recvBufferSize - recvBufferEnd;
+        res = recv(sockfd, &recvBuffer[recvBufferEnd], space, 0);
+#if COMPILING_ON_WINDOWS
+        if (res == 0 || (res == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK)) {
+            /* Uh oh - a real error and not just nonblocking flagging (or graceful shutdown) */
             closesocket(sockfd);
             sockfd = INVALID_SOCKET;
 #else
+        if (res == 0 || (res == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            /* Uh oh - a real error and not just nonblocking flagging (or graceful shutdown) */
             close(sockfd);
             sockfd = -1;
 #endif
@@ -469,18 +1161,472 @@ void Connection::poll(double secs)
             if (cbs.onConnectionLost != nullptr) {
                 cbs.onConnectionLost(this);
             }
-            return;
+            return false;
+        } else if (res < 0) {
+            /* Nothing more to read for now */
+            releaseEmptyRecvBuffer();
+            return true;
+        }
+
+        /* We got data! */
+        recvBufferEnd += res;
+        if (trafficCounters != nullptr) {
+            trafficCounters->countBytesReceived(res);
+        }
+        if (!handleBufferedFrames()) {
+            return false;
+        }
+
+        if ((size_t) res < space) {
+            /* A short read means the socket has been drained, so skip the extra recv */
+            return true;
+        }
+    }
+}
+
+bool Connection::handleBufferedFrames()
+{
+    size_t used;
+    if (!handleReceivedFrames(&recvBuffer[recvBufferStart], recvBufferEnd - recvBufferStart, &used)) {
+        return false;
+    }
+
+    recvBufferStart += used;
+    releaseEmptyRecvBuffer();
+    return true;
+}
+
+bool Connection::handleReceivedFrames(const char *data, size_t len, size_t *used)
+{
+    size_t pos = 0;
+    recvFrameSize = 0;
+
+    if (!framingDetected) {
+        /* Incoming connections announce varint framing with a preamble before any message */
+        if (len >= 1 && data[0] != 0) {
+            framingDetected = true;
+        } else if (len >= 2 && data[1] != 0) {
+            framingDetected = true;
+        } else if (len >= sizeof(FRAMING_PREAMBLE)) {
+            if (memcmp(data, FRAMING_PREAMBLE, sizeof(FRAMING_PREAMBLE)) != 0) {
+                /* Unknown framing version */
+                loseConnection();
+                return false;
+            }
+            framingMode = FramingMode::VARINT;
+            framingDetected = true;
+            pos = sizeof(FRAMING_PREAMBLE);
+        } else {
+            *used = 0;
+            return true;
+        }
+    }
+
+    while (pos < len) {
+        size_t msgSize;
+        int headerSize = readFrameHeader(&data[pos], len - pos, &msgSize);
+        if (headerSize < 0 || msgSize > maxMessageSize) {
+            /* Malformed, or a message we are not willing to buffer */
+            loseConnection();
+            return false;
+        }
+        if (headerSize == 0) {
+            /* Only part of the length has arrived so far */
+            break;
+        }
+        if (len - pos < headerSize + msgSize) {
+            /* Only part of this frame has arrived so far. Note its size so it can be made room for */
+            recvFrameSize = headerSize + msgSize;
+            break;
+        }
+
+        if (!handleReceivedMessage(&data[pos + headerSize], msgSize)) {
+            return false;
+        }
+        pos += headerSize + msgSize;
+    }
+
+    *used = pos;
+    return true;
+}
+
+int Connection::readFrameHeader(const char *data, size_t len, size_t *msgSize)
+{
+    if (framingMode == FramingMode::FIXED16) {
+        if (len < 2) {
+            return 0;
+        }
+        uint16_t prefix;
+        memcpy(&prefix, data, 2);
+        *msgSize = ntohs(prefix);
+        return 2;
+    }
+
+    /* Base-128 varint, least significant group first */
+    size_t size = 0;
+    for (size_t i = 0; i < FRAME_VARINT_MAX_BYTES; i++) {
+        if (i == len) {
+            return 0;
+        }
+        uint8_t byte = data[i];
+        size |= (size_t) (byte & 0x7f) << (7 * i);
+        if (!(byte & 0x80)) {
+            *msgSize = size;
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+size_t Connection::writeFrameHeader(char *out, size_t msgSize)
+{
+    if (framingMode == FramingMode::FIXED16) {
+        uint16_t prefix = htons(msgSize);
+        memcpy(out, &prefix, 2);
+        return 2;
+    }
+
+    size_t i = 0;
+    while (msgSize >= 0x80) {
+        out[i++] = (char) (msgSize | 0x80);
+        msgSize >>= 7;
+    }
+    out[i++] = (char) msgSize;
+    return i;
+}
+
+size_t Connection::frameHeaderSize(size_t msgSize)
+{
+    if (framingMode == FramingMode::FIXED16) {
+        return 2;
+    }
+
+    size_t bytes = 1;
+    while (msgSize >= 0x80) {
+        msgSize >>= 7;
+        bytes++;
+    }
+    return bytes;
+}
+
+void Connection::prepareRecvBuffer()
+{
+    if (recvBuffer == nullptr) {
+        recvBuffer = acquireRecvBuffer(RECV_BUFFER_SIZE, &recvBufferSize);
+        recvBufferStart = 0;
+        recvBufferEnd = 0;
+    }
+
+    /* Make room for the whole of a partial frame whose size is known, or at least one more byte */
+    size_t pending = recvBufferEnd - recvBufferStart;
+    size_t needed = (recvFrameSize > pending) ? recvFrameSize : pending + 1;
+    if (recvBufferStart + needed <= recvBufferSize) {
+        return;
+    }
+
+    if (needed <= recvBufferSize) {
+        /* Move the partial frame back to the front */
+        memmove(recvBuffer, &recvBuffer[recvBufferStart], pending);
+    } else {
+        /* Large message: swap in a pooled buffer big enough to reassemble all of it */
+        size_t biggerSize;
+        char *bigger = acquireRecvBuffer(needed, &biggerSize);
+        memcpy(bigger, &recvBuffer[recvBufferStart], pending);
+        releaseRecvBuffer(recvBuffer, recvBufferSize);
+        recvBuffer = bigger;
+        recvBufferSize = biggerSize;
+    }
+    recvBufferStart = 0;
+    recvBufferEnd = pending;
+}
+
+void Connection::releaseEmptyRecvBuffer()
+{
+    /* Idle connections hold no receive buffer at all */
+    if (recvBuffer != nullptr && recvBufferStart == recvBufferEnd) {
+        releaseRecvBuffer(recvBuffer, recvBufferSize);
+        recvBuffer = nullptr;
+        recvBufferSize = 0;
+        recvBufferStart = 0;
+        recvBufferEnd = 0;
+    }
+}
+
+bool Connection::handleReceivedMessage(const char *data, int size)
+{
+    /*
+     * Parse into the arena when there is one, since the connection's own message frees and
+     * reallocates string fields as the oneof changes
+     */
+    pbuf::NetworkMessage *msg = &recvMsg;
+    if (msgArena != nullptr) {
+        msg = google::protobuf::Arena::CreateMessage<pbuf::NetworkMessage>(msgArena);
+    }
+
+    bool successfulParse = msg->ParseFromArray(data, size);
+    if (!successfulParse) {
+        /* Parsing failed. No saving this connection now. */
+        loseConnection();
+        return false;
+    }
+    if (trafficCounters != nullptr) {
+        trafficCounters->countMessageReceived(msg->type_case());
+    }
+    bool resumed = (currentState != State::ACTIVE);
+    if (resumed) {
+        /* A connection that has only just recovered is watched as closely as a busy one */
+        currentState = State::ACTIVE;
+        pingInterval = PING_PONG_TIME;
+        if (cbs.onConnectionResumed != nullptr) {
+            cbs.onConnectionResumed(this);
+        }
+    }
+
+    if (msg->type_case() == pbuf::NetworkMessage::kProbeType) {
+
+        if (msg->probetype() == pbuf::NetworkMessage_ProbeType_PING) { 
+            /* Handle ping: flag to send pong once safe to do so */
+            shouldPong = true;
+            pongSeq = msg->probeseq();
+            pongTime = msg->probetime();
+        } else {
+            measurePong(msg->probeseq(), msg->probetime());
+
+            if (pingSent && !resumed) {
+                /*
+                 * Nothing but the answer to our ping was heard, so the connection is idle but
+                 * healthy: wait longer before the next one, as long as a dead peer is still
+                 * noticed in time
+                 */
+                pingInterval = std::min(pingInterval * 2, keepAliveTime - PING_PONG_TIME);
+            }
+        }
+
+    } else {
+        pingInterval = PING_PONG_TIME;
+        if (cbs.onMsgReceived != nullptr) {
+            cbs.onMsgReceived(this, *msg);
+        }
+    }
+
+    /*
+     * Usually this only moves the deadlines along, which the timer service finds out about lazily
+     * when the old one comes up. After a ping, the next deadline can be sooner than the one
+     * scheduled, so it has to be brought forward
+     */
+    lastHeard = currentTime();
+    pingSent = false;
+    rescheduleTimersIfSooner();
+    return true;
+}
+
+void Connection::loseConnection()
+{
+#if COMPILING_ON_WINDOWS
+    closesocket(sockfd);
+    sockfd = INVALID_SOCKET;
+#else
+    close(sockfd);
+    sockfd = -1;
+#endif
+    currentState = State::DISCONNECTED;
+    if (cbs.onConnectionLost != nullptr) {
+        cbs.onConnectionLost(this);
+    }
+}
+
+double Connection::currentTime()
+{
+#if !COMPILING_ON_WINDOWS
+    if (timers != nullptr) {
+        return timers->now();
+    }
+#endif
+    return clock;
+}
+
+#if !COMPILING_ON_WINDOWS
+void Connection::scheduleTimers()
+{
+    scheduledDeadline = nextTimerDeadline();
+    timers->schedule(this, scheduledDeadline);
+}
+#endif
+
+void Connection::rescheduleTimersIfSooner()
+{
+#if !COMPILING_ON_WINDOWS
+    if (timers != nullptr && nextTimerDeadline() < scheduledDeadline) {
+        scheduleTimers();
+    }
+#endif
+}
+
+double Connection::nextTimerDeadline()
+{
+    double deadline;
+    if (!pingSent && !tcpKeepAlive) {
+        deadline = lastHeard + pingInterval;
+    } else if (currentState == State::ACTIVE) {
+        deadline = lastHeard + getSuspendTime();
+    } else {
+        deadline = lastHeard + CLOSE_SUSPENDED_TIME;
+    }
+
+    if (probeInterval > 0 && !pingSent) {
+        deadline = std::min(deadline, lastPingTime + probeInterval);
+    }
+    return deadline;
+}
+
+double Connection::getSuspendTime()
+{
+    return tcpKeepAlive ? keepAliveTime : pingInterval + PING_PONG_TIME;
+}
+
+void Connection::expectAnswer()
+{
+    double silentTime = currentTime() - lastHeard;
+    if (silentTime + PING_PONG_TIME < pingInterval) {
+        pingInterval = std::max(silentTime + PING_PONG_TIME, (double) PING_PONG_TIME);
+        rescheduleTimersIfSooner();
+    }
+}
+
+bool Connection::updateTimers()
+{
+    double silentTime = currentTime() - lastHeard;
+
+#if COMPILING_ON_LINUX
+    if (tcpKeepAlive && silentTime >= keepAliveTime) {
+        /* The peer's TCP stack answering the kernel's probes counts as hearing from the peer */
+        struct tcp_info info;
+        socklen_t infoLen = sizeof(info);
+        if (getsockopt(sockfd, IPPROTO_TCP, TCP_INFO, &info, &infoLen) == 0 &&
+                info.tcpi_last_ack_recv / 1000.0 < silentTime) {
+            silentTime = info.tcpi_last_ack_recv / 1000.0;
+            lastHeard = currentTime() - silentTime;
+            if (currentState != State::ACTIVE) {
+                currentState = State::ACTIVE;
+                if (cbs.onConnectionResumed != nullptr) {
+                    cbs.onConnectionResumed(this);
+                }
+            }
         }
+    }
+#endif
 
-        /* Safe to pong here since if conn is destroyed up stack we don't explode */
-        if (shouldPong) {
-            shouldPong = false;
-            pbuf::NetworkMessage pongMsg;
-            pongMsg.set_probetype(pbuf::NetworkMessage_ProbeType_PONG);
-            sendNetworkMessage(pongMsg);
+    bool probeDue = (probeInterval > 0 && currentTime() - lastPingTime >= probeInterval);
+    if (((silentTime >= pingInterval && !tcpKeepAlive) || probeDue) && !pingSent) {
+        sendPing();
+    }
+
+    if (silentTime >= getSuspendTime() && currentState == State::ACTIVE) {
+        if (pingPending) {
+            countPing(true);
         }
+        currentState = State::SUSPENDED;
+        if (cbs.onConnectionSuspended != nullptr) {
+            cbs.onConnectionSuspended(this);
+        }
+    }
 
+    /* Close out long-term inactive socket */
+    if (silentTime >= CLOSE_SUSPENDED_TIME) {
+#if COMPILING_ON_WINDOWS
+        closesocket(sockfd);
+        sockfd = INVALID_SOCKET;
+#else
+        close(sockfd);
+        sockfd = -1;
+#endif
+        currentState = State::DISCONNECTED;
+        if (cbs.onConnectionLost != nullptr) {
+            cbs.onConnectionLost(this);
+        }
+        return false;
     }
+
+#if !COMPILING_ON_WINDOWS
+    if (timers != nullptr) {
+        scheduleTimers();
+    }
+#endif
+    return true;
+}
+
+void Connection::flushOwnSends()
+{
+#if !COMPILING_ON_WINDOWS
+    if (transport != nullptr) {
+        /* The transport flushes when it sees fit */
+        return;
+    }
+#endif
+    flushSends();
+}
+
+void Connection::sendPendingPong()
+{
+    /* Safe to pong here since if conn is destroyed up stack we don't explode */
+    if (shouldPong) {
+        shouldPong = false;
+        pbuf::NetworkMessage pongMsg;
+        pongMsg.set_probetype(pbuf::NetworkMessage_ProbeType_PONG);
+        pongMsg.set_probeseq(pongSeq);
+        pongMsg.set_probetime(pongTime);
+        sendNetworkMessage(pongMsg);
+    }
+}
+
+void Connection::sendPing()
+{
+    /* A ping still unanswered when the next one goes out is as good as lost */
+    if (pingPending) {
+        countPing(true);
+    }
+
+    pingSent = true;
+    pingPending = true;
+    lastPingTime = currentTime();
+    pingSeq = (pingSeq == UINT32_MAX) ? 1 : pingSeq + 1;
+
+    pbuf::NetworkMessage pingMsg;
+    pingMsg.set_probetype(pbuf::NetworkMessage_ProbeType_PING);
+    pingMsg.set_probeseq(pingSeq);
+    pingMsg.set_probetime(probeClockMicros());
+    sendNetworkMessage(pingMsg);
+}
+
+void Connection::measurePong(uint32_t seq, uint64_t sentMicros)
+{
+    /* Peers that don't measure send back nothing to measure with, as would a bogus echo */
+    uint64_t nowMicros = probeClockMicros();
+    if (seq == 0 || seq > pingSeq || sentMicros > nowMicros) {
+        return;
+    }
+
+    double rtt = (nowMicros - sentMicros) / 1000000.0;
+    if (linkStats.rttSamples == 0) {
+        linkStats.smoothedRtt = rtt;
+        linkStats.rttVariance = rtt / 2;
+    } else {
+        double deviation = std::abs(linkStats.smoothedRtt - rtt);
+        linkStats.rttVariance += RTT_VARIANCE_GAIN * (deviation - linkStats.rttVariance);
+        linkStats.smoothedRtt += RTT_GAIN * (rtt - linkStats.smoothedRtt);
+    }
+    linkStats.rttSamples++;
+
+    /* Only the latest ping counts towards loss. Earlier ones were counted when it was sent */
+    if (seq == pingSeq && pingPending) {
+        countPing(rtt > PING_PONG_TIME);
+    }
+}
+
+void Connection::countPing(bool lost)
+{
+    pingPending = false;
+    linkStats.lossRate += LOSS_GAIN * ((lost ? 1.0 : 0.0) - linkStats.lossRate);
 }
 
 int Connection::getSuspendedTimeLeft()
@@ -489,11 +1635,12 @@ int Connection::getSuspendedTimeLeft()
         return CLOSE_SUSPENDED_TIME;
     }
 
-    if (timer > CLOSE_SUSPENDED_TIME) {
+    double silentTime = currentTime() - lastHeard;
+    if (silentTime > CLOSE_SUSPENDED_TIME) {
         return 0;
     }
 
-    return (CLOSE_SUSPENDED_TIME - timer);
+    return (CLOSE_SUSPENDED_TIME - silentTime);
 }
 
 
@@ -512,38 +1659,43 @@ void Connection::setOnConnectionResumedCallback(std::function<void(Connection*)>
     cbs.onConnectionResumed = cb;
 }
 
-void Connection::setOnMsgReceivedCallback(std::function<void(Connection*, pbuf::NetworkMessage)> cb)
+void Connection::setOnMsgReceivedCallback(std::function<void(Connection*, const pbuf::NetworkMessage&)> cb)
 {
     cbs.onMsgReceived = cb;
 }
 
+void Connection::setOnSendBackpressureCallback(std::function<void(Connection*, bool)> cb)
+{
+    cbs.onSendBackpressure = cb;
+}
+
 
 /* Implementation for Listener class */
 #if COMPILING_ON_LINUX
 
-Listener::Listener(uint16_t port, std::function<void(Connection*)> cb)
+Listener::Listener(uint16_t port, std::function<void(Connection*)> cb, int backlog,
+        int deferAcceptSecs)
 {
-    int flags;
     int err;
 
     callback = cb;
 
-    /* Create the socket file descriptor */
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    /* Create the socket file descriptor, in nonblocking mode */
+    sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (sockfd < 0) { 
         throw ListenerException("Socket creation failed");
     }
 
-    /* Set the socket to nonblocking mode */
-    flags = fcntl(sockfd, F_GETFL, 0);
-    err = fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
-    if (err == -1) {
-        throw ListenerException("Failed to set socket to nonblocking mode");
-    }
-
-    /* Allow address and port reuse for reliable binding */
+    /*
+     * Allow address and port reuse for reliable binding. Port reuse also lets several listeners
+     * bind the same port, with the kernel load balancing incoming connections between them
+     */
     const int optVal = 1;
-    err = setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &optVal, sizeof(optVal));
+    err = setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &optVal, sizeof(optVal));
+    if (err < 0) {
+        throw ListenerException("Socket options set failed");
+    }
+    err = setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &optVal, sizeof(optVal));
     if (err < 0) {
         throw ListenerException("Socket options set failed");
     }
@@ -556,13 +1708,19 @@ Listener::Listener(uint16_t port, std::function<void(Connection*)> cb)
         throw ListenerException("Socket option TCP_USER_TIMEOUT set failed");
     }
 
-    struct sockaddr_in address = {
-        .sin_family = AF_INET,
-        .sin_port = htons(port),
-        .sin_addr = (in_addr) {
-            .s_addr = INADDR_ANY
+    if (deferAcceptSecs > 0) {
+        err = setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &deferAcceptSecs,
+                sizeof(deferAcceptSecs));
+        if (err < 0) {
+            throw ListenerException("Socket option TCP_DEFER_ACCEPT set failed");
         }
-    };
+    }
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = INADDR_ANY;
 
     /* Bind to port specified in parameter */
     err = bind(sockfd, (struct sockaddr *) &address, sizeof(address));
@@ -571,7 +1729,7 @@ Listener::Listener(uint16_t port, std::function<void(Connection*)> cb)
     }
 
     /* Start listening */
-    err = listen(sockfd, SOCKET_ACCEPT_BACKLOG);
+    err = listen(sockfd, backlog);
     if (err < 0) { 
         throw ListenerException("Socket failed to start listening");
     }
@@ -582,27 +1740,73 @@ Listener::~Listener()
     close(sockfd);
 }
 
-void Listener::poll()
+int Listener::getSocketFd()
 {
-    int newsock = accept(sockfd, NULL, NULL);
-    while (newsock != -1) {
-        
-        /* Set the socket to nonblocking mode */
-        int flags = fcntl(newsock, F_GETFL, 0);
-        int err = fcntl(newsock, F_SETFL, flags | O_NONBLOCK);
-        if (err == -1) {
-            throw ListenerException("Failed to set new socket to nonblocking mode");
-        }
+    return sockfd;
+}
 
-        callback(new Connection(newsock));
-        
-        newsock = accept(sockfd, NULL, NULL);
+Listener * Listener::adopt(int sockfd, std::function<void(Connection*)> cb)
+{
+    Listener *listener = new Listener();
+    listener->sockfd = sockfd;
+    listener->callback = cb;
+    return listener;
+}
+
+void Listener::handleAccepted(int newsock, const struct sockaddr_in *peer)
+{
+    if (admitCallback != nullptr) {
+        struct sockaddr_in lookedUp;
+        socklen_t peerLen = sizeof(lookedUp);
+        if (peer == nullptr && getpeername(newsock, (struct sockaddr*) &lookedUp, &peerLen) == 0) {
+            peer = &lookedUp;
+        }
+        if (peer != nullptr && !admitCallback(*peer)) {
+            /* Reset rather than close, so a connect storm leaves no TIME_WAIT sockets behind */
+            struct linger reset = {1, 0};
+            setsockopt(newsock, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+            close(newsock);
+            return;
+        }
     }
+    callback(new Connection(newsock, peer));
+}
 
-    /* We got -1 as error. Check if it's just nonblocking notification or something worse */
-    if (errno != EWOULDBLOCK && errno != EAGAIN) {
+void Listener::setAdmitCallback(std::function<bool(const struct sockaddr_in&)> admit)
+{
+    admitCallback = admit;
+}
+
+bool Listener::poll()
+{
+    TRACE_ZONE("Listener::poll");
+    for (int accepted = 0; accepted < LISTENER_ACCEPT_BATCH; accepted++) {
+
+        /* One call accepts the socket nonblocking and reports the peer, saving three syscalls */
+        struct sockaddr_in peer;
+        socklen_t peerLen = sizeof(peer);
+        int newsock = accept4(sockfd, (struct sockaddr*) &peer, &peerLen,
+                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (newsock >= 0) {
+            handleAccepted(newsock, &peer);
+            continue;
+        }
+
+        /* Check if it's just nonblocking notification or something worse */
+        if (errno == EWOULDBLOCK || errno == EAGAIN) {
+            return true;
+        }
+        if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO) {
+            /* Only this one connection failed (or none did), so carry on with the rest */
+            continue;
+        }
+        if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+            /* Out of descriptors or memory for now. The rest wait in the backlog */
+            return false;
+        }
         throw ListenerException("Socket accept failed");
     }
+    return true;
 }
 
 #endif
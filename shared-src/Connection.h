@@ -17,8 +17,11 @@
 #endif
 
 #include <string>
+#include <deque>
+#include <atomic>
 #include <stdexcept>
 #include <functional>
+#include <memory>
 
 #include "pbuf/generated/NetworkMessage.pb.h"
 
@@ -33,11 +36,201 @@
     #include <netinet/in.h>
 #endif
 
+/* Smallest receive buffer. Buffers grow from here (in powers of two) to reassemble larger messages */
 #define RECV_BUFFER_SIZE 4096
 
+/* Default largest message that may be sent or received, in bytes (not counting the length prefix) */
+#define MAX_MESSAGE_SIZE (1024 * 1024)
+
+/* Default number of queued outgoing bytes above which a connection's send policy is applied */
+#define SEND_HIGH_WATERMARK (256 * 1024)
+
+/* Default number of queued outgoing bytes a connection is brought back down to (or below) */
+#define SEND_LOW_WATERMARK (64 * 1024)
+
+/*
+ * Default number of connections the kernel completes ahead of the listener accepting them. The
+ * kernel caps it at net.core.somaxconn
+ */
+#define DEFAULT_ACCEPT_BACKLOG 4096
+
+/*
+ * Most connections a Listener accepts in one poll. Any more are left for the next poll, so a
+ * connect storm can't starve the connections already accepted
+ */
+#define LISTENER_ACCEPT_BATCH 64
+
 /* Forward declaration to be used by ConnectionCallbacks */
 class Connection;
 
+#if !COMPILING_ON_WINDOWS
+/*
+ * Interface for an event loop that decides when a connection's queued outgoing data is written.
+ * A connection with a transport set reports through sendQueued whenever data is queued on it
+ * with none pending, and leaves writing it to the transport, which either calls
+ * Connection::flushSends or, when it performs socket I/O itself (e.g. io_uring), takes the data
+ * with Connection::takePendingSends. Such a transport also feeds received bytes back through
+ * Connection::receiveData and reports failures through Connection::transportLost.
+ */
+class ConnectionTransport {
+ public:
+    virtual ~ConnectionTransport() {}
+
+    /* Called when outgoing data has been queued on a connection that had none pending */
+    virtual void sendQueued(Connection *conn) = 0;
+};
+
+/*
+ * Interface for a timer service that runs the keep-alive deadlines of many connections together
+ * (e.g. a timer wheel). A connection with timers set is only visited through
+ * Connection::runTimers when one of its deadlines is due, instead of on every poll.
+ */
+class ConnectionTimers {
+ public:
+    virtual ~ConnectionTimers() {}
+
+    /* Returns the current time in seconds on the service's clock */
+    virtual double now() = 0;
+
+    /* Call runTimers on the connection at (or soon after) the given time, replacing any earlier call */
+    virtual void schedule(Connection *conn, double when) = 0;
+};
+#endif
+
+/* The ways the stream of messages on a connection can be framed */
+enum class FramingMode {
+    FIXED16,    /* Each message preceded by a 2-byte big-endian length, so at most 65535 bytes */
+    VARINT      /* Each message preceded by a base-128 varint length, announced by a preamble */
+};
+
+/* The quality of a connection's link, as measured by its keep-alive probes */
+struct LinkStats {
+    double smoothedRtt;     /* Smoothed round trip time in seconds, 0 until the first is measured */
+    double rttVariance;     /* Smoothed mean deviation of the round trip time (jitter) in seconds */
+    double lossRate;        /* Smoothed fraction of pings that went unanswered for too long */
+    uint64_t rttSamples;    /* How many round trips have been measured */
+};
+
+#if !COMPILING_ON_WINDOWS
+/*
+ * Everything needed for another process to carry on with an accepted connection, as given up by
+ * Connection::detach and picked up again by Connection::adopt
+ */
+struct ConnectionHandoff {
+    int sockfd;                     /* The socket itself, to be passed over as a descriptor */
+    FramingMode framingMode;        /* How messages are framed, once detected */
+    bool framingDetected;
+    std::string pendingRecv;        /* Received bytes of a frame that is not complete yet */
+    std::string pendingSend;        /* Queued outgoing bytes that have not been written yet */
+};
+#endif
+
+/*
+ * What a connection does when its queue of outgoing data grows beyond its high watermark, which
+ * happens when the peer stops reading (or reads slower than it is sent to)
+ */
+enum class SendPolicy {
+    DROP_OLDEST,    /* Drop the oldest droppable queued messages down to the low watermark */
+    PAUSE,          /* Tell the producer to stop sending (onSendBackpressure) until it drains */
+    DISCONNECT      /* Give up on the peer and lose the connection */
+};
+
+/*
+ * A limit on the total outgoing data queued by every connection that shares it, so the memory
+ * used by send queues stays bounded however many peers stop reading. A connection that would
+ * take the total over the limit is disconnected. Also counts how often each send policy fires
+ * across those connections. Thread-safe, so one budget can be shared between threads.
+ */
+class SendBudget {
+ public:
+
+    /* Constructor - allow at most limit bytes to be queued in total */
+    SendBudget(size_t limit);
+
+    /* Take bytes from the budget. Returns false (taking nothing) if that would exceed the limit */
+    bool charge(size_t bytes);
+
+    /* Give previously charged bytes back to the budget */
+    void release(size_t bytes);
+
+    /* Returns the number of bytes currently charged */
+    size_t getUsed();
+
+    /* Returns the total number of bytes that may be charged */
+    size_t getLimit();
+
+    /* Number of queued messages dropped under DROP_OLDEST */
+    std::atomic<uint64_t> framesDropped;
+
+    /* Number of times a producer was paused under PAUSE */
+    std::atomic<uint64_t> pauses;
+
+    /* Number of connections lost for exceeding their high watermark or the budget */
+    std::atomic<uint64_t> disconnects;
+
+ private:
+
+    std::atomic<size_t> used;
+    size_t limit;
+};
+
+/*
+ * Counts of the data and messages sent and received by every connection that shares it, by
+ * message type (the NetworkMessage type_case). Only one thread may count into it, which keeps
+ * counting free of locked instructions, but it may be read from any thread.
+ */
+class TrafficCounters {
+ public:
+
+    /* Number of message types counted, indexed by pbuf::NetworkMessage::TypeCase */
+    static const int NUM_TYPES = 12;
+
+    /* Constructor - start every count at 0 */
+    TrafficCounters();
+
+    void countBytesReceived(size_t bytes);
+    void countBytesSent(size_t bytes);
+    void countMessageReceived(pbuf::NetworkMessage::TypeCase type);
+    void countMessageSent(pbuf::NetworkMessage::TypeCase type);
+
+    std::atomic<uint64_t> bytesReceived;
+    std::atomic<uint64_t> bytesSent;
+    std::atomic<uint64_t> messagesReceived[NUM_TYPES];
+    std::atomic<uint64_t> messagesSent[NUM_TYPES];
+
+ private:
+
+    /* Add to a count only this thread writes */
+    static void add(std::atomic<uint64_t> &count, uint64_t amount);
+};
+
+/*
+ * A NetworkMessage serialized once to be sent to many connections (e.g. everyone in a room).
+ * Immutable once encoded and shared by reference count, so one encoding can be queued on any
+ * number of connections, on any thread, for the cost of copying its bytes into each send queue.
+ * Each connection adds its own length prefix, since peers may differ in framing.
+ */
+class EncodedMessage {
+ public:
+
+    /* Serialize the given message into a new shared encoding */
+    static std::shared_ptr<const EncodedMessage> encode(const pbuf::NetworkMessage &msg);
+
+    /* Returns the serialized message, without any length prefix */
+    const std::string & getBytes() const;
+
+    /* Returns the type of the message, for counting it as sent */
+    pbuf::NetworkMessage::TypeCase getType() const;
+
+ private:
+
+    /* Private constructor - only created through encode */
+    EncodedMessage() {}
+
+    std::string bytes;
+    pbuf::NetworkMessage::TypeCase type;
+};
+
 /*
  * Structs representing connection callback functions. These must be set to either valid
  * function pointers or NULL if no callback is desired to listen for a specific event.
@@ -71,10 +264,19 @@ struct ConnectionCallbacks {
     std::function<void(Connection*)> onConnectionResumed;
 
     /*
-     * Called when a NetworkMessage is received over the connection and has been parsed successfully
+     * Called when a NetworkMessage is received over the connection and has been parsed successfully.
+     * The message is only valid until the callback returns; copy anything needed for longer.
+     * WARNING! No deleting the Connection with this callback in the function stack!
+     */
+    std::function<void(Connection*, const pbuf::NetworkMessage&)> onMsgReceived;
+
+    /*
+     * Called under the PAUSE send policy with true when the outgoing queue goes over the high
+     * watermark, and with false once it has drained to the low watermark. The producer should
+     * hold back non-essential sends in between.
      * WARNING! No deleting the Connection with this callback in the function stack!
      */
-    std::function<void(Connection*, pbuf::NetworkMessage)> onMsgReceived;
+    std::function<void(Connection*, bool)> onSendBackpressure;
 };
 
 /* 
@@ -107,8 +309,82 @@ class Connection {
     /* Destructor to clean up memory used */
     ~Connection();
 
-    /* Send the given network message protobuf over the connection stream */
-    void sendNetworkMessage(pbuf::NetworkMessage &msg);
+    /*
+     * Queue the given network message protobuf to be sent over the connection stream. Queued
+     * messages are written together at the end of poll(), or whenever the transport flushes them.
+     * Set droppable for messages that may be discarded by the DROP_OLDEST send policy (e.g. state
+     * that is superseded by later messages)
+     */
+    void sendNetworkMessage(pbuf::NetworkMessage &msg, bool droppable = false);
+
+    /*
+     * Queue a message already encoded for many connections, as sendNetworkMessage does but
+     * without serializing it again
+     */
+    void sendEncodedMessage(const EncodedMessage &msg, bool droppable = false);
+
+    /*
+     * Choose how messages are framed on this connection. Must be called before anything is sent.
+     * Choosing VARINT opens the stream with a preamble announcing it, from which the accepting
+     * side detects the framing and uses it for its replies too. Accepted connections default to
+     * whatever their peer announces, and other connections to FIXED16
+     */
+    void setFramingMode(FramingMode mode);
+
+    /*
+     * Set the largest message that may be sent or received. Receiving a larger message loses
+     * the connection. Defaults to MAX_MESSAGE_SIZE
+     */
+    void setMaxMessageSize(size_t size);
+
+    /* Returns the largest message that can be sent to the peer, given its framing */
+    size_t getMaxSendSize();
+
+    /*
+     * Configure what happens when the peer falls behind: once more than highWatermark bytes are
+     * queued the policy is applied, bringing the queue down to lowWatermark where it applies
+     */
+    void setSendLimits(size_t lowWatermark, size_t highWatermark, SendPolicy policy);
+
+    /*
+     * Charge all outgoing data queued on this connection to the given budget, which must outlive
+     * the connection. Must be set before anything is sent, apart from the data an adopted
+     * connection starts out with, which is charged here (overflowing the queue if it won't fit)
+     */
+    void setSendBudget(SendBudget *budget);
+
+    /* Returns the number of outgoing bytes queued on this connection and not yet sent */
+    size_t getQueuedSendBytes();
+
+    /*
+     * Count the data and messages sent and received on this connection in the given counters,
+     * which must outlive the connection and are only counted into by the thread polling it
+     */
+    void setTrafficCounters(TrafficCounters *counters);
+
+    /*
+     * Parse received messages into the given arena instead of reusing a message of this
+     * connection's own. Whoever owns the arena must only Reset it while no message is being
+     * handled. Pass nullptr to go back to the connection's own message
+     */
+    void setMessageArena(google::protobuf::Arena *arena);
+
+    /*
+     * Let the keep-alive of an idle connection back off: each time a ping is answered with nothing
+     * else heard, the wait before the next ping doubles, as long as a dead peer still leaves the
+     * connection SUSPENDED within detectionSecs of last hearing from it. Any other message sent or
+     * received goes back to the shortest wait. The default leaves no room to back off
+     */
+    void setKeepAliveTime(double detectionSecs);
+
+    /*
+     * Ping at least every probeSecs even while other traffic shows the peer is alive, to keep
+     * the link stats up to date on a busy connection. 0 (the default) only pings for keep-alive
+     */
+    void setProbeInterval(double probeSecs);
+
+    /* Get the round trip time, jitter and loss measured from the pings answered so far */
+    LinkStats getLinkStats();
 
     /* Poll method for the connection. This should be called regularly with the time since last call */
     void poll(double secs);
@@ -117,11 +393,113 @@ class Connection {
     int getSuspendedTimeLeft();
 
 #if !COMPILING_ON_WINDOWS
+    /*
+     * Get the underlying socket file descriptor so an event loop can watch it for readiness.
+     * Returns -1 once the socket has been closed.
+     */
+    int getSocketFd();
+
+    /*
+     * Alternative to poll() for event-driven users: receive and handle everything currently
+     * readable on the socket without advancing the keep-alive timers. Call on read readiness.
+     */
+    void pollReadable();
+
+    /*
+     * Alternative to poll() for event-driven users: advance the keep-alive timers by the given
+     * number of seconds without attempting to receive. Call periodically for every connection.
+     */
+    void pollTimers(double secs);
+
+    /*
+     * Alternative to pollTimers() for event-driven users: hand the keep-alive deadlines to the
+     * given timer service, which calls runTimers() whenever one is due. Received traffic only
+     * moves the deadlines along without involving the service, so a call that turns out to be
+     * early just schedules the next one
+     */
+    void setTimers(ConnectionTimers *timers);
+
+    /* Called by the timer service when a deadline scheduled by this connection is due */
+    void runTimers();
+#endif
+
+#if COMPILING_ON_LINUX
+    /*
+     * Leave probing an idle peer to the kernel's TCP keep-alive instead of sending pings, so the
+     * peer's process is never woken to answer. The peer's TCP stack answering the probes counts
+     * as hearing from it; once it stops, the connection is SUSPENDED within the keep-alive time
+     * (set with setKeepAliveTime beforehand) and closed as usual. Pings from the peer are still
+     * answered. Throws ConnectionException if the socket options cannot be set
+     */
+    void enableTcpKeepAlive();
+#endif
+
+#if !COMPILING_ON_WINDOWS
+    /*
+     * Leave the writing of queued sends to the given transport. Pass nullptr to go back to
+     * flushing them at the end of poll(), pollReadable() and pollTimers(). The transport is told
+     * straight away about anything already queued
+     */
+    void setTransport(ConnectionTransport *transport);
+#endif
+
+    /*
+     * Write as much queued outgoing data to the socket as it will take right now, with a single
+     * send. Returns false if the connection was lost, in which case this object may already be
+     * deleted and must not be used
+     */
+    bool flushSends();
+
+    /* Returns true if there is queued outgoing data that has not been written yet */
+    bool hasPendingSends();
+
+    /*
+     * Returns true if the send queue overflowed, meaning the next flushSends or takePendingSends
+     * loses the connection
+     */
+    bool hasSendOverflowed();
+
+    /*
+     * Move all queued outgoing data into out (replacing its contents) for a transport to write.
+     * The previous contents of out are recycled as the new, empty send queue. The transport must
+     * report the bytes as they are written with sendCompleted. Returns false if the connection
+     * was lost instead, in which case this object may already be deleted and must not be used
+     */
+    bool takePendingSends(std::string &out);
+
+    /* Called by a transport when bytes it took with takePendingSends have been written */
+    void sendCompleted(size_t bytes);
+
+#if !COMPILING_ON_WINDOWS
+    /* Handle bytes received on this connection's socket by a transport */
+    void receiveData(const char *data, size_t len);
+
+    /* Called by a transport when the socket failed or was closed by the peer */
+    void transportLost();
+
     /* Get the peer ip address as a string for this connection */
     std::string getPeerIp();
 
     /* Get the peer port number as a number for this connection */
     uint16_t getPeerPort();
+
+    /* Get the peer ip address in network byte order, which is cheaper to keep than the string */
+    uint32_t getPeerAddr();
+
+    /*
+     * Give up the socket, along with any partial frame received and anything queued to send, for
+     * another process to carry on with through adopt. Remove the connection from its transport
+     * first. Fails, returning false and leaving the connection as it was, while a transport still
+     * has sends in flight. Afterwards the connection has no socket and can only be deleted,
+     * which leaves the socket (now owned by state) open
+     */
+    bool detach(ConnectionHandoff &state);
+
+    /*
+     * Create a connection carrying on with a socket given up by detach (usually in another
+     * process). Anything that was queued to send is written once it has a transport or is polled
+     */
+    static Connection * adopt(const ConnectionHandoff &state);
 #endif
 
     /* Used to set the onConnectionLost callback function for the Connection */
@@ -134,13 +512,19 @@ class Connection {
     void setOnConnectionResumedCallback(std::function<void(Connection*)> cb);
 
     /* Used to set the onMsgReceived callback function for the Connection */
-    void setOnMsgReceivedCallback(std::function<void(Connection*, pbuf::NetworkMessage)> cb);
+    void setOnMsgReceivedCallback(std::function<void(Connection*, const pbuf::NetworkMessage&)> cb);
+
+    /* Used to set the onSendBackpressure callback function for the Connection */
+    void setOnSendBackpressureCallback(std::function<void(Connection*, bool)> cb);
 
  private:
 
 #if !COMPILING_ON_WINDOWS
-    /* Private constructor to be used by the Listener when it receives an incoming connection */
-    Connection(int sockfd);
+    /*
+     * Private constructor to be used by the Listener when it receives an incoming connection.
+     * The peer address is looked up from the socket unless given
+     */
+    Connection(int sockfd, const struct sockaddr_in *peer = nullptr);
 
     /* Local member to store address of the peer endpoint */
     struct sockaddr_in peerAddr;
@@ -169,25 +553,238 @@ class Connection {
     /* Used as a stopwatch, to count up when timing some aspect of a socket */
     double timer;
 
+    /*
+     * Seconds this connection has been polled for, which is the clock keep-alive deadlines are
+     * measured on unless a timer service provides one, and the time anything was last received
+     */
+    double clock;
+    double lastHeard;
+
     /* Set when a ping is sent to mark that PING is sent until a message is received */
     bool pingSent;
 
+    /*
+     * Seconds of silence before sending a ping, backed off while the connection is idle, and the
+     * longest the peer may be silent before the connection is SUSPENDED
+     */
+    double pingInterval;
+    double keepAliveTime;
+
+    /* Set when the kernel probes the idle peer instead of this connection sending pings */
+    bool tcpKeepAlive;
+
+    /*
+     * The sequence number of the last ping sent (0 before the first), the time it was sent, and
+     * whether it is still waiting to be counted as answered or lost in the link stats
+     */
+    uint32_t pingSeq;
+    double lastPingTime;
+    bool pingPending;
+
+    /* The longest between pings while traffic is flowing, or 0 to only ping for keep-alive */
+    double probeInterval;
+
+    /* Round trip time, jitter and loss of the link so far */
+    LinkStats linkStats;
+
     /* Flag to mark when pong should be sent. Not sent immediately due to object deletion worry */
     bool shouldPong;
 
+    /* The sequence number and timestamp of the ping being answered, for the pong to echo */
+    uint32_t pongSeq;
+    uint64_t pongTime;
+
     /* The timeout period when opening a connection. If it takes longer, fail */
     double openTimeout;
 
-    /* The buffer into which received data will be read before decoding it */
-    char recvBuffer[RECV_BUFFER_SIZE];
-    int recvBufferPos;
+    /*
+     * The buffer into which received data is read in bulk before decoding it, taken from a pool
+     * only while there is something to receive into or a partial frame to hold. Bytes between
+     * recvBufferStart and recvBufferEnd have been received but not yet handled (a partial frame)
+     */
+    char *recvBuffer;
+    size_t recvBufferSize;
+    size_t recvBufferStart;
+    size_t recvBufferEnd;
+
+    /* The full size of the partial frame being received, once its length is known (else 0) */
+    size_t recvFrameSize;
 
-    /* This var tracks the size of the currently-being-read NetworkMessage with recv */
-    uint16_t recvMsgSize;
+    /* How messages are framed in both directions, and whether that is settled yet */
+    FramingMode framingMode;
+    bool framingDetected;
 
-    /* The network message struct to parse into when receiving data */
+    /* The largest message that may be sent or received */
+    size_t maxMessageSize;
+
+    /*
+     * Outgoing frames waiting to be written, serialized back to back. The bytes before
+     * sendBufferStart have already been written by a partial send
+     */
+    std::string sendBuffer;
+    size_t sendBufferStart;
+
+    /* Offsets into sendBuffer of the droppable frames that have not started being written */
+    std::deque<size_t> droppableFrames;
+
+    /* Bytes taken by the transport that it has not reported as written yet */
+    size_t sendBytesInFlight;
+
+    /* Send queue limits and what to do when they are exceeded. See setSendLimits */
+    size_t sendLowWatermark;
+    size_t sendHighWatermark;
+    SendPolicy sendPolicy;
+
+    /* Set while the producer has been told to pause under the PAUSE policy */
+    bool sendPaused;
+
+    /* Set when the send queue overflowed, so the connection is lost at the next flush */
+    bool sendOverflowed;
+
+    /* The budget queued sends are charged to, if any. Not owned by the connection */
+    SendBudget *sendBudget;
+
+    /* Where traffic is counted, if anywhere. Not owned by the connection */
+    TrafficCounters *trafficCounters;
+
+    /* The network message struct to parse into when receiving data, unless there is an arena */
     pbuf::NetworkMessage recvMsg;
 
+    /* The arena received messages are created in, if any. Not owned by the connection */
+    google::protobuf::Arena *msgArena;
+
+#if !COMPILING_ON_WINDOWS
+    /* Performs socket I/O on behalf of this connection when set. Not owned by the connection */
+    ConnectionTransport *transport;
+
+    /*
+     * Runs the keep-alive deadlines of this connection when set, and the deadline it was last
+     * asked to run at. Not owned by the connection
+     */
+    ConnectionTimers *timers;
+    double scheduledDeadline;
+#endif
+
+    /*
+     * Parse and dispatch a complete serialized message. Returns false if the connection was lost,
+     * in which case this object may already be deleted and must not be used
+     */
+    bool handleReceivedMessage(const char *data, int size);
+
+    /*
+     * Handle every complete length-prefixed frame at the start of the given data, setting used to
+     * the number of bytes they took up. Returns false if the connection was lost, in which case
+     * this object may already be deleted and must not be used
+     */
+    bool handleReceivedFrames(const char *data, size_t len, size_t *used);
+
+    /* Handle every complete frame in recvBuffer. Returns false if the connection was lost */
+    bool handleBufferedFrames();
+
+    /*
+     * Decode a frame's length prefix from the start of data, setting msgSize. Returns the size of
+     * the prefix, 0 if it is incomplete, or -1 if it is malformed
+     */
+    int readFrameHeader(const char *data, size_t len, size_t *msgSize);
+
+    /* Write the length prefix for a message of the given size, returning the bytes written */
+    size_t writeFrameHeader(char *out, size_t msgSize);
+
+    /* Returns the size of the length prefix for a message of the given size */
+    size_t frameHeaderSize(size_t msgSize);
+
+    /*
+     * Make sure recvBuffer exists and has room at the end, for the whole of the partial frame if
+     * its size is known, by moving the partial frame to the front or into a larger buffer
+     */
+    void prepareRecvBuffer();
+
+    /* Give recvBuffer back to the pool if there is nothing in it */
+    void releaseEmptyRecvBuffer();
+
+    /* Close the socket, mark the connection DISCONNECTED and notify onConnectionLost */
+    void loseConnection();
+
+    /*
+     * Receive and dispatch all fully-available messages on the socket. Returns false if the
+     * connection was lost, in which case this object may already be deleted and must not be used
+     */
+    bool receiveMessages();
+
+    /*
+     * Handle any ping / suspend / close deadlines that have passed. Returns false if the
+     * connection was lost, in which case this object may already be deleted and must not be used
+     */
+    bool updateTimers();
+
+    /* Returns the current time on the clock keep-alive deadlines are measured on */
+    double currentTime();
+
+    /* Returns the time of the next keep-alive deadline */
+    double nextTimerDeadline();
+
+    /* Returns how long the peer may be silent before the connection is SUSPENDED */
+    double getSuspendTime();
+
+    /* Cut the wait before the next ping so that an answer is due soon after the current time */
+    void expectAnswer();
+
+#if !COMPILING_ON_WINDOWS
+    /* Ask the timer service to run the next keep-alive deadline */
+    void scheduleTimers();
+#endif
+
+    /* Reschedule with the timer service (if any) when the next deadline has moved earlier */
+    void rescheduleTimersIfSooner();
+
+    /* Send the pong flagged by a received ping, if any. Only call when deletion is not a concern */
+    void sendPendingPong();
+
+    /* Send a ping carrying the next sequence number and the current time */
+    void sendPing();
+
+    /* Measure the round trip of one of this connection's pings from the fields its pong echoed */
+    void measurePong(uint32_t seq, uint64_t sentMicros);
+
+    /* Count the last ping as answered in time or lost in the smoothed loss rate */
+    void countPing(bool lost);
+
+    /*
+     * Make room at the end of the send queue for the frame of a message of the given size and
+     * type, writing its length prefix and setting wasEmpty if nothing was queued before. Returns
+     * where the message itself goes, or nullptr if it is not to be queued because the peer has
+     * been given up on. Throws ConnectionException if the message can't be sent at all
+     */
+    char * reserveFrame(size_t msgSize, pbuf::NetworkMessage::TypeCase type, bool *wasEmpty);
+
+    /* Finish queueing the frame reserved for a message of the given size and type */
+    void commitFrame(size_t msgSize, pbuf::NetworkMessage::TypeCase type, bool droppable,
+            bool wasEmpty);
+
+    /* Follow up on a message queued (or given up on) for sending: keep-alive and transport */
+    void onFrameQueued(pbuf::NetworkMessage::TypeCase type, bool wasEmpty);
+
+    /* Apply the send policy once the queue has grown beyond the high watermark */
+    void applySendPolicy();
+
+    /* Drop the oldest droppable frames until at least the given number of bytes are freed */
+    void dropQueuedFrames(size_t bytes);
+
+    /* Returns the full length of the queued frame starting at the given offset of sendBuffer */
+    size_t queuedFrameLength(size_t pos);
+
+    /* Discard everything queued and flag the connection to be lost at the next flush */
+    void overflowSends();
+
+    /* Let a paused producer resume once the queue has drained to the low watermark */
+    void checkSendResume();
+
+    /*
+     * Flush queued sends unless a transport is responsible for that. Only call when deletion is
+     * not a concern
+     */
+    void flushOwnSends();
+
 #if !COMPILING_ON_WINDOWS
     /* We need listener as a friend to create Connections from socket descriptors */
     friend class Listener;
@@ -211,23 +808,61 @@ class Listener {
      * The callback is a function to be called when new connections are accepted.
      * It receives a pointer to the new Connection and becomes responsible for managing
      * and freeing the connection when its use is complete.
+     * Up to backlog connections are completed by the kernel ahead of being accepted. With
+     * deferAcceptSecs set, a connection is only handed over once its first data arrives (or
+     * that many seconds pass), so peers that connect and never speak cost nothing
      */
-    Listener(uint16_t port, std::function<void(Connection*)> cb);
+    Listener(uint16_t port, std::function<void(Connection*)> cb,
+            int backlog = DEFAULT_ACCEPT_BACKLOG, int deferAcceptSecs = 0);
     
     /* Destructor - tear down any memory used by the Listener and close the socket */
     ~Listener();
 
-    /* Poll method for the listener socket. This should be called regularly */
-    void poll();
+    /*
+     * Poll method for the listener socket. This should be called regularly or on read readiness.
+     * Accepts at most LISTENER_ACCEPT_BATCH connections per call. Returns false if it stopped for
+     * want of descriptors or memory, in which case the socket stays readable with connections it
+     * can't take yet, so a caller waiting on readiness should stop watching it for a while
+     */
+    bool poll();
+
+    /* Get the listening socket file descriptor so an event loop can watch it for readiness */
+    int getSocketFd();
+
+    /*
+     * Create a listener carrying on with a listening socket that was set up elsewhere (usually by
+     * another process, which passed it over). The socket must already be nonblocking
+     */
+    static Listener * adopt(int sockfd, std::function<void(Connection*)> cb);
+
+    /*
+     * Wrap a socket accepted on this listener's behalf (e.g. by an io_uring multishot accept) in a
+     * Connection and pass it to the accept callback. The socket must already be nonblocking. The
+     * peer address is looked up from the socket unless given
+     */
+    void handleAccepted(int newsock, const struct sockaddr_in *peer = nullptr);
+
+    /*
+     * Ask the given function about every connection accepted from here on, by its peer's
+     * address, before anything is set up for it. Connections it refuses are reset straight away
+     * and never reach the accept callback
+     */
+    void setAdmitCallback(std::function<bool(const struct sockaddr_in&)> admit);
 
  private:
 
+    /* Private constructor for adopt, which sets everything up itself */
+    Listener() {}
+
     /* The file descriptor pointing to the main listening socket */
     int sockfd;
 
     /* Callback function that will be called when a new socket connection is received */
     std::function<void(Connection*)> callback;
 
+    /* Decides whether to take each connection accepted, or nullptr to take them all */
+    std::function<bool(const struct sockaddr_in&)> admitCallback;
+
 };
 
 /* Empty exception type to throw when a listener fails */
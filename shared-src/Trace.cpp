@@ -0,0 +1,185 @@
+#include "Trace.h"
+
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+/* One recorded event. Zones have a duration, instant events don't */
+struct TraceEvent {
+    const char *name;
+    uint64_t startNanos;
+    uint64_t durationNanos;
+    bool instant;
+};
+
+/*
+ * The events of one thread, allocated when it first records. Only that thread appends to it,
+ * publishing each event by bumping count, so write() can read up to count at any time without
+ * stopping it. Buffers are never freed, so a thread's events outlive it
+ */
+struct ThreadBuffer {
+    int tid;
+    std::string name;
+    TraceEvent *events;
+    std::atomic<uint32_t> count;
+    std::atomic<uint64_t> dropped;
+};
+
+std::atomic<bool> Trace::recording(false);
+std::atomic<bool> Trace::writeRequested(false);
+std::chrono::steady_clock::time_point Trace::startTime;
+
+/* Every thread's buffer, and the file to write, guarded by buffersMutex */
+static std::mutex buffersMutex;
+static std::vector<ThreadBuffer*> buffers;
+static std::string outputPath;
+
+/* The calling thread's buffer, created when it first records */
+static thread_local ThreadBuffer *threadBuffer = nullptr;
+
+static ThreadBuffer * getThreadBuffer()
+{
+    if (threadBuffer == nullptr) {
+        ThreadBuffer *buffer = new ThreadBuffer();
+        buffer->events = nullptr;
+        buffer->count = 0;
+        buffer->dropped = 0;
+
+        std::lock_guard<std::mutex> guard(buffersMutex);
+        buffer->tid = buffers.size() + 1;
+        buffers.push_back(buffer);
+        threadBuffer = buffer;
+    }
+    return threadBuffer;
+}
+
+static void record(const char *name, uint64_t startNanos, uint64_t durationNanos, bool instant)
+{
+    ThreadBuffer *buffer = getThreadBuffer();
+    if (buffer->events == nullptr) {
+        buffer->events = new TraceEvent[TRACE_THREAD_EVENTS];
+    }
+    uint32_t index = buffer->count.load(std::memory_order_relaxed);
+    if (index >= TRACE_THREAD_EVENTS) {
+        buffer->dropped.store(buffer->dropped.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+        return;
+    }
+
+    TraceEvent &event = buffer->events[index];
+    event.name = name;
+    event.startNanos = startNanos;
+    event.durationNanos = durationNanos;
+    event.instant = instant;
+    buffer->count.store(index + 1, std::memory_order_release);
+}
+
+/* Write a string as a JSON string, escaping what needs it */
+static void writeJsonString(FILE *file, const char *str)
+{
+    fputc('"', file);
+    for (; *str != '\0'; str++) {
+        if (*str == '"' || *str == '\\') {
+            fputc('\\', file);
+            fputc(*str, file);
+        } else if ((unsigned char) *str < 0x20) {
+            fprintf(file, "\\u%04x", *str);
+        } else {
+            fputc(*str, file);
+        }
+    }
+    fputc('"', file);
+}
+
+void Trace::start(const std::string &path)
+{
+    if (recording) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(buffersMutex);
+        outputPath = path;
+    }
+    startTime = std::chrono::steady_clock::now();
+    recording = true;
+}
+
+bool Trace::write()
+{
+    std::lock_guard<std::mutex> guard(buffersMutex);
+    if (outputPath.empty()) {
+        return false;
+    }
+    FILE *file = fopen(outputPath.c_str(), "w");
+    if (file == nullptr) {
+        return false;
+    }
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    bool first = true;
+    for (ThreadBuffer *buffer : buffers) {
+        std::string name = buffer->name.empty() ? "thread " + std::to_string(buffer->tid) :
+                buffer->name;
+        uint64_t dropped = buffer->dropped.load(std::memory_order_relaxed);
+        if (dropped > 0) {
+            name += " (" + std::to_string(dropped) + " events dropped)";
+        }
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                "\"args\":{\"name\":", first ? "" : ",\n", buffer->tid);
+        writeJsonString(file, name.c_str());
+        fprintf(file, "}}");
+        first = false;
+
+        uint32_t count = buffer->count.load(std::memory_order_acquire);
+        for (uint32_t i = 0; i < count; i++) {
+            const TraceEvent &event = buffer->events[i];
+            fprintf(file, ",\n{\"name\":");
+            writeJsonString(file, event.name);
+            if (event.instant) {
+                fprintf(file, ",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":1,\"tid\":%d}",
+                        event.startNanos / 1000.0, buffer->tid);
+            } else {
+                fprintf(file, ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d}",
+                        event.startNanos / 1000.0, event.durationNanos / 1000.0, buffer->tid);
+            }
+        }
+    }
+    fprintf(file, "\n]}\n");
+
+    bool success = !ferror(file);
+    if (fclose(file) != 0) {
+        success = false;
+    }
+    return success;
+}
+
+void Trace::requestWrite()
+{
+    writeRequested.store(true, std::memory_order_relaxed);
+}
+
+void Trace::writeIfRequested()
+{
+    if (writeRequested.load(std::memory_order_relaxed) && writeRequested.exchange(false)) {
+        write();
+    }
+}
+
+void Trace::zone(const char *name, uint64_t startNanos)
+{
+    record(name, startNanos, now() - startNanos, false);
+}
+
+void Trace::instant(const char *name)
+{
+    if (isRecording()) {
+        record(name, now(), 0, true);
+    }
+}
+
+void Trace::setThreadName(const std::string &name)
+{
+    ThreadBuffer *buffer = getThreadBuffer();
+    std::lock_guard<std::mutex> guard(buffersMutex);
+    buffer->name = name;
+}
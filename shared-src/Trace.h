@@ -0,0 +1,112 @@
+#ifndef FD__TRACE_H
+#define FD__TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+/* Build with -DTRACING_ENABLED=0 to compile every trace macro away to nothing */
+#ifndef TRACING_ENABLED
+#define TRACING_ENABLED 1
+#endif
+
+/* Most events kept per thread. Any more on that thread are counted as dropped */
+#define TRACE_THREAD_EVENTS (256 * 1024)
+
+#if TRACING_ENABLED
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+
+/* Record the time from here to the end of the enclosing scope as a zone. Takes a string literal */
+#define TRACE_ZONE(name) TraceZone TRACE_CONCAT(traceZone, __LINE__)(name)
+
+/* Record a moment in time, such as a state change. Takes a string literal */
+#define TRACE_INSTANT(name) Trace::instant(name)
+
+/* Name the calling thread in the trace */
+#define TRACE_THREAD_NAME(name) Trace::setThreadName(name)
+#else
+#define TRACE_ZONE(name) do {} while (0)
+#define TRACE_INSTANT(name) do {} while (0)
+#define TRACE_THREAD_NAME(name) do {} while (0)
+#endif
+
+/*
+ * Lightweight tracing of where time goes in the client and server, written out in the Chrome
+ * trace event JSON format for chrome://tracing or ui.perfetto.dev. Each thread records into a
+ * buffer of its own, so recording takes no locks and costs a couple of clock reads per zone, and
+ * nothing at all beyond a flag check while not recording. Use it through the TRACE_ macros
+ * above, which can be compiled out.
+ */
+class Trace {
+ public:
+
+    /* Start recording, to be written to the given file by write() */
+    static void start(const std::string &path);
+
+    /*
+     * Write everything recorded since start() to its file, while recording carries on. Returns
+     * false if the file can't be written
+     */
+    static bool write();
+
+    /* Ask for the trace to be written by the next writeIfRequested(). Safe in a signal handler */
+    static void requestWrite();
+
+    /* Write the trace if requestWrite() was called since last time */
+    static void writeIfRequested();
+
+    /* Returns true while recording */
+    static bool isRecording() {
+        return recording.load(std::memory_order_acquire);
+    }
+
+    /* Returns nanoseconds since recording started */
+    static uint64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - startTime).count();
+    }
+
+    /* Record a zone from startNanos until now. Used by TraceZone */
+    static void zone(const char *name, uint64_t startNanos);
+
+    /* Record an instant event now */
+    static void instant(const char *name);
+
+    /* Name the calling thread in the trace */
+    static void setThreadName(const std::string &name);
+
+ private:
+
+    static std::atomic<bool> recording;
+    static std::atomic<bool> writeRequested;
+    static std::chrono::steady_clock::time_point startTime;
+};
+
+/* Records a zone for as long as it is in scope, if recording when it was created */
+class TraceZone {
+ public:
+
+    TraceZone(const char *name) {
+        this->name = name;
+        active = Trace::isRecording();
+        if (active) {
+            startNanos = Trace::now();
+        }
+    }
+
+    ~TraceZone() {
+        if (active) {
+            Trace::zone(name, startNanos);
+        }
+    }
+
+ private:
+
+    const char *name;
+    bool active;
+    uint64_t startNanos;
+};
+
+#endif